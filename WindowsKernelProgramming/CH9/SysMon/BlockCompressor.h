@@ -0,0 +1,176 @@
+#pragma once
+
+#include "Platform.h"
+#include <string.h>
+
+//
+// LZ77 block compression for recorded batches, the LZ4 block layout: sequences of
+// a token (literal count << 4 | match length - 4), the literals, a 16-bit offset
+// back into the block and the match length's overflow. counts of 15 go on in
+// extra bytes, 255 at a time. the last sequence has literals only.
+// records are mostly zero padding and UTF-16 paths seen moments ago, so a greedy
+// single-probe match finder does well enough. blocks decompress on their own.
+// user mode only.
+//
+
+class BlockCompressor {
+public:
+	//
+	// compresses size bytes into at most capacity bytes; 0 if they don't fit,
+	// the caller stores the block as is then
+	//
+	ULONG Compress(const UCHAR* source, ULONG size, UCHAR* target, ULONG capacity) {
+		::memset(_table, 0, sizeof(_table));
+		auto ip = source, anchor = source, end = source + size;
+		auto op = target, limit = target + capacity;
+
+		if (size >= MinMatch + 1) {
+			// the first record would otherwise match itself at position 0
+			ip++;
+			while (ip + MinMatch <= end) {
+				auto sequence = Read32(ip);
+				auto hash = Hash(sequence);
+				auto match = source + _table[hash];
+				_table[hash] = (ULONG)(ip - source);
+				if (ip - match > MaxOffset || Read32(match) != sequence) {
+					// skip ahead faster through data that doesn't compress
+					ip += 1 + ((ip - anchor) >> SkipShift);
+					continue;
+				}
+
+				// back over literals that match too, then as far forward as it goes
+				while (ip > anchor && match > source && ip[-1] == match[-1]) {
+					ip--;
+					match--;
+				}
+				auto length = (ULONG)MinMatch;
+				while (ip + length < end && ip[length] == match[length])
+					length++;
+
+				op = Sequence(op, limit, anchor, (ULONG)(ip - anchor), (ULONG)(ip - match), length);
+				if (op == nullptr)
+					return 0;
+				ip += length;
+				anchor = ip;
+				if (ip + MinMatch <= end)
+					_table[Hash(Read32(ip - 2))] = (ULONG)(ip - 2 - source);
+			}
+		}
+
+		op = Sequence(op, limit, anchor, (ULONG)(end - anchor), 0, 0);
+		return op ? (ULONG)(op - target) : 0;
+	}
+
+	//
+	// size bytes of compressed data back into exactly rawSize bytes;
+	// false if the data is damaged, nothing is read or written out of bounds then
+	//
+	static bool Decompress(const UCHAR* source, ULONG size, UCHAR* target, ULONG rawSize) {
+		auto ip = source, end = source + size;
+		auto op = target, limit = target + rawSize;
+		while (ip < end) {
+			auto token = *ip++;
+			ULONG literals = token >> 4;
+			if (literals == 15 && !ReadCount(ip, end, literals))
+				return false;
+			if (literals > (ULONG)(end - ip) || literals > (ULONG)(limit - op))
+				return false;
+			::memcpy(op, ip, literals);
+			ip += literals;
+			op += literals;
+			if (ip == end)
+				break;
+
+			if (end - ip < 2)
+				return false;
+			ULONG offset = ip[0] | (ip[1] << 8);
+			ip += 2;
+			ULONG length = token & 15;
+			if (length == 15 && !ReadCount(ip, end, length))
+				return false;
+			length += MinMatch;
+			if (offset == 0 || offset > (ULONG)(op - target) || length > (ULONG)(limit - op))
+				return false;
+
+			auto match = op - offset;
+			if (offset >= length) {
+				::memcpy(op, match, length);
+				op += length;
+			}
+			else {
+				// a run: the match overlaps what it produces
+				while (length--)
+					*op++ = *match++;
+			}
+		}
+		return op == limit;
+	}
+
+private:
+	static const ULONG MinMatch = 4;
+	static const ULONG MaxOffset = 0xffff;
+	static const ULONG HashBits = 12;
+	static const ULONG SkipShift = 6;
+
+	static ULONG Read32(const UCHAR* p) {
+		ULONG value;
+		::memcpy(&value, p, sizeof(value));
+		return value;
+	}
+
+	static ULONG Hash(ULONG sequence) {
+		return (sequence * 2654435761u) >> (32 - HashBits);
+	}
+
+	static UCHAR* WriteCount(UCHAR* op, UCHAR* limit, ULONG count) {
+		for (; count >= 255; count -= 255) {
+			if (op == limit)
+				return nullptr;
+			*op++ = 255;
+		}
+		if (op == limit)
+			return nullptr;
+		*op++ = (UCHAR)count;
+		return op;
+	}
+
+	static bool ReadCount(const UCHAR*& ip, const UCHAR* end, ULONG& count) {
+		UCHAR more;
+		do {
+			if (ip == end)
+				return false;
+			more = *ip++;
+			count += more;
+		} while (more == 255);
+		return true;
+	}
+
+	// literals, then the match (none with length 0); nullptr if it doesn't fit
+	static UCHAR* Sequence(UCHAR* op, UCHAR* limit, const UCHAR* literals, ULONG count, ULONG offset, ULONG length) {
+		if (op == limit)
+			return nullptr;
+		auto token = op++;
+		*token = (UCHAR)((count < 15 ? count : 15) << 4);
+		if (count >= 15 && (op = WriteCount(op, limit, count - 15)) == nullptr)
+			return nullptr;
+		if (count > (ULONG)(limit - op))
+			return nullptr;
+		::memcpy(op, literals, count);
+		op += count;
+		if (length == 0)
+			return op;
+
+		if (limit - op < 2)
+			return nullptr;
+		*op++ = (UCHAR)offset;
+		*op++ = (UCHAR)(offset >> 8);
+		length -= MinMatch;
+		*token |= (UCHAR)(length < 15 ? length : 15);
+		if (length >= 15 && (op = WriteCount(op, limit, length - 15)) == nullptr)
+			return nullptr;
+		return op;
+	}
+
+private:
+	ULONG _table[1 << HashBits];	// where each hashed 4 bytes were last seen
+};
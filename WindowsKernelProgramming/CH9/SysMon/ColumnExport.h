@@ -0,0 +1,474 @@
+#pragma once
+
+#include "Platform.h"
+#include "SysMonCommon.h"
+#include "TimeSource.h"
+#include "TraceRecorder.h"
+#include "CommandLineDefinitions.h"
+#include <stdio.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//
+// events as columns, for analysis jobs that only want some fields of some of the time.
+// rows are buffered into row groups; a group goes out as one chunk per column, plain
+// little-endian values with the chunk's min and max. strings (command lines, image
+// paths, key and value names) are kept once in a dictionary and the rows have their ids.
+// the chunk index and the dictionary follow the last group, the header says where.
+// record formats are evened out: times are system time, v2/v3 types are their v1 ones.
+// user mode only (Windows or POSIX).
+//
+
+const ULONG ColumnMagic = 0x58434D53;	// "SMCX"
+const ULONG ColumnVersion = 1;
+
+enum class ExportColumn : ULONG {
+	Time,			// LONGLONG, 100 nsec system time, 0: not known (v4 before a calibration)
+	Type,			// USHORT, ItemType
+	ProcessId,		// ULONG
+	ThreadId,		// ULONG, 0: none
+	Name,			// ULONG string id: command line, image path or key name, 0: none
+	Value,			// ULONG string id: registry value name, 0: none
+	Count
+};
+
+const ULONG ColumnWidths[] = { sizeof(LONGLONG), sizeof(USHORT), sizeof(ULONG), sizeof(ULONG), sizeof(ULONG), sizeof(ULONG) };
+
+struct ColumnFileHeader {
+	ULONG Magic;
+	ULONG Version;
+	ULONG HeaderSize;
+	ULONG Columns;				// ExportColumn::Count
+	ULONG RowGroups;
+	ULONG Strings;
+	ULONG64 Rows;
+	ULONG64 IndexOffset;		// RowGroups * Columns ColumnChunks, a group's columns in order
+	ULONG64 StringsOffset;		// per string its length in WCHARs (ULONG) and the WCHARs, padded to 4; ids from 1
+	ULONG Complete;				// closed cleanly; if not, there's no index to go by
+	ULONG Reserved;
+};
+
+struct ColumnChunk {
+	ULONG64 Offset;				// from the start of the file, 8 aligned
+	ULONG Rows;
+	ULONG Width;				// bytes per value
+	LONGLONG Min;
+	LONGLONG Max;
+};
+
+class ColumnExporter {
+public:
+	~ColumnExporter() {
+		Close();
+	}
+
+	bool Init(const char* path, ULONG format, ULONG groupRows = 1 << 16) {
+		_file = ::fopen(path, "wb");
+		if (_file == nullptr)
+			return false;
+
+		_groupRows = groupRows ? groupRows : 1;
+		::memset(&_header, 0, sizeof(_header));
+		_header.Magic = ColumnMagic;
+		_header.Version = ColumnVersion;
+		_header.HeaderSize = sizeof(ColumnFileHeader);
+		_header.Columns = (ULONG)ExportColumn::Count;
+		_offset = sizeof(ColumnFileHeader);
+		SetFormat(format);
+		return ::fwrite(&_header, sizeof(_header), 1, _file) == 1;
+	}
+
+	// the format of the records that follow; a new client or segment starts over
+	void SetFormat(ULONG format) {
+		_format = format;
+		_clock = {};
+		_imageNames.clear();
+		_commandLines.Clear();
+	}
+
+	bool Export(const UCHAR* records, ULONG size) {
+		for (ULONG offset = 0; offset + sizeof(ItemHeader) <= size; ) {
+			auto header = (const ItemHeader*)(records + offset);
+			if (header->Size < sizeof(ItemHeader) || header->Size > size - offset)
+				break;
+			if (!Export(header))
+				return false;
+			offset += header->Size;
+		}
+		return true;
+	}
+
+	bool Export(const ItemHeader* header) {
+		auto record = (const UCHAR*)header;
+		switch (header->Type) {
+			case ItemType::ProcessCreate:
+			{
+				auto info = (const ProcessCreateInfo*)header;
+				Add(header, ItemType::ProcessCreate, info->ProcessId, 0,
+					Id((const WCHAR*)(record + info->CommandLineOffset), Bounded(header, info->CommandLineOffset, info->CommandLineLength)));
+				break;
+			}
+
+			case ItemType::ProcessCreateInterned:
+			{
+				auto info = (const ProcessCreateInternedInfo*)header;
+				auto line = _commandLines.Find(info->CommandLineId);
+				Add(header, ItemType::ProcessCreate, info->ProcessId, 0, line ? *line : 0);
+				break;
+			}
+
+			case ItemType::ProcessExit:
+				Add(header, ItemType::ProcessExit, ((const ProcessExitInfo*)header)->ProcessId);
+				break;
+
+			case ItemType::ThreadCreate:
+			case ItemType::ThreadExit:
+			{
+				auto info = (const ThreadCreateExitInfo*)header;
+				Add(header, header->Type, info->ProcessId, info->ThreadId);
+				break;
+			}
+
+			case ItemType::ThreadSummary:
+				Add(header, ItemType::ThreadSummary, ((const ThreadSummaryInfo*)header)->ProcessId);
+				break;
+
+			case ItemType::RateSummary:
+				Add(header, ItemType::RateSummary, ((const RateSummaryInfo*)header)->TopProcessId);
+				break;
+
+			case ItemType::ImageLoad:
+			{
+				auto info = (const ImageLoadInfo*)header;
+				ULONG length = 0;
+				while (length < MaxImageFileSize && info->ImageFileName[length])
+					length++;
+				Add(header, ItemType::ImageLoad, info->ProcessId, 0, Id(info->ImageFileName, length));
+				break;
+			}
+
+			case ItemType::ImageLoadV2:
+			{
+				auto info = (const ImageLoadInfoV2*)header;
+				Add(header, ItemType::ImageLoad, info->ProcessId, 0,
+					Id((const WCHAR*)(record + info->ImageFileNameOffset), Bounded(header, info->ImageFileNameOffset, info->ImageFileNameLength)));
+				break;
+			}
+
+			case ItemType::StringDefinition:
+			{
+				// the driver's id for a path or a command line, mapped to ours
+				auto info = (const StringDefinitionInfo*)header;
+				(_commandLines.IsCommandLine(info->Id) ? _commandLines.Define(info->Id) : _imageNames[info->Id]) = Id((const WCHAR*)(record + info->Offset), Bounded(header, info->Offset, info->Length));
+				return true;
+			}
+
+			case ItemType::ImageLoadInterned:
+			{
+				auto info = (const ImageLoadInternedInfo*)header;
+				auto name = _imageNames.find(info->ImageNameId);
+				Add(header, ItemType::ImageLoad, info->ProcessId, 0, name != _imageNames.end() ? name->second : 0);
+				break;
+			}
+
+			case ItemType::RegistrySetValue:
+			{
+				auto info = (const RegistrySetValueInfo*)header;
+				Add(header, ItemType::RegistrySetValue, info->ProcessId, info->ThreadId,
+					Id(info->KeyName, Terminated(info->KeyName)), Id(info->ValueName, Terminated(info->ValueName)));
+				break;
+			}
+
+			case ItemType::RegistrySetValueV2:
+			{
+				auto info = (const RegistrySetValueInfoV2*)header;
+				Add(header, ItemType::RegistrySetValue, info->ProcessId, info->ThreadId,
+					Id((const WCHAR*)(record + info->KeyNameOffset), Bounded(header, info->KeyNameOffset, info->KeyNameLength)),
+					Id((const WCHAR*)(record + info->ValueNameOffset), Bounded(header, info->ValueNameOffset, info->ValueNameLength)));
+				break;
+			}
+
+			case ItemType::TimeCalibration:
+			{
+				auto info = (const TimeCalibrationInfo*)header;
+				_clock.Counter = info->Time.QuadPart;
+				_clock.SystemTime = info->SystemTime.QuadPart;
+				_clock.Scale = info->Scale;
+				return true;
+			}
+
+			default:
+				return true;
+		}
+		return _time.size() < _groupRows || WriteGroup();
+	}
+
+	// writes what's buffered, the index and the dictionary; false if any write failed
+	bool Close() {
+		if (_file == nullptr)
+			return true;
+
+		auto ok = !_failed && (_time.empty() || WriteGroup()) && WriteIndex() && WriteStrings();
+		if (ok) {
+			_header.Complete = 1;
+			ok = ::fseek(_file, 0, SEEK_SET) == 0 && ::fwrite(&_header, sizeof(_header), 1, _file) == 1;
+		}
+		ok = ::fclose(_file) == 0 && ok;
+		_file = nullptr;
+		return ok;
+	}
+
+	ULONG64 Rows() const {
+		return _header.Rows + _time.size();
+	}
+
+	ULONG Strings() const {
+		return (ULONG)_strings.size();
+	}
+
+	ULONG64 Bytes() const {
+		return _offset;
+	}
+
+private:
+	void Add(const ItemHeader* header, ItemType type, ULONG processId, ULONG threadId = 0, ULONG name = 0, ULONG value = 0) {
+		auto time = header->Time.QuadPart;
+		if (_format >= SysMonFormatV4)
+			time = _clock.Scale ? _clock.ToSystemTime(time) : 0;
+		_time.push_back(time);
+		_type.push_back((USHORT)type);
+		_processId.push_back(processId);
+		_threadId.push_back(threadId);
+		_name.push_back(name);
+		_value.push_back(value);
+	}
+
+	// the dictionary id of a string, 0 for an empty one
+	ULONG Id(const WCHAR* text, ULONG length) {
+		if (length == 0)
+			return 0;
+		_key.assign(text, length);
+		auto it = _ids.find(_key);
+		if (it != _ids.end())
+			return it->second;
+		_strings.push_back(_key);
+		auto id = (ULONG)_strings.size();
+		_ids.emplace(_key, id);
+		return id;
+	}
+
+	bool WriteGroup() {
+		if (!WriteChunk(_time) || !WriteChunk(_type) || !WriteChunk(_processId) ||
+			!WriteChunk(_threadId) || !WriteChunk(_name) || !WriteChunk(_value)) {
+			_failed = true;
+			return false;
+		}
+		_header.RowGroups++;
+		_header.Rows += _time.size();
+		_time.clear();
+		_type.clear();
+		_processId.clear();
+		_threadId.clear();
+		_name.clear();
+		_value.clear();
+		return true;
+	}
+
+	template<typename T>
+	bool WriteChunk(const std::vector<T>& values) {
+		ColumnChunk chunk;
+		chunk.Offset = _offset;
+		chunk.Rows = (ULONG)values.size();
+		chunk.Width = sizeof(T);
+		chunk.Min = chunk.Max = values.empty() ? 0 : (LONGLONG)values[0];
+		for (auto value : values) {
+			if ((LONGLONG)value < chunk.Min)
+				chunk.Min = (LONGLONG)value;
+			if ((LONGLONG)value > chunk.Max)
+				chunk.Max = (LONGLONG)value;
+		}
+		_chunks.push_back(chunk);
+		return Write(values.data(), values.size() * sizeof(T));
+	}
+
+	bool WriteIndex() {
+		_header.IndexOffset = _offset;
+		return Write(_chunks.data(), _chunks.size() * sizeof(ColumnChunk));
+	}
+
+	bool WriteStrings() {
+		_header.StringsOffset = _offset;
+		_header.Strings = (ULONG)_strings.size();
+		for (auto& text : _strings) {
+			auto length = (ULONG)text.size();
+			if (!Write(&length, sizeof(length), 4) || !Write(text.data(), length * sizeof(WCHAR), 4))
+				return false;
+		}
+		return true;
+	}
+
+	// padded to align
+	bool Write(const void* data, size_t size, ULONG align = 8) {
+		static const UCHAR zeros[8] = {};
+		auto padding = (size_t)((align - (_offset + size) % align) % align);
+		if (size && ::fwrite(data, 1, size, _file) != size)
+			return false;
+		if (padding && ::fwrite(zeros, 1, padding, _file) != padding)
+			return false;
+		_offset += size + padding;
+		return true;
+	}
+
+	static ULONG Bounded(const ItemHeader* header, ULONG offset, ULONG length) {
+		if (offset > header->Size)
+			return 0;
+		auto room = (header->Size - offset) / sizeof(WCHAR);
+		return length < room ? length : (ULONG)room;
+	}
+
+	template<size_t N>
+	static ULONG Terminated(const WCHAR (&text)[N]) {
+		ULONG length = 0;
+		while (length < N && text[length])
+			length++;
+		return length;
+	}
+
+private:
+	FILE* _file = nullptr;
+	ColumnFileHeader _header;
+	ULONG64 _offset = 0;
+	ULONG _groupRows = 0;
+	bool _failed = false;
+	ULONG _format = SysMonFormatV1;
+	TimeScale _clock = {};
+	std::unordered_map<ULONG, ULONG> _imageNames;		// v3, driver id to ours
+	CommandLineDefinitions<ULONG> _commandLines;		// v5, the same
+
+	// the row group being filled
+	std::vector<LONGLONG> _time;
+	std::vector<USHORT> _type;
+	std::vector<ULONG> _processId;
+	std::vector<ULONG> _threadId;
+	std::vector<ULONG> _name;
+	std::vector<ULONG> _value;
+
+	std::vector<ColumnChunk> _chunks;
+	std::vector<std::basic_string<WCHAR>> _strings;		// by id - 1
+	std::unordered_map<std::basic_string<WCHAR>, ULONG> _ids;
+	std::basic_string<WCHAR> _key;
+};
+
+//
+// maps an export for reading: row groups are picked by their chunks' stats,
+// then only the columns wanted are touched
+//
+class ColumnReader {
+public:
+	~ColumnReader() {
+		Close();
+	}
+
+	bool Open(const char* path) {
+		if (!_file.Open(path)) {
+			_file.Close();
+			return false;
+		}
+
+		auto size = _file.Size();
+		_header = (const ColumnFileHeader*)_file.Data();
+		if (size < sizeof(ColumnFileHeader) || _header->Magic != ColumnMagic || _header->Version != ColumnVersion ||
+			!_header->Complete || _header->Columns != (ULONG)ExportColumn::Count ||
+			_header->IndexOffset > size || (size - _header->IndexOffset) / sizeof(ColumnChunk) < (ULONG64)_header->RowGroups * _header->Columns ||
+			_header->StringsOffset > size) {
+			_file.Close();
+			return false;
+		}
+
+		// chunks pointing outside the file make the whole thing suspect
+		_chunks = (const ColumnChunk*)(_file.Data() + _header->IndexOffset);
+		for (ULONG i = 0; i < _header->RowGroups * _header->Columns; i++) {
+			auto& chunk = _chunks[i];
+			if (chunk.Width != ColumnWidths[i % _header->Columns] || chunk.Offset % 8 ||
+				chunk.Offset > size || (size - chunk.Offset) / chunk.Width < chunk.Rows) {
+				_file.Close();
+				return false;
+			}
+		}
+		if (!IndexStrings()) {
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	void Close() {
+		_file.Close();
+		_strings.clear();
+	}
+
+	const ColumnFileHeader& Header() const {
+		return *_header;
+	}
+
+	ULONG RowGroups() const {
+		return _header->RowGroups;
+	}
+
+	// rows, min and max of one column in one group
+	const ColumnChunk& Chunk(ULONG group, ExportColumn column) const {
+		return _chunks[group * _header->Columns + (ULONG)column];
+	}
+
+	// a column's values in a group, T the column's width
+	template<typename T>
+	const T* Values(ULONG group, ExportColumn column) const {
+		return (const T*)(_file.Data() + Chunk(group, column).Offset);
+	}
+
+	// a dictionary string by id, nullptr for 0 or an id that isn't there
+	const WCHAR* String(ULONG id, ULONG& length) const {
+		if (id == 0 || id > _strings.size()) {
+			length = 0;
+			return nullptr;
+		}
+		auto p = _file.Data() + _strings[id - 1];
+		::memcpy(&length, p, sizeof(length));
+		return (const WCHAR*)(p + sizeof(ULONG));
+	}
+
+	// the groups that may have rows from first to last (inclusive)
+	template<typename Visit>
+	void ForEachGroup(LONGLONG first, LONGLONG last, Visit&& visit) const {
+		for (ULONG group = 0; group < _header->RowGroups; group++) {
+			auto& time = Chunk(group, ExportColumn::Time);
+			if (time.Max >= first && time.Min <= last)
+				visit(group);
+		}
+	}
+
+private:
+	bool IndexStrings() {
+		auto p = _header->StringsOffset, end = _file.Size();
+		_strings.reserve(_header->Strings);
+		for (ULONG i = 0; i < _header->Strings; i++) {
+			if (end - p < sizeof(ULONG))
+				return false;
+			ULONG length;
+			::memcpy(&length, _file.Data() + p, sizeof(length));
+			auto size = ((ULONG64)length * sizeof(WCHAR) + 3) & ~3ULL;
+			if (end - p - sizeof(ULONG) < size)
+				return false;
+			_strings.push_back(p);
+			p += sizeof(ULONG) + size;
+		}
+		return true;
+	}
+
+private:
+	MappedFile _file;
+	const ColumnFileHeader* _header = nullptr;
+	const ColumnChunk* _chunks = nullptr;
+	std::vector<ULONG64> _strings;		// offsets, by id - 1
+};
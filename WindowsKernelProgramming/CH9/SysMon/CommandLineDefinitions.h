@@ -0,0 +1,50 @@
+#pragma once
+
+#include "SysMonCommon.h"
+#include <map>
+
+//
+// a client's side of v5 command lines: what it keeps for each StringDefinitionInfo with
+// SysMonCommandLineIdBit set, by id. the driver only refers to its last
+// SysMonCommandLineCapacity lines and sends them in order, so anything that many ids
+// behind the newest definition won't be asked for again and is let go.
+// user mode only.
+//
+
+template<typename T>
+class CommandLineDefinitions {
+public:
+	static bool IsCommandLine(ULONG id) {
+		return (id & SysMonCommandLineIdBit) != 0;
+	}
+
+	// the value to fill in for the id
+	T& Define(ULONG id) {
+		auto& value = _lines[id];
+		if ((id & ~SysMonCommandLineIdBit) > SysMonCommandLineCapacity)
+			_lines.erase(_lines.begin(), _lines.lower_bound(id - SysMonCommandLineCapacity));
+		return value;
+	}
+
+	const T* Find(ULONG id) const {
+		auto line = _lines.find(id);
+		return line != _lines.end() ? &line->second : nullptr;
+	}
+
+	template<typename F>
+	void ForEach(F f) const {
+		for (auto& line : _lines)
+			f(line.first, line.second);
+	}
+
+	void Clear() {
+		_lines.clear();
+	}
+
+	size_t Count() const {
+		return _lines.size();
+	}
+
+private:
+	std::map<ULONG, T> _lines;
+};
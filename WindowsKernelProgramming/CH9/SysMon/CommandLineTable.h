@@ -0,0 +1,167 @@
+#pragma once
+
+#include "Platform.h"
+#include "InternTable.h"
+#include "SysMonCommon.h"
+
+//
+// the most recent distinct command lines, each known by an id (v5, ProcessCreateInterned).
+// ids count up from SysMonCommandLineIdBit | 1 and a line lives in slot id % capacity,
+// so a new line pushes out the one capacity lines before it, whether it's still being
+// repeated or not. a hash index (a few times the capacity, one id per bucket) finds a
+// repeat; a bucket another line took over just means that repeat is sent once more.
+// each id Intern hands out pins its line until Unpin: a record referring to it is still
+// queued. a pinned line isn't pushed out, the new line gets 0 and goes in full, so a
+// reader always finds the line of a record it holds.
+// the caller serializes Intern; Lookup of a pinned id and Unpin need no lock.
+//
+
+class CommandLineTable {
+public:
+	// capacity must be a power of 2
+	bool Init(ULONG capacity, ULONG tag) {
+		_capacity = capacity;
+		_tag = tag;
+		_next = 1;
+		_added = _repeats = 0;
+		_bytes = 0;
+		_pinned = 0;
+		auto size = capacity * (sizeof(InternEntry*) + sizeof(LONG)) + IndexSize() * sizeof(ULONG);
+		_slots = (InternEntry**)AllocateMemory(size, tag);
+		if (_slots == nullptr)
+			return false;
+
+		_pins = (volatile LONG*)(_slots + capacity);
+		_index = (ULONG*)(_pins + capacity);
+		::memset(_slots, 0, size);
+		return true;
+	}
+
+	void Destroy() {
+		if (_slots == nullptr)
+			return;
+
+		for (ULONG i = 0; i < _capacity; i++)
+			if (_slots[i])
+				FreeMemory(_slots[i]);
+		FreeMemory(_slots);
+		_slots = nullptr;
+	}
+
+	// the id of a repeat of a line still here or of the line just added, pinned;
+	// 0 out of memory or when the line it would push out is pinned
+	ULONG Intern(const WCHAR* text, USHORT length, bool& repeat) {
+		auto hash = Hash(text, length);
+		auto& bucket = _index[hash & (IndexSize() - 1)];
+		auto entry = Lookup(bucket);
+		if (entry && entry->Hash == hash && entry->Length == length && ::memcmp(entry->Text, text, length * sizeof(WCHAR)) == 0) {
+			repeat = true;
+			_repeats++;
+			InterlockedIncrement(&_pins[Slot(bucket)]);
+			return bucket;
+		}
+
+		repeat = false;
+		if (_pins[Slot(SysMonCommandLineIdBit | _next)]) {
+			_pinned++;
+			return 0;
+		}
+
+		entry = (InternEntry*)AllocateMemory(FIELD_OFFSET(InternEntry, Text) + length * sizeof(WCHAR), _tag);
+		if (entry == nullptr)
+			return 0;
+
+		auto id = SysMonCommandLineIdBit | _next;
+		_next = (_next + 1) & ~SysMonCommandLineIdBit;
+		if (_next == 0)
+			_next = 1;
+		entry->Hash = hash;
+		entry->Length = length;
+		entry->Generation = (LONG)id;
+		::memcpy(entry->Text, text, length * sizeof(WCHAR));
+
+		auto& slot = _slots[Slot(id)];
+		if (slot) {
+			_bytes -= slot->Length * sizeof(WCHAR);
+			FreeMemory(slot);
+		}
+		slot = entry;
+		InterlockedIncrement(&_pins[Slot(id)]);
+		_bytes += length * sizeof(WCHAR);
+		bucket = id;
+		_added++;
+		return id;
+	}
+
+	// a record that had the id from Intern is gone
+	void Unpin(ULONG id) {
+		InterlockedDecrement(&_pins[Slot(id)]);
+	}
+
+	// the line given the id, null once newer lines pushed it out
+	InternEntry* Lookup(ULONG id) const {
+		if ((id & SysMonCommandLineIdBit) == 0)
+			return nullptr;
+		auto entry = _slots[Slot(id)];
+		return entry && (ULONG)entry->Generation == id ? entry : nullptr;
+	}
+
+	ULONG Slot(ULONG id) const {
+		return id & (_capacity - 1);
+	}
+
+	ULONG Capacity() const {
+		return _capacity;
+	}
+
+	// lines stored, and the ones that turned out to be repeats
+	ULONG64 Added() const {
+		return _added;
+	}
+
+	ULONG64 Repeats() const {
+		return _repeats;
+	}
+
+	// new lines sent in full because the oldest line was still pinned
+	ULONG64 Pinned() const {
+		return _pinned;
+	}
+
+	// of text held right now
+	ULONG64 Bytes() const {
+		return _bytes;
+	}
+
+	// FNV-1a, 64 bits at a time: build lines run to tens of KB and all of it counts
+	static ULONG Hash(const WCHAR* text, USHORT length) {
+		ULONG64 hash = 14695981039346656037ull ^ length;
+		auto bytes = (const UCHAR*)text;
+		ULONG size = length * sizeof(WCHAR), i = 0;
+		for (; i + sizeof(ULONG64) <= size; i += sizeof(ULONG64)) {
+			ULONG64 word;
+			::memcpy(&word, bytes + i, sizeof(word));
+			hash = (hash ^ word) * 1099511628211ull;
+		}
+		for (; i < size; i++)
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		return (ULONG)(hash ^ (hash >> 32));
+	}
+
+private:
+	ULONG IndexSize() const {
+		return _capacity * 4;
+	}
+
+private:
+	InternEntry** _slots = nullptr;
+	volatile LONG* _pins;	// by slot, records referring to the line
+	ULONG* _index;			// by hash, the id of the last line seen there
+	ULONG _capacity;
+	ULONG _next;			// id of the next line, without SysMonCommandLineIdBit
+	ULONG _tag;
+	ULONG64 _added;
+	ULONG64 _repeats;
+	ULONG64 _pinned;
+	ULONG64 _bytes;
+};
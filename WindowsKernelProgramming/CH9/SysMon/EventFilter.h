@@ -0,0 +1,110 @@
+#pragma once
+
+#include "Platform.h"
+#include "SysMonCommon.h"
+
+//
+// decides, before anything is allocated, whether an event is wanted.
+// notify routines read the filter without taking a lock: it is kept twice and
+// the writer updates one copy while readers use the other (a seqlock "latch"),
+// so a reader only retries if it raced with two updates in a row.
+// updates must be serialized by the caller.
+//
+
+class EventFilter {
+public:
+	void Init() {
+		_sequence = 0;
+		for (auto& table : _tables) {
+			table.TypeMask = SysMonFilterAllTypes;
+			table.IncludeCount = table.ExcludeCount = 0;
+		}
+	}
+
+	// validates and installs a filter coming from user mode
+	bool Set(const SysMonFilter* filter, ULONG size) {
+		if (size < SYSMON_FILTER_SIZE(0))
+			return false;
+
+		auto include = filter->IncludeCount, exclude = filter->ExcludeCount;
+		if (include > SysMonFilterMaxProcesses || exclude > SysMonFilterMaxProcesses || size < SYSMON_FILTER_SIZE(include + exclude))
+			return false;
+
+		Table table;
+		table.TypeMask = filter->TypeMask;
+		table.IncludeCount = include;
+		table.ExcludeCount = exclude;
+		::memcpy(table.Include, filter->ProcessIds, include * sizeof(ULONG));
+		::memcpy(table.Exclude, filter->ProcessIds + include, exclude * sizeof(ULONG));
+		Sort(table.Include, include);
+		Sort(table.Exclude, exclude);
+
+		// an odd sequence sends readers to the second copy while the first is
+		// rewritten, an even one back to the first while the second is
+		for (int i = 0; i < 2; i++) {
+			WriteULongRelease(&_sequence, _sequence + 1);
+			MemoryBarrier();
+			_tables[i & 1] = table;
+		}
+		MemoryBarrier();
+		return true;
+	}
+
+	bool Allows(ItemType type, ULONG processId) const {
+		for (;;) {
+			auto sequence = ReadULongAcquire(&_sequence);
+			auto& table = _tables[sequence & 1];
+			auto allowed = Allows(table, type, processId);
+			ReadBarrier();
+			if (ReadULongNoFence(&_sequence) == sequence)
+				return allowed;
+		}
+	}
+
+private:
+	struct Table {
+		ULONG TypeMask;
+		ULONG IncludeCount;
+		ULONG ExcludeCount;
+		ULONG Include[SysMonFilterMaxProcesses];
+		ULONG Exclude[SysMonFilterMaxProcesses];
+	};
+
+	static bool Allows(const Table& table, ItemType type, ULONG processId) {
+		if ((table.TypeMask & (1 << (ULONG)type)) == 0)
+			return false;
+
+		// a torn read only gives a wrong answer, which the caller throws away;
+		// the counts are clamped so it can't run off the table either
+		auto include = table.IncludeCount, exclude = table.ExcludeCount;
+		if (include && !Contains(table.Include, include > SysMonFilterMaxProcesses ? SysMonFilterMaxProcesses : include, processId))
+			return false;
+		return exclude == 0 || !Contains(table.Exclude, exclude > SysMonFilterMaxProcesses ? SysMonFilterMaxProcesses : exclude, processId);
+	}
+
+	static bool Contains(const ULONG* ids, ULONG count, ULONG id) {
+		ULONG low = 0, high = count;
+		while (low < high) {
+			auto mid = (low + high) / 2;
+			if (ids[mid] < id)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		return low < count && ids[low] == id;
+	}
+
+	static void Sort(ULONG* ids, ULONG count) {
+		for (ULONG i = 1; i < count; i++) {
+			auto id = ids[i];
+			auto j = i;
+			for (; j > 0 && ids[j - 1] > id; j--)
+				ids[j] = ids[j - 1];
+			ids[j] = id;
+		}
+	}
+
+private:
+	volatile ULONG _sequence;
+	Table _tables[2];
+};
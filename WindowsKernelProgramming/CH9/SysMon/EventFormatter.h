@@ -0,0 +1,494 @@
+#pragma once
+
+#include "Platform.h"
+#include "SysMonCommon.h"
+#include "TimeSource.h"
+#include "CommandLineDefinitions.h"
+#include "OutputWriter.h"
+#include <stdio.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//
+// turns event records into the client's text lines. everything goes into one
+// reusable buffer that is written out in large chunks (when full, or on Flush):
+// no allocation per event, no printf, strings go out as UTF-8 and the
+// "hh:mm:ss." part of a timestamp is only worked out when the second changes.
+// keeps what later records depend on: v3 image paths, the v4 calibration and the
+// v5 command lines. with an OutputWriter the chunks go to its thread instead.
+// user mode only (Windows or POSIX).
+//
+
+class EventFormatter {
+public:
+	~EventFormatter() {
+		if (_output && _writer == nullptr)
+			Flush();
+	}
+
+	void Init(FILE* output, ULONG format, ULONG capacity = 1 << 20) {
+		_output = output;
+		_buffer.resize(capacity);
+		_used = 0;
+		SetFormat(format);
+	}
+
+	// the format of the records that follow; a new client or segment starts over
+	void SetFormat(ULONG format) {
+		_format = format;
+		_clock = {};
+		_imageNames.clear();
+		_commandLines.Clear();
+		_second = -1;
+	}
+
+	void Format(const UCHAR* records, ULONG size) {
+		for (ULONG offset = 0; offset + sizeof(ItemHeader) <= size; ) {
+			auto header = (const ItemHeader*)(records + offset);
+			if (header->Size < sizeof(ItemHeader) || header->Size > size - offset)
+				break;
+			Format(header);
+			offset += header->Size;
+		}
+	}
+
+	// text from now on goes to the writer's thread, until SetWriter(nullptr); flush first
+	void SetWriter(OutputWriter* writer) {
+		_writer = writer;
+	}
+
+	bool Flush() {
+		if (_writer) {
+			// the filled buffer goes over as it is, the writer's empty one comes back
+			if (_used) {
+				_buffer.swap(_writer->Buffer());
+				_writer->Write(_used);
+				_buffer.swap(_writer->Buffer());
+				_used = 0;
+			}
+			return !_writer->Failed();
+		}
+
+		auto ok = _used == 0 || ::fwrite(_buffer.data(), 1, _used, _output) == _used;
+		_used = 0;
+		return ::fflush(_output) == 0 && ok;
+	}
+
+	void Format(const ItemHeader* header) {
+		auto record = (const UCHAR*)header;
+		switch (header->Type) {
+			case ItemType::ProcessExit:
+			{
+				auto info = (const ProcessExitInfo*)header;
+				Start(header, 64);
+				Text("Process ");
+				Decimal(info->ProcessId);
+				Text(" Exited\n");
+				break;
+			}
+
+			case ItemType::ProcessCreate:
+			{
+				auto info = (const ProcessCreateInfo*)header;
+				auto length = Bounded(header, info->CommandLineOffset, info->CommandLineLength);
+				Start(header, 80 + length * 3);
+				Text("Process ");
+				Decimal(info->ProcessId);
+				Text(" Created. Command line: ");
+				Wide((const WCHAR*)(record + info->CommandLineOffset), length);
+				Text("\n");
+				break;
+			}
+
+			case ItemType::ProcessCreateInterned:
+			{
+				auto info = (const ProcessCreateInternedInfo*)header;
+				auto line = _commandLines.Find(info->CommandLineId);
+				Start(header, 160 + (line ? (ULONG)line->size() * 3 : 0));
+				Text("Process ");
+				Decimal(info->ProcessId);
+				Text(" Created. Command line: ");
+				if (line) {
+					Wide(line->data(), (ULONG)line->size());
+					if (line->size() < info->CommandLineLength) {
+						Text(" (");
+						Decimal((ULONG)line->size());
+						Text(" of ");
+						Decimal(info->CommandLineLength);
+						Text(" characters)");
+					}
+				}
+				else if (info->CommandLineId) {
+					Text("(a repeat, no longer known)");
+				}
+				Text("\n");
+				break;
+			}
+
+			case ItemType::ThreadCreate:
+			case ItemType::ThreadExit:
+			{
+				auto info = (const ThreadCreateExitInfo*)header;
+				Start(header, 80);
+				Text("Thread ");
+				Decimal(info->ThreadId);
+				if (header->Type == ItemType::ThreadCreate)
+					Text(" Created in process ");
+				else
+					Text(" Exited from process ");
+				Decimal(info->ProcessId);
+				Text("\n");
+				break;
+			}
+
+			case ItemType::ThreadSummary:
+			{
+				auto info = (const ThreadSummaryInfo*)header;
+				Start(header, 200);
+				Text("Threads of process ");
+				Decimal(info->ProcessId);
+				Text(" over ");
+				Decimal(info->IntervalMs);
+				Text(" msec: ");
+				Decimal(info->Creates);
+				Text(" created, ");
+				Decimal(info->Exits);
+				Text(" exited, ");
+				Decimal(info->LiveThreads);
+				Text(" running");
+				if (info->Exits) {
+					Text(", lifetime ");
+					Signed(info->MinLifetime / 10);
+					Text("-");
+					Signed(info->MaxLifetime / 10);
+					Text(" usec");
+				}
+				if (info->ProcessExited)
+					Text(" (process exited)");
+				Text("\n");
+				break;
+			}
+
+			case ItemType::RateSummary:
+			{
+				auto info = (const RateSummaryInfo*)header;
+				Start(header, 300);
+				Text("Rate limits over ");
+				Decimal(info->IntervalMs);
+				Text(" msec kept out");
+				auto& suppressed = info->Suppressed;
+				bool first = true;
+				Suppressed(suppressed[(int)ItemType::ProcessCreate], " process creates", first);
+				Suppressed(suppressed[(int)ItemType::ProcessExit], " process exits", first);
+				Suppressed(suppressed[(int)ItemType::ThreadCreate], " thread creates", first);
+				Suppressed(suppressed[(int)ItemType::ThreadExit], " thread exits", first);
+				Suppressed(suppressed[(int)ItemType::ImageLoad], " image loads", first);
+				Suppressed(suppressed[(int)ItemType::RegistrySetValue], " registry writes", first);
+				if (info->TopProcessId) {
+					Text(", ");
+					Decimal(info->TopProcessSuppressed);
+					Text(" from process ");
+					Decimal(info->TopProcessId);
+				}
+				Text("\n");
+				break;
+			}
+
+			case ItemType::ImageLoad:
+			{
+				auto info = (const ImageLoadInfo*)header;
+				ULONG length = 0;
+				while (length < MaxImageFileSize && info->ImageFileName[length])
+					length++;
+				ImageLoad(header, info->ProcessId, info->LoadAddress, info->ImageFileName, length);
+				break;
+			}
+
+			case ItemType::ImageLoadV2:
+			{
+				auto info = (const ImageLoadInfoV2*)header;
+				ImageLoad(header, info->ProcessId, info->LoadAddress, (const WCHAR*)(record + info->ImageFileNameOffset),
+					Bounded(header, info->ImageFileNameOffset, info->ImageFileNameLength));
+				break;
+			}
+
+			case ItemType::StringDefinition:
+			{
+				auto info = (const StringDefinitionInfo*)header;
+				auto text = (const WCHAR*)(record + info->Offset);
+				auto length = Bounded(header, info->Offset, info->Length);
+				if (_commandLines.IsCommandLine(info->Id))
+					_commandLines.Define(info->Id).assign(text, length);
+				else
+					_imageNames[info->Id].assign(text, length);
+				break;
+			}
+
+			case ItemType::ImageLoadInterned:
+			{
+				static const WCHAR unknown[] = { '?' };
+				auto info = (const ImageLoadInternedInfo*)header;
+				auto name = _imageNames.find(info->ImageNameId);
+				if (name != _imageNames.end())
+					ImageLoad(header, info->ProcessId, info->LoadAddress, name->second.data(), (ULONG)name->second.size());
+				else
+					ImageLoad(header, info->ProcessId, info->LoadAddress, unknown, 1);
+				break;
+			}
+
+			case ItemType::RegistrySetValueV2:
+			{
+				auto info = (const RegistrySetValueInfoV2*)header;
+				auto keyLength = Bounded(header, info->KeyNameOffset, info->KeyNameLength);
+				auto valueLength = Bounded(header, info->ValueNameOffset, info->ValueNameLength);
+				auto dataLength = info->DataOffset + info->DataLength <= header->Size ? info->DataLength : 0;
+				Start(header, 120 + (keyLength + valueLength) * 3 + dataLength * 3);
+				RegistryWrite(info->ProcessId, (const WCHAR*)(record + info->KeyNameOffset), keyLength,
+					(const WCHAR*)(record + info->ValueNameOffset), valueLength, info->DataType, info->DataSize);
+				RegistryData(info->DataType, record + info->DataOffset, dataLength);
+				break;
+			}
+
+			case ItemType::RegistrySetValue:
+			{
+				auto info = (const RegistrySetValueInfo*)header;
+				Start(header, 120 + (ARRAYSIZE(info->KeyName) + ARRAYSIZE(info->ValueName)) * 3 + sizeof(info->Data) * 3);
+				RegistryWrite(info->ProcessId, info->KeyName, Terminated(info->KeyName), info->ValueName, Terminated(info->ValueName),
+					info->DataType, info->DataSize);
+				auto size = info->DataSize < sizeof(info->Data) ? info->DataSize : (ULONG)sizeof(info->Data);
+				if (info->DataType == 4 /* REG_DWORD */ || info->DataType == 1 /* REG_SZ */ || info->DataType == 2 /* REG_EXPAND_SZ */)
+					size = sizeof(info->Data);		// v1 didn't bound these by the value's size
+				RegistryData(info->DataType, info->Data, size);
+				break;
+			}
+
+			case ItemType::TimeCalibration:
+			{
+				auto info = (const TimeCalibrationInfo*)header;
+				_clock.Counter = info->Time.QuadPart;
+				_clock.SystemTime = info->SystemTime.QuadPart;
+				_clock.Scale = info->Scale;
+				break;
+			}
+
+			default:
+				break;
+		}
+	}
+
+private:
+	// makes room for a line of up to size bytes and writes its timestamp
+	void Start(const ItemHeader* header, ULONG size) {
+		size += 16;
+		if (_used + size > _buffer.size()) {
+			Flush();
+			if (size > _buffer.size())
+				_buffer.resize(size);
+		}
+		Time(header->Time.QuadPart);
+	}
+
+	void Time(LONGLONG time) {
+		if (_format >= SysMonFormatV4) {
+			// the driver sends a calibration ahead of anything that needs one
+			if (_clock.Scale == 0) {
+				Text("??:??:??.???: ");
+				return;
+			}
+			time = _clock.ToSystemTime(time);
+		}
+
+		auto second = time / 10000000;
+		if (second != _second) {
+			auto seconds = (ULONG)(second % 86400);
+			auto p = _secondText;
+			Digits2(p, seconds / 3600);
+			*p++ = ':';
+			Digits2(p, seconds / 60 % 60);
+			*p++ = ':';
+			Digits2(p, seconds % 60);
+			*p++ = '.';
+			_second = second;
+		}
+		auto p = _buffer.data() + _used;
+		::memcpy(p, _secondText, sizeof(_secondText));
+		p += sizeof(_secondText);
+		auto ms = (ULONG)(time / 10000 % 1000);
+		*p++ = (char)('0' + ms / 100);
+		Digits2(p, ms % 100);
+		*p++ = ':';
+		*p++ = ' ';
+		_used = (ULONG)(p - _buffer.data());
+	}
+
+	void ImageLoad(const ItemHeader* header, ULONG processId, const void* address, const WCHAR* name, ULONG length) {
+		Start(header, 100 + length * 3);
+		Text("Image loaded into process ");
+		Decimal(processId);
+		Text(" at address 0x");
+		Hex((ULONG64)(ULONG_PTR)address, sizeof(void*) * 2);
+		Text(" (");
+		Wide(name, length);
+		Text(")\n");
+	}
+
+	void RegistryWrite(ULONG processId, const WCHAR* key, ULONG keyLength, const WCHAR* value, ULONG valueLength, ULONG type, ULONG size) {
+		Text("Registry write PID=");
+		Decimal(processId);
+		Text(": ");
+		Wide(key, keyLength);
+		Text("\\");
+		Wide(value, valueLength);
+		Text(" type: ");
+		Decimal(type);
+		Text(" size: ");
+		Decimal(size);
+		Text(" data: ");
+	}
+
+	void RegistryData(ULONG type, const UCHAR* data, ULONG size) {
+		switch (type) {
+			case 4:		// REG_DWORD
+				if (size >= sizeof(ULONG)) {
+					ULONG value;
+					::memcpy(&value, data, sizeof(value));
+					Text("0x");
+					Hex(value, 8);
+					Text("\n");
+					return;
+				}
+				break;
+
+			case 1:		// REG_SZ
+			case 2:		// REG_EXPAND_SZ
+			{
+				auto text = (const WCHAR*)data;
+				ULONG length = 0;
+				while (length < size / sizeof(WCHAR) && text[length])
+					length++;
+				Wide(text, length);
+				Text("\n");
+				return;
+			}
+		}
+
+		for (ULONG i = 0; i < size; i++) {
+			Hex(data[i], 2);
+			Text(" ");
+		}
+		Text("\n");
+	}
+
+	template<size_t N>
+	void Text(const char (&text)[N]) {
+		::memcpy(_buffer.data() + _used, text, N - 1);
+		_used += N - 1;
+	}
+
+	template<size_t N>
+	void Suppressed(ULONG count, const char (&what)[N], bool& first) {
+		if (count == 0)
+			return;
+		if (!first)
+			Text(",");
+		Text(" ");
+		first = false;
+		Decimal(count);
+		Text(what);
+	}
+
+	void Decimal(ULONG64 value) {
+		char digits[20];
+		int count = 0;
+		do {
+			digits[count++] = (char)('0' + value % 10);
+			value /= 10;
+		} while (value);
+		auto p = _buffer.data() + _used;
+		while (count)
+			*p++ = digits[--count];
+		_used = (ULONG)(p - _buffer.data());
+	}
+
+	void Signed(LONGLONG value) {
+		if (value < 0) {
+			Text("-");
+			Decimal(0 - (ULONG64)value);
+		}
+		else {
+			Decimal(value);
+		}
+	}
+
+	void Hex(ULONG64 value, int digits) {
+		static const char hex[] = "0123456789ABCDEF";
+		auto p = _buffer.data() + _used;
+		for (int i = digits - 1; i >= 0; i--) {
+			p[i] = hex[value & 15];
+			value >>= 4;
+		}
+		_used += digits;
+	}
+
+	// UTF-16 to UTF-8, up to 3 bytes per WCHAR (a surrogate pair is 4 for 2)
+	void Wide(const WCHAR* text, ULONG length) {
+		auto p = (UCHAR*)_buffer.data() + _used;
+		for (ULONG i = 0; i < length; i++) {
+			ULONG c = text[i];
+			if (c < 0x80) {
+				*p++ = (UCHAR)c;
+			}
+			else if (c < 0x800) {
+				*p++ = (UCHAR)(0xc0 | c >> 6);
+				*p++ = (UCHAR)(0x80 | (c & 0x3f));
+			}
+			else {
+				if (c >= 0xd800 && c < 0xdc00 && i + 1 < length && text[i + 1] >= 0xdc00 && text[i + 1] < 0xe000) {
+					c = 0x10000 + ((c - 0xd800) << 10) + (text[++i] - 0xdc00);
+					*p++ = (UCHAR)(0xf0 | c >> 18);
+					*p++ = (UCHAR)(0x80 | (c >> 12 & 0x3f));
+				}
+				else {
+					*p++ = (UCHAR)(0xe0 | c >> 12);
+				}
+				*p++ = (UCHAR)(0x80 | (c >> 6 & 0x3f));
+				*p++ = (UCHAR)(0x80 | (c & 0x3f));
+			}
+		}
+		_used = (ULONG)(p - (UCHAR*)_buffer.data());
+	}
+
+	static void Digits2(char*& p, ULONG value) {
+		*p++ = (char)('0' + value / 10);
+		*p++ = (char)('0' + value % 10);
+	}
+
+	// a string's length in WCHARs, as far as it stays inside the record
+	static ULONG Bounded(const ItemHeader* header, ULONG offset, ULONG length) {
+		if (offset > header->Size)
+			return 0;
+		auto room = (header->Size - offset) / sizeof(WCHAR);
+		return length < room ? length : (ULONG)room;
+	}
+
+	template<size_t N>
+	static ULONG Terminated(const WCHAR (&text)[N]) {
+		ULONG length = 0;
+		while (length < N && text[length])
+			length++;
+		return length;
+	}
+
+private:
+	FILE* _output = nullptr;
+	OutputWriter* _writer = nullptr;
+	std::vector<char> _buffer;
+	ULONG _used = 0;
+	ULONG _format = SysMonFormatV1;
+	TimeScale _clock = {};
+	std::unordered_map<ULONG, std::basic_string<WCHAR>> _imageNames;	// v3, by id
+	CommandLineDefinitions<std::basic_string<WCHAR>> _commandLines;	// v5
+	LONGLONG _second = -1;			// the second _secondText shows
+	char _secondText[9];			// "hh:mm:ss."
+};
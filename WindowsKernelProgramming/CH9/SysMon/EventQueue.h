@@ -0,0 +1,391 @@
+#pragma once
+
+#include "EventRing.h"
+#include "ItemPool.h"
+#include "SysMonCommon.h"
+
+//
+// SysMon's event queue without the kernel around it: per-CPU rings of pool records,
+// the queue limits with their overflow policy, and the drop counters.
+// producers Admit and then Push into their own CPU's ring; the driver raises
+// to DISPATCH_LEVEL for the push, so there is one producer per ring at a time.
+// the consumer is whoever holds the reader lock (TLock: Lock/TryLock/Unlock);
+// producers only ever try it, to evict on overflow.
+//
+// each CPU has a ring per priority class (SysMonTypePriority), so a storm of one
+// kind of record only fills its own rings, and DropLowestPriority takes the oldest
+// of the lowest class queued without looking through the others. reads merge all
+// the rings by timestamp.
+//
+// several readers: each Attaches a ReadCursor. while there's more than one,
+// reads move what the rings hold into a shared log (InitLog) in order, each record
+// numbered, and copy out from their own cursor; a record is freed once every cursor
+// is past it, or evicted when the log is full (the cursors behind count it as missed).
+// with one reader the log stays empty and reads take records straight from the rings.
+//
+
+// a reader's place in the shared log
+struct ReadCursor {
+	ULONG64 Next;			// sequence number of the next record to read
+	ULONG64 Missed;			// evicted before this reader got to them
+	ReadCursor* Link;		// the attached cursors
+	bool Attached;
+};
+
+// nothing goes in front of the records Read copies out
+struct NoReadPrefix {
+	ULONG Size(ItemHeader*) {
+		return 0;
+	}
+
+	void Taken(ItemHeader*) {}
+
+	ULONG Write(UCHAR*, ItemHeader*) {
+		return 0;
+	}
+};
+
+template<ULONG Capacity, typename TLock>
+class EventQueue {
+public:
+	typedef EventRingSet<ItemHeader, Capacity> Rings;
+	typedef typename Rings::Ring Ring;
+
+	// buffers: RingCount(cpus) rings
+	void Init(Ring* buffers, ULONG cpus, ItemPool* pool, TLock* readers) {
+		_rings.Init(buffers, RingCount(cpus));
+		_cpus = cpus;
+		_pool = pool;
+		_readers = readers;
+		_log = nullptr;
+		_logCapacity = 0;
+		_logHead = _logTail = 0;
+		_logCount = _logBytes = 0;
+		_cursors = nullptr;
+		_cursorCount = 0;
+		Limits.MaxRecords = Limits.MaxBytes = 0;
+		Limits.Policy = SysMonOverflowPolicy::DropOldest;
+		::memset((void*)Dropped, 0, sizeof(Dropped));
+		Evicted = 0;
+	}
+
+	static ULONG RingCount(ULONG cpus) {
+		return cpus * SysMonPriorityClasses;
+	}
+
+	// room for the shared log, capacity a power of 2; without it every read takes from the rings
+	void InitLog(ItemHeader** log, ULONG capacity) {
+		_log = log;
+		_logCapacity = capacity;
+	}
+
+	//
+	// producers
+	//
+
+	// makes room for the item in this CPU's ring for its class as the policy says;
+	// false if the item itself is the one to go, it's been dropped then
+	bool Admit(ULONG cpu, ItemHeader* item) {
+		auto ring = RingOf(cpu, item->Type);
+		if (HasRoom(ring, item->Size) || MakeRoom(ring, item))
+			return true;
+
+		Drop(item);
+		return false;
+	}
+
+	// caller is this CPU's only producer right now. type and size are the item's: the driver
+	// pushes at DISPATCH_LEVEL and records are pageable, so a full ring leaves the item
+	// to the caller to Drop once it's back down
+	bool Push(ULONG cpu, ItemHeader* item, ItemType type, ULONG size) {
+		return _rings.Push(RingOf(cpu, type), item, size);
+	}
+
+	// for records that never made it as far as the queue
+	void CountDrop(ItemType type) {
+		InterlockedIncrement(&Dropped[(ULONG)type]);
+	}
+
+	void Drop(ItemHeader* item) {
+		CountDrop(item->Type);
+		_pool->Free(item);
+	}
+
+	//
+	// consumer, holding the reader lock unless noted
+	//
+
+	// a new reader gets what's queued from now on; takes the lock itself
+	void Attach(ReadCursor* cursor) {
+		_readers->Lock();
+		cursor->Next = _logTail;
+		cursor->Missed = 0;
+		cursor->Link = _cursors;
+		cursor->Attached = true;
+		_cursors = cursor;
+		_cursorCount++;
+		_readers->Unlock();
+	}
+
+	// what only this reader still needed goes; takes the lock itself
+	void Detach(ReadCursor* cursor) {
+		_readers->Lock();
+		for (auto link = &_cursors; *link; link = &(*link)->Link) {
+			if (*link == cursor) {
+				*link = cursor->Link;
+				cursor->Attached = false;
+				_cursorCount--;
+				break;
+			}
+		}
+		Reclaim();
+		_readers->Unlock();
+	}
+
+	// records this reader would get now, nullptr: arrived since any reader looked. any thread
+	ULONG Available(const ReadCursor* cursor) const {
+		auto queued = _rings.Count();
+		if (cursor == nullptr || !Shared())
+			return queued;
+		auto next = cursor->Next > _logHead ? cursor->Next : _logHead;
+		return queued + (ULONG)(_logTail - next);
+	}
+
+	ULONG Readers() const {
+		return _cursorCount;
+	}
+
+	//
+	// fills the buffer with whole records, oldest first. records are taken a batch
+	// at a time under the reader lock and copied and freed after letting go of it;
+	// only what fits is taken, so nothing goes back. takes the lock itself.
+	// prefix.Size(item) is how many bytes go in front of a record, prefix.Taken(item)
+	// is called for those that do (under the lock) and prefix.Write(buffer, item) writes them.
+	// cursor: the reader's, if there may be more than one
+	//
+	template<typename Prefix>
+	ULONG Read(UCHAR* buffer, ULONG length, Prefix& prefix, ReadCursor* cursor = nullptr) {
+		const ULONG BatchSize = 128;
+		ItemHeader* batch[BatchSize];
+		ULONG extra[BatchSize];
+		ULONG count = 0, taken;
+		do {
+			taken = 0;
+			_readers->Lock();
+			if (cursor && (Shared() || !cursor->Attached)) {
+				// another reader showed up (or this one is going away)
+				count += ReadLog(buffer, length, prefix, cursor);
+				_readers->Unlock();
+				break;
+			}
+			_rings.Drain([&](ItemHeader* item) {
+				auto size = item->Size;
+				auto before = prefix.Size(item);
+				if (taken == BatchSize || length < size + before) {
+					// batch or buffer full, leave the record in its ring
+					return false;
+				}
+				if (before)
+					prefix.Taken(item);
+				extra[taken] = before;
+				batch[taken++] = item;
+				length -= size + before;
+				return true;
+			});
+			_readers->Unlock();
+
+			for (ULONG i = 0; i < taken; i++) {
+				if (extra[i]) {
+					auto written = prefix.Write(buffer, batch[i]);
+					buffer += written;
+					count += written;
+				}
+				auto size = batch[i]->Size;
+				::memcpy(buffer, batch[i], size);
+				buffer += size;
+				count += size;
+				_pool->Free(batch[i]);
+			}
+		} while (taken == BatchSize);
+		return count;
+	}
+
+	ULONG Read(UCHAR* buffer, ULONG length, ReadCursor* cursor = nullptr) {
+		NoReadPrefix none;
+		return Read(buffer, length, none, cursor);
+	}
+
+	// frees whatever is queued; nothing may be producing
+	void Clear() {
+		_rings.Drain([&](ItemHeader* item) {
+			_pool->Free(item);
+			return true;
+		});
+		while (_logCount)
+			Release(false);
+	}
+
+	// any thread
+	void GetStats(SysMonQueueStats& stats) const {
+		stats.Limits = Limits;
+		stats.Records = Count();
+		stats.Bytes = Bytes();
+		for (ULONG i = 0; i < SysMonMaxTypes; i++)
+			stats.Dropped[i] = Dropped[i];
+		stats.Readers = _cursorCount;
+		stats.Evicted = Evicted;
+		stats.Missed = 0;
+	}
+
+	// the rings and the shared log together
+	ULONG Count() const {
+		return _rings.Count() + _logCount;
+	}
+
+	ULONG Bytes() const {
+		return _rings.Bytes() + _logBytes;
+	}
+
+	SysMonQueueLimits Limits;
+	volatile LONG Dropped[SysMonMaxTypes];	// by ItemType
+	volatile LONG Evicted;					// from the log before every reader had them
+
+private:
+	ULONG RingOf(ULONG cpu, ItemType type) const {
+		return SysMonTypePriority(type) * _cpus + cpu;
+	}
+
+	bool HasRoom(ULONG ring, ULONG size) const {
+		if (_rings.Full(ring))
+			return false;
+
+		if (Limits.MaxRecords && Count() >= Limits.MaxRecords)
+			return false;
+		return Limits.MaxBytes == 0 || Bytes() + size <= Limits.MaxBytes;
+	}
+
+	bool MakeRoom(ULONG ring, ItemHeader* item) {
+		auto policy = Limits.Policy;
+		if (policy == SysMonOverflowPolicy::DropNewest)
+			return false;
+
+		// evicting means being the consumer. if a read holds the lock it is emptying
+		// the queue anyway, so go over the limit for now rather than wait for it
+		if (!_readers->TryLock())
+			return !_rings.Full(ring);
+
+		// a full ring only gets room from its own records, oldest first whatever the policy
+		while (_rings.Full(ring))
+			Drop(_rings.Remove(ring));
+
+		if (policy == SysMonOverflowPolicy::DropOldest) {
+			// the log's records are older than anything in the rings
+			while (_logCount && !HasRoom(ring, item->Size))
+				Release(true);
+			_rings.Drain([&](ItemHeader* oldest) {
+				if (HasRoom(ring, item->Size))
+					return false;
+				Drop(oldest);
+				return true;
+			});
+		}
+		else {
+			// a class's rings are next to each other, the lowest class first
+			auto priority = SysMonTypePriority(item->Type);
+			for (ULONG level = 0; level <= priority && !HasRoom(ring, item->Size); level++) {
+				_rings.Drain(level * _cpus, _cpus, [&](ItemHeader* oldest) {
+					if (HasRoom(ring, item->Size))
+						return false;
+					Drop(oldest);
+					return true;
+				});
+			}
+		}
+
+		auto room = HasRoom(ring, item->Size);
+		_readers->Unlock();
+		return room;
+	}
+
+	bool Shared() const {
+		return _log && (_cursorCount > 1 || _logCount);
+	}
+
+	// Read with more than one reader: the rings go into the log, the reader copies
+	// from its cursor on. copying under the lock keeps the records from being
+	// evicted meanwhile; producers only try the lock, they go over the limit instead
+	template<typename Prefix>
+	ULONG ReadLog(UCHAR* buffer, ULONG length, Prefix& prefix, ReadCursor* cursor) {
+		if (!cursor->Attached)
+			return 0;
+
+		_rings.Drain([&](ItemHeader* item) {
+			if (_logCount == _logCapacity)
+				Release(true);
+			_log[_logTail++ & (_logCapacity - 1)] = item;
+			_logCount++;
+			_logBytes += item->Size;
+			return true;
+		});
+
+		if (cursor->Next < _logHead) {
+			cursor->Missed += _logHead - cursor->Next;
+			cursor->Next = _logHead;
+		}
+
+		ULONG count = 0;
+		for (; cursor->Next != _logTail; cursor->Next++) {
+			auto item = _log[cursor->Next & (_logCapacity - 1)];
+			auto size = item->Size;
+			auto before = prefix.Size(item);
+			if (length < size + before)
+				break;
+			if (before) {
+				prefix.Taken(item);
+				count += prefix.Write(buffer + count, item);
+			}
+			::memcpy(buffer + count, item, size);
+			count += size;
+			length -= size + before;
+		}
+
+		Reclaim();
+		return count;
+	}
+
+	// frees the log's records every reader is past
+	void Reclaim() {
+		auto oldest = _logTail;
+		for (auto cursor = _cursors; cursor; cursor = cursor->Link)
+			if (cursor->Next < oldest)
+				oldest = cursor->Next;
+		while (_logHead < oldest && _logCount)
+			Release(false);
+	}
+
+	// the log's oldest record goes; evicted: before every reader got it
+	void Release(bool evicted) {
+		auto item = _log[_logHead++ & (_logCapacity - 1)];
+		_logCount--;
+		_logBytes -= item->Size;
+		if (evicted)
+			InterlockedIncrement(&Evicted);
+		_pool->Free(item);
+	}
+
+private:
+	Rings _rings;				// RingCount(_cpus), class by class
+	ULONG _cpus;
+	ItemPool* _pool;
+	TLock* _readers;
+
+	// shared log: sequence numbers [_logHead, _logTail)
+	ItemHeader** _log;
+	ULONG _logCapacity;
+	ULONG64 _logHead;
+	ULONG64 _logTail;
+	volatile ULONG _logCount;
+	volatile ULONG _logBytes;
+	ReadCursor* _cursors;
+	volatile ULONG _cursorCount;
+};
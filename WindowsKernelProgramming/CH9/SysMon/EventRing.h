@@ -0,0 +1,309 @@
+#pragma once
+
+#include "Platform.h"
+
+//
+// single producer, single consumer ring of record pointers.
+// the driver keeps one per CPU: a producer runs at DISPATCH_LEVEL while pushing,
+// so nobody else can touch the same ring, and readers serialize on their own lock.
+// the ring also keeps track of the bytes queued; T must expose a Size member.
+// records may be pageable: a push doesn't touch the record, the caller passes its size.
+//
+
+template<typename T, ULONG Capacity>
+class EventRing {
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+
+public:
+	void Init() {
+		_head = _tail = 0;
+		_pushedBytes = _poppedBytes = 0;
+	}
+
+	// producer side; size is the record's, read before raising IRQL
+	bool Push(T* item, ULONG size) {
+		auto head = ReadULongNoFence(&_head);
+		if (head - ReadULongAcquire(&_tail) == Capacity)
+			return false;
+
+		_items[head & (Capacity - 1)] = item;
+		WriteULongNoFence(&_pushedBytes, _pushedBytes + size);
+		WriteULongRelease(&_head, head + 1);
+		return true;
+	}
+
+	bool Full() const {
+		return ReadULongAcquire(&_head) - ReadULongAcquire(&_tail) == Capacity;
+	}
+
+	// consumer side
+	T* Peek() const {
+		auto tail = ReadULongNoFence(&_tail);
+		if (tail == ReadULongAcquire(&_head))
+			return nullptr;
+
+		return _items[tail & (Capacity - 1)];
+	}
+
+	// size is the popped record's, it may already be gone
+	void Pop(ULONG size) {
+		WriteULongNoFence(&_poppedBytes, _poppedBytes + size);
+		WriteULongRelease(&_tail, ReadULongNoFence(&_tail) + 1);
+	}
+
+	//
+	// takes out up to max records for which match() is true, oldest first,
+	// and hands each to dispose(). the rest keep their order.
+	// the records from the tail up to the last one taken are packed towards the head,
+	// which only touches slots the producer can't reach until the tail moves.
+	//
+	template<typename Match, typename Dispose>
+	ULONG RemoveIf(Match&& match, Dispose&& dispose, ULONG max) {
+		auto tail = ReadULongNoFence(&_tail);
+		auto head = ReadULongAcquire(&_head);
+		ULONG found = 0, last = tail;
+		for (auto i = tail; i != head && found < max; i++) {
+			if (match(_items[i & (Capacity - 1)])) {
+				found++;
+				last = i;
+			}
+		}
+		if (found == 0)
+			return 0;
+
+		auto write = last;
+		ULONG bytes = 0;
+		for (auto i = last + 1; i-- != tail; ) {
+			auto item = _items[i & (Capacity - 1)];
+			if (match(item)) {
+				bytes += item->Size;
+				dispose(item);
+			}
+			else {
+				_items[write-- & (Capacity - 1)] = item;
+			}
+		}
+
+		WriteULongNoFence(&_poppedBytes, _poppedBytes + bytes);
+		WriteULongRelease(&_tail, write + 1);
+		return found;
+	}
+
+	template<typename Visit>
+	void ForEach(Visit&& visit) const {
+		auto head = ReadULongAcquire(&_head);
+		for (auto i = ReadULongNoFence(&_tail); i != head; i++)
+			visit(_items[i & (Capacity - 1)]);
+	}
+
+	ULONG Count() const {
+		return ReadULongAcquire(&_head) - ReadULongAcquire(&_tail);
+	}
+
+	ULONG Bytes() const {
+		return ReadULongAcquire(&_pushedBytes) - ReadULongAcquire(&_poppedBytes);
+	}
+
+private:
+	// keep producer and consumer sides on separate cache lines
+	volatile ULONG _head;
+	volatile ULONG _pushedBytes;
+	UCHAR _pad1[64 - 2 * sizeof(ULONG)];
+	volatile ULONG _tail;
+	volatile ULONG _poppedBytes;
+	UCHAR _pad2[64 - 2 * sizeof(ULONG)];
+	T* _items[Capacity];
+};
+
+//
+// one ring per CPU (EventQueue has one per CPU and priority class), drained in timestamp order.
+// T must expose a LARGE_INTEGER Time member (ItemHeader does).
+//
+
+template<typename T, ULONG Capacity>
+class EventRingSet {
+public:
+	typedef EventRing<T, Capacity> Ring;
+
+	void Init(Ring* rings, ULONG count) {
+		_rings = rings;
+		_count = count;
+		for (ULONG i = 0; i < count; i++)
+			rings[i].Init();
+	}
+
+	ULONG RingCount() const {
+		return _count;
+	}
+
+	bool Push(ULONG ring, T* item, ULONG size) {
+		return _rings[ring].Push(item, size);
+	}
+
+	// hands records to consume() oldest first, across all rings.
+	// consume() returns false to stop; that record stays queued.
+	// only one thread may drain at a time.
+	template<typename Consume>
+	ULONG Drain(Consume&& consume) {
+		return Drain(0, _count, consume);
+	}
+
+	// the same over rings [first, first + count). the heads go in a heap, so each record
+	// costs a few compares rather than a look at every ring; what arrives in a ring
+	// that was empty when the drain started waits for the next one
+	template<typename Consume>
+	ULONG Drain(ULONG first, ULONG count, Consume&& consume) {
+		if (count <= MinMerge || count > MaxMerge)
+			return ScanDrain(first, count, consume);
+
+		Head heap[MaxMerge];
+		ULONG size = 0;
+		for (ULONG i = first; i < first + count; i++) {
+			auto head = _rings[i].Peek();
+			if (head) {
+				heap[size] = { head->Time.QuadPart, i };
+				SiftUp(heap, size++);
+			}
+		}
+
+		ULONG drained = 0;
+		while (size) {
+			auto& ring = _rings[heap[0].Ring];
+			auto item = ring.Peek();
+			auto itemSize = item->Size;
+			if (!consume(item))
+				break;
+
+			ring.Pop(itemSize);
+			drained++;
+			item = ring.Peek();
+			if (item)
+				heap[0].Time = item->Time.QuadPart;
+			else
+				heap[0] = heap[--size];
+			SiftDown(heap, size);
+		}
+		return drained;
+	}
+
+	// the oldest record of one ring, taken out; nullptr if the ring is empty
+	T* Remove(ULONG ring) {
+		auto item = _rings[ring].Peek();
+		if (item)
+			_rings[ring].Pop(item->Size);
+		return item;
+	}
+
+	template<typename Match, typename Dispose>
+	ULONG RemoveIf(Match&& match, Dispose&& dispose, ULONG max) {
+		ULONG count = 0;
+		for (ULONG i = 0; i < _count && count < max; i++)
+			count += _rings[i].RemoveIf(match, dispose, max - count);
+		return count;
+	}
+
+	// visits every queued record, consumer side only
+	template<typename Visit>
+	void ForEach(Visit&& visit) const {
+		for (ULONG i = 0; i < _count; i++)
+			_rings[i].ForEach(visit);
+	}
+
+	bool Full(ULONG ring) const {
+		return _rings[ring].Full();
+	}
+
+	ULONG Count() const {
+		ULONG count = 0;
+		for (ULONG i = 0; i < _count; i++)
+			count += _rings[i].Count();
+		return count;
+	}
+
+	ULONG Bytes() const {
+		ULONG bytes = 0;
+		for (ULONG i = 0; i < _count; i++)
+			bytes += _rings[i].Bytes();
+		return bytes;
+	}
+
+private:
+	static const ULONG MinMerge = 8;	// fewer rings are quicker to look over every time
+	static const ULONG MaxMerge = 64;	// rings merged through a heap, on the stack
+
+	struct Head {
+		LONGLONG Time;
+		ULONG Ring;
+	};
+
+	static void SiftUp(Head* heap, ULONG i) {
+		while (i) {
+			auto parent = (i - 1) / 2;
+			if (heap[parent].Time <= heap[i].Time)
+				break;
+			auto swap = heap[parent];
+			heap[parent] = heap[i];
+			heap[i] = swap;
+			i = parent;
+		}
+	}
+
+	static void SiftDown(Head* heap, ULONG size) {
+		for (ULONG i = 0; ; ) {
+			auto smallest = i, left = 2 * i + 1, right = left + 1;
+			if (left < size && heap[left].Time < heap[smallest].Time)
+				smallest = left;
+			if (right < size && heap[right].Time < heap[smallest].Time)
+				smallest = right;
+			if (smallest == i)
+				break;
+			auto swap = heap[smallest];
+			heap[smallest] = heap[i];
+			heap[i] = swap;
+			i = smallest;
+		}
+	}
+
+	// few rings, or more than the heap takes: the oldest head of all of them, then
+	// that ring's records until they're newer than the next oldest head
+	template<typename Consume>
+	ULONG ScanDrain(ULONG first, ULONG count, Consume&& consume) {
+		ULONG drained = 0;
+		for (;;) {
+			Ring* oldest = nullptr;
+			T* item = nullptr;
+			LONGLONG next = 0x7fffffffffffffffLL;
+			for (ULONG i = first; i < first + count; i++) {
+				auto head = _rings[i].Peek();
+				if (head == nullptr)
+					continue;
+				if (item == nullptr || head->Time.QuadPart < item->Time.QuadPart) {
+					if (item)
+						next = item->Time.QuadPart;
+					item = head;
+					oldest = &_rings[i];
+				}
+				else if (head->Time.QuadPart < next) {
+					next = head->Time.QuadPart;
+				}
+			}
+			if (item == nullptr)
+				break;
+
+			do {
+				auto size = item->Size;
+				if (!consume(item))
+					return drained;
+
+				oldest->Pop(size);
+				drained++;
+				item = oldest->Peek();
+			} while (item && item->Time.QuadPart <= next);
+		}
+		return drained;
+	}
+
+private:
+	Ring* _rings;
+	ULONG _count;
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "Platform.h"
+#include "SysMonCommon.h"
+
+//
+// latency histograms and per-type counters, one block per CPU so producers on different
+// processors never touch the same cache line. every update is an interlocked add on the
+// producer's own block, uncontended unless the thread moved between processors; nothing
+// is summed until someone asks (Collect). histograms are log2: bucket 0 holds zeros,
+// bucket i values in [2^(i-1), 2^i), the last one everything above.
+// values are whatever the caller measures in, time counter ticks in the driver.
+// the driver updates them at DISPATCH_LEVEL, so the blocks must be non-paged.
+//
+
+enum class EventHistogram {
+	Callback,		// notify routine, entry to queued
+	Residence,		// stamped to read
+	ReadBatch,		// records per completed read
+	Count
+};
+
+class EventStats {
+public:
+	// callbacks timed when each stamp is a system time query rather than a counter read:
+	// 1 in this many a CPU makes
+	static const ULONG SlowClockSampling = 16;
+
+	bool Init(ULONG cpus, ULONG tag) {
+		_cpus = cpus;
+		_blocks = (Block*)AllocateNonPagedMemory(cpus * sizeof(Block), tag);
+		if (_blocks == nullptr)
+			return false;
+
+		::memset((void*)_blocks, 0, cpus * sizeof(Block));
+		return true;
+	}
+
+	void Destroy() {
+		if (_blocks) {
+			FreeMemory((void*)_blocks);
+			_blocks = nullptr;
+		}
+	}
+
+	// whether this one of the CPU's calls is to be timed, when 1 in every is. a call
+	// moved to another processor halfway may make the count slip, which doesn't matter
+	bool Sample(ULONG cpu, ULONG every) {
+		return every <= 1 || ++Of(cpu).Calls % every == 0;
+	}
+
+	void Record(ULONG cpu, EventHistogram histogram, ULONG64 value) {
+		auto& counts = Of(cpu).Histograms[(ULONG)histogram];
+		InterlockedExchangeAdd64((volatile LONG64*)&counts.Sum, (LONG64)value);
+		InterlockedExchangeAdd64((volatile LONG64*)&counts.Buckets[Bucket(value)], 1);
+	}
+
+	// a batch counted on the caller's side first, see Tally
+	void Record(ULONG cpu, EventHistogram histogram, const SysMonHistogram& batch) {
+		auto& counts = Of(cpu).Histograms[(ULONG)histogram];
+		InterlockedExchangeAdd64((volatile LONG64*)&counts.Sum, (LONG64)batch.Sum);
+		for (ULONG i = 0; i < SysMonHistogramBuckets; i++)
+			if (batch.Buckets[i])
+				InterlockedExchangeAdd64((volatile LONG64*)&counts.Buckets[i], (LONG64)batch.Buckets[i]);
+	}
+
+	// type is the one the record is queued as
+	void Enqueued(ULONG cpu, ItemType type) {
+		auto index = (ULONG)type;
+		if (index < SysMonMaxTypes)
+			InterlockedExchangeAdd64((volatile LONG64*)&Of(cpu).Enqueued[index], 1);
+	}
+
+	//
+	// every CPU's blocks added up; they keep counting meanwhile, so a histogram's Count
+	// and Sum may be a few records apart. Frequency and Dropped are the caller's to fill
+	//
+	void Collect(SysMonLatencyStats& stats) const {
+		::memset(&stats, 0, sizeof(stats));
+		SysMonHistogram* histograms[] = { &stats.Callback, &stats.Residence, &stats.ReadBatch };
+		for (ULONG cpu = 0; cpu < _cpus; cpu++) {
+			auto& block = _blocks[cpu];
+			for (ULONG h = 0; h < (ULONG)EventHistogram::Count; h++) {
+				auto& from = block.Histograms[h];
+				auto& to = *histograms[h];
+				to.Sum += ReadNoFence64((volatile LONG64*)&from.Sum);
+				for (ULONG i = 0; i < SysMonHistogramBuckets; i++) {
+					auto count = (ULONG64)ReadNoFence64((volatile LONG64*)&from.Buckets[i]);
+					to.Buckets[i] += count;
+					to.Count += count;
+				}
+			}
+			for (ULONG i = 0; i < SysMonMaxTypes; i++)
+				stats.Enqueued[i] += ReadNoFence64((volatile LONG64*)&block.Enqueued[i]);
+		}
+	}
+
+	void Reset() {
+		::memset((void*)_blocks, 0, _cpus * sizeof(Block));
+	}
+
+	static void Tally(SysMonHistogram& batch, ULONG64 value) {
+		batch.Count++;
+		batch.Sum += value;
+		batch.Buckets[Bucket(value)]++;
+	}
+
+	static ULONG Bucket(ULONG64 value) {
+		ULONG bit;
+		if (BitScanReverse(&bit, (ULONG)(value >> 32)))
+			bit += 32;
+		else if (!BitScanReverse(&bit, (ULONG)value))
+			return 0;
+		return bit + 1 < SysMonHistogramBuckets ? bit + 1 : SysMonHistogramBuckets - 1;
+	}
+
+private:
+	struct Counts {
+		volatile ULONG64 Sum;
+		volatile ULONG64 Buckets[SysMonHistogramBuckets];
+	};
+
+	// a multiple of the cache line, so neighbours don't share one
+	struct Block {
+		Counts Histograms[(ULONG)EventHistogram::Count];
+		volatile ULONG64 Enqueued[SysMonMaxTypes];
+		ULONG64 Calls;				// for Sample
+		UCHAR _pad[64 - ((sizeof(Counts) * (ULONG)EventHistogram::Count + sizeof(ULONG64) * (SysMonMaxTypes + 1)) & 63)];
+	};
+
+	Block& Of(ULONG cpu) const {
+		// CPUs hot-added past the count the blocks were allocated for share the last one
+		return _blocks[cpu < _cpus ? cpu : _cpus - 1];
+	}
+
+private:
+	Block* _blocks = nullptr;
+	ULONG _cpus = 0;
+};
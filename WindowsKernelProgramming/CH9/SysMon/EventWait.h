@@ -0,0 +1,105 @@
+#pragma once
+
+#include "Platform.h"
+
+//
+// auto-reset event: Signal() releases one Wait(), extra signals collapse into one.
+// kernel: KEVENT, Windows user mode: event object, elsewhere: eventfd
+//
+
+const ULONG WaitInfinite = 0xffffffff;
+
+#if defined(_KERNEL_MODE)
+
+class WaitEvent {
+public:
+	bool Init() {
+		KeInitializeEvent(&_event, SynchronizationEvent, FALSE);
+		return true;
+	}
+
+	void Destroy() {}
+
+	void Signal() {
+		KeSetEvent(&_event, IO_NO_INCREMENT, FALSE);
+	}
+
+	// returns false on timeout
+	bool Wait(ULONG timeoutMs) {
+		LARGE_INTEGER interval;
+		interval.QuadPart = -10000LL * timeoutMs;
+		return KeWaitForSingleObject(&_event, Executive, KernelMode, FALSE,
+			timeoutMs == WaitInfinite ? nullptr : &interval) == STATUS_SUCCESS;
+	}
+
+private:
+	KEVENT _event;
+};
+
+#elif defined(_WIN32)
+
+class WaitEvent {
+public:
+	bool Init() {
+		_event = ::CreateEvent(nullptr, FALSE, FALSE, nullptr);
+		return _event != nullptr;
+	}
+
+	void Destroy() {
+		if (_event) {
+			::CloseHandle(_event);
+			_event = nullptr;
+		}
+	}
+
+	void Signal() {
+		::SetEvent(_event);
+	}
+
+	bool Wait(ULONG timeoutMs) {
+		return ::WaitForSingleObject(_event, timeoutMs == WaitInfinite ? INFINITE : timeoutMs) == WAIT_OBJECT_0;
+	}
+
+private:
+	HANDLE _event;
+};
+
+#else
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+
+class WaitEvent {
+public:
+	bool Init() {
+		_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		return _fd >= 0;
+	}
+
+	void Destroy() {
+		if (_fd >= 0) {
+			::close(_fd);
+			_fd = -1;
+		}
+	}
+
+	void Signal() {
+		uint64_t one = 1;
+		(void)!::write(_fd, &one, sizeof(one));
+	}
+
+	bool Wait(ULONG timeoutMs) {
+		pollfd p = { _fd, POLLIN, 0 };
+		if (::poll(&p, 1, timeoutMs == WaitInfinite ? -1 : (int)timeoutMs) <= 0)
+			return false;
+
+		// reading resets the counter, which makes the event auto-reset
+		uint64_t value;
+		return ::read(_fd, &value, sizeof(value)) == sizeof(value);
+	}
+
+private:
+	int _fd = -1;
+};
+
+#endif
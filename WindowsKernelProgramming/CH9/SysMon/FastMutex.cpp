@@ -10,6 +10,10 @@ void FastMutex::Lock() {
 	ExAcquireFastMutex(&_mutex);
 }
 
+bool FastMutex::TryLock() {
+	return ExTryToAcquireFastMutex(&_mutex);
+}
+
 void FastMutex::Unlock() {
 	ExReleaseFastMutex(&_mutex);
 }
@@ -5,6 +5,7 @@ public:
 	void Init();
 
 	void Lock();
+	bool TryLock();
 	void Unlock();
 
 private:
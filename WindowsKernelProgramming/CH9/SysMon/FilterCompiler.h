@@ -0,0 +1,392 @@
+#pragma once
+
+#include "SysMonCommon.h"
+#include <vector>
+
+//
+// compiles a filter expression into the SysMonFilterProgram the driver runs
+// (FilterProgram.h), e.g.
+//   type==ImageLoad && path endswith "\\evil.dll"
+//   type == RegistrySetValue && key startswith "\\REGISTRY\\MACHINE\\SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Run"
+//   !(pid == 4 || ppid == 4) && (cmdline contains "-enc" || path endswith "\\powershell.exe")
+// fields: type, pid, ppid, tid (numbers, decimal or 0x hex; type also takes the v1
+// type names) and path, cmdline, key, value (strings in quotes, UTF-8, \\ and \" for
+// a backslash and a quote, any other backslash as is). numbers compare with == != < <= > >=,
+// strings with == != startswith endswith contains, ignoring case. && binds tighter than ||,
+// ! and parentheses as usual. an empty expression lets everything through.
+// user mode only.
+//
+
+class FilterCompiler {
+public:
+	static const ULONG MaxDepth = 64;		// nested ! and parentheses
+
+	bool Compile(const char* text) {
+		_text = _position = _tokenStart = text;
+		_error = nullptr;
+		_code.clear();
+		_chars.clear();
+		_program.clear();
+
+		if (!Next() || (_token != Token::End && !ParseOr(0)))
+			return false;
+		if (_token != Token::End)
+			return Fail("expected && or ||");
+
+		_program.resize(SYSMON_FILTER_PROGRAM_SIZE(_code.size(), _chars.size()));
+		auto program = (SysMonFilterProgram*)_program.data();
+		program->Count = (ULONG)_code.size();
+		program->CharCount = (ULONG)_chars.size();
+		if (!_code.empty())
+			::memcpy(program->Code, _code.data(), _code.size() * sizeof(SysMonFilterInstruction));
+		if (!_chars.empty())
+			::memcpy(program->Code + _code.size(), _chars.data(), _chars.size() * sizeof(WCHAR));
+		return true;
+	}
+
+	// valid after a successful Compile
+	const SysMonFilterProgram* Program() const {
+		return (const SysMonFilterProgram*)_program.data();
+	}
+
+	ULONG Size() const {
+		return (ULONG)_program.size();
+	}
+
+	// after a failed one: what's wrong and where, in chars from the start
+	const char* Error() const {
+		return _error;
+	}
+
+	ULONG ErrorOffset() const {
+		return _errorOffset;
+	}
+
+private:
+	enum class Token {
+		End, Name, Number, String, And, Or, Not, Open, Close, Compare
+	};
+
+	struct FieldName {
+		const char* Name;
+		SysMonFilterField Field;
+	};
+
+	struct OpName {
+		const char* Name;
+		SysMonFilterOp Op;
+	};
+
+	bool ParseOr(ULONG depth) {
+		std::vector<size_t> jumps;
+		if (!ParseAnd(depth))
+			return false;
+		while (_token == Token::Or) {
+			jumps.push_back(_code.size());
+			if (!Emit(SysMonFilterOp::JumpIfTrue, SysMonFilterField::Type, 0, 0) || !Next() || !ParseAnd(depth))
+				return false;
+		}
+		for (auto jump : jumps)
+			_code[jump].Operand = (ULONG)_code.size();
+		return true;
+	}
+
+	bool ParseAnd(ULONG depth) {
+		std::vector<size_t> jumps;
+		if (!ParseUnary(depth))
+			return false;
+		while (_token == Token::And) {
+			jumps.push_back(_code.size());
+			if (!Emit(SysMonFilterOp::JumpIfFalse, SysMonFilterField::Type, 0, 0) || !Next() || !ParseUnary(depth))
+				return false;
+		}
+		for (auto jump : jumps)
+			_code[jump].Operand = (ULONG)_code.size();
+		return true;
+	}
+
+	bool ParseUnary(ULONG depth) {
+		if (depth == MaxDepth)
+			return Fail("nested too deeply");
+
+		if (_token == Token::Not)
+			return Next() && ParseUnary(depth + 1) && Emit(SysMonFilterOp::Not, SysMonFilterField::Type, 0, 0);
+		if (_token == Token::Open) {
+			if (!Next() || !ParseOr(depth + 1))
+				return false;
+			if (_token != Token::Close)
+				return Fail("expected )");
+			return Next();
+		}
+		return ParseComparison();
+	}
+
+	// field op literal
+	bool ParseComparison() {
+		static const FieldName fields[] = {
+			{ "type", SysMonFilterField::Type },
+			{ "pid", SysMonFilterField::ProcessId },
+			{ "ppid", SysMonFilterField::ParentProcessId },
+			{ "tid", SysMonFilterField::ThreadId },
+			{ "path", SysMonFilterField::Path },
+			{ "cmdline", SysMonFilterField::CommandLine },
+			{ "key", SysMonFilterField::Key },
+			{ "value", SysMonFilterField::Value },
+		};
+		static const OpName words[] = {
+			{ "startswith", SysMonFilterOp::StartsWith },
+			{ "endswith", SysMonFilterOp::EndsWith },
+			{ "contains", SysMonFilterOp::Contains },
+		};
+
+		if (_token != Token::Name)
+			return Fail("expected a field, ! or (");
+		auto field = SysMonFilterField::Count;
+		for (auto& name : fields)
+			if (IsWord(name.Name))
+				field = name.Field;
+		if (field == SysMonFilterField::Count)
+			return Fail("unknown field");
+		bool string = field >= SysMonFilterFirstString;
+		if (!Next())
+			return false;
+
+		auto op = SysMonFilterOp::Count;
+		if (_token == Token::Compare)
+			op = _compare;
+		else if (_token == Token::Name)
+			for (auto& name : words)
+				if (IsWord(name.Name))
+					op = name.Op;
+		if (op == SysMonFilterOp::Count)
+			return Fail(string ? "expected == != startswith endswith or contains" : "expected == != < <= > or >=");
+		if (string) {
+			if (op == SysMonFilterOp::Equal || op == SysMonFilterOp::NotEqual)
+				op = op == SysMonFilterOp::Equal ? SysMonFilterOp::StringEqual : SysMonFilterOp::StringNotEqual;
+			else if (op < SysMonFilterOp::StringEqual)
+				return Fail("strings compare with == != startswith endswith or contains");
+		}
+		else if (op >= SysMonFilterOp::StringEqual)
+			return Fail("numbers compare with == != < <= > or >=");
+		if (!Next())
+			return false;
+
+		if (string) {
+			if (_token != Token::String)
+				return Fail("expected a string in quotes");
+			auto start = (ULONG)_chars.size();
+			if (!Decode(_tokenStart + 1, _position - 1))
+				return false;
+			if (!Emit(op, field, start, (USHORT)(_chars.size() - start)))
+				return false;
+		}
+		else {
+			auto value = _number;
+			if (field == SysMonFilterField::Type && _token == Token::Name) {
+				if (!TypeName(value))
+					return Fail("unknown type");
+			}
+			else if (_token != Token::Number)
+				return Fail(field == SysMonFilterField::Type ? "expected a type name or a number" : "expected a number");
+			if (!Emit(op, field, value, 0))
+				return false;
+		}
+		return Next();
+	}
+
+	// the v1 types, as SysMonFilter has them
+	bool TypeName(ULONG& type) const {
+		static const char* const names[] = {
+			"ProcessCreate", "ProcessExit", "ThreadCreate", "ThreadExit", "ImageLoad", "RegistrySetValue"
+		};
+		for (ULONG i = 0; i < ARRAYSIZE(names); i++)
+			if (IsWord(names[i])) {
+				type = (ULONG)ItemType::ProcessCreate + i;
+				return true;
+			}
+		return false;
+	}
+
+	bool Emit(SysMonFilterOp op, SysMonFilterField field, ULONG operand, USHORT length) {
+		if (_code.size() == SysMonFilterMaxInstructions)
+			return Fail("expression too long");
+		_code.push_back({ op, field, length, operand });
+		return true;
+	}
+
+	// a string literal's text, between the quotes
+	bool Decode(const char* p, const char* end) {
+		while (p < end) {
+			ULONG c = (UCHAR)*p++;
+			if (c == '\\' && p < end && (*p == '\\' || *p == '"'))
+				c = (UCHAR)*p++;
+			else if (c >= 0xc0) {
+				// UTF-8; a byte that doesn't start a sequence is taken as is
+				ULONG extra = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : 1;
+				ULONG code = c & (0x3f >> extra);
+				ULONG n = 0;
+				while (n < extra && p + n < end && ((UCHAR)p[n] & 0xc0) == 0x80) {
+					code = code << 6 | ((UCHAR)p[n] & 0x3f);
+					n++;
+				}
+				if (n == extra && code < 0x110000) {
+					c = code;
+					p += n;
+				}
+			}
+
+			if (c >= 0x10000) {
+				c -= 0x10000;
+				if (!Append((WCHAR)(0xd800 + (c >> 10))))
+					return false;
+				c = 0xdc00 + (c & 0x3ff);
+			}
+			if (!Append((WCHAR)c))
+				return false;
+		}
+		return true;
+	}
+
+	bool Append(WCHAR c) {
+		if (_chars.size() == SysMonFilterMaxChars)
+			return Fail("strings too long");
+		_chars.push_back(c);
+		return true;
+	}
+
+	// the token at _position; false (and the error) if there's no making one out
+	bool Next() {
+		while (*_position == ' ' || *_position == '\t')
+			_position++;
+		_tokenStart = _position;
+
+		auto c = *_position;
+		if (c == 0) {
+			_token = Token::End;
+			return true;
+		}
+		if (IsNameChar(c) && !(c >= '0' && c <= '9')) {
+			while (IsNameChar(*_position))
+				_position++;
+			_token = Token::Name;
+			return true;
+		}
+		if (c >= '0' && c <= '9')
+			return ParseNumber();
+		if (c == '"') {
+			for (_position++; *_position != '"'; _position++) {
+				if (*_position == 0)
+					return Fail("string without its closing quote");
+				if (*_position == '\\' && (_position[1] == '\\' || _position[1] == '"'))
+					_position++;
+			}
+			_position++;
+			_token = Token::String;
+			return true;
+		}
+
+		auto next = _position[1];
+		_position += 2;
+		if (c == '&' && next == '&')
+			_token = Token::And;
+		else if (c == '|' && next == '|')
+			_token = Token::Or;
+		else if (c == '=' && next == '=')
+			SetCompare(SysMonFilterOp::Equal);
+		else if (c == '!' && next == '=')
+			SetCompare(SysMonFilterOp::NotEqual);
+		else if (c == '<' && next == '=')
+			SetCompare(SysMonFilterOp::LessEqual);
+		else if (c == '>' && next == '=')
+			SetCompare(SysMonFilterOp::GreaterEqual);
+		else {
+			_position--;
+			if (c == '!')
+				_token = Token::Not;
+			else if (c == '(')
+				_token = Token::Open;
+			else if (c == ')')
+				_token = Token::Close;
+			else if (c == '<')
+				SetCompare(SysMonFilterOp::Less);
+			else if (c == '>')
+				SetCompare(SysMonFilterOp::Greater);
+			else {
+				_position--;
+				return Fail("unexpected character");
+			}
+		}
+		return true;
+	}
+
+	void SetCompare(SysMonFilterOp op) {
+		_token = Token::Compare;
+		_compare = op;
+	}
+
+	// decimal or 0x hex, 32 bits
+	bool ParseNumber() {
+		ULONG base = 10;
+		if (_position[0] == '0' && (_position[1] == 'x' || _position[1] == 'X')) {
+			base = 16;
+			_position += 2;
+		}
+		ULONG64 value = 0;
+		auto digits = _position;
+		for (;; _position++) {
+			auto c = *_position;
+			ULONG digit;
+			if (c >= '0' && c <= '9')
+				digit = c - '0';
+			else if (base == 16 && c >= 'a' && c <= 'f')
+				digit = c - 'a' + 10;
+			else if (base == 16 && c >= 'A' && c <= 'F')
+				digit = c - 'A' + 10;
+			else
+				break;
+			value = value * base + digit;
+			if (value > 0xffffffff)
+				return Fail("number too large");
+		}
+		if (_position == digits || IsNameChar(*_position))
+			return Fail("not a number");
+		_number = (ULONG)value;
+		_token = Token::Number;
+		return true;
+	}
+
+	static bool IsNameChar(char c) {
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+	}
+
+	// the current name token is word, ignoring case
+	bool IsWord(const char* word) const {
+		auto p = _tokenStart;
+		for (; p < _position; p++, word++) {
+			auto c = *p >= 'A' && *p <= 'Z' ? *p - 'A' + 'a' : *p;
+			auto w = *word >= 'A' && *word <= 'Z' ? *word - 'A' + 'a' : *word;
+			if (c != w)
+				return false;
+		}
+		return *word == 0;
+	}
+
+	bool Fail(const char* error) {
+		_error = error;
+		_errorOffset = (ULONG)(_tokenStart - _text);
+		return false;
+	}
+
+private:
+	const char* _text = nullptr;
+	const char* _position = nullptr;
+	const char* _tokenStart = nullptr;
+	Token _token = Token::End;
+	SysMonFilterOp _compare;
+	ULONG _number;
+	const char* _error = nullptr;
+	ULONG _errorOffset = 0;
+	std::vector<SysMonFilterInstruction> _code;
+	std::vector<WCHAR> _chars;
+	std::vector<UCHAR> _program;
+};
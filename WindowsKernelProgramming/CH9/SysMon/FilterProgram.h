@@ -0,0 +1,208 @@
+#pragma once
+
+#include "Platform.h"
+#include "SysMonCommon.h"
+#include "KeyFilter.h"
+
+//
+// runs a compiled filter expression (SysMonFilterProgram) against an event the
+// notify routine describes with what it has at hand, before anything is allocated.
+// the program is checked once when it's set: known ops, fields of the kind the op
+// compares, string operands inside the text, jumps only forward, so running it
+// takes at most Count steps. operands are upcased then, events as they're compared.
+// readers don't lock: the program is kept twice, the same latch as EventFilter.
+// Init and Set must be serialized by the caller.
+//
+
+struct FilterEvent {
+	static const ULONG Numbers = (ULONG)SysMonFilterFirstString;
+	static const ULONG Strings = (ULONG)SysMonFilterField::Count - Numbers;
+
+	FilterEvent(ItemType type, ULONG processId) : Present(0) {
+		SetNumber(SysMonFilterField::Type, (ULONG)type);
+		SetNumber(SysMonFilterField::ProcessId, processId);
+	}
+
+	void SetNumber(SysMonFilterField field, ULONG value) {
+		Number[(ULONG)field] = value;
+		Present |= 1 << (ULONG)field;
+	}
+
+	// length in WCHARs; the text must stay put until the program ran
+	void SetString(SysMonFilterField field, const WCHAR* text, ULONG length) {
+		auto& string = String[(ULONG)field - Numbers];
+		string.Text = text;
+		string.Length = length;
+		Present |= 1 << (ULONG)field;
+	}
+
+	struct StringField {
+		const WCHAR* Text;
+		ULONG Length;
+	};
+
+	ULONG Present;			// 1 << SysMonFilterField
+	ULONG Number[Numbers];
+	StringField String[Strings];
+};
+
+class FilterProgram {
+public:
+	// lets everything through
+	void Init() {
+		_sequence = 0;
+		for (auto& table : _tables)
+			table.Count = 0;
+	}
+
+	// validates and installs a program coming from user mode
+	bool Set(const SysMonFilterProgram* program, ULONG size) {
+		if (size < SYSMON_FILTER_PROGRAM_SIZE(0, 0))
+			return false;
+
+		auto count = program->Count, chars = program->CharCount;
+		if (count > SysMonFilterMaxInstructions || chars > SysMonFilterMaxChars || size < SYSMON_FILTER_PROGRAM_SIZE(count, chars))
+			return false;
+
+		for (ULONG pc = 0; pc < count; pc++)
+			if (!Valid(program->Code[pc], pc, count, chars))
+				return false;
+
+		// see EventFilter::Set; straight from the caller's buffer, a copy at a time
+		auto text = (const WCHAR*)(program->Code + count);
+		for (int i = 0; i < 2; i++) {
+			WriteULongRelease(&_sequence, _sequence + 1);
+			MemoryBarrier();
+			auto& table = _tables[i & 1];
+			table.Count = count;
+			::memcpy(table.Code, program->Code, count * sizeof(SysMonFilterInstruction));
+			for (ULONG c = 0; c < chars; c++)
+				table.Chars[c] = UpcaseKeyChar(text[c]);
+		}
+		MemoryBarrier();
+		return true;
+	}
+
+	bool Allows(const FilterEvent& event) const {
+		for (;;) {
+			auto sequence = ReadULongAcquire(&_sequence);
+			auto allowed = Run(_tables[sequence & 1], event);
+			ReadBarrier();
+			if (ReadULongNoFence(&_sequence) == sequence)
+				return allowed;
+		}
+	}
+
+private:
+	struct Table {
+		ULONG Count;
+		SysMonFilterInstruction Code[SysMonFilterMaxInstructions];
+		WCHAR Chars[SysMonFilterMaxChars];		// upcased
+	};
+
+	static bool Valid(const SysMonFilterInstruction& instruction, ULONG pc, ULONG count, ULONG chars) {
+		auto op = instruction.Op;
+		if (op >= SysMonFilterOp::Count)
+			return false;
+		if (op == SysMonFilterOp::Not)
+			return true;
+		if (op == SysMonFilterOp::JumpIfFalse || op == SysMonFilterOp::JumpIfTrue)
+			return instruction.Operand > pc && instruction.Operand <= count;
+
+		auto field = instruction.Field;
+		if (field >= SysMonFilterField::Count)
+			return false;
+		if (op < SysMonFilterOp::StringEqual)
+			return field < SysMonFilterFirstString;
+		return field >= SysMonFilterFirstString && instruction.Operand <= chars && instruction.Length <= chars - instruction.Operand;
+	}
+
+	static bool Run(const Table& table, const FilterEvent& event) {
+		// a torn read only gives a wrong answer, which the caller throws away; the count
+		// is clamped and jumps that wouldn't go forward are steps, so it still ends
+		auto count = table.Count > SysMonFilterMaxInstructions ? SysMonFilterMaxInstructions : table.Count;
+		bool flag = true;
+		for (ULONG pc = 0; pc < count; ) {
+			auto& instruction = table.Code[pc];
+			switch (instruction.Op) {
+				case SysMonFilterOp::Not:
+					flag = !flag;
+					break;
+
+				case SysMonFilterOp::JumpIfFalse:
+				case SysMonFilterOp::JumpIfTrue:
+					if (flag == (instruction.Op == SysMonFilterOp::JumpIfTrue) && instruction.Operand > pc) {
+						pc = instruction.Operand;
+						continue;
+					}
+					break;
+
+				default:
+					flag = Compare(table, instruction, event);
+			}
+			pc++;
+		}
+		return flag;
+	}
+
+	static bool Compare(const Table& table, const SysMonFilterInstruction& instruction, const FilterEvent& event) {
+		auto field = (ULONG)instruction.Field;
+		if (field >= (ULONG)SysMonFilterField::Count || (event.Present & (1 << field)) == 0)
+			return false;
+
+		auto op = instruction.Op;
+		if (op < SysMonFilterOp::StringEqual) {
+			if (field >= FilterEvent::Numbers)
+				return false;
+			auto value = event.Number[field], operand = instruction.Operand;
+			switch (op) {
+				case SysMonFilterOp::Equal: return value == operand;
+				case SysMonFilterOp::NotEqual: return value != operand;
+				case SysMonFilterOp::Less: return value < operand;
+				case SysMonFilterOp::LessEqual: return value <= operand;
+				case SysMonFilterOp::Greater: return value > operand;
+				default: return value >= operand;
+			}
+		}
+
+		ULONG start = instruction.Operand, length = instruction.Length;
+		if (field < FilterEvent::Numbers || start > SysMonFilterMaxChars || length > SysMonFilterMaxChars - start)
+			return false;
+		auto operand = table.Chars + start;
+		auto& string = event.String[field - FilterEvent::Numbers];
+		switch (op) {
+			case SysMonFilterOp::StringEqual:
+				return string.Length == length && Matches(string.Text, operand, length);
+
+			case SysMonFilterOp::StringNotEqual:
+				return string.Length != length || !Matches(string.Text, operand, length);
+
+			case SysMonFilterOp::StartsWith:
+				return string.Length >= length && Matches(string.Text, operand, length);
+
+			case SysMonFilterOp::EndsWith:
+				return string.Length >= length && Matches(string.Text + string.Length - length, operand, length);
+
+			case SysMonFilterOp::Contains:
+				for (ULONG i = 0; i + length <= string.Length; i++)
+					if (Matches(string.Text + i, operand, length))
+						return true;
+				return false;
+
+			default:
+				return false;
+		}
+	}
+
+	// upcased is the operand's side
+	static bool Matches(const WCHAR* text, const WCHAR* upcased, ULONG length) {
+		for (ULONG i = 0; i < length; i++)
+			if (text[i] != upcased[i] && UpcaseKeyChar(text[i]) != upcased[i])
+				return false;
+		return true;
+	}
+
+private:
+	volatile ULONG _sequence;
+	Table _tables[2];
+};
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "Platform.h"
+
+//
+// bounded set of strings, each known by a small id (its slot number + 1).
+// open addressing over slots that only ever go from empty to taken, so lookups
+// and inserts need no lock: an insert claims an empty slot with a compare-exchange.
+// nothing is removed until Destroy; once the table is 3/4 full new strings get id 0
+// and the caller sends them in full instead.
+//
+
+struct InternEntry {
+	ULONG Hash;
+	USHORT Length;					// in WCHARs
+	volatile LONG Generation;		// free for the caller
+	WCHAR Text[1];
+};
+
+class InternTable {
+public:
+	// capacity must be a power of 2
+	bool Init(ULONG capacity, ULONG tag) {
+		_capacity = capacity;
+		_count = 0;
+		_tag = tag;
+		_slots = (InternEntry* volatile*)AllocateMemory(capacity * sizeof(InternEntry*), tag);
+		if (_slots == nullptr)
+			return false;
+
+		::memset((void*)_slots, 0, capacity * sizeof(InternEntry*));
+		return true;
+	}
+
+	void Destroy() {
+		if (_slots == nullptr)
+			return;
+
+		for (ULONG i = 0; i < _capacity; i++)
+			if (_slots[i])
+				FreeMemory(_slots[i]);
+		FreeMemory((void*)_slots);
+		_slots = nullptr;
+	}
+
+	// id of the string, added if it's new; 0 if the table is full or out of memory
+	ULONG Intern(const WCHAR* text, USHORT length) {
+		auto hash = Hash(text, length);
+		InternEntry* entry = nullptr;
+		for (ULONG i = 0; i < _capacity; i++) {
+			auto slot = (hash + i) & (_capacity - 1);
+			auto existing = (InternEntry*)ReadPointerAcquire((PVOID const volatile*)&_slots[slot]);
+			if (existing == nullptr) {
+				if (entry == nullptr) {
+					if ((ULONG)_count >= _capacity / 4 * 3)
+						return 0;
+					entry = NewEntry(text, length, hash);
+					if (entry == nullptr)
+						return 0;
+				}
+
+				existing = (InternEntry*)InterlockedCompareExchangePointer((PVOID volatile*)&_slots[slot], entry, nullptr);
+				if (existing == nullptr) {
+					InterlockedIncrement(&_count);
+					return slot + 1;
+				}
+				// someone got there first, maybe with the same string
+			}
+
+			if (existing->Hash == hash && existing->Length == length &&
+				::memcmp(existing->Text, text, length * sizeof(WCHAR)) == 0) {
+				if (entry)
+					FreeMemory(entry);
+				return slot + 1;
+			}
+		}
+
+		if (entry)
+			FreeMemory(entry);
+		return 0;
+	}
+
+	InternEntry* Lookup(ULONG id) const {
+		if (id == 0 || id > _capacity)
+			return nullptr;
+		return (InternEntry*)ReadPointerAcquire((PVOID const volatile*)&_slots[id - 1]);
+	}
+
+	ULONG Count() const {
+		return (ULONG)_count;
+	}
+
+private:
+	static ULONG Hash(const WCHAR* text, USHORT length) {
+		// FNV-1a over the length and the last characters only: paths share
+		// long directory prefixes and differ in the file name
+		const USHORT HashedChars = 32;
+		ULONG hash = (2166136261 ^ length) * 16777619;
+		for (USHORT i = length > HashedChars ? length - HashedChars : 0; i < length; i++)
+			hash = (hash ^ text[i]) * 16777619;
+		return hash;
+	}
+
+	InternEntry* NewEntry(const WCHAR* text, USHORT length, ULONG hash) {
+		auto entry = (InternEntry*)AllocateMemory(FIELD_OFFSET(InternEntry, Text) + length * sizeof(WCHAR), _tag);
+		if (entry) {
+			entry->Hash = hash;
+			entry->Length = length;
+			entry->Generation = 0;
+			::memcpy(entry->Text, text, length * sizeof(WCHAR));
+		}
+		return entry;
+	}
+
+private:
+	InternEntry* volatile* _slots;
+	ULONG _capacity;
+	volatile LONG _count;
+	ULONG _tag;
+};
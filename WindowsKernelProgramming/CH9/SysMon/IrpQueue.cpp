@@ -0,0 +1,61 @@
+#include "pch.h"
+#include "IrpQueue.h"
+
+void IrpQueue::Init() {
+	InitializeListHead(&_head);
+	KeInitializeSpinLock(&_lock);
+	_count = 0;
+	IoCsqInitialize(&_csq, InsertIrp, RemoveIrp, PeekNextIrp, AcquireLock, ReleaseLock, CompleteCanceledIrp);
+}
+
+void IrpQueue::Insert(PIRP Irp) {
+	IoCsqInsertIrp(&_csq, Irp, nullptr);
+}
+
+PIRP IrpQueue::RemoveNext(PFILE_OBJECT FileObject) {
+	return IoCsqRemoveNextIrp(&_csq, FileObject);
+}
+
+bool IrpQueue::Holds(PFILE_OBJECT FileObject) {
+	KIRQL irql;
+	AcquireLock(&_csq, &irql);
+	auto irp = PeekNextIrp(&_csq, nullptr, FileObject);
+	ReleaseLock(&_csq, irql);
+	return irp != nullptr;
+}
+
+void IrpQueue::InsertIrp(PIO_CSQ csq, PIRP Irp) {
+	auto queue = FromCsq(csq);
+	InsertTailList(&queue->_head, &Irp->Tail.Overlay.ListEntry);
+	InterlockedIncrement(&queue->_count);
+}
+
+void IrpQueue::RemoveIrp(PIO_CSQ csq, PIRP Irp) {
+	RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+	InterlockedDecrement(&FromCsq(csq)->_count);
+}
+
+PIRP IrpQueue::PeekNextIrp(PIO_CSQ csq, PIRP Irp, PVOID PeekContext) {
+	auto queue = FromCsq(csq);
+	auto entry = Irp ? Irp->Tail.Overlay.ListEntry.Flink : queue->_head.Flink;
+	for (; entry != &queue->_head; entry = entry->Flink) {
+		auto next = CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
+		if (PeekContext == nullptr || IoGetCurrentIrpStackLocation(next)->FileObject == PeekContext)
+			return next;
+	}
+	return nullptr;
+}
+
+void IrpQueue::AcquireLock(PIO_CSQ csq, PKIRQL Irql) {
+	KeAcquireSpinLock(&FromCsq(csq)->_lock, Irql);
+}
+
+void IrpQueue::ReleaseLock(PIO_CSQ csq, KIRQL Irql) {
+	KeReleaseSpinLock(&FromCsq(csq)->_lock, Irql);
+}
+
+void IrpQueue::CompleteCanceledIrp(PIO_CSQ, PIRP Irp) {
+	Irp->IoStatus.Status = STATUS_CANCELLED;
+	Irp->IoStatus.Information = 0;
+	IoCompleteRequest(Irp, 0);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+//
+// cancel-safe queue of parked IRPs
+//
+
+class IrpQueue {
+public:
+	void Init();
+
+	void Insert(PIRP Irp);
+
+	// oldest IRP, optionally only one issued on the given file object
+	PIRP RemoveNext(PFILE_OBJECT FileObject = nullptr);
+
+	// whether an IRP issued on the file object is parked here
+	bool Holds(PFILE_OBJECT FileObject);
+
+	LONG Count() const {
+		return _count;
+	}
+
+private:
+	static void InsertIrp(PIO_CSQ csq, PIRP Irp);
+	static void RemoveIrp(PIO_CSQ csq, PIRP Irp);
+	static PIRP PeekNextIrp(PIO_CSQ csq, PIRP Irp, PVOID PeekContext);
+	static void AcquireLock(PIO_CSQ csq, PKIRQL Irql);
+	static void ReleaseLock(PIO_CSQ csq, KIRQL Irql);
+	static void CompleteCanceledIrp(PIO_CSQ csq, PIRP Irp);
+
+	static IrpQueue* FromCsq(PIO_CSQ csq) {
+		return CONTAINING_RECORD(csq, IrpQueue, _csq);
+	}
+
+private:
+	IO_CSQ _csq;
+	LIST_ENTRY _head;
+	KSPIN_LOCK _lock;
+	volatile LONG _count;
+};
@@ -0,0 +1,168 @@
+#pragma once
+
+#include "Platform.h"
+#include "SysMonCommon.h"
+
+//
+// fixed size blocks carved out of one preallocated slab.
+// free blocks form a lock-free stack threaded through the blocks themselves;
+// the stack head packs a block index with a tag that changes on every pop,
+// so a stale head can never be swapped back in (ABA).
+//
+
+class SlabPool {
+public:
+	bool Init(ULONG blockSize, ULONG count, ULONG tag) {
+		// each free block holds the index of the next one
+		_blockSize = (blockSize + 7) & ~7;
+		_count = count;
+		_slab = count ? (UCHAR*)AllocateMemory((SIZE_T)_blockSize * count, tag) : nullptr;
+		if (_slab == nullptr)
+			return false;
+
+		for (ULONG i = 0; i < count; i++)
+			*Next(i) = i + 2;	// 1-based, 0 terminates the list
+		*Next(count - 1) = 0;
+		_freeHead = 1;
+		return true;
+	}
+
+	void Destroy() {
+		if (_slab) {
+			FreeMemory(_slab);
+			_slab = nullptr;
+		}
+	}
+
+	void* Alloc() {
+		for (;;) {
+			auto head = ReadNoFence64(&_freeHead);
+			auto index = (ULONG)head;
+			if (index == 0)
+				return nullptr;
+
+			// the block may be handed out under our feet; the tag catches that
+			auto next = ReadULongNoFence(Next(index - 1));
+			auto tag = ((ULONG64)head >> 32) + 1;
+			if (InterlockedCompareExchange64(&_freeHead, (LONG64)((tag << 32) | next), head) == head)
+				return Block(index - 1);
+		}
+	}
+
+	void Free(void* p) {
+		auto index = (ULONG)(((UCHAR*)p - _slab) / _blockSize);
+		for (;;) {
+			auto head = ReadNoFence64(&_freeHead);
+			WriteULongNoFence(Next(index), (ULONG)head);
+			auto newHead = ((ULONG64)head & 0xffffffff00000000ULL) | (index + 1);
+			if (InterlockedCompareExchange64(&_freeHead, (LONG64)newHead, head) == head)
+				return;
+		}
+	}
+
+	bool Owns(const void* p) const {
+		return p >= _slab && p < _slab + (SIZE_T)_blockSize * _count;
+	}
+
+	ULONG BlockSize() const {
+		return _blockSize;
+	}
+
+private:
+	UCHAR* Block(ULONG index) const {
+		return _slab + (SIZE_T)_blockSize * index;
+	}
+
+	volatile ULONG* Next(ULONG index) const {
+		return (volatile ULONG*)Block(index);
+	}
+
+private:
+	volatile LONG64 _freeHead;
+	UCHAR* _slab;
+	ULONG _blockSize, _count;
+};
+
+//
+// size classed record allocator, one slab per ItemType.
+// records that don't fit their class (long command lines) or arrive when
+// the slab is exhausted fall back to the general allocator.
+// a type can have a release routine, run on each of its records as it's freed.
+//
+
+struct ItemPoolClass {
+	ItemType Type;
+	ULONG BlockSize;
+	ULONG Count;
+};
+
+class ItemPool {
+public:
+	static const int MaxTypes = 16;
+
+	bool Init(const ItemPoolClass* classes, int count, ULONG tag) {
+		_tag = tag;
+		_classCount = 0;
+		for (auto& p : _byType)
+			p = nullptr;
+		for (auto& release : _release)
+			release = nullptr;
+
+		for (int i = 0; i < count && i < MaxTypes; i++) {
+			auto& slab = _slabs[i];
+			if (!slab.Init(classes[i].BlockSize, classes[i].Count, tag)) {
+				Destroy();
+				return false;
+			}
+			_classCount++;
+			_byType[(int)classes[i].Type] = &slab;
+		}
+		return true;
+	}
+
+	void Destroy() {
+		for (int i = 0; i < _classCount; i++)
+			_slabs[i].Destroy();
+		_classCount = 0;
+	}
+
+	ItemHeader* Alloc(ItemType type, ULONG size) {
+		auto index = (int)type;
+		if (index >= 0 && index < MaxTypes) {
+			auto slab = _byType[index];
+			if (slab && size <= slab->BlockSize()) {
+				auto item = slab->Alloc();
+				if (item)
+					return (ItemHeader*)item;
+			}
+		}
+		return (ItemHeader*)AllocateMemory(size, _tag);
+	}
+
+	// whoever frees a record of the type, the routine sees it first; set before any are allocated
+	void SetRelease(ItemType type, void (*release)(ItemHeader*)) {
+		if ((int)type >= 0 && (int)type < MaxTypes)
+			_release[(int)type] = release;
+	}
+
+	void Free(ItemHeader* item) {
+		auto index = (int)item->Type;
+		if (index >= 0 && index < MaxTypes && _release[index])
+			_release[index](item);
+
+		for (int i = 0; i < _classCount; i++) {
+			if (_slabs[i].Owns(item)) {
+				_slabs[i].Free(item);
+				return;
+			}
+		}
+		FreeMemory(item);
+	}
+
+private:
+	SlabPool _slabs[MaxTypes];
+	SlabPool* _byType[MaxTypes];
+	void (*_release[MaxTypes])(ItemHeader*);
+	int _classCount;
+	ULONG _tag;
+};
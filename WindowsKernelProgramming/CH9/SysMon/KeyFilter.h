@@ -0,0 +1,316 @@
+#pragma once
+
+#include "Platform.h"
+#include "SysMonCommon.h"
+
+#if !defined(_KERNEL_MODE) && !defined(_WIN32)
+#include <wctype.h>
+#endif
+
+//
+// decides which registry keys writes are recorded for (SysMonKeyFilter).
+// the prefixes are compiled into a radix trie of upcased text, each node's children
+// next to each other and sorted by their first character, so a key name is accepted
+// or rejected in one pass: a binary search where prefixes part ways, a compare four
+// characters a step along the stretches they share, stopping as soon as no prefix continues.
+// readers don't lock: the trie is kept twice, the same latch as EventFilter.
+// Init and Set must be serialized by the caller.
+//
+
+inline WCHAR UpcaseKeyChar(WCHAR c) {
+	if (c < 0x80)
+		return c >= 'a' && c <= 'z' ? (WCHAR)(c - ('a' - 'A')) : c;
+#if defined(_KERNEL_MODE)
+	return RtlUpcaseUnicodeChar(c);
+#elif defined(_WIN32)
+	return (WCHAR)(ULONG_PTR)::CharUpperW((LPWSTR)(ULONG_PTR)c);
+#else
+	return (WCHAR)towupper(c);
+#endif
+}
+
+class KeyFilter {
+public:
+	static const ULONG MaxNodes = 2 * SysMonKeyFilterMaxPrefixes;
+	static const ULONG MaxChars = SysMonKeyFilterMaxPrefixes * SysMonKeyFilterMaxLength;
+
+	// starts out recording \REGISTRY\MACHINE only
+	bool Init(ULONG tag) {
+		static const char machine[] = "\\REGISTRY\\MACHINE";
+
+		_tag = tag;
+		_sequence = 0;
+		auto filter = (SysMonKeyFilter*)AllocateMemory(SYSMON_KEY_FILTER_SIZE(1), tag);
+		if (filter == nullptr)
+			return false;
+
+		filter->Count = 1;
+		filter->Prefixes[0].Exclude = 0;
+		filter->Prefixes[0].Length = sizeof(machine) - 1;
+		for (ULONG i = 0; i < sizeof(machine) - 1; i++)
+			filter->Prefixes[0].Text[i] = machine[i];
+		auto ok = Set(filter, SYSMON_KEY_FILTER_SIZE(1));
+		FreeMemory(filter);
+		return ok;
+	}
+
+	// validates, compiles and installs a filter coming from user mode
+	bool Set(const SysMonKeyFilter* filter, ULONG size) {
+		if (size < SYSMON_KEY_FILTER_SIZE(0) || filter->Count > SysMonKeyFilterMaxPrefixes || size < SYSMON_KEY_FILTER_SIZE(filter->Count))
+			return false;
+
+		auto scratch = (Scratch*)AllocateMemory(sizeof(Scratch), _tag);
+		if (scratch == nullptr)
+			return false;
+
+		auto ok = Compile(filter, *scratch);
+		if (ok) {
+			// see EventFilter::Set
+			for (int i = 0; i < 2; i++) {
+				WriteULongRelease(&_sequence, _sequence + 1);
+				MemoryBarrier();
+				Copy(_tables[i & 1], scratch->Trie);
+			}
+			MemoryBarrier();
+		}
+		FreeMemory(scratch);
+		return ok;
+	}
+
+	// name: a full kernel key name, length in WCHARs
+	bool Allows(const WCHAR* name, ULONG length) const {
+		for (;;) {
+			auto sequence = ReadULongAcquire(&_sequence);
+			auto allowed = Match(_tables[sequence & 1], name, length);
+			ReadBarrier();
+			if (ReadULongNoFence(&_sequence) == sequence)
+				return allowed;
+		}
+	}
+
+	// changes with every Set, for callers caching verdicts
+	ULONG Generation() const {
+		return ReadULongAcquire(&_sequence) / 2;
+	}
+
+private:
+	enum : UCHAR { NoMatch, Include, Exclude };
+
+	struct Node {
+		WCHAR Char;				// the label's first, what children are sorted by
+		USHORT Label;			// upcased text from the parent to here, in Chars
+		USHORT LabelLength;
+		USHORT FirstChild;
+		USHORT ChildCount;
+		UCHAR Verdict;			// of the prefix ending here
+	};
+
+	struct Table {
+		UCHAR Default;			// for keys no prefix matches
+		ULONG NodeCount;
+		ULONG CharCount;
+		Node Nodes[MaxNodes];	// the root, with the empty prefix, first
+		WCHAR Chars[MaxChars];
+	};
+
+	struct Prefix {
+		const WCHAR* Text;
+		ULONG Length;
+		UCHAR Verdict;
+	};
+
+	// nodes still to get their children: the prefixes [First, Last) all go through Node
+	struct Pending {
+		USHORT Node;
+		USHORT First;
+		USHORT Last;
+		USHORT Depth;
+	};
+
+	struct Scratch {
+		Table Trie;
+		Prefix Prefixes[SysMonKeyFilterMaxPrefixes];
+		Pending Queue[MaxNodes];
+	};
+
+	// only what Compile filled in; the rest of the scratch was never written
+	static void Copy(Table& to, const Table& from) {
+		to.Default = from.Default;
+		to.NodeCount = from.NodeCount;
+		to.CharCount = from.CharCount;
+		::memcpy(to.Nodes, from.Nodes, from.NodeCount * sizeof(Node));
+		::memcpy(to.Chars, from.Chars, from.CharCount * sizeof(WCHAR));
+	}
+
+	static bool Match(const Table& table, const WCHAR* name, ULONG length) {
+		auto verdict = table.Default;
+		ULONG nodes = table.NodeCount, chars = table.CharCount;
+		if (nodes > MaxNodes)
+			nodes = MaxNodes;
+		if (chars > MaxChars)
+			chars = MaxChars;
+		ULONG node = 0;
+		for (ULONG i = 0; ; ) {
+			auto& current = table.Nodes[node];
+			// prefixes match whole path components
+			if (current.Verdict != NoMatch && (i == length || name[i] == '\\'))
+				verdict = current.Verdict;
+			if (i == length)
+				break;
+
+			// a torn read only gives a wrong answer, which the caller throws away;
+			// ranges are clamped to what's in the table so it can't run off it either
+			auto c = UpcaseKeyChar(name[i]);
+			ULONG first = current.FirstChild, low = first, high = first + current.ChildCount;
+			if (high > nodes)
+				high = nodes;
+			auto end = high;
+			while (low < high) {
+				auto mid = (low + high) / 2;
+				if (table.Nodes[mid].Char < c)
+					low = mid + 1;
+				else
+					high = mid;
+			}
+			if (low >= end || table.Nodes[low].Char != c)
+				break;
+
+			auto& child = table.Nodes[low];
+			ULONG label = child.Label, labelLength = child.LabelLength;
+			if (labelLength == 0 || labelLength > length - i || label + labelLength > chars ||
+				!Matches(name + i + 1, table.Chars + label + 1, labelLength - 1))
+				break;
+			i += labelLength;
+			node = low;
+		}
+		return verdict == Include;
+	}
+
+	// the label is upcased already. key names are ASCII nearly always, so they're folded
+	// four characters at a time; a word with anything else in it goes one by one
+	static bool Matches(const WCHAR* name, const WCHAR* label, ULONG length) {
+		ULONG k = 0;
+		for (; k + 4 <= length; k += 4) {
+			ULONG64 word, upcased;
+			::memcpy(&word, name + k, sizeof(word));
+			::memcpy(&upcased, label + k, sizeof(upcased));
+			if (word == upcased)
+				continue;
+			if ((word & 0xff80ff80ff80ff80ull) == 0) {
+				// a character from 'a' to 'z' gets 0x80 from adding 0x1f and not from adding 5
+				auto lower = (word + 0x001f001f001f001full) & ~(word + 0x0005000500050005ull) & 0x0080008000800080ull;
+				if (word - (lower >> 2) != upcased)
+					return false;
+				continue;
+			}
+			for (auto j = k; j < k + 4; j++)
+				if (UpcaseKeyChar(name[j]) != label[j])
+					return false;
+		}
+		for (; k < length; k++)
+			if (UpcaseKeyChar(name[k]) != label[k])
+				return false;
+		return true;
+	}
+
+	static bool Compile(const SysMonKeyFilter* filter, Scratch& scratch) {
+		auto prefixes = scratch.Prefixes;
+		ULONG count = 0;
+		bool include = false;
+		for (ULONG i = 0; i < filter->Count; i++) {
+			auto& prefix = filter->Prefixes[i];
+			auto length = prefix.Length;
+			if (length > SysMonKeyFilterMaxLength)
+				return false;
+			// "\REGISTRY\MACHINE\" is "\REGISTRY\MACHINE"
+			while (length > 0 && prefix.Text[length - 1] == '\\')
+				length--;
+			if (length == 0)
+				return false;
+
+			prefixes[count].Text = prefix.Text;
+			prefixes[count].Length = length;
+			prefixes[count].Verdict = prefix.Exclude ? Exclude : Include;
+			include |= prefix.Exclude == 0;
+			count++;
+		}
+		Sort(prefixes, count);
+
+		// breadth first, so each node's children are laid out together
+		auto& table = scratch.Trie;
+		table.Default = include ? Exclude : Include;
+		table.NodeCount = 1;
+		table.CharCount = 0;
+		table.Nodes[0] = { 0, 0, 0, 0, 0, NoMatch };
+		ULONG head = 0, tail = 0;
+		scratch.Queue[tail++] = { 0, 0, (USHORT)count, 0 };
+		while (head < tail) {
+			auto pending = scratch.Queue[head++];
+			auto& node = table.Nodes[pending.Node];
+			node.FirstChild = (USHORT)table.NodeCount;
+			for (ULONG i = pending.First; i < pending.Last; ) {
+				auto& prefix = prefixes[i];
+				if (prefix.Length == pending.Depth) {
+					// ends here; listed twice, exclude wins
+					if (node.Verdict != Exclude)
+						node.Verdict = prefix.Verdict;
+					i++;
+					continue;
+				}
+
+				// the prefixes sharing the next character are next to each other
+				auto c = UpcaseKeyChar(prefix.Text[pending.Depth]);
+				auto last = i + 1;
+				while (last < pending.Last && UpcaseKeyChar(prefixes[last].Text[pending.Depth]) == c)
+					last++;
+
+				// the child's label runs on while they all go on the same way,
+				// up to where one of them ends or they part
+				ULONG depth = pending.Depth + 1;
+				for (bool same = true; same; ) {
+					for (auto j = i; j < last && same; j++)
+						same = prefixes[j].Length > depth && UpcaseKeyChar(prefixes[j].Text[depth]) == UpcaseKeyChar(prefix.Text[depth]);
+					if (same)
+						depth++;
+				}
+
+				auto labelLength = depth - pending.Depth;
+				if (table.NodeCount == MaxNodes || table.CharCount + labelLength > MaxChars)
+					return false;
+				auto child = table.NodeCount++;
+				table.Nodes[child] = { c, (USHORT)table.CharCount, (USHORT)labelLength, 0, 0, NoMatch };
+				for (ULONG k = pending.Depth; k < depth; k++)
+					table.Chars[table.CharCount++] = UpcaseKeyChar(prefix.Text[k]);
+				scratch.Queue[tail++] = { (USHORT)child, (USHORT)i, (USHORT)last, (USHORT)depth };
+				i = last;
+			}
+			node.ChildCount = (USHORT)(table.NodeCount - node.FirstChild);
+		}
+		return true;
+	}
+
+	// upcased order, a prefix before the longer ones it starts
+	static int Compare(const Prefix& a, const Prefix& b) {
+		for (ULONG i = 0; i < a.Length && i < b.Length; i++) {
+			auto ca = UpcaseKeyChar(a.Text[i]), cb = UpcaseKeyChar(b.Text[i]);
+			if (ca != cb)
+				return ca < cb ? -1 : 1;
+		}
+		return a.Length < b.Length ? -1 : a.Length > b.Length ? 1 : 0;
+	}
+
+	static void Sort(Prefix* prefixes, ULONG count) {
+		for (ULONG i = 1; i < count; i++) {
+			auto prefix = prefixes[i];
+			auto j = i;
+			for (; j > 0 && Compare(prefixes[j - 1], prefix) > 0; j--)
+				prefixes[j] = prefixes[j - 1];
+			prefixes[j] = prefix;
+		}
+	}
+
+private:
+	volatile ULONG _sequence;
+	ULONG _tag;
+	Table _tables[2];
+};
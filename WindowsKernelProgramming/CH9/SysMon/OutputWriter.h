@@ -0,0 +1,128 @@
+#pragma once
+
+#include "Platform.h"
+#include <stdio.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+//
+// the client's text going out on a thread of its own, so the thread decoding
+// records never waits on the console or a file. whoever formats hands a filled
+// buffer over whole (Write) and gets an empty one back in exchange; the writer
+// thread writes them in the order handed over and flushes the stream whenever it
+// has caught up. the decoder only waits once every buffer is filled and waiting,
+// that is, when the output is what's behind.
+// user mode only (Windows or POSIX).
+//
+
+class OutputWriter {
+public:
+	~OutputWriter() {
+		Close();
+	}
+
+	// buffers of size bytes, one of them is the caller's at any time
+	bool Start(FILE* output, ULONG buffers, ULONG size) {
+		_output = output;
+		_buffers.assign(buffers < 2 ? 2 : buffers, std::vector<char>(size));
+		_free.clear();
+		for (ULONG i = 1; i < _buffers.size(); i++)
+			_free.push_back(i);
+		_current = 0;
+		_filled.clear();
+		_stopping = _failed = false;
+		_bytes = _waits = 0;
+		_writer = std::thread([this] { Run(); });
+		return true;
+	}
+
+	// the buffer to format into; Write swaps it for another
+	std::vector<char>& Buffer() {
+		return _buffers[_current];
+	}
+
+	// queues the first size bytes of Buffer() and makes an empty one current
+	void Write(ULONG size) {
+		std::unique_lock<std::mutex> locker(_lock);
+		_filled.push_back({ _current, size });
+		_ready.notify_one();
+		if (_free.empty()) {
+			_waits++;
+			_idle.wait(locker, [this] { return !_free.empty(); });
+		}
+		_current = _free.front();
+		_free.pop_front();
+	}
+
+	// writes out what's queued, then stops the thread
+	void Close() {
+		if (!_writer.joinable())
+			return;
+		{
+			std::lock_guard<std::mutex> locker(_lock);
+			_stopping = true;
+		}
+		_ready.notify_one();
+		_writer.join();
+	}
+
+	bool Failed() const {
+		return _failed;
+	}
+
+	ULONG64 Bytes() const {
+		return _bytes;
+	}
+
+	// times the decoder had to wait for a buffer
+	ULONG64 Waits() const {
+		return _waits;
+	}
+
+private:
+	struct Filled {
+		ULONG Index;
+		ULONG Size;
+	};
+
+	// the writer thread
+	void Run() {
+		std::unique_lock<std::mutex> locker(_lock);
+		for (;;) {
+			_ready.wait(locker, [this] { return !_filled.empty() || _stopping; });
+			if (_filled.empty())
+				break;
+
+			auto filled = _filled.front();
+			_filled.pop_front();
+			auto caughtUp = _filled.empty();
+			locker.unlock();
+			auto& buffer = _buffers[filled.Index];
+			if (filled.Size && ::fwrite(buffer.data(), 1, filled.Size, _output) != filled.Size)
+				_failed = true;
+			if (caughtUp && ::fflush(_output) != 0)
+				_failed = true;
+			_bytes += filled.Size;
+			locker.lock();
+			_free.push_back(filled.Index);
+			_idle.notify_one();
+		}
+	}
+
+private:
+	FILE* _output = nullptr;
+	std::vector<std::vector<char>> _buffers;
+	ULONG _current = 0;					// the caller's
+	std::thread _writer;
+	std::mutex _lock;
+	std::condition_variable _ready;		// a buffer handed over, or stopping
+	std::condition_variable _idle;		// a buffer written
+	std::deque<ULONG> _free;
+	std::deque<Filled> _filled;
+	bool _stopping = false;
+	volatile bool _failed = false;
+	ULONG64 _bytes = 0, _waits = 0;
+};
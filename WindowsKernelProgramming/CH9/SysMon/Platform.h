@@ -0,0 +1,184 @@
+#pragma once
+
+//
+// lets the portable parts of SysMon (queue, allocator etc.) build outside the kernel.
+// kernel and Windows user mode get the real definitions, anything else gets
+// a minimal stand-in for the few types and interlocked functions being used.
+//
+
+#if defined(_KERNEL_MODE)
+#include <ntddk.h>
+#elif defined(_WIN32)
+#include <Windows.h>
+#include <string.h>
+#else
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sched.h>
+
+typedef uint8_t UCHAR;
+typedef int16_t SHORT;
+typedef uint16_t USHORT;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef int64_t LONG64;
+typedef uint64_t ULONG64;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef uintptr_t ULONG_PTR;
+typedef size_t SIZE_T;
+typedef char16_t WCHAR;
+typedef uint8_t BOOLEAN;
+typedef void* PVOID;
+
+typedef union _LARGE_INTEGER {
+	struct {
+		ULONG LowPart;
+		LONG HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+#ifndef CONTAINING_RECORD
+#define CONTAINING_RECORD(address, type, field) ((type*)((char*)(address) - offsetof(type, field)))
+#endif
+
+#ifndef FIELD_OFFSET
+#define FIELD_OFFSET(type, field) ((LONG)offsetof(type, field))
+#endif
+
+#ifndef ARRAYSIZE
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+#endif
+
+inline ULONG ReadULongNoFence(const volatile ULONG* source) {
+	return __atomic_load_n(source, __ATOMIC_RELAXED);
+}
+
+inline ULONG ReadULongAcquire(const volatile ULONG* source) {
+	return __atomic_load_n(source, __ATOMIC_ACQUIRE);
+}
+
+inline void WriteULongRelease(volatile ULONG* destination, ULONG value) {
+	__atomic_store_n(destination, value, __ATOMIC_RELEASE);
+}
+
+inline void WriteULongNoFence(volatile ULONG* destination, ULONG value) {
+	__atomic_store_n(destination, value, __ATOMIC_RELAXED);
+}
+
+inline LONG64 ReadNoFence64(const volatile LONG64* source) {
+	return __atomic_load_n(source, __ATOMIC_RELAXED);
+}
+
+inline LONG InterlockedIncrement(volatile LONG* addend) {
+	return __atomic_add_fetch(addend, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedDecrement(volatile LONG* addend) {
+	return __atomic_sub_fetch(addend, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedExchangeAdd(volatile LONG* addend, LONG value) {
+	return __atomic_fetch_add(addend, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG64 InterlockedExchangeAdd64(volatile LONG64* addend, LONG64 value) {
+	return __atomic_fetch_add(addend, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedExchange(volatile LONG* target, LONG value) {
+	return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedCompareExchange(volatile LONG* destination, LONG exchange, LONG comparand) {
+	__atomic_compare_exchange_n(destination, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return comparand;
+}
+
+inline LONG InterlockedOr(volatile LONG* destination, LONG value) {
+	return __atomic_fetch_or(destination, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG64 InterlockedCompareExchange64(volatile LONG64* destination, LONG64 exchange, LONG64 comparand) {
+	__atomic_compare_exchange_n(destination, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return comparand;
+}
+
+inline PVOID ReadPointerAcquire(PVOID const volatile* source) {
+	return __atomic_load_n(source, __ATOMIC_ACQUIRE);
+}
+
+inline PVOID InterlockedCompareExchangePointer(PVOID volatile* destination, PVOID exchange, PVOID comparand) {
+	__atomic_compare_exchange_n(destination, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return comparand;
+}
+
+inline void MemoryBarrier() {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+inline void ReadBarrier() {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+inline BOOLEAN BitScanReverse(ULONG* index, ULONG mask) {
+	if (mask == 0)
+		return 0;
+	*index = 31 - __builtin_clz(mask);
+	return 1;
+}
+
+inline void YieldProcessor() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	sched_yield();
+#endif
+}
+#endif
+
+#if defined(_KERNEL_MODE) || defined(_WIN32)
+// orders earlier loads before later ones; x86/x64 already do, so only the compiler needs telling
+inline void ReadBarrier() {
+#if defined(_M_ARM64)
+	__dmb(_ARM64_BARRIER_ISHLD);
+#else
+	_ReadBarrier();
+#endif
+}
+#endif
+
+//
+// backing memory for the portable pieces
+//
+
+#if defined(_KERNEL_MODE)
+inline void* AllocateMemory(SIZE_T size, ULONG tag) {
+	return ExAllocatePoolWithTag(PagedPool, size, tag);
+}
+
+// for anything touched at DISPATCH_LEVEL
+inline void* AllocateNonPagedMemory(SIZE_T size, ULONG tag) {
+	return ExAllocatePoolWithTag(NonPagedPool, size, tag);
+}
+
+inline void FreeMemory(void* p) {
+	ExFreePool(p);
+}
+#else
+#include <stdlib.h>
+
+inline void* AllocateMemory(SIZE_T size, ULONG) {
+	return ::malloc(size);
+}
+
+inline void* AllocateNonPagedMemory(SIZE_T size, ULONG) {
+	return ::malloc(size);
+}
+
+inline void FreeMemory(void* p) {
+	::free(p);
+}
+#endif
@@ -0,0 +1,157 @@
+#pragma once
+
+#include "Platform.h"
+
+//
+// per process state for ThreadAggregator and RateLimiter: an open addressing table
+// keyed by process ID that producers claim slots in and update with interlocked
+// operations, holding a shared spin lock (Shared) only to keep the collector out.
+// the collector takes it exclusively to rebuild the table into its spare copy,
+// keeping the processes it asks to keep.
+// Entry has a volatile LONG ProcessId (0: free) and a Clear() that makes it a free
+// slot; claiming one only sets its process ID.
+// the driver holds the lock at DISPATCH_LEVEL, so the table must be non-paged.
+//
+
+template<typename Entry>
+class ProcessTable {
+public:
+	// capacity must be a power of 2
+	bool Init(ULONG capacity, ULONG tag) {
+		_capacity = capacity;
+		_count = 0;
+		_lock = 0;
+		_table = (Entry*)AllocateNonPagedMemory(2 * capacity * sizeof(Entry), tag);
+		if (_table == nullptr)
+			return false;
+
+		_spare = _table + capacity;
+		Clear(_table);
+		return true;
+	}
+
+	void Destroy() {
+		if (_table) {
+			FreeMemory(_table < _spare ? _table : _spare);
+			_table = _spare = nullptr;
+		}
+	}
+
+	// readers add 2, the collector owns bit 0
+	struct Shared {
+		explicit Shared(ProcessTable& table) : _lock(table._lock) {
+			for (;;) {
+				auto value = ReadULongAcquire((volatile ULONG*)&_lock);
+				if ((value & 1) == 0 && (ULONG)InterlockedCompareExchange(&_lock, value + 2, value) == value)
+					break;
+				YieldProcessor();
+			}
+		}
+
+		~Shared() {
+			InterlockedExchangeAdd(&_lock, -2);
+		}
+
+	private:
+		volatile LONG& _lock;
+	};
+
+	// producers, holding Shared. nullptr if the process isn't there and either add
+	// is false or there's no room for it
+	Entry* Find(ULONG processId, bool add = true) {
+		if (processId == 0)
+			return nullptr;
+
+		auto slot = Hash(processId);
+		for (ULONG i = 0; i < _capacity; i++) {
+			auto& entry = _table[(slot + i) & (_capacity - 1)];
+			auto id = (ULONG)ReadULongAcquire((volatile ULONG*)&entry.ProcessId);
+			if (id == processId)
+				return &entry;
+
+			if (id == 0) {
+				if (!add || (ULONG)_count >= _capacity / 4 * 3)
+					return nullptr;
+
+				if (InterlockedCompareExchange(&entry.ProcessId, processId, 0) == 0) {
+					InterlockedIncrement(&_count);
+					return &entry;
+				}
+				if ((ULONG)entry.ProcessId == processId)
+					return &entry;
+			}
+		}
+		return nullptr;
+	}
+
+	//
+	// collector, one at a time. keep(entry) sees every process with the table
+	// locked and says whether it moves over to the rebuilt one
+	//
+	template<typename Keep>
+	void Rebuild(Keep keep) {
+		LockExclusive();
+		ULONG kept = 0;
+		Clear(_spare);
+		for (ULONG i = 0; i < _capacity; i++) {
+			auto& entry = _table[i];
+			if (entry.ProcessId == 0 || !keep(entry))
+				continue;
+
+			*Slot(_spare, entry.ProcessId) = entry;
+			kept++;
+		}
+
+		auto table = _table;
+		_table = _spare;
+		_spare = table;
+		_count = kept;
+		WriteULongRelease((volatile ULONG*)&_lock, 0);
+	}
+
+	// forgets every process
+	void Reset() {
+		LockExclusive();
+		Clear(_table);
+		_count = 0;
+		WriteULongRelease((volatile ULONG*)&_lock, 0);
+	}
+
+	ULONG Count() const {
+		return (ULONG)_count;
+	}
+
+private:
+	// process IDs are multiples of 4
+	static ULONG Hash(ULONG processId) {
+		return (processId >> 2) * 2654435761u;
+	}
+
+	void LockExclusive() {
+		while (InterlockedOr(&_lock, 1) & 1)
+			YieldProcessor();
+		while (ReadULongAcquire((volatile ULONG*)&_lock) != 1)
+			YieldProcessor();
+	}
+
+	void Clear(Entry* table) {
+		for (ULONG i = 0; i < _capacity; i++)
+			table[i].Clear();
+	}
+
+	Entry* Slot(Entry* table, ULONG processId) const {
+		auto slot = Hash(processId);
+		for (ULONG i = 0; ; i++) {
+			auto& entry = table[(slot + i) & (_capacity - 1)];
+			if (entry.ProcessId == 0 || (ULONG)entry.ProcessId == processId)
+				return &entry;
+		}
+	}
+
+private:
+	Entry* _table;
+	Entry* _spare;
+	ULONG _capacity;
+	volatile LONG _count;
+	volatile LONG _lock;
+};
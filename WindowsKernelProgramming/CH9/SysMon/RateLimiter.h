@@ -0,0 +1,198 @@
+#pragma once
+
+#include "ProcessTable.h"
+#include "SysMonCommon.h"
+
+//
+// token buckets checked before a record is allocated (SysMonRateLimits): one per type
+// and, where the limits ask for it, one per process and type. a bucket is a single
+// 64-bit value, the time it's full again (GCRA): a token pushes it one interval further,
+// and a record gets in while that stays within burst - 1 intervals of now.
+// producers move it with a compare-exchange, never waiting on each other.
+// times are 100 nsec units of any cheap clock, KeQueryInterruptTime in the driver.
+// processes are in a ProcessTable; collecting drops the processes whose buckets filled
+// up again. a process with no room in the table is held to its type's limit only.
+//
+
+struct RateCounters {
+	ULONG Suppressed[SysMonMaxTypes];	// by ItemType, since the last collection
+	ULONG TopProcessId;					// the process that lost the most, 0 if none was known
+	ULONG TopProcessSuppressed;
+};
+
+class RateLimiter {
+public:
+	// capacity must be a power of 2
+	bool Init(ULONG capacity, ULONG tag) {
+		_active = 0;
+		::memset(_limits, 0, sizeof(_limits));
+		::memset((void*)_due, 0, sizeof(_due));
+		::memset((void*)_suppressed, 0, sizeof(_suppressed));
+		return _processes.Init(capacity, tag);
+	}
+
+	void Destroy() {
+		_processes.Destroy();
+	}
+
+	//
+	// one update at a time. producers pick the new limits up as they go; every bucket
+	// starts out full. false if a limit is out of range
+	//
+	bool Set(const SysMonRateLimits& limits) {
+		Limit converted[SysMonMaxTypes];
+		for (ULONG i = 0; i < SysMonMaxTypes; i++) {
+			auto& limit = limits.Types[i];
+			if (!Convert(limit.Rate, limit.Burst, converted[i].Interval, converted[i].Tolerance) ||
+				!Convert(limit.ProcessRate, limit.ProcessBurst, converted[i].ProcessInterval, converted[i].ProcessTolerance))
+				return false;
+		}
+
+		LONG active = 0;
+		for (ULONG i = 0; i < SysMonMaxTypes; i++) {
+			_limits[i] = converted[i];
+			_due[i] = 0;
+			active |= converted[i].Interval || converted[i].ProcessInterval;
+		}
+		_processes.Reset();
+		InterlockedExchange(&_active, active);
+		return true;
+	}
+
+	// nothing limited, the notify routines needn't even ask
+	bool Active() const {
+		return _active != 0;
+	}
+
+	//
+	// producers; type is the v1 type the filter knows it by. process buckets come first,
+	// so a flooding process uses up its own allowance before its type's
+	//
+	bool Allows(ItemType type, ULONG processId, LONG64 now) {
+		auto index = (ULONG)type;
+		if (index >= SysMonMaxTypes)
+			return true;
+
+		auto& limit = _limits[index];
+		if (limit.ProcessInterval) {
+			Processes::Shared locker(_processes);
+			auto entry = _processes.Find(processId);
+			if (entry && !Take(entry->Due[index], limit.ProcessInterval, limit.ProcessTolerance, now)) {
+				InterlockedIncrement(&entry->Suppressed);
+				InterlockedIncrement(&_suppressed[index]);
+				return false;
+			}
+		}
+
+		if (limit.Interval && !Take(_due[index], limit.Interval, limit.Tolerance, now)) {
+			// still charged to the process, for the summary
+			Processes::Shared locker(_processes);
+			auto entry = _processes.Find(processId);
+			if (entry)
+				InterlockedIncrement(&entry->Suppressed);
+			InterlockedIncrement(&_suppressed[index]);
+			return false;
+		}
+		return true;
+	}
+
+	//
+	// collector, one at a time. what was suppressed since the last collection, by type
+	// and the worst process; forgets processes whose buckets are full again.
+	// returns how many records were suppressed
+	//
+	ULONG Collect(RateCounters& counters, LONG64 now) {
+		ULONG total = 0;
+		for (ULONG i = 0; i < SysMonMaxTypes; i++)
+			total += counters.Suppressed[i] = (ULONG)InterlockedExchange(&_suppressed[i], 0);
+		counters.TopProcessId = counters.TopProcessSuppressed = 0;
+
+		_processes.Rebuild([&](Entry& entry) {
+			if ((ULONG)entry.Suppressed > counters.TopProcessSuppressed) {
+				counters.TopProcessId = entry.ProcessId;
+				counters.TopProcessSuppressed = entry.Suppressed;
+			}
+			entry.Suppressed = 0;
+			return !Idle(entry, now);
+		});
+		return total;
+	}
+
+	// counts a collection couldn't report go back in for the next one
+	void Restore(const RateCounters& counters) {
+		for (ULONG i = 0; i < SysMonMaxTypes; i++)
+			if (counters.Suppressed[i])
+				InterlockedExchangeAdd(&_suppressed[i], counters.Suppressed[i]);
+	}
+
+	// anything suppressed since the last collection
+	bool Pending() const {
+		for (ULONG i = 0; i < SysMonMaxTypes; i++)
+			if (_suppressed[i])
+				return true;
+		return false;
+	}
+
+	ULONG Count() const {
+		return _processes.Count();
+	}
+
+private:
+	static const LONG64 UnitsPerSecond = 10000000;
+
+	struct Limit {
+		LONG64 Interval;		// between tokens, 0: no limit
+		LONG64 Tolerance;		// (burst - 1) intervals
+		LONG64 ProcessInterval;
+		LONG64 ProcessTolerance;
+	};
+
+	struct Entry {
+		volatile LONG ProcessId;	// 0: free
+		volatile LONG Suppressed;
+		volatile LONG64 Due[SysMonMaxTypes];
+
+		void Clear() {
+			::memset((void*)this, 0, sizeof(*this));
+		}
+	};
+
+	typedef ProcessTable<Entry> Processes;
+
+	// rate 0 is no limit, burst 0 a second's worth
+	static bool Convert(ULONG rate, ULONG burst, LONG64& interval, LONG64& tolerance) {
+		if (rate > UnitsPerSecond)
+			return false;
+		interval = rate ? UnitsPerSecond / rate : 0;
+		tolerance = ((LONG64)(burst ? burst : rate) - 1) * interval;
+		if (tolerance < 0)
+			tolerance = 0;
+		return true;
+	}
+
+	static bool Take(volatile LONG64& due, LONG64 interval, LONG64 tolerance, LONG64 now) {
+		for (auto full = ReadNoFence64(&due); ; ) {
+			auto start = full > now ? full : now;
+			if (start - now > tolerance)
+				return false;
+			auto seen = InterlockedCompareExchange64(&due, start + interval, full);
+			if (seen == full)
+				return true;
+			full = seen;
+		}
+	}
+
+	static bool Idle(const Entry& entry, LONG64 now) {
+		for (ULONG i = 0; i < SysMonMaxTypes; i++)
+			if (entry.Due[i] > now)
+				return false;
+		return true;
+	}
+
+private:
+	Limit _limits[SysMonMaxTypes];
+	volatile LONG64 _due[SysMonMaxTypes];		// type buckets
+	volatile LONG _suppressed[SysMonMaxTypes];
+	volatile LONG _active;
+	Processes _processes;
+};
@@ -0,0 +1,405 @@
+#pragma once
+
+#include "Platform.h"
+#include "SysMonCommon.h"
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+//
+// the client's reads, kept going while the records already read are formatted.
+// a reader thread keeps several buffers in flight on a ReadSource and does nothing
+// else: it waits for the oldest read, queues the filled buffer and starts another
+// read on a free one. whoever consumes them takes filled buffers off the queue in
+// the order they were read (Next) and gives them back (Release). the reader only
+// goes without a read in flight once every buffer is filled and waiting, that is,
+// when decoding is what's behind: with records coming faster than they're decoded
+// that's every read, however many buffers; they're sized to get a burst through.
+// the text goes out on a thread of its own too (OutputWriter.h).
+// ReadSource is the I/O: the driver's handle with overlapped reads on Windows, a
+// file or pipe of records read back to back anywhere else (SysMonBench).
+// user mode only (Windows or POSIX).
+//
+
+enum class ReadResult {
+	Filled,		// possibly with nothing, a driver that doesn't block reads
+	Ended,		// the source is done, or the reads were cancelled
+	Failed
+};
+
+#if defined(_WIN32)
+
+// the handle must be opened with FILE_FLAG_OVERLAPPED; the driver completes a
+// handle's reads in the order they were issued
+class ReadSource {
+public:
+	~ReadSource() {
+		Detach();
+	}
+
+	// slots: reads that may be outstanding at once
+	bool Attach(HANDLE file, ULONG slots) {
+		_file = file;
+		_reads.resize(slots);
+		for (auto& read : _reads) {
+			::memset(&read, 0, sizeof(read));
+			read.hEvent = ::CreateEvent(nullptr, TRUE, FALSE, nullptr);
+			if (read.hEvent == nullptr)
+				return false;
+		}
+		return true;
+	}
+
+	void Detach() {
+		for (auto& read : _reads)
+			if (read.hEvent)
+				::CloseHandle(read.hEvent);
+		_reads.clear();
+	}
+
+	bool Start(ULONG slot, UCHAR* buffer, ULONG size) {
+		if (::ReadFile(_file, buffer, size, nullptr, &_reads[slot]) || ::GetLastError() == ERROR_IO_PENDING)
+			return true;
+		_error = ::GetLastError();
+		return false;
+	}
+
+	ReadResult Wait(ULONG slot, ULONG& bytes) {
+		DWORD transferred;
+		if (::GetOverlappedResult(_file, &_reads[slot], &transferred, TRUE)) {
+			bytes = transferred;
+			return ReadResult::Filled;
+		}
+		_error = ::GetLastError();
+		return _error == ERROR_OPERATION_ABORTED ? ReadResult::Ended : ReadResult::Failed;
+	}
+
+	// reads parked in the driver complete as cancelled
+	void Cancel() {
+		::CancelIoEx(_file, nullptr);
+	}
+
+	ULONG Error() const {
+		return _error;
+	}
+
+private:
+	HANDLE _file = INVALID_HANDLE_VALUE;
+	std::vector<OVERLAPPED> _reads;
+	ULONG _error = 0;
+};
+
+#else
+#include <errno.h>
+#include <unistd.h>
+
+// whole records back to back, as a file or a pipe. a read is done when it's waited
+// for, in the order started, and like the driver's it only hands out whole records:
+// a record cut off at the end goes at the start of the next one
+class ReadSource {
+public:
+	bool Attach(int fd, ULONG slots) {
+		_fd = fd;
+		_reads.assign(slots, Read{});
+		_carry.clear();
+		_cancelled = false;
+		return true;
+	}
+
+	void Detach() {
+		_reads.clear();
+	}
+
+	bool Start(ULONG slot, UCHAR* buffer, ULONG size) {
+		_reads[slot] = { buffer, size };
+		return true;
+	}
+
+	ReadResult Wait(ULONG slot, ULONG& bytes) {
+		auto& read = _reads[slot];
+		if (_cancelled)
+			return ReadResult::Ended;
+		if (_carry.size() > read.Size)
+			return Fail(EINVAL);
+
+		ULONG used = (ULONG)_carry.size();
+		::memcpy(read.Buffer, _carry.data(), used);
+		for (;;) {
+			auto count = ::read(_fd, read.Buffer + used, read.Size - used);
+			if (count < 0) {
+				if (errno == EINTR)
+					continue;
+				return Fail(errno);
+			}
+			used += (ULONG)count;
+
+			ULONG whole = 0;
+			while (whole + sizeof(ItemHeader) <= used) {
+				auto header = (const ItemHeader*)(read.Buffer + whole);
+				if (header->Size < sizeof(ItemHeader))
+					return Fail(EILSEQ);
+				if (header->Size > used - whole)
+					break;
+				whole += header->Size;
+			}
+
+			if (count == 0 && whole == 0) {
+				// the end, unless it cut a record short
+				if (used)
+					return Fail(EILSEQ);
+				_carry.clear();
+				return ReadResult::Ended;
+			}
+			if (whole == 0 && used == read.Size)
+				return Fail(EMSGSIZE);
+			if (whole == 0)
+				continue;
+
+			_carry.assign(read.Buffer + whole, read.Buffer + used);
+			bytes = whole;
+			return ReadResult::Filled;
+		}
+	}
+
+	// the reads not done yet end without reading; a read(2) already waiting isn't
+	// interrupted, that one ends when the writer closes
+	void Cancel() {
+		_cancelled = true;
+	}
+
+	ULONG Error() const {
+		return _error;
+	}
+
+private:
+	ReadResult Fail(int error) {
+		_error = (ULONG)error;
+		return ReadResult::Failed;
+	}
+
+	struct Read {
+		UCHAR* Buffer;
+		ULONG Size;
+	};
+
+	int _fd = -1;
+	std::vector<Read> _reads;
+	std::vector<UCHAR> _carry;
+	ULONG _error = 0;
+	volatile bool _cancelled = false;
+};
+
+#endif
+
+struct ReadBatch {
+	UCHAR* Data;
+	ULONG Size;			// bytes read
+};
+
+class ReadPipeline {
+public:
+	~ReadPipeline() {
+		Close();
+	}
+
+	//
+	// buffers of size bytes, depth of them in flight and the rest for filled ones
+	// waiting to be consumed; the source is attached with a slot per buffer.
+	// idleMs: how long to pause after a read came back empty
+	//
+	bool Start(ReadSource& source, ULONG buffers, ULONG depth, ULONG size, ULONG idleMs = 0) {
+		_source = &source;
+		_depth = depth < buffers ? depth : buffers;
+		_size = size;
+		_idleMs = idleMs;
+		_data.resize((size_t)buffers * size);
+		_batches.resize(buffers);
+		_free.clear();
+		for (ULONG i = 0; i < buffers; i++) {
+			_batches[i] = { _data.data() + (size_t)i * size, 0 };
+			_free.push_back(i);
+		}
+		_filled.clear();
+		_stopping = _done = _failed = false;
+		_reads = _bytes = _stalls = 0;
+		_reader = std::thread([this] { Read(); });
+		return true;
+	}
+
+	// stops starting reads and cancels the ones in flight; what was read is still handed out
+	void Cancel() {
+		std::lock_guard<std::mutex> starting(_starting);
+		{
+			std::lock_guard<std::mutex> locker(_lock);
+			_stopping = true;
+		}
+		_idle.notify_one();
+		_source->Cancel();
+	}
+
+	void Close() {
+		if (!_reader.joinable())
+			return;
+		Cancel();
+		_reader.join();
+	}
+
+	// the oldest filled buffer; nullptr after timeoutMs without one, or once Done
+	ReadBatch* Next(ULONG timeoutMs) {
+		std::unique_lock<std::mutex> locker(_lock);
+		_ready.wait_for(locker, std::chrono::milliseconds(timeoutMs), [this] { return !_filled.empty() || _done; });
+		if (_filled.empty())
+			return nullptr;
+
+		auto index = _filled.front();
+		_filled.pop_front();
+		return &_batches[index];
+	}
+
+	void Release(ReadBatch* batch) {
+		{
+			std::lock_guard<std::mutex> locker(_lock);
+			_free.push_back((ULONG)(batch - _batches.data()));
+		}
+		_idle.notify_one();
+	}
+
+	// the reader stopped and every filled buffer was taken
+	bool Done() {
+		std::lock_guard<std::mutex> locker(_lock);
+		return _done && _filled.empty();
+	}
+
+	// filled buffers not taken yet
+	ULONG Waiting() {
+		std::lock_guard<std::mutex> locker(_lock);
+		return (ULONG)_filled.size();
+	}
+
+	bool Failed() const {
+		return _failed;
+	}
+
+	ULONG Error() const {
+		return _source->Error();
+	}
+
+	ULONG64 Reads() const {
+		return _reads;
+	}
+
+	ULONG64 Bytes() const {
+		return _bytes;
+	}
+
+	// times the reader had nothing in flight and no buffer to start one on
+	ULONG64 Stalls() const {
+		return _stalls;
+	}
+
+private:
+	// the reader thread
+	void Read() {
+		std::deque<ULONG> inflight;
+		bool ended = false;
+		while (!ended) {
+			// keep depth reads going; start and Cancel take turns, nothing starts after a cancel
+			while (inflight.size() < _depth) {
+				std::lock_guard<std::mutex> starting(_starting);
+				ULONG index;
+				{
+					std::lock_guard<std::mutex> locker(_lock);
+					if (_stopping || _free.empty())
+						break;
+					index = _free.front();
+					_free.pop_front();
+				}
+				if (!_source->Start(index, _batches[index].Data, _size)) {
+					Finish(index, ReadResult::Failed);
+					ended = true;
+					break;
+				}
+				inflight.push_back(index);
+			}
+
+			if (inflight.empty()) {
+				if (ended)
+					break;
+				std::unique_lock<std::mutex> locker(_lock);
+				if (_stopping)
+					break;
+				_stalls++;
+				_idle.wait(locker, [this] { return !_free.empty() || _stopping; });
+				continue;
+			}
+
+			auto index = inflight.front();
+			inflight.pop_front();
+			ULONG bytes = 0;
+			auto result = _source->Wait(index, bytes);
+			if (result != ReadResult::Filled) {
+				Finish(index, result);
+				ended = true;
+				break;
+			}
+
+			_reads++;
+			_bytes += bytes;
+			_batches[index].Size = bytes;
+			std::unique_lock<std::mutex> locker(_lock);
+			if (bytes == 0) {
+				_free.push_back(index);
+				if (_idleMs)
+					_idle.wait_for(locker, std::chrono::milliseconds(_idleMs), [this] { return _stopping; });
+				continue;
+			}
+			_filled.push_back(index);
+			locker.unlock();
+			_ready.notify_one();
+		}
+
+		// the ones still in flight were cancelled, or the source is gone anyway
+		_source->Cancel();
+		for (auto index : inflight) {
+			ULONG bytes;
+			_source->Wait(index, bytes);
+			std::lock_guard<std::mutex> locker(_lock);
+			_free.push_back(index);
+		}
+
+		{
+			std::lock_guard<std::mutex> locker(_lock);
+			_done = true;
+		}
+		_ready.notify_all();
+	}
+
+	// a read that didn't fill its buffer; failing on a cancel is just stopping
+	void Finish(ULONG index, ReadResult result) {
+		std::lock_guard<std::mutex> locker(_lock);
+		_free.push_back(index);
+		_failed = result == ReadResult::Failed && !_stopping;
+	}
+
+private:
+	ReadSource* _source = nullptr;
+	ULONG _depth;
+	ULONG _size;
+	ULONG _idleMs;
+	std::vector<UCHAR> _data;
+	std::vector<ReadBatch> _batches;
+	std::thread _reader;
+	std::mutex _lock;
+	std::mutex _starting;				// a read starting, or Cancel
+	std::condition_variable _ready;		// a buffer filled, or the reader done
+	std::condition_variable _idle;		// a buffer freed, or stopping
+	std::deque<ULONG> _free;
+	std::deque<ULONG> _filled;
+	bool _stopping = false;
+	bool _done = false;
+	volatile bool _failed = false;
+	ULONG64 _reads, _bytes, _stalls;
+};
@@ -0,0 +1,203 @@
+#pragma once
+
+#include "Platform.h"
+
+//
+// event ring living in memory shared by the driver and its client.
+// producers reserve space, build the record in place and commit it;
+// the consumer reads records where they are and moves the read index on.
+// nothing is copied or freed per event.
+//
+// layout: SharedChannelHeader, then a power of 2 sized data area made of
+// slots. each slot is a SharedChannelSlot followed by the record itself.
+// a slot's Length is zero until its record is committed: the consumer zeroes
+// everything it consumed, so a slot never starts on an old record's bytes.
+// producers reserve against their own write index, in memory the client can't
+// touch; the header's WriteIndex is only published for the consumer to check
+// lengths against.
+//
+
+struct SharedChannelHeader {
+	ULONG Size;						// data area bytes
+	ULONG HeaderSize;				// offset of the data area
+	volatile ULONG WriteIndex;		// producers, published: at least every reserved slot's end
+	volatile ULONG ReadIndex;		// consumer
+	volatile ULONG Dropped;			// records lost because the ring was full
+	volatile ULONG ConsumerWaiting;	// consumer is about to sleep, wake it on commit
+};
+
+struct SharedChannelSlot {
+	volatile ULONG Length;			// whole slot, 0 while being filled
+	ULONG Allocated;				// whole slot, set when reserved
+};
+
+const ULONG SharedChannelPadding = 0x80000000;	// slot skips to the start of the ring
+
+class SharedChannel {
+public:
+	// producer side, formats the memory; size is the whole region
+	bool Init(void* memory, ULONG size) {
+		auto header = (SharedChannelHeader*)memory;
+		if (size < sizeof(SharedChannelHeader) + 4096)
+			return false;
+
+		ULONG dataSize = 4096;
+		while (dataSize * 2 <= size - sizeof(SharedChannelHeader))
+			dataSize *= 2;
+
+		::memset(memory, 0, sizeof(SharedChannelHeader) + dataSize);
+		header->Size = dataSize;
+		header->HeaderSize = sizeof(SharedChannelHeader);
+		Attach(memory, dataSize);
+		return true;
+	}
+
+	// consumer side, maps an already formatted region
+	bool Attach(void* memory) {
+		auto header = (SharedChannelHeader*)memory;
+		if (header->HeaderSize != sizeof(SharedChannelHeader) || (header->Size & (header->Size - 1)))
+			return false;
+
+		Attach(memory, header->Size);
+		return true;
+	}
+
+	//
+	// producers
+	// the other side may scribble over the header; the read index it controls
+	// is only used modulo our own copy of the size, so we never write outside the ring,
+	// and nothing it writes can keep a producer looping
+	//
+
+	void* Reserve(ULONG size) {
+		auto total = (ULONG)((sizeof(SharedChannelSlot) + size + 7) & ~7);
+		if (total > _size / 2)
+			return nullptr;
+
+		for (;;) {
+			auto write = ReadULongAcquire(&_write);
+			auto read = ReadULongAcquire(&_header->ReadIndex);
+			auto offset = write & (_size - 1);
+			auto contiguous = _size - offset;
+			auto needed = contiguous < total ? contiguous + total : total;
+			if (write + needed - read > _size) {
+				InterlockedIncrement((volatile LONG*)&_header->Dropped);
+				return nullptr;
+			}
+
+			if ((ULONG)InterlockedCompareExchange((volatile LONG*)&_write, (LONG)(write + needed), (LONG)write) != write)
+				continue;
+
+			if (contiguous < total) {
+				// not enough room before the end, burn it and start over at the beginning
+				WriteULongRelease(&Slot(offset)->Length, contiguous | SharedChannelPadding);
+				offset = 0;
+			}
+			auto slot = Slot(offset);
+			slot->Allocated = total;
+			return slot + 1;
+		}
+	}
+
+	// publishes a record returned by Reserve; true if the consumer wants a wake-up
+	bool Commit(void* record) {
+		auto slot = (SharedChannelSlot*)record - 1;
+		// the consumer takes no length past the published index
+		Publish();
+		WriteULongRelease(&slot->Length, slot->Allocated);
+		return ReadULongAcquire(&_header->ConsumerWaiting) &&
+			InterlockedExchange((volatile LONG*)&_header->ConsumerWaiting, 0) != 0;
+	}
+
+	bool Owns(const void* p) const {
+		return p >= _data && p < _data + _size;
+	}
+
+	void Detach() {
+		_header = nullptr;
+		_data = nullptr;
+		_size = 0;
+	}
+
+	//
+	// consumer
+	//
+
+	// oldest committed record, nullptr if none
+	void* Peek() {
+		for (;;) {
+			auto read = ReadULongNoFence(&_header->ReadIndex);
+			auto write = ReadULongAcquire(&_header->WriteIndex);
+			if (read == write)
+				return nullptr;
+
+			auto slot = Slot(read & (_size - 1));
+			auto length = ReadULongAcquire(&slot->Length);
+			if (length == 0)
+				return nullptr;		// still being filled
+
+			// no slot a producer commits crosses the published index, runs off the
+			// ring or is misaligned; anything else isn't a committed length
+			auto span = length & ~SharedChannelPadding;
+			if (span < sizeof(SharedChannelSlot) || (span & 7) || span > write - read || span > _size - (read & (_size - 1)))
+				return nullptr;
+
+			if ((length & SharedChannelPadding) == 0)
+				return slot + 1;
+
+			Release(slot, span);
+		}
+	}
+
+	// done with the record Peek returned
+	void Advance() {
+		auto slot = Slot(ReadULongNoFence(&_header->ReadIndex) & (_size - 1));
+		Release(slot, slot->Length);
+	}
+
+	// call before sleeping, then check Peek once more
+	void SetWaiting() {
+		InterlockedExchange((volatile LONG*)&_header->ConsumerWaiting, 1);
+	}
+
+	ULONG Dropped() const {
+		return _header->Dropped;
+	}
+
+private:
+	void Attach(void* memory, ULONG size) {
+		_header = (SharedChannelHeader*)memory;
+		_data = (UCHAR*)memory + sizeof(SharedChannelHeader);
+		_size = size;
+		_write = 0;
+	}
+
+	SharedChannelSlot* Slot(ULONG offset) const {
+		return (SharedChannelSlot*)(_data + offset);
+	}
+
+	void Release(SharedChannelSlot* slot, ULONG length) {
+		// all of it, a later slot may start anywhere in there; the index moves
+		// only once it's clear, or a producer could reserve it under our feet
+		::memset(slot, 0, length);
+		WriteULongRelease(&_header->ReadIndex, ReadULongNoFence(&_header->ReadIndex) + length);
+	}
+
+	// raises the header's WriteIndex to ours. a client scribbling over it only
+	// confuses its own reads, so after a few tries this gives up rather than spin
+	void Publish() {
+		for (int i = 0; i < 4; i++) {
+			auto write = ReadULongAcquire(&_write);
+			auto published = ReadULongAcquire(&_header->WriteIndex);
+			if ((LONG)(published - write) >= 0 ||
+				(ULONG)InterlockedCompareExchange((volatile LONG*)&_header->WriteIndex, (LONG)write, (LONG)published) == published)
+				return;
+		}
+	}
+
+private:
+	SharedChannelHeader* _header;
+	UCHAR* _data;
+	ULONG _size;
+	volatile ULONG _write;		// producers' own, the header's is a copy
+};
@@ -0,0 +1,503 @@
+#pragma once
+
+#include "Platform.h"
+#include "SysMonCommon.h"
+#include "TimeSource.h"
+#include "CommandLineDefinitions.h"
+#include <string>
+#include <vector>
+
+//
+// what is running right now, kept up to date from the event stream: processes with
+// their parent and command line, their live threads and the images they loaded.
+// processes, threads and image names are found through open addressing tables
+// (linear probing; a delete shifts the rest of its run back, so there are no tombstones).
+// the records themselves sit in arrays with free lists, so their indices stay put
+// and a process' threads and modules are chained through them. every event costs O(1),
+// a process exit also frees what the process had, which its own events put there.
+// processes and threads that were running before monitoring started show up with their
+// first event, without a parent or command line. SysMon doesn't report image unloads,
+// modules go with their process.
+// user mode only (Windows or POSIX).
+//
+
+const ULONG StateNone = 0xffffffff;
+
+// id (process, thread, string) -> record index
+class IdTable {
+public:
+	// capacity must be a power of 2, the table doubles when 3/4 full
+	void Init(ULONG capacity) {
+		_slots.assign(capacity, Slot{ StateNone, StateNone });
+		_mask = capacity - 1;
+		_shift = 32;
+		while (capacity > 1) {
+			_shift--;
+			capacity >>= 1;
+		}
+		_count = 0;
+	}
+
+	ULONG Find(ULONG id) const {
+		for (auto i = Home(id); ; i = (i + 1) & _mask) {
+			auto& slot = _slots[i];
+			if (slot.Id == id)
+				return slot.Index;
+			if (slot.Id == StateNone)
+				return StateNone;
+		}
+	}
+
+	// id must not be in the table
+	void Insert(ULONG id, ULONG index) {
+		if (_count >= _slots.size() / 4 * 3)
+			Grow();
+		auto i = Home(id);
+		while (_slots[i].Id != StateNone)
+			i = (i + 1) & _mask;
+		_slots[i] = { id, index };
+		_count++;
+	}
+
+	void Remove(ULONG id) {
+		auto i = Home(id);
+		for (; _slots[i].Id != id; i = (i + 1) & _mask)
+			if (_slots[i].Id == StateNone)
+				return;
+
+		// move up whatever probed past the hole, there's no other way to find it again
+		for (auto j = i; ; ) {
+			_slots[i].Id = StateNone;
+			for (;;) {
+				j = (j + 1) & _mask;
+				if (_slots[j].Id == StateNone) {
+					_count--;
+					return;
+				}
+				// stays put if its home lies between the hole and where it is
+				if (((j - Home(_slots[j].Id)) & _mask) >= ((j - i) & _mask))
+					break;
+			}
+			_slots[i] = _slots[j];
+			i = j;
+		}
+	}
+
+	ULONG Count() const {
+		return _count;
+	}
+
+private:
+	struct Slot {
+		ULONG Id;			// StateNone: free
+		ULONG Index;
+	};
+
+	// Fibonacci hashing, the top bits: IDs are multiples of 4
+	ULONG Home(ULONG id) const {
+		return _shift < 32 ? (id * 2654435761u) >> _shift : 0;
+	}
+
+	void Grow() {
+		std::vector<Slot> slots;
+		slots.swap(_slots);
+		Init((ULONG)slots.size() * 2);
+		for (auto& slot : slots)
+			if (slot.Id != StateNone)
+				Insert(slot.Id, slot.Index);
+	}
+
+private:
+	std::vector<Slot> _slots;
+	ULONG _mask = 0;
+	ULONG _shift = 32;
+	ULONG _count = 0;
+};
+
+struct ProcessRecord {
+	ULONG ProcessId;			// StateNone: free
+	ULONG ParentProcessId;		// StateNone: running before monitoring started
+	LONGLONG CreateTime;		// system time, 0 if not known
+	std::basic_string<WCHAR> CommandLine;
+	ULONG FirstThread;			// live threads, newest first
+	ULONG ThreadCount;
+	ULONG FirstModule;			// loaded images, newest first
+	ULONG ModuleCount;
+	ULONG SummaryThreads;		// LiveThreads of the last ThreadSummaryInfo, StateNone if none came
+};
+
+struct ThreadRecord {
+	ULONG ThreadId;
+	ULONG Process;				// index
+	ULONG Previous;				// in the process' chain
+	ULONG Next;
+	LONGLONG CreateTime;
+};
+
+struct ModuleRecord {
+	ULONG Name;					// StateTable::Name
+	ULONG Next;
+	ULONG64 Base;
+	ULONG64 Size;
+	LONGLONG LoadTime;
+};
+
+class StateTable {
+public:
+	void Init(ULONG processes = 1024, ULONG threads = 8192) {
+		_processIds.Init(processes);
+		_threadIds.Init(threads);
+		_nameSlots.assign(1024, StateNone);
+		_driverNames.Init(1024);
+		_commandLines.Clear();
+		_processes.clear();
+		_threads.clear();
+		_modules.clear();
+		_freeProcesses.clear();
+		_freeThreads.clear();
+		_freeModules.clear();
+		_names.clear();
+		_moduleCount = 0;
+		SetFormat(SysMonFormatV1);
+	}
+
+	// the format of the records that follow; the state carries on across clients and segments
+	void SetFormat(ULONG format) {
+		_format = format;
+		_clock = {};
+	}
+
+	void Update(const UCHAR* records, ULONG size) {
+		for (ULONG offset = 0; offset + sizeof(ItemHeader) <= size; ) {
+			auto header = (const ItemHeader*)(records + offset);
+			if (header->Size < sizeof(ItemHeader) || header->Size > size - offset)
+				break;
+			Update(header);
+			offset += header->Size;
+		}
+	}
+
+	void Update(const ItemHeader* header) {
+		auto record = (const UCHAR*)header;
+		switch (header->Type) {
+			case ItemType::ProcessCreate:
+			{
+				auto info = (const ProcessCreateInfo*)header;
+				ProcessCreated(header, info->ProcessId, info->ParentProcessId, (const WCHAR*)(record + info->CommandLineOffset),
+					Bounded(header, info->CommandLineOffset, info->CommandLineLength));
+				break;
+			}
+
+			case ItemType::ProcessCreateInterned:
+			{
+				auto info = (const ProcessCreateInternedInfo*)header;
+				auto line = _commandLines.Find(info->CommandLineId);
+				ProcessCreated(header, info->ProcessId, info->ParentProcessId, line ? line->data() : nullptr,
+					line ? (ULONG)line->size() : 0);
+				break;
+			}
+
+			case ItemType::ProcessExit:
+			{
+				auto index = _processIds.Find(((const ProcessExitInfo*)header)->ProcessId);
+				if (index != StateNone)
+					RemoveProcess(index);
+				break;
+			}
+
+			case ItemType::ThreadCreate:
+			{
+				auto info = (const ThreadCreateExitInfo*)header;
+				auto index = _threadIds.Find(info->ThreadId);
+				if (index != StateNone)
+					RemoveThread(index);
+				AddThread(info->ThreadId, Process(info->ProcessId), Time(header));
+				break;
+			}
+
+			case ItemType::ThreadExit:
+			{
+				auto index = _threadIds.Find(((const ThreadCreateExitInfo*)header)->ThreadId);
+				if (index != StateNone)
+					RemoveThread(index);
+				break;
+			}
+
+			case ItemType::ThreadSummary:
+			{
+				auto info = (const ThreadSummaryInfo*)header;
+				if (!info->ProcessExited)
+					_processes[Process(info->ProcessId)].SummaryThreads = info->LiveThreads;
+				break;
+			}
+
+			case ItemType::ImageLoad:
+			{
+				auto info = (const ImageLoadInfo*)header;
+				ULONG length = 0;
+				while (length < MaxImageFileSize && info->ImageFileName[length])
+					length++;
+				AddModule(header, info->ProcessId, Intern(info->ImageFileName, length), info->LoadAddress, info->ImageSize);
+				break;
+			}
+
+			case ItemType::ImageLoadV2:
+			{
+				auto info = (const ImageLoadInfoV2*)header;
+				auto name = Intern((const WCHAR*)(record + info->ImageFileNameOffset),
+					Bounded(header, info->ImageFileNameOffset, info->ImageFileNameLength));
+				AddModule(header, info->ProcessId, name, info->LoadAddress, info->ImageSize);
+				break;
+			}
+
+			case ItemType::StringDefinition:
+			{
+				auto info = (const StringDefinitionInfo*)header;
+				if (_commandLines.IsCommandLine(info->Id)) {
+					_commandLines.Define(info->Id).assign((const WCHAR*)(record + info->Offset), Bounded(header, info->Offset, info->Length));
+					break;
+				}
+				auto name = Intern((const WCHAR*)(record + info->Offset), Bounded(header, info->Offset, info->Length));
+				_driverNames.Remove(info->Id);
+				_driverNames.Insert(info->Id, name);
+				break;
+			}
+
+			case ItemType::ImageLoadInterned:
+			{
+				static const WCHAR unknown[] = { '?' };
+				auto info = (const ImageLoadInternedInfo*)header;
+				auto name = _driverNames.Find(info->ImageNameId);
+				if (name == StateNone)
+					name = Intern(unknown, 1);
+				AddModule(header, info->ProcessId, name, info->LoadAddress, info->ImageSize);
+				break;
+			}
+
+			case ItemType::TimeCalibration:
+			{
+				auto info = (const TimeCalibrationInfo*)header;
+				_clock.Counter = info->Time.QuadPart;
+				_clock.SystemTime = info->SystemTime.QuadPart;
+				_clock.Scale = info->Scale;
+				break;
+			}
+
+			default:
+				break;
+		}
+	}
+
+	//
+	// snapshot queries, straight from the tables
+	//
+
+	ULONG Processes() const {
+		return _processIds.Count();
+	}
+
+	ULONG Threads() const {
+		return _threadIds.Count();
+	}
+
+	ULONG Modules() const {
+		return _moduleCount;
+	}
+
+	const ProcessRecord* FindProcess(ULONG processId) const {
+		auto index = _processIds.Find(processId);
+		return index == StateNone ? nullptr : &_processes[index];
+	}
+
+	// visit(const ProcessRecord&), in no particular order
+	template<typename Visit>
+	void ForEachProcess(Visit&& visit) const {
+		for (auto& process : _processes)
+			if (process.ProcessId != StateNone)
+				visit(process);
+	}
+
+	// visit(const ThreadRecord&)
+	template<typename Visit>
+	void ForEachThread(const ProcessRecord& process, Visit&& visit) const {
+		for (auto index = process.FirstThread; index != StateNone; index = _threads[index].Next)
+			visit(_threads[index]);
+	}
+
+	// visit(const ModuleRecord&)
+	template<typename Visit>
+	void ForEachModule(const ProcessRecord& process, Visit&& visit) const {
+		for (auto index = process.FirstModule; index != StateNone; index = _modules[index].Next)
+			visit(_modules[index]);
+	}
+
+	const std::basic_string<WCHAR>& Name(ULONG name) const {
+		return _names[name].Text;
+	}
+
+private:
+	struct NameEntry {
+		ULONG Hash;
+		std::basic_string<WCHAR> Text;
+	};
+
+	template<typename Record>
+	static ULONG Allocate(std::vector<Record>& records, std::vector<ULONG>& free) {
+		if (free.empty()) {
+			records.emplace_back();
+			return (ULONG)records.size() - 1;
+		}
+		auto index = free.back();
+		free.pop_back();
+		return index;
+	}
+
+	ULONG AddProcess(ULONG processId) {
+		auto index = Allocate(_processes, _freeProcesses);
+		auto& process = _processes[index];
+		process.ProcessId = processId;
+		process.ParentProcessId = StateNone;
+		process.CreateTime = 0;
+		process.CommandLine.clear();		// keeps its buffer for the next one
+		process.FirstThread = process.FirstModule = StateNone;
+		process.ThreadCount = process.ModuleCount = 0;
+		process.SummaryThreads = StateNone;
+		_processIds.Insert(processId, index);
+		return index;
+	}
+
+	void ProcessCreated(const ItemHeader* header, ULONG processId, ULONG parentId, const WCHAR* commandLine, ULONG length) {
+		// the ID came back around, the exit got lost
+		auto index = _processIds.Find(processId);
+		if (index != StateNone)
+			RemoveProcess(index);
+
+		index = AddProcess(processId);
+		auto& process = _processes[index];
+		process.ParentProcessId = parentId;
+		process.CreateTime = Time(header);
+		if (length)
+			process.CommandLine.assign(commandLine, length);
+	}
+
+	// the process' index, added if it isn't known yet
+	ULONG Process(ULONG processId) {
+		auto index = _processIds.Find(processId);
+		return index != StateNone ? index : AddProcess(processId);
+	}
+
+	void RemoveProcess(ULONG index) {
+		auto& process = _processes[index];
+		while (process.FirstThread != StateNone)
+			RemoveThread(process.FirstThread);
+		for (auto module = process.FirstModule; module != StateNone; module = _modules[module].Next)
+			_freeModules.push_back(module);
+		_moduleCount -= process.ModuleCount;
+
+		_processIds.Remove(process.ProcessId);
+		process.ProcessId = StateNone;
+		_freeProcesses.push_back(index);
+	}
+
+	void AddThread(ULONG threadId, ULONG processIndex, LONGLONG time) {
+		auto index = Allocate(_threads, _freeThreads);
+		auto& process = _processes[processIndex];
+		auto& thread = _threads[index];
+		thread = { threadId, processIndex, StateNone, process.FirstThread, time };
+		if (process.FirstThread != StateNone)
+			_threads[process.FirstThread].Previous = index;
+		process.FirstThread = index;
+		process.ThreadCount++;
+		_threadIds.Insert(threadId, index);
+	}
+
+	void RemoveThread(ULONG index) {
+		auto& thread = _threads[index];
+		auto& process = _processes[thread.Process];
+		if (thread.Previous != StateNone)
+			_threads[thread.Previous].Next = thread.Next;
+		else
+			process.FirstThread = thread.Next;
+		if (thread.Next != StateNone)
+			_threads[thread.Next].Previous = thread.Previous;
+		process.ThreadCount--;
+
+		_threadIds.Remove(thread.ThreadId);
+		_freeThreads.push_back(index);
+	}
+
+	void AddModule(const ItemHeader* header, ULONG processId, ULONG name, void* base, ULONG_PTR size) {
+		auto index = Allocate(_modules, _freeModules);
+		auto& process = _processes[Process(processId)];
+		_modules[index] = { name, process.FirstModule, (ULONG64)(ULONG_PTR)base, size, Time(header) };
+		process.FirstModule = index;
+		process.ModuleCount++;
+		_moduleCount++;
+	}
+
+	// image paths repeat across processes, each is kept once
+	ULONG Intern(const WCHAR* text, ULONG length) {
+		// FNV-1a over the length and the last characters, like InternTable
+		const ULONG HashedChars = 32;
+		ULONG hash = (2166136261 ^ length) * 16777619;
+		for (ULONG i = length > HashedChars ? length - HashedChars : 0; i < length; i++)
+			hash = (hash ^ text[i]) * 16777619;
+
+		if (_names.size() >= _nameSlots.size() / 4 * 3)
+			GrowNames();
+		auto mask = (ULONG)_nameSlots.size() - 1;
+		for (auto i = hash & mask; ; i = (i + 1) & mask) {
+			auto name = _nameSlots[i];
+			if (name == StateNone) {
+				name = _nameSlots[i] = (ULONG)_names.size();
+				_names.push_back({ hash, std::basic_string<WCHAR>(text, length) });
+				return name;
+			}
+			auto& entry = _names[name];
+			if (entry.Hash == hash && entry.Text.size() == length && ::memcmp(entry.Text.data(), text, length * sizeof(WCHAR)) == 0)
+				return name;
+		}
+	}
+
+	void GrowNames() {
+		_nameSlots.assign(_nameSlots.size() * 2, StateNone);
+		auto mask = (ULONG)_nameSlots.size() - 1;
+		for (ULONG name = 0; name < _names.size(); name++) {
+			auto i = _names[name].Hash & mask;
+			while (_nameSlots[i] != StateNone)
+				i = (i + 1) & mask;
+			_nameSlots[i] = name;
+		}
+	}
+
+	LONGLONG Time(const ItemHeader* header) const {
+		if (_format < SysMonFormatV4)
+			return header->Time.QuadPart;
+		return _clock.Scale ? _clock.ToSystemTime(header->Time.QuadPart) : 0;
+	}
+
+	// a string's length in WCHARs, as far as it stays inside the record
+	static ULONG Bounded(const ItemHeader* header, ULONG offset, ULONG length) {
+		if (offset > header->Size)
+			return 0;
+		auto room = (header->Size - offset) / sizeof(WCHAR);
+		return length < room ? length : (ULONG)room;
+	}
+
+private:
+	IdTable _processIds;
+	IdTable _threadIds;
+	IdTable _driverNames;			// v3 image name ids -> names
+	CommandLineDefinitions<std::basic_string<WCHAR>> _commandLines;	// v5
+	std::vector<ProcessRecord> _processes;
+	std::vector<ThreadRecord> _threads;
+	std::vector<ModuleRecord> _modules;
+	std::vector<ULONG> _freeProcesses;
+	std::vector<ULONG> _freeThreads;
+	std::vector<ULONG> _freeModules;
+	std::vector<NameEntry> _names;
+	std::vector<ULONG> _nameSlots;	// open addressing by hash, StateNone: free
+	ULONG _moduleCount = 0;
+	ULONG _format = SysMonFormatV1;
+	TimeScale _clock = {};
+};
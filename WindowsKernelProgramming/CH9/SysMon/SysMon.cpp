@@ -5,21 +5,213 @@
 #include "AutoLock.h"
 
 DRIVER_UNLOAD SysMonUnload;
-DRIVER_DISPATCH SysMonCreateClose, SysMonRead;
+DRIVER_DISPATCH SysMonCreate, SysMonClose, SysMonCleanup, SysMonRead, SysMonDeviceControl;
 void OnProcessNotify(_Inout_ PEPROCESS Process, _In_ HANDLE ProcessId, _Inout_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo);
 void OnThreadNotify(_In_ HANDLE ProcessId, _In_ HANDLE ThreadId, _In_ BOOLEAN Create);
 void OnImageLoadNotify(_In_opt_ PUNICODE_STRING FullImageName, _In_ HANDLE ProcessId, _In_ PIMAGE_INFO ImageInfo);
-void PushItem(LIST_ENTRY* entry);
+void PushItem(ItemHeader* item);
 NTSTATUS OnRegistryNotify(PVOID context, PVOID arg1, PVOID arg2);
+NTSTATUS CompleteRead(PIRP Irp);
+void ReadCompletionThread(PVOID);
+void WakeReadThread();
+void StopReadThread();
+ItemHeader* AllocateItem(ItemType type, ULONG size);
+NTSTATUS MapChannel(PFILE_OBJECT owner, const SysMonChannelRequest& request, SysMonChannelMapping& mapping);
+void UnmapChannel();
+void PushImageLoadV2(PUNICODE_STRING FullImageName, HANDLE ProcessId, PIMAGE_INFO ImageInfo);
+bool PushImageLoadInterned(PUNICODE_STRING FullImageName, HANDLE ProcessId, PIMAGE_INFO ImageInfo);
+bool PushProcessCreateInterned(HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO CreateInfo, USHORT length);
+InternEntry* UnsentString(const Consumer* consumer, ItemHeader* item);
+void UnpinCommandLine(ItemHeader* item);
+bool AttachConsumer(Consumer* consumer);
+void UpdateFormat();
+ULONG DefinitionSize(const InternEntry* entry);
+ULONG WriteDefinition(UCHAR* buffer, ItemHeader* item);
+LONG64 CurrentThreadLifetime();
+ULONG FlushThreadSummaries();
+bool RateAllows(ItemType type, ULONG processId);
+ULONG FlushRateSummary();
+void StampTime(ItemHeader& item);
+LONG64 CurrentStamp();
+void RecordRead(const UCHAR* buffer, ULONG size);
+ULONG RefreshClock();
+ULONG WriteCalibration(UCHAR* buffer);
+void ConvertTimes(UCHAR* buffer, ULONG size);
+struct KeyContext;
+KeyContext* AttachKeyContext(PVOID object, PCUNICODE_STRING name);
+bool KeyAllowed(KeyContext* context);
+void OnRegistrySetValue(REG_POST_OPERATION_INFORMATION* args);
+void PushRegistrySetValue(PCUNICODE_STRING keyName, REG_SET_VALUE_KEY_INFORMATION* preInfo);
+void PushRegistrySetValueV2(PCUNICODE_STRING keyName, REG_SET_VALUE_KEY_INFORMATION* preInfo);
 
 Globals g_Globals;
 
+// preallocated records per type; anything beyond falls back to the pool
+const ItemPoolClass PoolClasses[] = {
+	{ ItemType::ProcessCreate, sizeof(ProcessCreateInfo) + 512 * sizeof(WCHAR), 256 },
+	{ ItemType::ProcessExit, sizeof(ProcessExitInfo), 256 },
+	{ ItemType::ThreadCreate, sizeof(ThreadCreateExitInfo), 4096 },
+	{ ItemType::ThreadExit, sizeof(ThreadCreateExitInfo), 4096 },
+	{ ItemType::ImageLoad, sizeof(ImageLoadInfo), 1024 },
+	{ ItemType::RegistrySetValue, sizeof(RegistrySetValueInfo), 512 },
+	{ ItemType::ImageLoadV2, sizeof(ImageLoadInfoV2) + 128 * sizeof(WCHAR), 1024 },
+	{ ItemType::RegistrySetValueV2, sizeof(RegistrySetValueInfoV2) + 128 * sizeof(WCHAR) + MaxRegistryDataSizeV2, 512 },
+	{ ItemType::ImageLoadInterned, sizeof(ImageLoadInternedInfo), 1024 },
+	{ ItemType::ThreadSummary, sizeof(ThreadSummaryInfo), 256 },
+	{ ItemType::RateSummary, sizeof(RateSummaryInfo), 16 },
+	{ ItemType::ProcessCreateInterned, sizeof(ProcessCreateInternedInfo), 256 },
+};
+
+const ULONG ThreadCapacity = 1024;		// processes with thread counters, power of 2
+const ULONG MinSummaryIntervalMs = 100;
+const ULONG RateCapacity = 256;			// processes with their own buckets, power of 2
+const ULONG CalibrationIntervalMs = 1000;
+const ULONG MaxCachedKeyName = 1024;	// WCHARs, longer key names are looked up every time
+
+// a key object's name and the key filter's verdict on it, kept with the object
+struct KeyContext {
+	KeyContext* Next;			// lost a race to attach, freed with this one
+	volatile LONG Verdict;		// key filter generation << 1 | allowed, 0: not known yet
+	USHORT NameLength;			// WCHARs
+	WCHAR Name[1];
+};
+
+// a notify routine's time from entry to return, filtered out or not. without an invariant
+// TSC the two stamps are system time queries, too dear for every call, so a sample is timed
+ULONG CallbackSampling() {
+	return g_Globals.CounterTime ? 1 : EventStats::SlowClockSampling;
+}
+
+struct CallbackTimer {
+	CallbackTimer() : Cpu(KeGetCurrentProcessorNumberEx(nullptr)), Timed(g_Globals.Stats.Sample(Cpu, CallbackSampling())),
+		Start(Timed ? CurrentStamp() : 0) {}
+
+	~CallbackTimer() {
+		if (!Timed)
+			return;
+		auto elapsed = CurrentStamp() - Start;
+		g_Globals.Stats.Record(Cpu, EventHistogram::Callback, elapsed > 0 ? (ULONG64)elapsed : 0);
+	}
+
+	ULONG Cpu;
+	bool Timed;
+	LONG64 Start;
+};
+
+extern "C" NTSYSAPI NTSTATUS NTAPI ZwQueryInformationThread(HANDLE ThreadHandle, THREADINFOCLASS ThreadInformationClass,
+	PVOID ThreadInformation, ULONG ThreadInformationLength, PULONG ReturnLength);
+
 extern "C" NTSTATUS
 DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING) {
 	auto status = STATUS_SUCCESS;
 
-	InitializeListHead(&g_Globals.ItemsHead);
+	// rings for every possible CPU, so hot-added processors get their own too
+	auto cpuCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	auto ringSize = ItemQueue::RingCount(cpuCount) * sizeof(ItemQueue::Ring);
+	g_Globals.RingBuffers = (ItemQueue::Ring*)ExAllocatePoolWithTag(NonPagedPool, ringSize + SharedLogCapacity * sizeof(ItemHeader*), DRIVER_TAG);
+	if (g_Globals.RingBuffers == nullptr) {
+		KdPrint((DRIVER_PREFIX "failed to allocate event rings\n"));
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	g_Globals.Queue.Init(g_Globals.RingBuffers, cpuCount, &g_Globals.Pool, &g_Globals.Mutex);
+	g_Globals.Queue.InitLog((ItemHeader**)((UCHAR*)g_Globals.RingBuffers + ringSize), SharedLogCapacity);
+	// a storm of thread events mustn't push out the process creates
+	g_Globals.Queue.Limits.Policy = SysMonOverflowPolicy::DropLowestPriority;
 	g_Globals.Mutex.Init();
+	InitializeListHead(&g_Globals.Consumers);
+	g_Globals.ConsumerMutex.Init();
+	g_Globals.PendingReads.Init();
+	g_Globals.ReadWake.Init();
+	g_Globals.ReadMode = { FALSE, 1, 100 };
+	g_Globals.Format = SysMonFormatV1;		// until a client asks for something newer
+	g_Globals.Filter.Init();
+	g_Globals.Expression.Init();
+	g_Globals.FilterMutex.Init();
+	if (!g_Globals.Keys.Init(DRIVER_TAG)) {
+		ExFreePool(g_Globals.RingBuffers);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	g_Globals.ClockMutex.Init();
+
+	// without an invariant TSC every record gets KeQuerySystemTimePrecise, and no v4
+	g_Globals.CounterTime = TimeCounterIsReliable();
+	if (g_Globals.CounterTime)
+		g_Globals.Clock.Init();
+
+	// no channel yet, so producers can't get in until one is mapped
+	g_Globals.ChannelRundown = ExAllocateCacheAwareRundownProtection(NonPagedPool, DRIVER_TAG);
+	if (g_Globals.ChannelRundown == nullptr) {
+		ExFreePool(g_Globals.RingBuffers);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	ExWaitForRundownProtectionReleaseCacheAware(g_Globals.ChannelRundown);
+
+	if (!g_Globals.Pool.Init(PoolClasses, ARRAYSIZE(PoolClasses), DRIVER_TAG)) {
+		KdPrint((DRIVER_PREFIX "failed to allocate record slabs\n"));
+		ExFreeCacheAwareRundownProtection(g_Globals.ChannelRundown);
+		ExFreePool(g_Globals.RingBuffers);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if (!g_Globals.ImageNames.Init(ImageNameCapacity, DRIVER_TAG)) {
+		KdPrint((DRIVER_PREFIX "failed to allocate image name table\n"));
+		g_Globals.Pool.Destroy();
+		ExFreeCacheAwareRundownProtection(g_Globals.ChannelRundown);
+		ExFreePool(g_Globals.RingBuffers);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if (!g_Globals.CommandLines.Init(SysMonCommandLineCapacity, DRIVER_TAG)) {
+		KdPrint((DRIVER_PREFIX "failed to allocate command line table\n"));
+		g_Globals.ImageNames.Destroy();
+		g_Globals.Pool.Destroy();
+		ExFreeCacheAwareRundownProtection(g_Globals.ChannelRundown);
+		ExFreePool(g_Globals.RingBuffers);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	g_Globals.Pool.SetRelease(ItemType::ProcessCreateInterned, UnpinCommandLine);
+	g_Globals.CommandLineMutex.Init();
+	g_Globals.CommandLineMax = SysMonCommandLineMaxLength;
+
+	g_Globals.Summaries = (ThreadCounters*)ExAllocatePoolWithTag(NonPagedPool, ThreadCapacity * sizeof(ThreadCounters), DRIVER_TAG);
+	if (g_Globals.Summaries == nullptr || !g_Globals.Threads.Init(ThreadCapacity, DRIVER_TAG)) {
+		KdPrint((DRIVER_PREFIX "failed to allocate thread counters\n"));
+		if (g_Globals.Summaries)
+			ExFreePool(g_Globals.Summaries);
+		g_Globals.CommandLines.Destroy();
+		g_Globals.ImageNames.Destroy();
+		g_Globals.Pool.Destroy();
+		ExFreeCacheAwareRundownProtection(g_Globals.ChannelRundown);
+		ExFreePool(g_Globals.RingBuffers);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	g_Globals.SummaryIntervalMs = 1000;
+
+	if (!g_Globals.Limiter.Init(RateCapacity, DRIVER_TAG)) {
+		KdPrint((DRIVER_PREFIX "failed to allocate rate limiter\n"));
+		g_Globals.Threads.Destroy();
+		ExFreePool(g_Globals.Summaries);
+		g_Globals.CommandLines.Destroy();
+		g_Globals.ImageNames.Destroy();
+		g_Globals.Pool.Destroy();
+		ExFreeCacheAwareRundownProtection(g_Globals.ChannelRundown);
+		ExFreePool(g_Globals.RingBuffers);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	g_Globals.RateIntervalMs = 1000;
+
+	if (!g_Globals.Stats.Init(cpuCount, DRIVER_TAG)) {
+		KdPrint((DRIVER_PREFIX "failed to allocate latency stats\n"));
+		g_Globals.Limiter.Destroy();
+		g_Globals.Threads.Destroy();
+		ExFreePool(g_Globals.Summaries);
+		g_Globals.CommandLines.Destroy();
+		g_Globals.ImageNames.Destroy();
+		g_Globals.Pool.Destroy();
+		ExFreeCacheAwareRundownProtection(g_Globals.ChannelRundown);
+		ExFreePool(g_Globals.RingBuffers);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
 
 	PDEVICE_OBJECT DeviceObject = nullptr;
 	UNICODE_STRING symLink = RTL_CONSTANT_STRING(L"\\??\\sysmon");
@@ -28,7 +220,7 @@ DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING) {
 
 	do {
 		UNICODE_STRING devName = RTL_CONSTANT_STRING(L"\\Device\\sysmon");
-		status = IoCreateDevice(DriverObject, 0, &devName, FILE_DEVICE_UNKNOWN, 0, TRUE, &DeviceObject);
+		status = IoCreateDevice(DriverObject, 0, &devName, FILE_DEVICE_UNKNOWN, 0, FALSE, &DeviceObject);
 		if (!NT_SUCCESS(status)) {
 			KdPrint((DRIVER_PREFIX "failed to create device (0x%08X)\n", status));
 			break;
@@ -42,6 +234,15 @@ DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING) {
 		}
 		symLinkCreated = true;
 
+		HANDLE hThread;
+		status = PsCreateSystemThread(&hThread, THREAD_ALL_ACCESS, nullptr, nullptr, nullptr, ReadCompletionThread, nullptr);
+		if (!NT_SUCCESS(status)) {
+			KdPrint((DRIVER_PREFIX "failed to create read thread (0x%08X)\n", status));
+			break;
+		}
+		ObReferenceObjectByHandle(hThread, SYNCHRONIZE, *PsThreadType, KernelMode, (PVOID*)&g_Globals.ReadThread, nullptr);
+		ZwClose(hThread);
+
 		status = PsSetCreateProcessNotifyRoutineEx(OnProcessNotify, FALSE);
 		if (!NT_SUCCESS(status)) {
 			KdPrint((DRIVER_PREFIX "failed to register process callback (0x%08X)\n", status));
@@ -78,31 +279,193 @@ DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING) {
 			PsRemoveCreateThreadNotifyRoutine(OnThreadNotify);
 		if (processCallbacks)
 			PsSetCreateProcessNotifyRoutineEx(OnProcessNotify, TRUE);
+		if (g_Globals.ReadThread)
+			StopReadThread();
 		if (symLinkCreated)
 			IoDeleteSymbolicLink(&symLink);
 		if (DeviceObject)
 			IoDeleteDevice(DeviceObject);
+		g_Globals.Stats.Destroy();
+		g_Globals.Limiter.Destroy();
+		g_Globals.Threads.Destroy();
+		ExFreePool(g_Globals.Summaries);
+		g_Globals.CommandLines.Destroy();
+		g_Globals.ImageNames.Destroy();
+		g_Globals.Pool.Destroy();
+		ExFreeCacheAwareRundownProtection(g_Globals.ChannelRundown);
+		ExFreePool(g_Globals.RingBuffers);
 	}
 
 	DriverObject->DriverUnload = SysMonUnload;
-	DriverObject->MajorFunction[IRP_MJ_CREATE] = DriverObject->MajorFunction[IRP_MJ_CLOSE] = SysMonCreateClose;
+	DriverObject->MajorFunction[IRP_MJ_CREATE] = SysMonCreate;
+	DriverObject->MajorFunction[IRP_MJ_CLOSE] = SysMonClose;
+	DriverObject->MajorFunction[IRP_MJ_CLEANUP] = SysMonCleanup;
 	DriverObject->MajorFunction[IRP_MJ_READ] = SysMonRead;
+	DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = SysMonDeviceControl;
+
+	return status;
+}
+
+NTSTATUS SysMonCreate(PDEVICE_OBJECT, PIRP Irp) {
+	// every handle reads on its own, from wherever the queue is when it starts
+	auto status = STATUS_SUCCESS;
+	auto consumer = (Consumer*)ExAllocatePoolWithTag(NonPagedPool, sizeof(Consumer), DRIVER_TAG);
+	if (consumer == nullptr) {
+		status = STATUS_INSUFFICIENT_RESOURCES;
+	}
+	else {
+		RtlZeroMemory(consumer, sizeof(Consumer));
+		consumer->FileObject = IoGetCurrentIrpStackLocation(Irp)->FileObject;
+		consumer->ReadOrder.Init();
+		consumer->FileObject->FsContext = consumer;
+		AutoLock locker(g_Globals.ConsumerMutex);
+		InsertTailList(&g_Globals.Consumers, &consumer->Link);
+	}
 
+	Irp->IoStatus.Status = status;
+	Irp->IoStatus.Information = 0;
+	IoCompleteRequest(Irp, 0);
 	return status;
 }
 
-NTSTATUS SysMonCreateClose(PDEVICE_OBJECT, PIRP Irp) {
+NTSTATUS SysMonClose(PDEVICE_OBJECT, PIRP Irp) {
+	auto consumer = (Consumer*)IoGetCurrentIrpStackLocation(Irp)->FileObject->FsContext;
+	if (consumer)
+		ExFreePool(consumer);
+
 	Irp->IoStatus.Status = STATUS_SUCCESS;
 	Irp->IoStatus.Information = 0;
 	IoCompleteRequest(Irp, 0);
 	return STATUS_SUCCESS;
 }
 
+NTSTATUS SysMonCleanup(PDEVICE_OBJECT, PIRP Irp) {
+	// the handle is going away, fail reads still waiting on it
+	auto fileObject = IoGetCurrentIrpStackLocation(Irp)->FileObject;
+	PIRP pending;
+	while ((pending = g_Globals.PendingReads.RemoveNext(fileObject)) != nullptr) {
+		pending->IoStatus.Status = STATUS_CANCELLED;
+		pending->IoStatus.Information = 0;
+		IoCompleteRequest(pending, 0);
+	}
+
+	// what only this handle still had to read is freed, the others may get a newer format
+	auto consumer = (Consumer*)fileObject->FsContext;
+	{
+		AutoLock locker(g_Globals.ConsumerMutex);
+		consumer->Closed = true;
+		RemoveEntryList(&consumer->Link);
+		if (consumer->Cursor.Attached)
+			g_Globals.Queue.Detach(&consumer->Cursor);
+		UpdateFormat();
+	}
+
+	if (g_Globals.ChannelOwner == fileObject) {
+		// usually we're in the owner's process, UnmapChannel attaches to it otherwise
+		AutoLock locker(g_Globals.Mutex);
+		if (g_Globals.ChannelOwner == fileObject)
+			UnmapChannel();
+	}
+
+	Irp->IoStatus.Status = STATUS_SUCCESS;
+	Irp->IoStatus.Information = 0;
+	IoCompleteRequest(Irp, 0);
+	return STATUS_SUCCESS;
+}
+
+ULONG CurrentTimeMs() {
+	return (ULONG)(KeQueryInterruptTime() / 10000);
+}
+
 NTSTATUS SysMonRead(PDEVICE_OBJECT, PIRP Irp) {
+	auto consumer = (Consumer*)IoGetCurrentIrpStackLocation(Irp)->FileObject->FsContext;
+	if (!AttachConsumer(consumer)) {
+		Irp->IoStatus.Status = STATUS_CANCELLED;
+		Irp->IoStatus.Information = 0;
+		IoCompleteRequest(Irp, 0);
+		return STATUS_CANCELLED;
+	}
+
+	// a client with several overlapped reads gets its buffers filled in the order it issued
+	// them: with one of them parked, the ones after it wait their turn
+	AutoLock order(consumer->ReadOrder);
+	if (g_Globals.PendingReads.Holds(consumer->FileObject) ||
+		(g_Globals.ReadMode.Blocking && g_Globals.Queue.Available(&consumer->Cursor) < g_Globals.ReadMode.BatchCount)) {
+		// park the read, the read thread completes it once enough events are queued
+		if (g_Globals.PendingReads.Count() == 0)
+			g_Globals.ParkTime = CurrentTimeMs();
+		g_Globals.PendingReads.Insert(Irp);
+		WakeReadThread();
+		return STATUS_PENDING;
+	}
+
+	return CompleteRead(Irp);
+}
+
+// the first read on a handle starts its cursor; false once the handle is going away
+bool AttachConsumer(Consumer* consumer) {
+	if (consumer->Cursor.Attached)
+		return true;
+
+	AutoLock locker(g_Globals.ConsumerMutex);
+	if (consumer->Closed)
+		return false;
+	if (!consumer->Cursor.Attached) {
+		g_Globals.Queue.Attach(&consumer->Cursor);
+		UpdateFormat();
+	}
+	return true;
+}
+
+// records are laid out for the oldest format a reader asked for, newer clients read
+// older layouts. handles that never read nor asked don't count. ConsumerMutex held
+void UpdateFormat() {
+	ULONG format = 0;
+	for (auto link = g_Globals.Consumers.Flink; link != &g_Globals.Consumers; link = link->Flink) {
+		auto consumer = CONTAINING_RECORD(link, Consumer, Link);
+		if (consumer->Format == 0 && !consumer->Cursor.Attached)
+			continue;
+		auto wanted = consumer->Format ? consumer->Format : SysMonFormatV1;
+		if (format == 0 || wanted < format)
+			format = wanted;
+	}
+	if (format)
+		g_Globals.Format = format;
+}
+
+// puts an image path's (v3) or a command line's (v5) definition in front of the first
+// record this client gets that uses it
+struct StringDefinitions {
+	Consumer* Reader;
+
+	ULONG Size(ItemHeader* item) {
+		auto text = UnsentString(Reader, item);
+		return text ? DefinitionSize(text) : 0;
+	}
+
+	void Taken(ItemHeader* item) {
+		// a handle's reads take turns on the lock, so this is the one read to send it
+		if (item->Type == ItemType::ProcessCreateInterned) {
+			auto id = ((ProcessCreateInternedInfo*)item)->CommandLineId;
+			Reader->LinesSent[g_Globals.CommandLines.Slot(id)] = id;
+			return;
+		}
+		auto id = ((ImageLoadInternedInfo*)item)->ImageNameId - 1;
+		Reader->NamesSent[id / 32] |= 1u << (id % 32);
+	}
+
+	ULONG Write(UCHAR* buffer, ItemHeader* item) {
+		return WriteDefinition(buffer, item);
+	}
+};
+
+NTSTATUS CompleteRead(PIRP Irp) {
 	auto stack = IoGetCurrentIrpStackLocation(Irp);
+	auto consumer = (Consumer*)stack->FileObject->FsContext;
+	auto format = consumer->Format ? consumer->Format : SysMonFormatV1;
 	auto len = stack->Parameters.Read.Length;
 	auto status = STATUS_SUCCESS;
-	auto count = 0;
+	ULONG count = 0;
 	NT_ASSERT(Irp->MdlAddress);		// we're using Direct I/O
 
 	auto buffer = (UCHAR*)MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
@@ -110,34 +473,619 @@ NTSTATUS SysMonRead(PDEVICE_OBJECT, PIRP Irp) {
 		status = STATUS_INSUFFICIENT_RESOURCES;
 	}
 	else {
-		AutoLock locker(g_Globals.Mutex);
-		while (true) {
-			if (IsListEmpty(&g_Globals.ItemsHead))	// can also check g_Globals.ItemCount
+		RefreshClock();
+
+		// v4 clients convert times themselves, the calibration goes ahead of the records using it
+		ULONG calibration = 0;
+		if (format >= SysMonFormatV4 && len >= sizeof(TimeCalibrationInfo)) {
+			auto generation = (LONG)g_Globals.Clock.Generation();
+			if (InterlockedExchange(&consumer->CalibrationSent, generation) != generation)
+				calibration = WriteCalibration(buffer);
+		}
+
+		// producers evicting on overflow only try the reader lock, Read holds it briefly.
+		// a queued record keeps its command line pinned, so process creates don't wait on the read
+		StringDefinitions definitions{ consumer };
+		count = calibration + g_Globals.Queue.Read(buffer + calibration, len - calibration, definitions, &consumer->Cursor);
+		RecordRead(buffer + calibration, count - calibration);
+		if (g_Globals.CounterTime && format < SysMonFormatV4)
+			ConvertTimes(buffer, count);
+	}
+
+	Irp->IoStatus.Status = status;
+	Irp->IoStatus.Information = count;
+	IoCompleteRequest(Irp, 0);
+	return status;
+}
+
+// the image path or command line the record refers to, if this client hasn't been sent it yet
+InternEntry* UnsentString(const Consumer* consumer, ItemHeader* item) {
+	if (item->Type == ItemType::ProcessCreateInterned) {
+		auto id = ((ProcessCreateInternedInfo*)item)->CommandLineId;
+		auto entry = g_Globals.CommandLines.Lookup(id);
+		return entry && consumer->LinesSent[g_Globals.CommandLines.Slot(id)] != id ? entry : nullptr;
+	}
+	if (item->Type != ItemType::ImageLoadInterned)
+		return nullptr;
+
+	auto id = ((ImageLoadInternedInfo*)item)->ImageNameId;
+	auto entry = g_Globals.ImageNames.Lookup(id);
+	if (entry == nullptr)
+		return nullptr;
+	id--;
+	return consumer->NamesSent[id / 32] & (1u << (id % 32)) ? nullptr : entry;
+}
+
+// the pool's release routine for ProcessCreateInterned: the record no longer needs its line
+void UnpinCommandLine(ItemHeader* item) {
+	g_Globals.CommandLines.Unpin(((ProcessCreateInternedInfo*)item)->CommandLineId);
+}
+
+ULONG DefinitionSize(const InternEntry* entry) {
+	return (sizeof(StringDefinitionInfo) + entry->Length * sizeof(WCHAR) + RecordAlignmentV2 - 1) & ~(RecordAlignmentV2 - 1);
+}
+
+ULONG WriteDefinition(UCHAR* buffer, ItemHeader* item) {
+	auto id = item->Type == ItemType::ProcessCreateInterned ? ((ProcessCreateInternedInfo*)item)->CommandLineId
+		: ((ImageLoadInternedInfo*)item)->ImageNameId;
+	auto entry = id & SysMonCommandLineIdBit ? g_Globals.CommandLines.Lookup(id) : g_Globals.ImageNames.Lookup(id);
+	auto& info = *(StringDefinitionInfo*)buffer;
+	info.Type = ItemType::StringDefinition;
+	info.Size = (USHORT)DefinitionSize(entry);
+	info.Time = item->Time;
+	info.Id = id;
+	info.Length = entry->Length;
+	info.Offset = sizeof(info);
+	::memcpy(buffer + sizeof(info), entry->Text, entry->Length * sizeof(WCHAR));
+	::memset(buffer + sizeof(info) + entry->Length * sizeof(WCHAR), 0, info.Size - sizeof(info) - entry->Length * sizeof(WCHAR));
+	return info.Size;
+}
+
+// re-anchors the counter to system time once the interval is up,
+// returns how long until it's due again
+ULONG RefreshClock() {
+	if (!g_Globals.CounterTime)
+		return WaitInfinite;
+
+	AutoLock locker(g_Globals.ClockMutex);
+	auto elapsed = CurrentTimeMs() - g_Globals.LastCalibrationTime;
+	if (elapsed < CalibrationIntervalMs)
+		return CalibrationIntervalMs - elapsed;
+
+	g_Globals.Clock.Calibrate();
+	g_Globals.LastCalibrationTime = CurrentTimeMs();
+	return CalibrationIntervalMs;
+}
+
+ULONG WriteCalibration(UCHAR* buffer) {
+	auto scale = g_Globals.Clock.Current();
+	auto& info = *(TimeCalibrationInfo*)buffer;
+	info.Type = ItemType::TimeCalibration;
+	info.Size = sizeof(info);
+	info.Time.QuadPart = scale.Counter;
+	info.SystemTime.QuadPart = scale.SystemTime;
+	info.Scale = scale.Scale;
+	info.Frequency = scale.Frequency();
+	return sizeof(info);
+}
+
+// how long the records just read were queued and how many came at once;
+// counted here first, the shared counters see one update per bucket
+void RecordRead(const UCHAR* buffer, ULONG size) {
+	if (size == 0)
+		return;
+
+	auto now = CurrentStamp();
+	SysMonHistogram residence, batch;
+	RtlZeroMemory(&residence, sizeof(residence));
+	RtlZeroMemory(&batch, sizeof(batch));
+	for (ULONG offset = 0; offset < size; ) {
+		auto item = (const ItemHeader*)(buffer + offset);
+		// definitions carry their image load's time, they were never queued
+		if (item->Type != ItemType::StringDefinition) {
+			auto queued = now - item->Time.QuadPart;
+			EventStats::Tally(residence, queued > 0 ? (ULONG64)queued : 0);
+		}
+		offset += item->Size;
+	}
+	EventStats::Tally(batch, residence.Count);
+
+	auto cpu = KeGetCurrentProcessorNumberEx(nullptr);
+	g_Globals.Stats.Record(cpu, EventHistogram::Residence, residence);
+	g_Globals.Stats.Record(cpu, EventHistogram::ReadBatch, batch);
+}
+
+// clients before v4 get system time, the queue holds counter values
+void ConvertTimes(UCHAR* buffer, ULONG size) {
+	auto scale = g_Globals.Clock.Current();
+	for (ULONG offset = 0; offset < size; ) {
+		auto item = (ItemHeader*)(buffer + offset);
+		item->Time.QuadPart = scale.ToSystemTime(item->Time.QuadPart);
+		offset += item->Size;
+	}
+}
+
+NTSTATUS SysMonDeviceControl(PDEVICE_OBJECT, PIRP Irp) {
+	auto stack = IoGetCurrentIrpStackLocation(Irp);
+	auto status = STATUS_SUCCESS;
+	ULONG_PTR information = 0;
+
+	switch (stack->Parameters.DeviceIoControl.IoControlCode) {
+		case IOCTL_SYSMON_SET_READ_MODE:
+		{
+			if (stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SysMonReadMode)) {
+				status = STATUS_BUFFER_TOO_SMALL;
 				break;
+			}
+
+			g_Globals.ReadMode = *(SysMonReadMode*)Irp->AssociatedIrp.SystemBuffer;
+			if (g_Globals.ReadMode.BatchCount == 0)
+				g_Globals.ReadMode.BatchCount = 1;
+
+			// let waiting reads re-evaluate with the new settings
+			WakeReadThread();
+			break;
+		}
 
-			auto entry = RemoveHeadList(&g_Globals.ItemsHead);
-			auto info = CONTAINING_RECORD(entry, FullItem<ItemHeader>, Entry);
-			auto size = info->Data.Size;
-			if (len < size) {
-				// user's buffer full, insert item back
-				InsertHeadList(&g_Globals.ItemsHead, entry);
+		case IOCTL_SYSMON_SET_FORMAT:
+		{
+			auto& params = stack->Parameters.DeviceIoControl;
+			if (params.InputBufferLength < sizeof(ULONG) || params.OutputBufferLength < sizeof(ULONG)) {
+				status = STATUS_BUFFER_TOO_SMALL;
 				break;
 			}
-			g_Globals.ItemCount--;
-			::memcpy(buffer, &info->Data, size);
-			len -= size;
-			buffer += size;
-			count += size;
-			ExFreePool(info);
+
+			auto format = (ULONG*)Irp->AssociatedIrp.SystemBuffer;
+			if (*format > SysMonFormatLatest)
+				*format = SysMonFormatLatest;
+			else if (*format < SysMonFormatV1)
+				*format = SysMonFormatV1;
+			if (*format >= SysMonFormatV4 && !g_Globals.CounterTime)
+				*format = SysMonFormatV3;
+			// a new client on this handle, it hasn't seen any image path nor a calibration yet
+			auto consumer = (Consumer*)stack->FileObject->FsContext;
+			AutoLock locker(g_Globals.ConsumerMutex);
+			consumer->Format = *format;
+			RtlZeroMemory(consumer->NamesSent, sizeof(consumer->NamesSent));
+			RtlZeroMemory(consumer->LinesSent, sizeof(consumer->LinesSent));
+			InterlockedExchange(&consumer->CalibrationSent, 0);
+			UpdateFormat();
+			information = sizeof(ULONG);
+			break;
+		}
+
+		case IOCTL_SYSMON_SET_FILTER:
+		{
+			AutoLock locker(g_Globals.FilterMutex);
+			if (!g_Globals.Filter.Set((SysMonFilter*)Irp->AssociatedIrp.SystemBuffer, stack->Parameters.DeviceIoControl.InputBufferLength))
+				status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+
+		case IOCTL_SYSMON_SET_KEY_FILTER:
+		{
+			AutoLock locker(g_Globals.FilterMutex);
+			if (!g_Globals.Keys.Set((SysMonKeyFilter*)Irp->AssociatedIrp.SystemBuffer, stack->Parameters.DeviceIoControl.InputBufferLength))
+				status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+
+		case IOCTL_SYSMON_SET_FILTER_PROGRAM:
+		{
+			AutoLock locker(g_Globals.FilterMutex);
+			if (!g_Globals.Expression.Set((SysMonFilterProgram*)Irp->AssociatedIrp.SystemBuffer, stack->Parameters.DeviceIoControl.InputBufferLength))
+				status = STATUS_INVALID_PARAMETER;
+			break;
 		}
+
+		case IOCTL_SYSMON_SET_QUEUE_LIMITS:
+		{
+			if (stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SysMonQueueLimits)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+
+			auto limits = *(SysMonQueueLimits*)Irp->AssociatedIrp.SystemBuffer;
+			if (limits.Policy > SysMonOverflowPolicy::DropLowestPriority) {
+				status = STATUS_INVALID_PARAMETER;
+				break;
+			}
+			g_Globals.Queue.Limits = limits;
+			break;
+		}
+
+		case IOCTL_SYSMON_SET_AGGREGATION:
+		{
+			if (stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SysMonAggregation)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+
+			auto aggregation = *(SysMonAggregation*)Irp->AssociatedIrp.SystemBuffer;
+			g_Globals.SummaryIntervalMs = aggregation.IntervalMs < MinSummaryIntervalMs ? MinSummaryIntervalMs : aggregation.IntervalMs;
+			if (aggregation.Threads && !g_Globals.AggregateThreads)
+				g_Globals.LastSummaryTime = CurrentTimeMs();
+			InterlockedExchange(&g_Globals.AggregateThreads, aggregation.Threads ? 1 : 0);
+
+			// the read thread picks up the new interval, or flushes what was counted so far
+			WakeReadThread();
+			break;
+		}
+
+		case IOCTL_SYSMON_SET_RATE_LIMITS:
+		{
+			if (stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SysMonRateLimits)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+
+			auto& limits = *(SysMonRateLimits*)Irp->AssociatedIrp.SystemBuffer;
+			AutoLock locker(g_Globals.FilterMutex);
+			// producers hold the process table's lock at DISPATCH_LEVEL, so must we
+			KIRQL irql;
+			KeRaiseIrql(DISPATCH_LEVEL, &irql);
+			auto set = g_Globals.Limiter.Set(limits);
+			KeLowerIrql(irql);
+			if (!set) {
+				status = STATUS_INVALID_PARAMETER;
+				break;
+			}
+			g_Globals.RateIntervalMs = limits.IntervalMs < MinSummaryIntervalMs ? MinSummaryIntervalMs : limits.IntervalMs;
+			g_Globals.LastRateSummaryTime = CurrentTimeMs();
+
+			// the read thread starts (or stops) sending summaries
+			WakeReadThread();
+			break;
+		}
+
+		case IOCTL_SYSMON_GET_QUEUE_STATS:
+		{
+			// clients from before several readers pass the stats without the reader counts
+			auto length = stack->Parameters.DeviceIoControl.OutputBufferLength;
+			if (length < FIELD_OFFSET(SysMonQueueStats, Readers)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+
+			SysMonQueueStats stats;
+			g_Globals.Queue.GetStats(stats);
+			auto consumer = (Consumer*)stack->FileObject->FsContext;
+			stats.Missed = (ULONG)consumer->Cursor.Missed;
+			information = min(length, (ULONG)sizeof(stats));
+			::memcpy(Irp->AssociatedIrp.SystemBuffer, &stats, information);
+			break;
+		}
+
+		case IOCTL_SYSMON_SET_COMMAND_LINE:
+		{
+			if (stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SysMonCommandLineCapture)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+
+			// lines already interned keep their length, new ones are cut to the new limit
+			auto max = ((SysMonCommandLineCapture*)Irp->AssociatedIrp.SystemBuffer)->MaxLength;
+			g_Globals.CommandLineMax = max && max < SysMonCommandLineMaxLength ? max : SysMonCommandLineMaxLength;
+			break;
+		}
+
+		case IOCTL_SYSMON_GET_LATENCY_STATS:
+		{
+			if (stack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(SysMonLatencyStats)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+
+			// summed only now, producers keep their own CPU's counters
+			auto& stats = *(SysMonLatencyStats*)Irp->AssociatedIrp.SystemBuffer;
+			g_Globals.Stats.Collect(stats);
+			stats.Frequency = g_Globals.CounterTime ? g_Globals.Clock.Current().Frequency() : 10000000;
+			SysMonQueueStats queue;
+			g_Globals.Queue.GetStats(queue);
+			for (ULONG i = 0; i < SysMonMaxTypes; i++)
+				stats.Dropped[i] = queue.Dropped[i];
+			stats.CallbackSampling = CallbackSampling();
+			information = sizeof(stats);
+			break;
+		}
+
+		case IOCTL_SYSMON_MAP_CHANNEL:
+		{
+			auto& params = stack->Parameters.DeviceIoControl;
+			if (params.InputBufferLength < sizeof(SysMonChannelRequest) || params.OutputBufferLength < sizeof(SysMonChannelMapping)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+
+			// METHOD_BUFFERED: the same system buffer holds the request and the result
+			auto request = *(SysMonChannelRequest*)Irp->AssociatedIrp.SystemBuffer;
+			auto mapping = (SysMonChannelMapping*)Irp->AssociatedIrp.SystemBuffer;
+			status = MapChannel(stack->FileObject, request, *mapping);
+			if (NT_SUCCESS(status)) {
+				information = sizeof(SysMonChannelMapping);
+				// the read thread keeps the clock calibrated for the channel's producers
+				WakeReadThread();
+			}
+			break;
+		}
+
+		default:
+			status = STATUS_INVALID_DEVICE_REQUEST;
+			break;
 	}
 
 	Irp->IoStatus.Status = status;
-	Irp->IoStatus.Information = count;
+	Irp->IoStatus.Information = information;
 	IoCompleteRequest(Irp, 0);
 	return status;
 }
 
+NTSTATUS MapChannel(PFILE_OBJECT owner, const SysMonChannelRequest& request, SysMonChannelMapping& mapping) {
+	AutoLock locker(g_Globals.Mutex);
+	if (g_Globals.ChannelOwner)
+		return STATUS_SHARING_VIOLATION;
+
+	// power of 2 ring between 64 KB and 64 MB, plus a page for the header
+	ULONG size = 1 << 16;
+	while (size < request.Size && size < (1 << 26))
+		size <<= 1;
+
+	auto status = ObReferenceObjectByHandle((HANDLE)request.Event, EVENT_MODIFY_STATE, *ExEventObjectType,
+		UserMode, (PVOID*)&g_Globals.ChannelEvent, nullptr);
+	if (!NT_SUCCESS(status))
+		return status;
+	g_Globals.ChannelOwner = owner;
+	g_Globals.ChannelProcess = PsGetCurrentProcess();
+	ObReferenceObject(g_Globals.ChannelProcess);
+
+	PHYSICAL_ADDRESS low, high, skip;
+	low.QuadPart = 0;
+	high.QuadPart = -1;
+	skip.QuadPart = 0;
+	g_Globals.ChannelMdl = MmAllocatePagesForMdlEx(low, high, skip, size + PAGE_SIZE, MmCached, MM_ALLOCATE_FULLY_REQUIRED);
+	if (g_Globals.ChannelMdl == nullptr) {
+		UnmapChannel();
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	g_Globals.ChannelKernelAddress = MmMapLockedPagesSpecifyCache(g_Globals.ChannelMdl, KernelMode, MmCached,
+		nullptr, FALSE, NormalPagePriority);
+	__try {
+		g_Globals.ChannelUserAddress = MmMapLockedPagesSpecifyCache(g_Globals.ChannelMdl, UserMode, MmCached,
+			nullptr, FALSE, NormalPagePriority);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER) {
+		g_Globals.ChannelUserAddress = nullptr;
+	}
+	if (g_Globals.ChannelKernelAddress == nullptr || g_Globals.ChannelUserAddress == nullptr) {
+		UnmapChannel();
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	g_Globals.Channel.Init(g_Globals.ChannelKernelAddress, size + PAGE_SIZE);
+	ExReInitializeRundownProtectionCacheAware(g_Globals.ChannelRundown);
+	InterlockedExchange(&g_Globals.ChannelActive, 1);
+
+	mapping.Address = (ULONG64)g_Globals.ChannelUserAddress;
+	mapping.Size = size + PAGE_SIZE;
+	return STATUS_SUCCESS;
+}
+
+// undoes whatever MapChannel got to; called with the reader lock held
+void UnmapChannel() {
+	if (InterlockedExchange(&g_Globals.ChannelActive, 0)) {
+		// wait for producers still writing into the ring
+		ExWaitForRundownProtectionReleaseCacheAware(g_Globals.ChannelRundown);
+		g_Globals.Channel.Detach();
+	}
+
+	if (g_Globals.ChannelUserAddress) {
+		// the view is in the mapping process; the last handle may be closed from
+		// another one (a duplicated handle), so unmap from inside the right one
+		KAPC_STATE apcState;
+		auto attach = PsGetCurrentProcess() != g_Globals.ChannelProcess;
+		if (attach)
+			KeStackAttachProcess(g_Globals.ChannelProcess, &apcState);
+		MmUnmapLockedPages(g_Globals.ChannelUserAddress, g_Globals.ChannelMdl);
+		if (attach)
+			KeUnstackDetachProcess(&apcState);
+		g_Globals.ChannelUserAddress = nullptr;
+	}
+	if (g_Globals.ChannelKernelAddress) {
+		MmUnmapLockedPages(g_Globals.ChannelKernelAddress, g_Globals.ChannelMdl);
+		g_Globals.ChannelKernelAddress = nullptr;
+	}
+	if (g_Globals.ChannelMdl) {
+		MmFreePagesFromMdl(g_Globals.ChannelMdl);
+		ExFreePool(g_Globals.ChannelMdl);
+		g_Globals.ChannelMdl = nullptr;
+	}
+	if (g_Globals.ChannelEvent) {
+		ObDereferenceObject(g_Globals.ChannelEvent);
+		g_Globals.ChannelEvent = nullptr;
+	}
+	if (g_Globals.ChannelProcess) {
+		ObDereferenceObject(g_Globals.ChannelProcess);
+		g_Globals.ChannelProcess = nullptr;
+	}
+	g_Globals.ChannelOwner = nullptr;
+}
+
+void WakeReadThread() {
+	// one signal is enough until the thread gets around to looking
+	if (InterlockedCompareExchange(&g_Globals.WakePosted, 1, 0) == 0)
+		g_Globals.ReadWake.Signal();
+}
+
+// completes the parked reads that are due,
+// returns how long to sleep before checking again
+ULONG CompletePendingReads() {
+	if (g_Globals.PendingReads.Count() == 0)
+		return WaitInfinite;
+
+	auto& mode = g_Globals.ReadMode;
+	auto queued = g_Globals.Queue.Count();
+	auto elapsed = CurrentTimeMs() - g_Globals.ParkTime;
+	if (!mode.Blocking || queued >= mode.BatchCount || (queued > 0 && elapsed >= mode.TimeoutMs)) {
+		InterlockedExchange(&g_Globals.WakeOnAnyEvent, 0);
+		// with several readers the queue may only hold what some of them haven't read,
+		// a read with nothing for its own handle keeps waiting, and the handle's later ones
+		// with it. a handle's reads go oldest first, under its ReadOrder so a new read
+		// can't be completed in between
+		AutoLock consumers(g_Globals.ConsumerMutex);
+		for (auto link = g_Globals.Consumers.Flink; link != &g_Globals.Consumers; link = link->Flink) {
+			auto consumer = CONTAINING_RECORD(link, Consumer, Link);
+			AutoLock order(consumer->ReadOrder);
+			while (!mode.Blocking || g_Globals.Queue.Available(&consumer->Cursor) > 0) {
+				auto irp = g_Globals.PendingReads.RemoveNext(consumer->FileObject);
+				if (irp == nullptr)
+					break;
+				CompleteRead(irp);
+			}
+		}
+
+		g_Globals.ParkTime = CurrentTimeMs();
+		return g_Globals.PendingReads.Count() ? mode.TimeoutMs : WaitInfinite;
+	}
+
+	if (elapsed >= mode.TimeoutMs) {
+		// timed out with nothing queued, have the next event wake us up
+		InterlockedExchange(&g_Globals.WakeOnAnyEvent, 1);
+		return g_Globals.Queue.Count() ? 0 : WaitInfinite;
+	}
+
+	return mode.TimeoutMs - elapsed;
+}
+
+// sends the thread summaries when the interval is up,
+// returns how long until the next ones are due
+ULONG FlushThreadSummaries() {
+	auto aggregating = g_Globals.AggregateThreads != 0;
+	if (!aggregating && g_Globals.Threads.Count() == 0)
+		return WaitInfinite;
+
+	auto now = CurrentTimeMs();
+	auto elapsed = now - g_Globals.LastSummaryTime;
+	if (aggregating && elapsed < g_Globals.SummaryIntervalMs)
+		return g_Globals.SummaryIntervalMs - elapsed;
+
+	// producers hold the table's lock at DISPATCH_LEVEL, so must we
+	KIRQL irql;
+	KeRaiseIrql(DISPATCH_LEVEL, &irql);
+	auto count = g_Globals.Threads.Collect(g_Globals.Summaries, ThreadCapacity);
+	if (!aggregating)
+		g_Globals.Threads.Reset();
+	KeLowerIrql(irql);
+	g_Globals.LastSummaryTime = now;
+
+	for (ULONG i = 0; i < count; i++) {
+		auto& counters = g_Globals.Summaries[i];
+		auto info = (ThreadSummaryInfo*)AllocateItem(ItemType::ThreadSummary, sizeof(ThreadSummaryInfo));
+		if (info == nullptr)
+			continue;
+
+		auto& item = *info;
+		StampTime(item);
+		item.Type = ItemType::ThreadSummary;
+		item.Size = sizeof(ThreadSummaryInfo);
+		item.ProcessId = counters.ProcessId;
+		item.Creates = counters.Creates;
+		item.Exits = counters.Exits;
+		item.LiveThreads = counters.Live;
+		item.MinLifetime = counters.MinLifetime;
+		item.MaxLifetime = counters.MaxLifetime;
+		item.IntervalMs = elapsed;
+		item.ProcessExited = counters.ProcessExited;
+		PushItem(info);
+	}
+	return aggregating ? g_Globals.SummaryIntervalMs : WaitInfinite;
+}
+
+// the notify routines' token buckets, after the filter and before anything is allocated
+bool RateAllows(ItemType type, ULONG processId) {
+	if (!g_Globals.Limiter.Active())
+		return true;
+
+	// interrupt time is a read of shared memory, and the process table's lock is held at DISPATCH_LEVEL
+	KIRQL irql;
+	KeRaiseIrql(DISPATCH_LEVEL, &irql);
+	auto allowed = g_Globals.Limiter.Allows(type, processId, KeQueryInterruptTime());
+	KeLowerIrql(irql);
+	return allowed;
+}
+
+// sends what the rate limits kept out when the interval is up,
+// returns how long until the next summary is due
+ULONG FlushRateSummary() {
+	auto active = g_Globals.Limiter.Active();
+	if (!active && !g_Globals.Limiter.Pending())
+		return WaitInfinite;
+
+	auto now = CurrentTimeMs();
+	auto elapsed = now - g_Globals.LastRateSummaryTime;
+	if (active && elapsed < g_Globals.RateIntervalMs)
+		return g_Globals.RateIntervalMs - elapsed;
+
+	RateCounters counters;
+	KIRQL irql;
+	KeRaiseIrql(DISPATCH_LEVEL, &irql);
+	auto suppressed = g_Globals.Limiter.Collect(counters, KeQueryInterruptTime());
+	KeLowerIrql(irql);
+	g_Globals.LastRateSummaryTime = now;
+
+	if (suppressed) {
+		auto info = (RateSummaryInfo*)AllocateItem(ItemType::RateSummary, sizeof(RateSummaryInfo));
+		if (info == nullptr) {
+			// not lost, they go out with the next one
+			g_Globals.Limiter.Restore(counters);
+		}
+		else {
+			auto& item = *info;
+			StampTime(item);
+			item.Type = ItemType::RateSummary;
+			item.Size = sizeof(RateSummaryInfo);
+			item.IntervalMs = elapsed;
+			::memcpy(item.Suppressed, counters.Suppressed, sizeof(item.Suppressed));
+			item.TopProcessId = counters.TopProcessId;
+			item.TopProcessSuppressed = counters.TopProcessSuppressed;
+			PushItem(info);
+		}
+	}
+	return active ? g_Globals.RateIntervalMs : WaitInfinite;
+}
+
+void ReadCompletionThread(PVOID) {
+	auto timeout = WaitInfinite;
+	for (;;) {
+		g_Globals.ReadWake.Wait(timeout);
+		InterlockedExchange(&g_Globals.WakePosted, 0);
+		if (g_Globals.Stopping)
+			break;
+
+		timeout = CompletePendingReads();
+		auto summaries = FlushThreadSummaries();
+		if (summaries < timeout)
+			timeout = summaries;
+		auto rates = FlushRateSummary();
+		if (rates < timeout)
+			timeout = rates;
+		if (g_Globals.ChannelActive) {
+			auto clock = RefreshClock();
+			if (clock < timeout)
+				timeout = clock;
+		}
+	}
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+void StopReadThread() {
+	g_Globals.Stopping = true;
+	g_Globals.ReadWake.Signal();
+	KeWaitForSingleObject(g_Globals.ReadThread, Executive, KernelMode, FALSE, nullptr);
+	ObDereferenceObject(g_Globals.ReadThread);
+	g_Globals.ReadThread = nullptr;
+}
+
 void SysMonUnload(PDRIVER_OBJECT DriverObject) {
 	CmUnRegisterCallback(g_Globals.RegCookie);
 	PsRemoveLoadImageNotifyRoutine(OnImageLoadNotify);
@@ -147,32 +1095,67 @@ void SysMonUnload(PDRIVER_OBJECT DriverObject) {
 	UNICODE_STRING symLink = RTL_CONSTANT_STRING(L"\\??\\sysmon");
 	IoDeleteSymbolicLink(&symLink);
 	IoDeleteDevice(DriverObject->DeviceObject);
+	StopReadThread();
 
-	while (!IsListEmpty(&g_Globals.ItemsHead)) {
-		auto entry = RemoveHeadList(&g_Globals.ItemsHead);
-		ExFreePool(CONTAINING_RECORD(entry, FullItem<ItemHeader>, Entry));
-	}
+	g_Globals.Queue.Clear();
+	g_Globals.Stats.Destroy();
+	g_Globals.Limiter.Destroy();
+	g_Globals.Threads.Destroy();
+	ExFreePool(g_Globals.Summaries);
+	g_Globals.CommandLines.Destroy();
+	g_Globals.ImageNames.Destroy();
+	g_Globals.Pool.Destroy();
+	ExFreeCacheAwareRundownProtection(g_Globals.ChannelRundown);
+	ExFreePool(g_Globals.RingBuffers);
 }
 
 void OnProcessNotify(PEPROCESS Process, HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO CreateInfo) {
 	UNREFERENCED_PARAMETER(Process);
+	CallbackTimer timer;
+
+	if (CreateInfo == nullptr && g_Globals.Threads.Count()) {
+		// regardless of the filter, or the process' counters would stay around
+		KIRQL irql;
+		KeRaiseIrql(DISPATCH_LEVEL, &irql);
+		g_Globals.Threads.OnProcessExit(HandleToULong(ProcessId));
+		KeLowerIrql(irql);
+	}
+
+	FilterEvent event(CreateInfo ? ItemType::ProcessCreate : ItemType::ProcessExit, HandleToULong(ProcessId));
+	if (CreateInfo) {
+		event.SetNumber(SysMonFilterField::ParentProcessId, HandleToULong(CreateInfo->ParentProcessId));
+		if (CreateInfo->ImageFileName)
+			event.SetString(SysMonFilterField::Path, CreateInfo->ImageFileName->Buffer, CreateInfo->ImageFileName->Length / sizeof(WCHAR));
+		if (CreateInfo->CommandLine)
+			event.SetString(SysMonFilterField::CommandLine, CreateInfo->CommandLine->Buffer, CreateInfo->CommandLine->Length / sizeof(WCHAR));
+	}
+
+	if (!g_Globals.Filter.Allows(CreateInfo ? ItemType::ProcessCreate : ItemType::ProcessExit, HandleToULong(ProcessId)) ||
+		!g_Globals.Expression.Allows(event) ||
+		!RateAllows(CreateInfo ? ItemType::ProcessCreate : ItemType::ProcessExit, HandleToULong(ProcessId)))
+		return;
 
 	if (CreateInfo) {
-		// process created
-		USHORT allocSize = sizeof(FullItem<ProcessCreateInfo>);
-		USHORT commandLineSize = 0;
-		if (CreateInfo->CommandLine) {
-			commandLineSize = CreateInfo->CommandLine->Length;
-			allocSize += commandLineSize;
-		}
-		auto info = (FullItem<ProcessCreateInfo>*)ExAllocatePoolWithTag(PagedPool, allocSize, DRIVER_TAG);
+		// process created; build tools' lines run to tens of KB, only CommandLineMax of it is kept
+		USHORT commandLineLength = 0;
+		if (CreateInfo->CommandLine)
+			commandLineLength = (USHORT)min(CreateInfo->CommandLine->Length / sizeof(WCHAR), g_Globals.CommandLineMax);
+
+		// the channel has no reader in between to send the line definitions
+		if (g_Globals.Format >= SysMonFormatV5 && !g_Globals.ChannelActive && commandLineLength > 0 &&
+			PushProcessCreateInterned(ProcessId, CreateInfo, commandLineLength))
+			return;
+
+		USHORT commandLineSize = commandLineLength * sizeof(WCHAR);
+		USHORT allocSize = sizeof(ProcessCreateInfo) + commandLineSize;
+		auto info = (ProcessCreateInfo*)AllocateItem(ItemType::ProcessCreate, allocSize);
 		if (info == nullptr) {
 			KdPrint((DRIVER_PREFIX "failed allocation\n"));
 			return;
 		}
 
-		auto& item = info->Data;
-		KeQuerySystemTimePrecise(&item.Time);
+		auto& item = *info;
+		StampTime(item);
 		item.Type = ItemType::ProcessCreate;
 		item.Size = sizeof(ProcessCreateInfo) + commandLineSize;
 		item.ProcessId = HandleToULong(ProcessId);
@@ -186,51 +1169,109 @@ void OnProcessNotify(PEPROCESS Process, HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO
 		else {
 			item.CommandLineLength = 0;
 		}
-		PushItem(&info->Entry);
+		PushItem(info);
 	}
 	else {
 		// process exited
-		auto info = (FullItem<ProcessExitInfo>*)ExAllocatePoolWithTag(PagedPool, sizeof(FullItem<ProcessExitInfo>), DRIVER_TAG);
+		auto info = (ProcessExitInfo*)AllocateItem(ItemType::ProcessExit, sizeof(ProcessExitInfo));
 		if (info == nullptr) {
 			KdPrint((DRIVER_PREFIX "failed allocation\n"));
 			return;
 		}
 
-		auto& item = info->Data;
-		KeQuerySystemTimePrecise(&item.Time);
+		auto& item = *info;
+		StampTime(item);
 		item.Type = ItemType::ProcessExit;
 		item.ProcessId = HandleToULong(ProcessId);
 		item.Size = sizeof(ProcessExitInfo);
 
-		PushItem(&info->Entry);
+		PushItem(info);
 	}
 }
 
 void OnThreadNotify(HANDLE ProcessId, HANDLE ThreadId, BOOLEAN Create) {
-	auto size = sizeof(FullItem<ThreadCreateExitInfo>);
-	auto info = (FullItem<ThreadCreateExitInfo>*)ExAllocatePoolWithTag(PagedPool, size, DRIVER_TAG);
+	CallbackTimer timer;
+	if (!g_Globals.Filter.Allows(Create ? ItemType::ThreadCreate : ItemType::ThreadExit, HandleToULong(ProcessId)))
+		return;
+
+	// what the expression keeps out isn't counted either
+	FilterEvent event(Create ? ItemType::ThreadCreate : ItemType::ThreadExit, HandleToULong(ProcessId));
+	event.SetNumber(SysMonFilterField::ThreadId, HandleToULong(ThreadId));
+	if (!g_Globals.Expression.Allows(event))
+		return;
+
+	if (g_Globals.AggregateThreads) {
+		// exiting threads notify in their own context, so they can tell how old they are
+		auto lifetime = Create ? 0 : CurrentThreadLifetime();
+		KIRQL irql;
+		KeRaiseIrql(DISPATCH_LEVEL, &irql);
+		auto counted = Create ? g_Globals.Threads.OnCreate(HandleToULong(ProcessId))
+			: g_Globals.Threads.OnExit(HandleToULong(ProcessId), lifetime);
+		KeLowerIrql(irql);
+		if (counted)
+			return;
+		// no room for the process, record the event as is
+	}
+
+	// counted ones above cost nothing, only records are limited
+	if (!RateAllows(Create ? ItemType::ThreadCreate : ItemType::ThreadExit, HandleToULong(ProcessId)))
+		return;
+
+	auto size = sizeof(ThreadCreateExitInfo);
+	auto info = (ThreadCreateExitInfo*)AllocateItem(Create ? ItemType::ThreadCreate : ItemType::ThreadExit, size);
 	if (info == nullptr) {
 		KdPrint((DRIVER_PREFIX "Failed to allocate memory\n"));
 		return;
 	}
-	auto& item = info->Data;
-	KeQuerySystemTimePrecise(&item.Time);
+	auto& item = *info;
+	StampTime(item);
 	item.Size = sizeof(item);
 	item.Type = Create ? ItemType::ThreadCreate : ItemType::ThreadExit;
 	item.ProcessId = HandleToULong(ProcessId);
 	item.ThreadId = HandleToULong(ThreadId);
 
-	PushItem(&info->Entry);
+	PushItem(info);
+}
+
+// 100 nsec units since the current thread was created
+LONG64 CurrentThreadLifetime() {
+	KERNEL_USER_TIMES times;
+	if (!NT_SUCCESS(ZwQueryInformationThread(NtCurrentThread(), ThreadTimes, &times, sizeof(times), nullptr)))
+		return 0;
+
+	LARGE_INTEGER now;
+	KeQuerySystemTimePrecise(&now);
+	return now.QuadPart - times.CreateTime.QuadPart;
 }
 
 void OnImageLoadNotify(PUNICODE_STRING FullImageName, HANDLE ProcessId, PIMAGE_INFO ImageInfo) {
+	CallbackTimer timer;
 	if (ProcessId == nullptr) {
 		// system image, ignore
 		return;
 	}
 
-	auto size = sizeof(FullItem<ImageLoadInfo>);
-	auto info = (FullItem<ImageLoadInfo>*)ExAllocatePoolWithTag(PagedPool, size, DRIVER_TAG);
+	FilterEvent event(ItemType::ImageLoad, HandleToULong(ProcessId));
+	if (FullImageName)
+		event.SetString(SysMonFilterField::Path, FullImageName->Buffer, FullImageName->Length / sizeof(WCHAR));
+
+	if (!g_Globals.Filter.Allows(ItemType::ImageLoad, HandleToULong(ProcessId)) ||
+		!g_Globals.Expression.Allows(event) ||
+		!RateAllows(ItemType::ImageLoad, HandleToULong(ProcessId)))
+		return;
+
+	// the channel has no reader in between to send the path definitions
+	if (g_Globals.Format >= SysMonFormatV3 && !g_Globals.ChannelActive &&
+		PushImageLoadInterned(FullImageName, ProcessId, ImageInfo))
+		return;
+
+	if (g_Globals.Format >= SysMonFormatV2) {
+		PushImageLoadV2(FullImageName, ProcessId, ImageInfo);
+		return;
+	}
+
+	auto size = sizeof(ImageLoadInfo);
+	auto info = (ImageLoadInfo*)AllocateItem(ItemType::ImageLoad, size);
 	if (info == nullptr) {
 		KdPrint((DRIVER_PREFIX "Failed to allocate memory\n"));
 		return;
@@ -238,8 +1279,8 @@ void OnImageLoadNotify(PUNICODE_STRING FullImageName, HANDLE ProcessId, PIMAGE_I
 
 	::memset(info, 0, size);
 
-	auto& item = info->Data;
-	KeQuerySystemTimePrecise(&item.Time);
+	auto& item = *info;
+	StampTime(item);
 	item.Size = sizeof(item);
 	item.Type = ItemType::ImageLoad;
 	item.ProcessId = HandleToULong(ProcessId);
@@ -257,66 +1298,351 @@ void OnImageLoadNotify(PUNICODE_STRING FullImageName, HANDLE ProcessId, PIMAGE_I
 	//	auto exinfo = CONTAINING_RECORD(ImageInfo, IMAGE_INFO_EX, ImageInfo);
 	//}
 
-	PushItem(&info->Entry);
+	PushItem(info);
+}
+
+void PushImageLoadV2(PUNICODE_STRING FullImageName, HANDLE ProcessId, PIMAGE_INFO ImageInfo) {
+	USHORT nameLength = FullImageName ? min(FullImageName->Length / sizeof(WCHAR), MaxImageFileSizeV2) : 0;
+	USHORT size = (sizeof(ImageLoadInfoV2) + nameLength * sizeof(WCHAR) + RecordAlignmentV2 - 1) & ~(RecordAlignmentV2 - 1);
+	auto info = (ImageLoadInfoV2*)AllocateItem(ItemType::ImageLoadV2, size);
+	if (info == nullptr) {
+		KdPrint((DRIVER_PREFIX "Failed to allocate memory\n"));
+		return;
+	}
+
+	auto& item = *info;
+	StampTime(item);
+	item.Size = size;
+	item.Type = ItemType::ImageLoadV2;
+	item.ProcessId = HandleToULong(ProcessId);
+	item.ImageSize = ImageInfo->ImageSize;
+	item.LoadAddress = ImageInfo->ImageBase;
+	item.ImageFileNameLength = nameLength;
+	item.ImageFileNameOffset = sizeof(item);
+	auto name = (UCHAR*)&item + sizeof(item);
+	if (nameLength > 0)
+		::memcpy(name, FullImageName->Buffer, nameLength * sizeof(WCHAR));
+	// don't hand stale pool contents to the client
+	::memset(name + nameLength * sizeof(WCHAR), 0, size - sizeof(item) - nameLength * sizeof(WCHAR));
+
+	PushItem(info);
 }
 
-void PushItem(LIST_ENTRY * entry) {
-	AutoLock<FastMutex> locker(g_Globals.Mutex);
-	if (g_Globals.ItemCount > 1024) {
-		// too many items, remove oldest one
-		auto head = RemoveHeadList(&g_Globals.ItemsHead);
-		g_Globals.ItemCount--;
-		auto item = CONTAINING_RECORD(head, FullItem<ItemHeader>, Entry);
-		ExFreePool(item);
+// false if the path can't be interned, send it in full then
+bool PushImageLoadInterned(PUNICODE_STRING FullImageName, HANDLE ProcessId, PIMAGE_INFO ImageInfo) {
+	if (FullImageName == nullptr)
+		return false;
+
+	auto id = g_Globals.ImageNames.Intern(FullImageName->Buffer, FullImageName->Length / sizeof(WCHAR));
+	if (id == 0)
+		return false;
+
+	auto info = (ImageLoadInternedInfo*)AllocateItem(ItemType::ImageLoadInterned, sizeof(ImageLoadInternedInfo));
+	if (info == nullptr) {
+		KdPrint((DRIVER_PREFIX "Failed to allocate memory\n"));
+		return true;
 	}
-	InsertTailList(&g_Globals.ItemsHead, entry);
-	g_Globals.ItemCount++;
+
+	auto& item = *info;
+	StampTime(item);
+	item.Size = sizeof(item);
+	item.Type = ItemType::ImageLoadInterned;
+	item.ProcessId = HandleToULong(ProcessId);
+	item.ImageNameId = id;
+	item.ImageSize = ImageInfo->ImageSize;
+	item.LoadAddress = ImageInfo->ImageBase;
+
+	PushItem(info);
+	return true;
+}
+
+// now, in the units queued records are stamped with
+LONG64 CurrentStamp() {
+	if (g_Globals.CounterTime)
+		return (LONG64)ReadTimeCounter();
+
+	LARGE_INTEGER now;
+	KeQuerySystemTimePrecise(&now);
+	return now.QuadPart;
+}
+
+// false if the line can't be interned, send it in full then
+bool PushProcessCreateInterned(HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO CreateInfo, USHORT length) {
+	ULONG id;
+	{
+		bool repeat;
+		AutoLock locker(g_Globals.CommandLineMutex);
+		id = g_Globals.CommandLines.Intern(CreateInfo->CommandLine->Buffer, length, repeat);
+	}
+	if (id == 0)
+		return false;
+
+	auto info = (ProcessCreateInternedInfo*)AllocateItem(ItemType::ProcessCreateInterned, sizeof(ProcessCreateInternedInfo));
+	if (info == nullptr) {
+		KdPrint((DRIVER_PREFIX "failed allocation\n"));
+		g_Globals.CommandLines.Unpin(id);
+		return true;
+	}
+	// a channel mapped since the caller looked; its records never go back to the pool
+	if (g_Globals.Channel.Owns(info))
+		g_Globals.CommandLines.Unpin(id);
+
+	auto& item = *info;
+	StampTime(item);
+	item.Size = sizeof(item);
+	item.Type = ItemType::ProcessCreateInterned;
+	item.ProcessId = HandleToULong(ProcessId);
+	item.ParentProcessId = HandleToULong(CreateInfo->ParentProcessId);
+	item.CommandLineId = id;
+	item.CommandLineLength = CreateInfo->CommandLine->Length / sizeof(WCHAR);
+	item.Reserved = 0;
+
+	PushItem(info);
+	return true;
+}
+
+// queued records get the counter, reads convert it for clients before v4;
+// records built right in the mapped channel are read as they are, so they get system time
+void StampTime(ItemHeader& item) {
+	if (!g_Globals.CounterTime) {
+		KeQuerySystemTimePrecise(&item.Time);
+		return;
+	}
+
+	item.Time.QuadPart = ReadTimeCounter();
+	if (g_Globals.Channel.Owns(&item))
+		item.Time.QuadPart = g_Globals.Clock.ToSystemTime(item.Time.QuadPart);
+}
+
+ItemHeader* AllocateItem(ItemType type, ULONG size) {
+	if (g_Globals.ChannelActive && ExAcquireRundownProtectionCacheAware(g_Globals.ChannelRundown)) {
+		// build the record right in the consumer's ring; PushItem publishes it
+		auto item = (ItemHeader*)g_Globals.Channel.Reserve(size);
+		if (item == nullptr) {
+			ExReleaseRundownProtectionCacheAware(g_Globals.ChannelRundown);
+			g_Globals.Queue.CountDrop(type);
+		}
+		return item;
+	}
+
+	auto item = g_Globals.Pool.Alloc(type, size);
+	if (item == nullptr)
+		g_Globals.Queue.CountDrop(type);
+	return item;
+}
+
+void PushItem(ItemHeader* item) {
+	// the item may be read and freed the moment it's published, and it's
+	// pageable, so nothing below DISPATCH_LEVEL may look at it either
+	auto type = item->Type;
+	ULONG size = item->Size;
+	if (g_Globals.Channel.Owns(item)) {
+		g_Globals.Stats.Enqueued(KeGetCurrentProcessorNumberEx(nullptr), type);
+		if (g_Globals.Channel.Commit(item))
+			KeSetEvent(g_Globals.ChannelEvent, IO_NO_INCREMENT, FALSE);
+		ExReleaseRundownProtectionCacheAware(g_Globals.ChannelRundown);
+		return;
+	}
+
+	if (!g_Globals.Queue.Admit(KeGetCurrentProcessorNumberEx(nullptr), item))
+		return;
+
+	// at DISPATCH_LEVEL we can't be preempted or migrated,
+	// which makes us the only producer of this CPU's ring
+	KIRQL oldIrql;
+	KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+	auto cpu = KeGetCurrentProcessorNumberEx(nullptr);
+	auto pushed = g_Globals.Queue.Push(cpu, item, type, size);
+	if (pushed)
+		g_Globals.Stats.Enqueued(cpu, type);
+	KeLowerIrql(oldIrql);
+
+	if (!pushed) {
+		// we moved to a CPU whose ring is full; freeing touches the pageable slab
+		g_Globals.Queue.Drop(item);
+		return;
+	}
+
+	// only what's arrived since a reader last looked, records a slow reader still holds don't wake anyone
+	if (g_Globals.PendingReads.Count() > 0 &&
+		(g_Globals.WakeOnAnyEvent || g_Globals.Queue.Available(nullptr) >= g_Globals.ReadMode.BatchCount))
+		WakeReadThread();
 }
 
 NTSTATUS OnRegistryNotify(PVOID context, PVOID arg1, PVOID arg2) {
 	UNREFERENCED_PARAMETER(context);
 
-	static const WCHAR machine[] = L"\\REGISTRY\\MACHINE\\";
-
 	switch ((REG_NOTIFY_CLASS)(ULONG_PTR)arg1) {
 		case RegNtPostSetValueKey:
-			auto args = static_cast<REG_POST_OPERATION_INFORMATION*>(arg2);
-			if (!NT_SUCCESS(args->Status))
-				break;
+			OnRegistrySetValue(static_cast<REG_POST_OPERATION_INFORMATION*>(arg2));
+			break;
 
-			PCUNICODE_STRING name;
-			if (NT_SUCCESS(CmCallbackGetKeyObjectIDEx(&g_Globals.RegCookie, args->Object, nullptr, &name, 0))) {
-				// filter out none-HKLM writes
-				if (::wcsncmp(name->Buffer, machine, ARRAYSIZE(machine) - 1) == 0) {
-					auto preInfo = (REG_SET_VALUE_KEY_INFORMATION*)args->PreInformation;
-					NT_ASSERT(preInfo);
-
-					auto size = sizeof(FullItem<RegistrySetValueInfo>);
-					auto info = (FullItem<RegistrySetValueInfo>*)ExAllocatePoolWithTag(PagedPool, size, DRIVER_TAG);
-					if (info == nullptr)
-						break;
-
-					RtlZeroMemory(info, size);
-					auto& item = info->Data;
-					KeQuerySystemTimePrecise(&item.Time);
-					item.Size = sizeof(item);
-					item.Type = ItemType::RegistrySetValue;
-					::wcsncpy_s(item.KeyName, name->Buffer, name->Length / sizeof(WCHAR) - 1);
-					::wcsncpy_s(item.ValueName, preInfo->ValueName->Buffer, preInfo->ValueName->Length / sizeof(WCHAR) - 1);
-					item.DataType = preInfo->Type;
-					item.DataSize = preInfo->DataSize;
-					item.ProcessId = HandleToULong(PsGetCurrentProcessId());
-					item.ThreadId = HandleToULong(PsGetCurrentThreadId());
-					::memcpy(item.Data, preInfo->Data, min(item.DataSize, sizeof(item.Data)));
-
-					PushItem(&info->Entry);
-				}
-
-				CmCallbackReleaseKeyObjectIDEx(name);
+		case RegNtCallbackObjectContextCleanup:
+		{
+			// the key object is going away (or we're unregistering)
+			auto context = (KeyContext*)static_cast<REG_CALLBACK_CONTEXT_CLEANUP_INFORMATION*>(arg2)->ObjectContext;
+			while (context) {
+				auto next = context->Next;
+				ExFreePool(context);
+				context = next;
 			}
 			break;
-
+		}
 	}
 
 	return STATUS_SUCCESS;
 }
+
+void OnRegistrySetValue(REG_POST_OPERATION_INFORMATION* args) {
+	CallbackTimer timer;
+	if (!NT_SUCCESS(args->Status))
+		return;
+
+	// before the (expensive) key name lookup
+	if (!g_Globals.Filter.Allows(ItemType::RegistrySetValue, HandleToULong(PsGetCurrentProcessId())) ||
+		!RateAllows(ItemType::RegistrySetValue, HandleToULong(PsGetCurrentProcessId())))
+		return;
+
+	// the first write through a handle looks the name up and caches it with the key object
+	PCUNICODE_STRING lookedUp = nullptr;
+	auto context = (KeyContext*)args->ObjectContext;
+	if (context == nullptr) {
+		if (!NT_SUCCESS(CmCallbackGetKeyObjectIDEx(&g_Globals.RegCookie, args->Object, nullptr, &lookedUp, 0)))
+			return;
+		context = AttachKeyContext(args->Object, lookedUp);
+	}
+
+	UNICODE_STRING name;
+	bool allowed;
+	if (context) {
+		name.Buffer = context->Name;
+		name.Length = name.MaximumLength = context->NameLength * sizeof(WCHAR);
+		allowed = KeyAllowed(context);
+	}
+	else {
+		name = *lookedUp;
+		allowed = g_Globals.Keys.Allows(name.Buffer, name.Length / sizeof(WCHAR));
+	}
+
+	auto preInfo = (REG_SET_VALUE_KEY_INFORMATION*)args->PreInformation;
+	NT_ASSERT(preInfo);
+	if (allowed) {
+		// the expression wants the key name, so it comes after the key filter
+		FilterEvent event(ItemType::RegistrySetValue, HandleToULong(PsGetCurrentProcessId()));
+		event.SetNumber(SysMonFilterField::ThreadId, HandleToULong(PsGetCurrentThreadId()));
+		event.SetString(SysMonFilterField::Key, name.Buffer, name.Length / sizeof(WCHAR));
+		if (preInfo->ValueName)
+			event.SetString(SysMonFilterField::Value, preInfo->ValueName->Buffer, preInfo->ValueName->Length / sizeof(WCHAR));
+		allowed = g_Globals.Expression.Allows(event);
+	}
+
+	if (allowed) {
+		if (g_Globals.Format >= SysMonFormatV2)
+			PushRegistrySetValueV2(&name, preInfo);
+		else
+			PushRegistrySetValue(&name, preInfo);
+	}
+
+	if (lookedUp)
+		CmCallbackReleaseKeyObjectIDEx(lookedUp);
+}
+
+// nullptr if the name can't be cached, the caller goes on with the one it looked up
+KeyContext* AttachKeyContext(PVOID object, PCUNICODE_STRING name) {
+	auto length = name->Length / sizeof(WCHAR);
+	if (length > MaxCachedKeyName)
+		return nullptr;
+
+	auto context = (KeyContext*)ExAllocatePoolWithTag(PagedPool, FIELD_OFFSET(KeyContext, Name) + length * sizeof(WCHAR), DRIVER_TAG);
+	if (context == nullptr)
+		return nullptr;
+
+	context->Next = nullptr;
+	context->Verdict = 0;		// filter generations start at 1
+	context->NameLength = (USHORT)length;
+	::memcpy(context->Name, name->Buffer, length * sizeof(WCHAR));
+
+	PVOID old = nullptr;
+	if (!NT_SUCCESS(CmSetCallbackObjectContext(object, &g_Globals.RegCookie, context, &old))) {
+		ExFreePool(context);
+		return nullptr;
+	}
+
+	// a concurrent write through the same handle got there first and may still be
+	// using its context, it goes when this one does
+	context->Next = (KeyContext*)old;
+	return context;
+}
+
+// the key filter's verdict for the cached name, worked out again after the filter changed
+bool KeyAllowed(KeyContext* context) {
+	// 1 to 2^30 - 1 round and round, so the shifted value stays clear of the sign bit
+	// and never reads as the 0 a new context starts with
+	ULONG generation = g_Globals.Keys.Generation() % 0x3fffffff + 1;
+	auto verdict = (ULONG)context->Verdict;
+	if (verdict >> 1 != generation) {
+		verdict = generation << 1 | (g_Globals.Keys.Allows(context->Name, context->NameLength) ? 1 : 0);
+		InterlockedExchange(&context->Verdict, (LONG)verdict);
+	}
+	return (verdict & 1) != 0;
+}
+
+void PushRegistrySetValue(PCUNICODE_STRING keyName, REG_SET_VALUE_KEY_INFORMATION* preInfo) {
+	auto size = sizeof(RegistrySetValueInfo);
+	auto info = (RegistrySetValueInfo*)AllocateItem(ItemType::RegistrySetValue, size);
+	if (info == nullptr)
+		return;
+
+	RtlZeroMemory(info, size);
+	auto& item = *info;
+	StampTime(item);
+	item.Size = sizeof(item);
+	item.Type = ItemType::RegistrySetValue;
+	::wcsncpy_s(item.KeyName, keyName->Buffer, keyName->Length / sizeof(WCHAR) - 1);
+	::wcsncpy_s(item.ValueName, preInfo->ValueName->Buffer, preInfo->ValueName->Length / sizeof(WCHAR) - 1);
+	item.DataType = preInfo->Type;
+	item.DataSize = preInfo->DataSize;
+	item.ProcessId = HandleToULong(PsGetCurrentProcessId());
+	item.ThreadId = HandleToULong(PsGetCurrentThreadId());
+	::memcpy(item.Data, preInfo->Data, min(item.DataSize, sizeof(item.Data)));
+
+	PushItem(info);
+}
+
+void PushRegistrySetValueV2(PCUNICODE_STRING keyName, REG_SET_VALUE_KEY_INFORMATION* preInfo) {
+	USHORT keyLength = min(keyName->Length / sizeof(WCHAR), MaxKeyNameSizeV2);
+	USHORT valueLength = min(preInfo->ValueName->Length / sizeof(WCHAR), MaxValueNameSizeV2);
+	USHORT dataLength = (USHORT)min(preInfo->DataSize, MaxRegistryDataSizeV2);
+	USHORT size = (sizeof(RegistrySetValueInfoV2) + (keyLength + valueLength) * sizeof(WCHAR) + dataLength
+		+ RecordAlignmentV2 - 1) & ~(RecordAlignmentV2 - 1);
+	auto info = (RegistrySetValueInfoV2*)AllocateItem(ItemType::RegistrySetValueV2, size);
+	if (info == nullptr)
+		return;
+
+	auto& item = *info;
+	StampTime(item);
+	item.Size = size;
+	item.Type = ItemType::RegistrySetValueV2;
+	item.ProcessId = HandleToULong(PsGetCurrentProcessId());
+	item.ThreadId = HandleToULong(PsGetCurrentThreadId());
+	item.DataType = preInfo->Type;
+	item.DataSize = preInfo->DataSize;
+
+	auto offset = (USHORT)sizeof(item);
+	item.KeyNameLength = keyLength;
+	item.KeyNameOffset = offset;
+	::memcpy((UCHAR*)&item + offset, keyName->Buffer, keyLength * sizeof(WCHAR));
+	offset += keyLength * sizeof(WCHAR);
+
+	item.ValueNameLength = valueLength;
+	item.ValueNameOffset = offset;
+	::memcpy((UCHAR*)&item + offset, preInfo->ValueName->Buffer, valueLength * sizeof(WCHAR));
+	offset += valueLength * sizeof(WCHAR);
+
+	item.DataLength = dataLength;
+	item.DataOffset = offset;
+	::memcpy((UCHAR*)&item + offset, preInfo->Data, dataLength);
+	::memset((UCHAR*)&item + offset + dataLength, 0, size - offset - dataLength);
+
+	PushItem(info);
+}
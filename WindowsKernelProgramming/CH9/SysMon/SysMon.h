@@ -1,20 +1,105 @@
 #pragma once
 
 #include "FastMutex.h"
+#include "EventQueue.h"
+#include "ItemPool.h"
+#include "IrpQueue.h"
+#include "EventWait.h"
+#include "SharedChannel.h"
+#include "EventFilter.h"
+#include "InternTable.h"
+#include "CommandLineTable.h"
+#include "ThreadAggregator.h"
+#include "RateLimiter.h"
+#include "EventStats.h"
+#include "TimeSource.h"
+#include "KeyFilter.h"
+#include "FilterProgram.h"
+#include "SysMonCommon.h"
 
 #define DRIVER_PREFIX "SysMon: "
 #define DRIVER_TAG 'nmys'
 
+const ULONG RingCapacity = 2048;	// records per CPU and priority class, SysMonQueueLimits can lower the total
+const ULONG SharedLogCapacity = 1 << 15;	// records kept for the slowest of several readers
+const ULONG ImageNameCapacity = 4096;	// distinct image paths interned
+
+typedef EventQueue<RingCapacity, FastMutex> ItemQueue;
+
+// a handle on the device, FileObject->FsContext
+struct Consumer {
+	LIST_ENTRY Link;				// Globals::Consumers
+	PFILE_OBJECT FileObject;
+	FastMutex ReadOrder;			// reads complete in the order issued, taken before Mutex
+	ReadCursor Cursor;				// attached from the first read on
+	ULONG Format;					// SysMonFormatXxx asked for, 0: never asked
+	bool Closed;
+	volatile LONG CalibrationSent;	// Clock generation last sent, v4
+	ULONG NamesSent[ImageNameCapacity / 32];	// v3 image paths sent, bit id - 1
+	ULONG LinesSent[SysMonCommandLineCapacity];	// v5 command line last sent, by table slot
+};
+
 struct Globals {
-	LIST_ENTRY ItemsHead;
-	int ItemCount;
-	FastMutex Mutex;
+	ItemQueue Queue;
+	ItemQueue::Ring* RingBuffers;	// per CPU and priority class, then the shared log
+	FastMutex Mutex;				// serializes readers
+	ItemPool Pool;					// event records
+	ULONG Format;					// SysMonFormatXxx, the oldest any reader asked for
+	LIST_ENTRY Consumers;			// open handles
+	FastMutex ConsumerMutex;		// taken before a ReadOrder and Mutex
+	EventFilter Filter;				// checked before anything is allocated
+	KeyFilter Keys;					// registry keys, checked before a write is recorded
+	FilterProgram Expression;		// after Filter, and for registry writes after Keys
+	FastMutex FilterMutex;			// serializes filter updates
+
+	// v3 image paths
+	InternTable ImageNames;
 	LARGE_INTEGER RegCookie;
-};
 
-template<typename T>
-struct FullItem {
-	LIST_ENTRY Entry;
-	T Data;
-};
+	// v5 recent command lines; the mutex serializes Intern, queued records pin theirs
+	CommandLineTable CommandLines;
+	FastMutex CommandLineMutex;
+	ULONG CommandLineMax;			// WCHARs recorded, SysMonCommandLineCapture
 
+	// queued records are stamped with the cycle counter where it's reliable (CounterTime)
+	TimeCalibrator Clock;
+	bool CounterTime;
+	FastMutex ClockMutex;			// serializes calibrations
+	ULONG LastCalibrationTime;		// ms
+
+	// thread events counted per process, the read thread sends the summaries
+	ThreadAggregator Threads;
+	ThreadCounters* Summaries;		// Collect's output, non-paged
+	volatile LONG AggregateThreads;
+	ULONG SummaryIntervalMs;
+	ULONG LastSummaryTime;			// ms
+
+	// token buckets in the notify routines, the read thread sends what they kept out
+	RateLimiter Limiter;
+	ULONG RateIntervalMs;
+	ULONG LastRateSummaryTime;		// ms
+
+	// latency histograms and per-type counts, per CPU (IOCTL_SYSMON_GET_LATENCY_STATS)
+	EventStats Stats;
+
+	// blocking reads
+	SysMonReadMode ReadMode;
+	IrpQueue PendingReads;
+	WaitEvent ReadWake;				// wakes the read completion thread
+	volatile LONG WakePosted;		// ReadWake already signaled
+	volatile LONG WakeOnAnyEvent;	// read timeout expired with nothing queued
+	ULONG ParkTime;					// when the oldest pending read arrived (ms)
+	PETHREAD ReadThread;
+	bool Stopping;
+
+	// mapped channel, producers hold ChannelRundown while writing into it
+	SharedChannel Channel;
+	volatile LONG ChannelActive;
+	PEX_RUNDOWN_REF_CACHE_AWARE ChannelRundown;
+	PFILE_OBJECT ChannelOwner;
+	PMDL ChannelMdl;
+	PVOID ChannelKernelAddress;
+	PVOID ChannelUserAddress;
+	PEPROCESS ChannelProcess;		// the one ChannelUserAddress is in, referenced
+	PKEVENT ChannelEvent;
+};
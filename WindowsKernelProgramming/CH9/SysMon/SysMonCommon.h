@@ -1,5 +1,221 @@
 #pragma once
 
+#define IOCTL_SYSMON_SET_READ_MODE	CTL_CODE(0x8000, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_SYSMON_MAP_CHANNEL	CTL_CODE(0x8000, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_SYSMON_SET_FORMAT		CTL_CODE(0x8000, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// record layouts. IOCTL_SYSMON_SET_FORMAT takes the newest format the client
+// understands (ULONG) and returns the one the driver is going to use
+const ULONG SysMonFormatV1 = 1;		// fixed size ImageLoadInfo and RegistrySetValueInfo
+const ULONG SysMonFormatV2 = 2;		// ImageLoadInfoV2 and RegistrySetValueInfoV2
+const ULONG SysMonFormatV3 = 3;		// v2, with image paths sent once (ImageLoadInterned)
+const ULONG SysMonFormatV4 = 4;		// v3, with times as raw counter values (TimeCalibrationInfo)
+const ULONG SysMonFormatV5 = 5;		// v4, with repeated command lines sent once (ProcessCreateInterned)
+const ULONG SysMonFormatLatest = SysMonFormatV5;
+
+#define IOCTL_SYSMON_SET_FILTER		CTL_CODE(0x8000, 0x803, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// which events get recorded at all. an event passes if its type bit is set,
+// its process is in the include list (or the list is empty)
+// and it isn't in the exclude list. ImageLoadV2/RegistrySetValueV2 records
+// are filtered by their v1 types
+const ULONG SysMonFilterAllTypes = 0xffffffff;
+const ULONG SysMonFilterMaxProcesses = 64;	// per list
+
+struct SysMonFilter {
+	ULONG TypeMask;			// 1 << ItemType
+	ULONG IncludeCount;
+	ULONG ExcludeCount;
+	ULONG ProcessIds[1];	// IncludeCount included PIDs, then ExcludeCount excluded ones
+};
+
+#define SYSMON_FILTER_SIZE(count) (FIELD_OFFSET(SysMonFilter, ProcessIds) + (count) * sizeof(ULONG))
+
+#define IOCTL_SYSMON_SET_QUEUE_LIMITS	CTL_CODE(0x8000, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_SYSMON_GET_QUEUE_STATS	CTL_CODE(0x8000, 0x805, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// what to give up once the queue is full
+enum class SysMonOverflowPolicy : ULONG {
+	DropOldest,			// make room by discarding the oldest queued records
+	DropNewest,			// discard the record being added
+	DropLowestPriority	// discard the oldest records of the least important class queued,
+						// up to the new record's own (SysMonTypePriority)
+};
+
+struct SysMonQueueLimits {
+	ULONG MaxRecords;	// 0: as many as the per-CPU rings hold
+	ULONG MaxBytes;		// 0: no limit
+	SysMonOverflowPolicy Policy;
+};
+
+const ULONG SysMonMaxTypes = 16;
+
+struct SysMonQueueStats {
+	SysMonQueueLimits Limits;
+	ULONG Records;					// queued right now
+	ULONG Bytes;
+	ULONG Dropped[SysMonMaxTypes];	// by ItemType, since the driver started
+
+	// with more than one handle reading; older clients pass a buffer without these
+	ULONG Readers;					// handles that have read
+	ULONG Evicted;					// shared records dropped before every reader had them
+	ULONG Missed;					// of those, the ones this handle never got
+};
+
+#define IOCTL_SYSMON_SET_AGGREGATION	CTL_CODE(0x8000, 0x806, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// thread creates and exits can be counted per process instead of recorded one by one;
+// a ThreadSummaryInfo per active process then comes every IntervalMs
+struct SysMonAggregation {
+	ULONG Threads;		// non-zero: summarize thread events
+	ULONG IntervalMs;
+};
+
+#define IOCTL_SYSMON_SET_KEY_FILTER	CTL_CODE(0x8000, 0x807, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// which registry keys writes are recorded for. the longest prefix matching a key
+// decides, on whole path components and ignoring case; a key no prefix matches is
+// recorded only if there are no include prefixes. prefixes are kernel key names
+// (\REGISTRY\MACHINE\SYSTEM\...). the driver starts out with \REGISTRY\MACHINE included
+const ULONG SysMonKeyFilterMaxPrefixes = 32;
+const ULONG SysMonKeyFilterMaxLength = 256;		// WCHARs per prefix
+
+struct SysMonKeyPrefix {
+	ULONG Exclude;		// non-zero: keys under it are not recorded
+	ULONG Length;		// in WCHARs
+	WCHAR Text[SysMonKeyFilterMaxLength];
+};
+
+struct SysMonKeyFilter {
+	ULONG Count;
+	SysMonKeyPrefix Prefixes[1];
+};
+
+#define SYSMON_KEY_FILTER_SIZE(count) (FIELD_OFFSET(SysMonKeyFilter, Prefixes) + (count) * sizeof(SysMonKeyPrefix))
+
+#define IOCTL_SYSMON_SET_RATE_LIMITS	CTL_CODE(0x8000, 0x808, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// token buckets the notify routines check before recording anything. a type gets Rate
+// records a second and Burst at once, each process ProcessRate and ProcessBurst of them;
+// a rate of 0 doesn't limit, a burst of 0 is a second's worth. types are the ones the
+// filter knows (v1). what's kept out is counted, a RateSummaryInfo comes every IntervalMs
+// there was any
+struct SysMonRateLimit {
+	ULONG Rate;
+	ULONG Burst;
+	ULONG ProcessRate;
+	ULONG ProcessBurst;
+};
+
+struct SysMonRateLimits {
+	SysMonRateLimit Types[SysMonMaxTypes];	// by ItemType
+	ULONG IntervalMs;
+};
+
+#define IOCTL_SYSMON_GET_LATENCY_STATS	CTL_CODE(0x8000, 0x809, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// log2 buckets: 0 holds zeros, i values in [2^(i-1), 2^i), the last one everything above
+const ULONG SysMonHistogramBuckets = 40;
+
+struct SysMonHistogram {
+	ULONG64 Count;
+	ULONG64 Sum;
+	ULONG64 Buckets[SysMonHistogramBuckets];
+};
+
+// since the driver started. times are in the ticks records are stamped with,
+// Frequency of them a second; a record's residence is from its stamp to the read
+// that took it off the queue, once for every handle reading
+struct SysMonLatencyStats {
+	ULONG64 Frequency;
+	SysMonHistogram Callback;		// notify routine, entry to queued
+	SysMonHistogram Residence;		// queued records only, not the mapped channel's
+	SysMonHistogram ReadBatch;		// records per completed read
+	ULONG64 Enqueued[SysMonMaxTypes];	// by ItemType as queued
+	ULONG64 Dropped[SysMonMaxTypes];	// SysMonQueueStats' Dropped
+	ULONG CallbackSampling;			// 1 in this many notify routines is in Callback
+};
+
+#define IOCTL_SYSMON_SET_COMMAND_LINE	CTL_CODE(0x8000, 0x80A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// how much of a new process' command line is recorded, in any format; the driver
+// never keeps more than SysMonCommandLineMaxLength, so a record stays under 64 KB
+const ULONG SysMonCommandLineMaxLength = 32000;	// WCHARs
+
+struct SysMonCommandLineCapture {
+	ULONG MaxLength;	// WCHARs, 0: up to SysMonCommandLineMaxLength
+};
+
+#define IOCTL_SYSMON_SET_FILTER_PROGRAM	CTL_CODE(0x8000, 0x80B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// a filter expression (type==ImageLoad && path endswith "\evil.dll"), compiled in user
+// mode (FilterCompiler.h), that events must pass after SysMonFilter and before anything
+// is allocated; registry writes once SysMonKeyFilter passed their key. the code works
+// on a single flag, true to start with: a comparison sets it, Not flips it, the jumps
+// (&& and ||) go forward when it's false or true, and the flag past the last instruction
+// decides. a field the event doesn't have compares false; strings compare ignoring case.
+// an empty program lets everything through
+const ULONG SysMonFilterMaxInstructions = 256;
+const ULONG SysMonFilterMaxChars = 4096;		// WCHARs of string operands, all of them
+
+enum class SysMonFilterField : UCHAR {
+	Type,				// ItemType, the v1 types as for SysMonFilter
+	ProcessId,
+	ParentProcessId,	// process creates
+	ThreadId,			// threads, registry writes
+	Path,				// image loads, and the image of a process being created
+	CommandLine,		// process creates
+	Key,				// registry writes, the kernel key name
+	Value,				// registry writes, the value name
+	Count
+};
+
+// fields before Path are numbers, the rest strings
+const SysMonFilterField SysMonFilterFirstString = SysMonFilterField::Path;
+
+enum class SysMonFilterOp : UCHAR {
+	Equal, NotEqual, Less, LessEqual, Greater, GreaterEqual,		// number fields
+	StringEqual, StringNotEqual, StartsWith, EndsWith, Contains,	// string fields
+	Not,
+	JumpIfFalse,		// to Operand, past this instruction and at most Count
+	JumpIfTrue,
+	Count
+};
+
+struct SysMonFilterInstruction {
+	SysMonFilterOp Op;
+	SysMonFilterField Field;	// comparisons
+	USHORT Length;				// a string operand's, in WCHARs
+	ULONG Operand;				// the number, where the string starts in the WCHARs, or the jump target
+};
+
+struct SysMonFilterProgram {
+	ULONG Count;				// instructions
+	ULONG CharCount;
+	SysMonFilterInstruction Code[1];	// Count of them, then CharCount WCHARs
+};
+
+#define SYSMON_FILTER_PROGRAM_SIZE(count, chars) (FIELD_OFFSET(SysMonFilterProgram, Code) + (count) * sizeof(SysMonFilterInstruction) + (chars) * sizeof(WCHAR))
+
+struct SysMonReadMode {
+	ULONG Blocking;		// non-zero: reads wait for events instead of returning empty
+	ULONG BatchCount;	// complete a waiting read once this many events are queued
+	ULONG TimeoutMs;	// ...or once this much time passed and anything is queued
+};
+
+// events go straight into a ring mapped into the caller (see SharedChannel.h)
+// until the handle is closed; one such consumer at a time
+struct SysMonChannelRequest {
+	ULONG Size;			// requested ring size in bytes
+	ULONG64 Event;		// event handle, set when the consumer asked to be woken up
+};
+
+struct SysMonChannelMapping {
+	ULONG64 Address;	// the channel in the caller's address space
+	ULONG Size;
+};
+
 enum class ItemType : short {
 	None,
 	ProcessCreate,
@@ -7,9 +223,45 @@ enum class ItemType : short {
 	ThreadCreate,
 	ThreadExit,
 	ImageLoad,
-	RegistrySetValue
+	RegistrySetValue,
+	ImageLoadV2,
+	RegistrySetValueV2,
+	ImageLoadInterned,
+	StringDefinition,
+	ThreadSummary,
+	TimeCalibration,
+	RateSummary,
+	ProcessCreateInterned
 };
 
+// the queue keeps each class apart, DropLowestPriority evicts from the lowest first.
+// higher is more important: process lifecycle, registry, image loads, threads
+const ULONG SysMonPriorityClasses = 4;
+
+inline ULONG SysMonTypePriority(ItemType type) {
+	switch (type) {
+		case ItemType::ProcessCreate:
+		case ItemType::ProcessCreateInterned:
+		case ItemType::ProcessExit:
+		case ItemType::TimeCalibration:
+		case ItemType::RateSummary:
+			return 3;
+
+		case ItemType::RegistrySetValue:
+		case ItemType::RegistrySetValueV2:
+		case ItemType::ThreadSummary:
+			return 2;
+
+		case ItemType::ImageLoad:
+		case ItemType::ImageLoadV2:
+		case ItemType::ImageLoadInterned:
+			return 1;
+
+		default:
+			return 0;
+	}
+}
+
 struct ItemHeader {
 	ItemType Type;
 	USHORT Size;
@@ -50,3 +302,119 @@ struct RegistrySetValueInfo : ItemHeader {
     UCHAR Data[128];		// data
     ULONG DataSize;			// size of data
 };
+
+//
+// v2: strings and data follow the fixed part, located by offset (from the start
+// of the record) and length, like ProcessCreateInfo's command line.
+// strings are not NULL terminated. Size is rounded up to keep the next
+// record aligned.
+//
+
+const int RecordAlignmentV2 = 8;
+
+const int MaxImageFileSizeV2 = 1024;
+const int MaxKeyNameSizeV2 = 512;
+const int MaxValueNameSizeV2 = 256;
+const int MaxRegistryDataSizeV2 = 128;
+
+struct ImageLoadInfoV2 : ItemHeader {
+	ULONG ProcessId;
+	USHORT ImageFileNameLength;		// in WCHARs, 0 if unknown
+	USHORT ImageFileNameOffset;
+	void* LoadAddress;
+	ULONG_PTR ImageSize;
+};
+
+struct RegistrySetValueInfoV2 : ItemHeader {
+	ULONG ProcessId;
+	ULONG ThreadId;
+	ULONG DataType;			// REG_xxx
+	ULONG DataSize;			// size of the value's data
+	USHORT KeyNameLength;	// in WCHARs
+	USHORT KeyNameOffset;
+	USHORT ValueNameLength;	// in WCHARs
+	USHORT ValueNameOffset;
+	USHORT DataLength;		// bytes captured, up to MaxRegistryDataSizeV2
+	USHORT DataOffset;
+};
+
+//
+// v3: image paths are interned. a read hands out a StringDefinitionInfo for
+// a path the first time one of its ids shows up after the client asked for v3,
+// ahead of the event using it. paths that don't fit the driver's table,
+// and all events going through the mapped channel, stay ImageLoadInfoV2.
+//
+
+struct ImageLoadInternedInfo : ItemHeader {
+	ULONG ProcessId;
+	ULONG ImageNameId;		// see StringDefinitionInfo
+	void* LoadAddress;
+	ULONG_PTR ImageSize;
+};
+
+struct StringDefinitionInfo : ItemHeader {
+	ULONG Id;
+	USHORT Length;			// in WCHARs, not NULL terminated
+	USHORT Offset;
+};
+
+// thread activity of one process over an aggregation interval (SysMonAggregation).
+// Time is the end of the interval
+struct ThreadSummaryInfo : ItemHeader {
+	ULONG ProcessId;
+	ULONG Creates;
+	ULONG Exits;
+	ULONG LiveThreads;		// created minus exited since the driver started counting
+	LONG64 MinLifetime;		// of the threads that exited, 100 nsec units; 0 if none did
+	LONG64 MaxLifetime;
+	ULONG IntervalMs;
+	ULONG ProcessExited;	// last summary for this process
+};
+
+// records the rate limits (SysMonRateLimits) kept out over an interval.
+// Time is the end of the interval
+struct RateSummaryInfo : ItemHeader {
+	ULONG IntervalMs;
+	ULONG Suppressed[SysMonMaxTypes];	// by ItemType
+	ULONG TopProcessId;		// the process that lost the most, 0 if not known
+	ULONG TopProcessSuppressed;
+};
+
+//
+// v4: ItemHeader::Time is the raw value of a cycle counter, where the driver has
+// a reliable one (the driver won't agree to v4 otherwise). a TimeCalibrationInfo
+// comes first in a read whenever the calibration changed since the last one sent:
+//   system time = SystemTime + (((counter - Time) * Scale) >> SysMonTimeScaleShift)
+// events going through the mapped channel keep system time.
+//
+
+const ULONG SysMonTimeScaleShift = 48;
+
+struct TimeCalibrationInfo : ItemHeader {	// Time: the counter at SystemTime
+	LARGE_INTEGER SystemTime;
+	ULONG64 Scale;			// 100 nsec units per counter tick, << SysMonTimeScaleShift
+	ULONG64 Frequency;		// counter ticks per second
+};
+
+//
+// v5: a new process' command line is a StringDefinitionInfo like a v3 image path, its id
+// with SysMonCommandLineIdBit set, and a read sends it ahead of the first record this
+// client gets that uses it. the driver keeps the last SysMonCommandLineCapacity distinct
+// lines, a repeat of one of those costs a ProcessCreateInterned and nothing more; a client
+// needn't keep definitions more than that many ids behind the newest it was sent.
+// a line stays pinned while a queued record uses it, so every record comes with a line
+// that can still be sent; when the oldest line is pinned a new line isn't interned and
+// the record goes as a full v1 ProcessCreateInfo instead.
+// events going through the mapped channel stay ProcessCreateInfo.
+//
+
+const ULONG SysMonCommandLineIdBit = 0x80000000;
+const ULONG SysMonCommandLineCapacity = 256;
+
+struct ProcessCreateInternedInfo : ItemHeader {
+	ULONG ProcessId;
+	ULONG ParentProcessId;
+	ULONG CommandLineId;		// 0: no command line
+	USHORT CommandLineLength;	// WCHARs in the whole line, the definition has what was captured
+	USHORT Reserved;
+};
@@ -0,0 +1,143 @@
+#pragma once
+
+#include "ProcessTable.h"
+
+//
+// thread churn per process, instead of a record for every thread create and exit.
+// producers find their process' counters in a ProcessTable and bump them with
+// interlocked operations; the collector reads and resets the counters while it
+// rebuilds the table, dropping processes that exited.
+//
+
+struct ThreadCounters {
+	ULONG ProcessId;
+	ULONG Creates;			// since the last collection
+	ULONG Exits;
+	LONG Live;				// created minus exited since the process was first seen
+	LONG64 MinLifetime;		// of the threads that exited, 100 nsec units
+	LONG64 MaxLifetime;
+	bool ProcessExited;
+};
+
+class ThreadAggregator {
+public:
+	// capacity must be a power of 2
+	bool Init(ULONG capacity, ULONG tag) {
+		return _processes.Init(capacity, tag);
+	}
+
+	void Destroy() {
+		_processes.Destroy();
+	}
+
+	//
+	// producers; false if the process has no room in the table
+	//
+
+	bool OnCreate(ULONG processId) {
+		Processes::Shared locker(_processes);
+		auto entry = _processes.Find(processId);
+		if (entry == nullptr)
+			return false;
+
+		InterlockedIncrement(&entry->Creates);
+		InterlockedIncrement(&entry->Live);
+		return true;
+	}
+
+	bool OnExit(ULONG processId, LONG64 lifetime) {
+		Processes::Shared locker(_processes);
+		auto entry = _processes.Find(processId);
+		if (entry == nullptr)
+			return false;
+
+		InterlockedIncrement(&entry->Exits);
+		InterlockedDecrement(&entry->Live);
+		for (auto min = ReadNoFence64(&entry->MinLifetime); lifetime < min; ) {
+			auto seen = InterlockedCompareExchange64(&entry->MinLifetime, lifetime, min);
+			if (seen == min)
+				break;
+			min = seen;
+		}
+		for (auto max = ReadNoFence64(&entry->MaxLifetime); lifetime > max; ) {
+			auto seen = InterlockedCompareExchange64(&entry->MaxLifetime, lifetime, max);
+			if (seen == max)
+				break;
+			max = seen;
+		}
+		return true;
+	}
+
+	// the next collection reports the process one last time and forgets it
+	void OnProcessExit(ULONG processId) {
+		Processes::Shared locker(_processes);
+		auto entry = _processes.Find(processId, false);
+		if (entry)
+			InterlockedExchange(&entry->Exited, 1);
+	}
+
+	//
+	// collector, one at a time. copies out every process with something to report
+	// and resets its counters; returns how many were copied
+	//
+
+	ULONG Collect(ThreadCounters* counters, ULONG max) {
+		ULONG collected = 0;
+		_processes.Rebuild([&](Entry& entry) {
+			if ((entry.Creates || entry.Exits || entry.Exited) && collected < max) {
+				auto& out = counters[collected++];
+				out.ProcessId = entry.ProcessId;
+				out.Creates = entry.Creates;
+				out.Exits = entry.Exits;
+				out.Live = entry.Live > 0 ? entry.Live : 0;
+				out.MinLifetime = entry.Exits ? entry.MinLifetime : 0;
+				out.MaxLifetime = entry.MaxLifetime;
+				out.ProcessExited = entry.Exited != 0;
+				if (entry.Exited)
+					return false;
+
+				entry.Creates = entry.Exits = 0;
+				entry.ResetLifetimes();
+			}
+			// still running (or not reported yet)
+			return true;
+		});
+		return collected;
+	}
+
+	// forgets every process, for when aggregation is turned off
+	void Reset() {
+		_processes.Reset();
+	}
+
+	ULONG Count() const {
+		return _processes.Count();
+	}
+
+private:
+	struct Entry {
+		volatile LONG ProcessId;	// 0: free
+		volatile LONG Creates;
+		volatile LONG Exits;
+		volatile LONG Live;
+		volatile LONG64 MinLifetime;
+		volatile LONG64 MaxLifetime;
+		volatile LONG Exited;
+
+		void ResetLifetimes() {
+			MinLifetime = 0x7fffffffffffffffLL;
+			MaxLifetime = 0;
+		}
+
+		// free slots are ready to count in
+		void Clear() {
+			::memset((void*)this, 0, sizeof(*this));
+			ResetLifetimes();
+		}
+	};
+
+	typedef ProcessTable<Entry> Processes;
+
+private:
+	Processes _processes;
+};
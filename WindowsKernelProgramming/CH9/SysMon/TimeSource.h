@@ -0,0 +1,232 @@
+#pragma once
+
+#include "Platform.h"
+#include "SysMonCommon.h"
+
+//
+// event timestamps. reading the CPU's cycle counter costs a few nsec, where
+// KeQuerySystemTimePrecise goes through the HAL every time, so records are stamped
+// with the raw counter and a TimeScale (a counter value, the system time it was read
+// at and the counter's rate) turns it into system time when someone looks at it.
+// the counter must tick at a constant rate and agree between CPUs (an invariant TSC),
+// TimeCounterIsReliable says whether it does.
+// back ends: kernel, Windows user mode (rdtsc/QueryPerformanceCounter)
+// and POSIX (rdtsc/clock_gettime).
+//
+
+#if defined(_KERNEL_MODE) || defined(_WIN32)
+#include <intrin.h>
+#else
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SYSMON_TSC 1
+#endif
+
+inline ULONG64 ReadTimeCounter() {
+#if defined(SYSMON_TSC)
+	return __rdtsc();
+#elif defined(_KERNEL_MODE)
+	return KeQueryPerformanceCounter(nullptr).QuadPart;
+#elif defined(_WIN32)
+	LARGE_INTEGER counter;
+	::QueryPerformanceCounter(&counter);
+	return counter.QuadPart;
+#else
+	timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// 100 nsec units since 1601, like KeQuerySystemTimePrecise
+inline LONGLONG ReadSystemTime() {
+#if defined(_KERNEL_MODE)
+	LARGE_INTEGER time;
+	KeQuerySystemTimePrecise(&time);
+	return time.QuadPart;
+#elif defined(_WIN32)
+	LARGE_INTEGER time;
+	::GetSystemTimePreciseAsFileTime((FILETIME*)&time);
+	return time.QuadPart;
+#else
+	const LONGLONG UnixEpoch = 116444736000000000LL;	// 1970 in 100 nsec units since 1601
+	timespec ts;
+	::clock_gettime(CLOCK_REALTIME, &ts);
+	return UnixEpoch + ts.tv_sec * 10000000LL + ts.tv_nsec / 100;
+#endif
+}
+
+// whether ReadTimeCounter ticks at a constant rate on all CPUs alike
+inline bool TimeCounterIsReliable() {
+#if defined(SYSMON_TSC)
+	// CPUID 80000007h, EDX bit 8: invariant TSC
+#if defined(_KERNEL_MODE) || defined(_WIN32)
+	int regs[4];
+	__cpuid(regs, 0x80000000);
+	if ((unsigned)regs[0] < 0x80000007)
+		return false;
+	__cpuid(regs, 0x80000007);
+	return (regs[3] & (1 << 8)) != 0;
+#else
+	unsigned eax, ebx, ecx, edx;
+	return __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1 << 8)) != 0;
+#endif
+#else
+	// the OS' own counter
+	return true;
+#endif
+}
+
+//
+// fixed point helpers, scales are 100 nsec units per tick << SysMonTimeScaleShift.
+// done in 32 bit pieces so they work the same everywhere, kernel included
+//
+
+// (ticks * scale) >> SysMonTimeScaleShift
+inline ULONG64 ScaleTicks(ULONG64 ticks, ULONG64 scale) {
+	ULONG64 al = (ULONG)ticks, ah = ticks >> 32, bl = (ULONG)scale, bh = scale >> 32;
+	ULONG64 ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+	ULONG64 middle = (ll >> 32) + (ULONG)lh + (ULONG)hl;
+	ULONG64 low = (middle << 32) | (ULONG)ll;
+	ULONG64 high = hh + (lh >> 32) + (hl >> 32) + (middle >> 32);
+	return (high << (64 - SysMonTimeScaleShift)) | (low >> SysMonTimeScaleShift);
+}
+
+// (value << SysMonTimeScaleShift) / divisor, the result has to fit in 64 bits
+inline ULONG64 DivideScaled(ULONG64 value, ULONG64 divisor) {
+	ULONG64 high = value >> (64 - SysMonTimeScaleShift), low = value << SysMonTimeScaleShift;
+	ULONG64 remainder = 0, quotient = 0;
+	for (int bit = 127; bit >= 0; bit--) {
+		auto carry = remainder >> 63;
+		remainder = (remainder << 1) | ((bit >= 64 ? high >> (bit - 64) : low >> bit) & 1);
+		quotient <<= 1;
+		if (carry || remainder >= divisor) {
+			remainder -= divisor;
+			quotient |= 1;
+		}
+	}
+	return quotient;
+}
+
+struct TimeScale {
+	ULONG64 Counter;		// read at SystemTime
+	LONGLONG SystemTime;
+	ULONG64 Scale;			// 0: not calibrated
+
+	LONGLONG ToSystemTime(ULONG64 counter) const {
+		return counter >= Counter ? SystemTime + (LONGLONG)ScaleTicks(counter - Counter, Scale)
+			: SystemTime - (LONGLONG)ScaleTicks(Counter - counter, Scale);
+	}
+
+	// ticks per second
+	ULONG64 Frequency() const {
+		return Scale ? DivideScaled(10000000, Scale) : 0;
+	}
+};
+
+struct TimeAnchor {
+	ULONG64 Counter;
+	LONGLONG SystemTime;
+};
+
+// a counter and a system time reading that go together. the counter is read on both
+// sides of the system time and the tightest of a few tries is kept, an interrupt
+// in between only makes one try worse
+inline TimeAnchor TakeTimeAnchor() {
+	TimeAnchor anchor = {};
+	auto width = ~0ULL;
+	for (int i = 0; i < 4; i++) {
+		auto before = ReadTimeCounter();
+		auto time = ReadSystemTime();
+		auto after = ReadTimeCounter();
+		if (after - before < width) {
+			width = after - before;
+			anchor.Counter = before + width / 2;
+			anchor.SystemTime = time;
+		}
+	}
+	return anchor;
+}
+
+//
+// keeps a TimeScale current. Calibrate takes a new anchor and measures the counter's
+// rate against an older one; callers serialize Init and Calibrate. readers don't lock:
+// the scale is kept twice, like EventFilter's tables, and a reader retries
+// only if it raced with two calibrations in a row.
+//
+class TimeCalibrator {
+public:
+	void Init() {
+		_sequence = 0;
+		_base = TakeTimeAnchor();
+
+		// a first rate, good to about 1e-4, for conversions before the first calibration
+		TimeAnchor now;
+		do {
+			YieldProcessor();
+			now = TakeTimeAnchor();
+		} while (now.SystemTime - _base.SystemTime < InitialSpan);
+		TimeScale scale = { now.Counter, now.SystemTime, DivideScaled(now.SystemTime - _base.SystemTime, now.Counter - _base.Counter) };
+		Publish(scale);
+	}
+
+	void Calibrate() {
+		auto now = TakeTimeAnchor();
+		auto scale = Current();
+		scale.Counter = now.Counter;
+		scale.SystemTime = now.SystemTime;
+
+		// the longer the span, the less the anchors' jitter matters;
+		// starting over now and then follows the system clock being adjusted
+		auto span = now.SystemTime - _base.SystemTime;
+		if (span >= MinRateSpan && now.Counter > _base.Counter)
+			scale.Scale = DivideScaled(span, now.Counter - _base.Counter);
+		if (span < 0 || span >= RebaseSpan)
+			_base = now;
+		Publish(scale);
+	}
+
+	TimeScale Current() const {
+		for (;;) {
+			auto sequence = ReadULongAcquire(&_sequence);
+			auto scale = _scales[sequence & 1];
+			ReadBarrier();
+			if (ReadULongNoFence(&_sequence) == sequence)
+				return scale;
+		}
+	}
+
+	LONGLONG ToSystemTime(ULONG64 counter) const {
+		return Current().ToSystemTime(counter);
+	}
+
+	// changes with every calibration
+	ULONG Generation() const {
+		return ReadULongAcquire(&_sequence) / 2;
+	}
+
+private:
+	static const LONGLONG InitialSpan = 10000;			// 1 msec
+	static const LONGLONG MinRateSpan = 1000000;		// 100 msec
+	static const LONGLONG RebaseSpan = 600000000;		// 60 sec
+
+	void Publish(const TimeScale& scale) {
+		for (int i = 0; i < 2; i++) {
+			WriteULongRelease(&_sequence, _sequence + 1);
+			MemoryBarrier();
+			_scales[i & 1] = scale;
+		}
+		MemoryBarrier();
+	}
+
+private:
+	volatile ULONG _sequence;
+	TimeScale _scales[2];
+	TimeAnchor _base;
+};
@@ -0,0 +1,631 @@
+#pragma once
+
+#include "Platform.h"
+#include "SysMonCommon.h"
+#include "BlockCompressor.h"
+#include "CommandLineDefinitions.h"
+#include <stdio.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+//
+// records event batches, exactly as read from the driver, into segment files.
+// a segment is sized up front and mapped, appending is a copy into the mapping
+// and a header update, no formatting and no write calls.
+// once a segment is full the next one is started (name.000001.trace, name.000002.trace...)
+// and the finished one is trimmed to what was written.
+// compressed segments hold a block per batch instead; the batches are handed to
+// a thread that compresses them into the mapping, so Append is still just a copy.
+// user mode only (Windows or POSIX).
+//
+
+const ULONG TraceMagic = 0x52544D53;	// "SMTR"
+const ULONG TraceVersion = 2;			// 1: no compression, header up to LastTime
+
+enum TraceCompression : ULONG {
+	TraceCompressionNone,
+	TraceCompressionBlock,		// BlockCompressor blocks, each after a TraceBlockHeader
+};
+
+struct TraceSegmentHeader {
+	ULONG Magic;
+	ULONG Version;
+	ULONG HeaderSize;			// records start here
+	ULONG Format;				// SysMonFormatXxx the records were read in
+	ULONG Sequence;				// segment number, from 1
+	ULONG Complete;				// closed cleanly; if not, DataSize is still good
+	ULONG64 DataSize;			// bytes of records
+	ULONG64 RecordCount;
+	LARGE_INTEGER FirstTime;	// earliest and latest record time (counter values in v4),
+	LARGE_INTEGER LastTime;		// batches from different CPUs aren't strictly in order
+	ULONG Compression;			// TraceCompressionXxx
+	ULONG Reserved;
+	ULONG64 RawSize;			// bytes of records once decompressed, DataSize is what's stored
+};
+
+// a compressed segment's data is a sequence of these, each followed by StoredSize
+// bytes and padded to 8; StoredSize == RawSize: the records as they are
+struct TraceBlockHeader {
+	ULONG RawSize;
+	ULONG StoredSize;
+};
+
+#if defined(_WIN32)
+
+class MappedFile {
+public:
+	bool Create(const char* path, ULONG64 size) {
+		_file = ::CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (_file == INVALID_HANDLE_VALUE)
+			return false;
+
+		// mapping a section bigger than the file extends it
+		return Map(size, PAGE_READWRITE, FILE_MAP_WRITE);
+	}
+
+	bool Open(const char* path) {
+		_file = ::CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (_file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER size;
+		return ::GetFileSizeEx(_file, &size) && size.QuadPart > 0 && Map(size.QuadPart, PAGE_READONLY, FILE_MAP_READ);
+	}
+
+	// truncate: file size to keep, 0 leaves it as is
+	void Close(ULONG64 truncate = 0) {
+		if (_data) {
+			::UnmapViewOfFile(_data);
+			_data = nullptr;
+		}
+		if (_mapping) {
+			::CloseHandle(_mapping);
+			_mapping = nullptr;
+		}
+		if (_file != INVALID_HANDLE_VALUE) {
+			LARGE_INTEGER size;
+			size.QuadPart = truncate;
+			if (truncate && ::SetFilePointerEx(_file, size, nullptr, FILE_BEGIN))
+				::SetEndOfFile(_file);
+			::CloseHandle(_file);
+			_file = INVALID_HANDLE_VALUE;
+		}
+	}
+
+	UCHAR* Data() const {
+		return _data;
+	}
+
+	ULONG64 Size() const {
+		return _size;
+	}
+
+private:
+	bool Map(ULONG64 size, DWORD protect, DWORD access) {
+		_mapping = ::CreateFileMappingA(_file, nullptr, protect, (DWORD)(size >> 32), (DWORD)size, nullptr);
+		if (_mapping == nullptr)
+			return false;
+
+		_data = (UCHAR*)::MapViewOfFile(_mapping, access, 0, 0, (SIZE_T)size);
+		_size = size;
+		return _data != nullptr;
+	}
+
+private:
+	HANDLE _file = INVALID_HANDLE_VALUE;
+	HANDLE _mapping = nullptr;
+	UCHAR* _data = nullptr;
+	ULONG64 _size = 0;
+};
+
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class MappedFile {
+public:
+	bool Create(const char* path, ULONG64 size) {
+		_fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (_fd < 0)
+			return false;
+
+		// sized, not preallocated: posix_fallocate leaves unwritten extents on ext4
+		// and converting them made every first write to a page slower still
+		if (::ftruncate(_fd, (off_t)size) != 0)
+			return false;
+
+		return Map(size, PROT_READ | PROT_WRITE);
+	}
+
+	bool Open(const char* path) {
+		_fd = ::open(path, O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		return _fd >= 0 && ::fstat(_fd, &st) == 0 && st.st_size > 0 && Map(st.st_size, PROT_READ);
+	}
+
+	void Close(ULONG64 truncate = 0) {
+		if (_data) {
+			::munmap(_data, _size);
+			_data = nullptr;
+		}
+		if (_fd >= 0) {
+			if (truncate)
+				(void)!::ftruncate(_fd, (off_t)truncate);
+			::close(_fd);
+			_fd = -1;
+		}
+	}
+
+	UCHAR* Data() const {
+		return _data;
+	}
+
+	ULONG64 Size() const {
+		return _size;
+	}
+
+private:
+	bool Map(ULONG64 size, int protect) {
+		auto data = ::mmap(nullptr, size, protect, MAP_SHARED, _fd, 0);
+		if (data == MAP_FAILED)
+			return false;
+
+		_data = (UCHAR*)data;
+		_size = size;
+		return true;
+	}
+
+private:
+	int _fd = -1;
+	UCHAR* _data = nullptr;
+	ULONG64 _size = 0;
+};
+
+#endif
+
+class TraceRecorder {
+public:
+	~TraceRecorder() {
+		Close();
+	}
+
+	// baseName: segment files are baseName.NNNNNN.trace
+	bool Init(const char* baseName, ULONG64 segmentSize, ULONG format, bool compress = false) {
+		if (segmentSize < MinSegmentSize)
+			segmentSize = MinSegmentSize;
+		::snprintf(_baseName, sizeof(_baseName), "%s", baseName);
+		_segmentSize = segmentSize;
+		_format = format;
+		_compression = compress ? TraceCompressionBlock : TraceCompressionNone;
+		_sequence = 0;
+		_records = _bytes = _stored = 0;
+		if (!Rotate())
+			return false;
+
+		if (compress) {
+			_stopping = _failed = false;
+			_worker = std::thread([this] { Compress(); });
+		}
+		return true;
+	}
+
+	void Close() {
+		if (_worker.joinable()) {
+			// whatever was handed over still goes in
+			{
+				std::lock_guard<std::mutex> locker(_lock);
+				_stopping = true;
+			}
+			_ready.notify_one();
+			_worker.join();
+		}
+
+		if (_header == nullptr)
+			return;
+
+		_header->Complete = 1;
+		auto used = _header->HeaderSize + _header->DataSize;
+		_header = nullptr;
+		_file.Close(used);
+	}
+
+	//
+	// appends a batch of whole records (ItemHeader::Size apart), starting
+	// new segments as needed; false if the batch is malformed or a file
+	// couldn't be created. compressing, that is found out by the worker and
+	// a later Append returns false
+	//
+	bool Append(const void* records, ULONG size) {
+		if (_worker.joinable())
+			return Hand(records, size);
+		return Store(records, size);
+	}
+
+	ULONG Segments() const {
+		return _sequence;
+	}
+
+	ULONG64 Records() const {
+		return _records;
+	}
+
+	// record bytes, as read
+	ULONG64 Bytes() const {
+		return _bytes;
+	}
+
+	// what they took in the segments
+	ULONG64 StoredBytes() const {
+		return _stored;
+	}
+
+private:
+	static const ULONG64 MinSegmentSize = 1 << 20;
+	static const size_t MaxPending = 64;	// batches the worker may fall behind before Append waits
+
+	bool Store(const void* records, ULONG size) {
+		if (_compression != TraceCompressionNone)
+			return StoreBlock((const UCHAR*)records, size);
+
+		auto p = (const UCHAR*)records, end = p + size;
+		while (p < end) {
+			if (_header == nullptr)
+				return false;
+
+			// take as many whole records as fit
+			auto room = _file.Size() - _header->HeaderSize - _header->DataSize;
+			auto chunk = p;
+			ULONG count = 0;
+			LARGE_INTEGER first, last;
+			first.QuadPart = 0x7fffffffffffffffLL;
+			last.QuadPart = 0;
+			while (chunk < end) {
+				auto header = (const ItemHeader*)chunk;
+				if (header->Size < sizeof(ItemHeader) || header->Size > end - chunk)
+					return false;
+				if ((ULONG64)(chunk - p) + header->Size > room)
+					break;
+
+				if (header->Time.QuadPart < first.QuadPart)
+					first = header->Time;
+				if (header->Time.QuadPart > last.QuadPart)
+					last = header->Time;
+				Remember(header);
+				chunk += header->Size;
+				count++;
+			}
+
+			if (count == 0) {
+				if (!Rotate())
+					return false;
+				continue;
+			}
+
+			Write(p, (ULONG)(chunk - p), count, first, last);
+			p = chunk;
+		}
+		return true;
+	}
+
+	// a compressed segment takes the batch whole, as one block
+	bool StoreBlock(const UCHAR* records, ULONG size) {
+		if (_header == nullptr)
+			return false;
+
+		ULONG count = 0;
+		LARGE_INTEGER first, last;
+		first.QuadPart = 0x7fffffffffffffffLL;
+		last.QuadPart = 0;
+		for (auto p = records, end = records + size; p < end; ) {
+			auto header = (const ItemHeader*)p;
+			if (header->Size < sizeof(ItemHeader) || header->Size > end - p)
+				return false;
+			if (header->Time.QuadPart < first.QuadPart)
+				first = header->Time;
+			if (header->Time.QuadPart > last.QuadPart)
+				last = header->Time;
+			Remember(header);
+			p += header->Size;
+			count++;
+		}
+		if (count == 0)
+			return true;
+
+		// room for it stored as is, whatever it compresses to
+		if (BlockRoom() < size && (!Rotate() || BlockRoom() < size))
+			return false;
+		Write(records, size, count, first, last);
+		return true;
+	}
+
+	// record bytes the next block can have in the current segment
+	ULONG64 BlockRoom() const {
+		const ULONG overhead = sizeof(TraceBlockHeader) + 7;
+		auto room = _file.Size() - _header->HeaderSize - _header->DataSize;
+		return room < overhead ? 0 : room - overhead;
+	}
+
+	// v3 image paths, v4 calibrations and v5 command lines, to repeat at the start of each segment
+	void Remember(const ItemHeader* header) {
+		auto record = (const UCHAR*)header;
+		if (header->Type == ItemType::StringDefinition && _lines.IsCommandLine(((const StringDefinitionInfo*)header)->Id))
+			_lines.Define(((const StringDefinitionInfo*)header)->Id).assign(record, record + header->Size);
+		else if (header->Type == ItemType::StringDefinition)
+			_definitions.insert(_definitions.end(), record, record + header->Size);
+		else if (header->Type == ItemType::TimeCalibration)
+			_calibration.assign(record, record + header->Size);
+	}
+
+	// the reader's side: a copy into a spare buffer for the worker
+	bool Hand(const void* records, ULONG size) {
+		std::vector<UCHAR> batch;
+		{
+			std::unique_lock<std::mutex> locker(_lock);
+			_drained.wait(locker, [this] { return _pending.size() < MaxPending || _failed; });
+			if (_failed)
+				return false;
+			if (!_spare.empty()) {
+				batch.swap(_spare.back());
+				_spare.pop_back();
+			}
+		}
+
+		batch.assign((const UCHAR*)records, (const UCHAR*)records + size);
+		{
+			std::lock_guard<std::mutex> locker(_lock);
+			_pending.push_back(std::move(batch));
+		}
+		_ready.notify_one();
+		return true;
+	}
+
+	// the worker: compresses and stores batches in the order they came
+	void Compress() {
+		std::unique_lock<std::mutex> locker(_lock);
+		for (;;) {
+			_ready.wait(locker, [this] { return !_pending.empty() || _stopping; });
+			if (_pending.empty())
+				break;
+
+			auto batch = std::move(_pending.front());
+			_pending.pop_front();
+			locker.unlock();
+			auto stored = _failed || Store(batch.data(), (ULONG)batch.size());
+			locker.lock();
+
+			if (!stored)
+				_failed = true;
+			_spare.push_back(std::move(batch));
+			_drained.notify_one();
+		}
+	}
+
+	bool Rotate() {
+		Close();
+
+		char path[sizeof(_baseName) + 16];
+		::snprintf(path, sizeof(path), "%s.%06u.trace", _baseName, ++_sequence);
+		if (!_file.Create(path, _segmentSize)) {
+			_file.Close();
+			return false;
+		}
+
+		_header = (TraceSegmentHeader*)_file.Data();
+		::memset(_header, 0, sizeof(*_header));
+		_header->Magic = TraceMagic;
+		_header->Version = TraceVersion;
+		_header->HeaderSize = sizeof(TraceSegmentHeader);
+		_header->Format = _format;
+		_header->Sequence = _sequence;
+		_header->Compression = _compression;
+
+		// v3 image paths, v4 calibrations and v5 command lines go out once per client; repeat
+		// the latest calibration, the paths seen so far and the lines still in use so every
+		// segment can be read on its own
+		Repeat(_calibration);
+		if (_definitions.size() <= _file.Size() / 2)
+			Repeat(_definitions);
+		std::vector<UCHAR> lines;
+		_lines.ForEach([&](ULONG, const std::vector<UCHAR>& record) {
+			lines.insert(lines.end(), record.begin(), record.end());
+		});
+		if (lines.size() <= _file.Size() / 2)
+			Repeat(lines);
+		return true;
+	}
+
+	void Repeat(const std::vector<UCHAR>& records) {
+		if (records.empty())
+			return;
+
+		ULONG count = 0;
+		LARGE_INTEGER first, last;
+		first.QuadPart = 0x7fffffffffffffffLL;
+		last.QuadPart = 0;
+		for (size_t offset = 0; offset < records.size(); offset += ((const ItemHeader*)&records[offset])->Size) {
+			auto header = (const ItemHeader*)&records[offset];
+			if (header->Time.QuadPart < first.QuadPart)
+				first = header->Time;
+			if (header->Time.QuadPart > last.QuadPart)
+				last = header->Time;
+			count++;
+		}
+		Write(records.data(), (ULONG)records.size(), count, first, last);
+	}
+
+	void Write(const UCHAR* records, ULONG size, ULONG count, LARGE_INTEGER first, LARGE_INTEGER last) {
+		auto target = _file.Data() + _header->HeaderSize + _header->DataSize;
+		auto stored = size;
+		if (_compression != TraceCompressionNone) {
+			// straight into the mapping; as is if it doesn't get any smaller
+			auto block = (TraceBlockHeader*)target;
+			auto packed = _compressor.Compress(records, size, target + sizeof(TraceBlockHeader), size - 1);
+			if (packed == 0)
+				::memcpy(target + sizeof(TraceBlockHeader), records, size);
+			block->RawSize = size;
+			block->StoredSize = packed ? packed : size;
+			stored = (sizeof(TraceBlockHeader) + block->StoredSize + 7) & ~7;
+		}
+		else {
+			::memcpy(target, records, size);
+		}
+		if (_header->RecordCount == 0 || first.QuadPart < _header->FirstTime.QuadPart)
+			_header->FirstTime = first;
+		if (last.QuadPart > _header->LastTime.QuadPart)
+			_header->LastTime = last;
+		_header->RecordCount += count;
+		_header->DataSize += stored;
+		_header->RawSize += size;
+		_records += count;
+		_bytes += size;
+		_stored += stored;
+	}
+
+private:
+	MappedFile _file;
+	TraceSegmentHeader* _header = nullptr;
+	std::vector<UCHAR> _definitions;	// every image path StringDefinition recorded
+	CommandLineDefinitions<std::vector<UCHAR>> _lines;	// the command line ones the driver may still refer to
+	std::vector<UCHAR> _calibration;	// the latest TimeCalibration
+	char _baseName[260];
+	ULONG64 _segmentSize;
+	ULONG _format;
+	ULONG _compression = TraceCompressionNone;
+	ULONG _sequence = 0;
+	ULONG64 _records = 0, _bytes = 0, _stored = 0;
+
+	// compressed segments
+	BlockCompressor _compressor;
+	std::thread _worker;
+	std::mutex _lock;
+	std::condition_variable _ready;		// something pending, or stopping
+	std::condition_variable _drained;	// the worker took one
+	std::deque<std::vector<UCHAR>> _pending;
+	std::vector<std::vector<UCHAR>> _spare;
+	bool _stopping = false;
+	bool _failed = false;
+};
+
+// maps a segment for reading, compressed ones are decompressed a block at a time
+class TraceReader {
+public:
+	~TraceReader() {
+		Close();
+	}
+
+	bool Open(const char* path) {
+		if (!_file.Open(path)) {
+			_file.Close();
+			return false;
+		}
+
+		// version 1 headers stop before Compression, the rest reads as none
+		auto header = (const TraceSegmentHeader*)_file.Data();
+		const ULONG version1Size = offsetof(TraceSegmentHeader, Compression);
+		if (_file.Size() < version1Size || header->Magic != TraceMagic || header->Version == 0 || header->Version > TraceVersion ||
+			header->HeaderSize < (header->Version == 1 ? version1Size : sizeof(TraceSegmentHeader)) ||
+			header->HeaderSize > _file.Size() || header->DataSize > _file.Size() - header->HeaderSize) {
+			_file.Close();
+			return false;
+		}
+
+		::memset(&_header, 0, sizeof(_header));
+		::memcpy(&_header, header, header->Version == 1 ? version1Size : sizeof(TraceSegmentHeader));
+		if (_header.Version == 1)
+			_header.RawSize = _header.DataSize;
+		if (_header.Compression > TraceCompressionBlock) {
+			_file.Close();
+			return false;
+		}
+		return true;
+	}
+
+	void Close() {
+		_file.Close();
+	}
+
+	// RawSize: bytes of records, DataSize: bytes of them stored
+	const TraceSegmentHeader& Header() const {
+		return _header;
+	}
+
+	bool Compressed() const {
+		return _header.Compression != TraceCompressionNone;
+	}
+
+	// an uncompressed segment's records, RawSize bytes of them
+	const UCHAR* Records() const {
+		return _file.Data() + _header.HeaderSize;
+	}
+
+	//
+	// visit(records, size) with the segment's records a batch at a time,
+	// the whole of an uncompressed segment at once. false if a block is
+	// damaged, the batches before it have been visited
+	//
+	template<typename Visit>
+	bool ForEachBatch(Visit&& visit) {
+		if (!Compressed()) {
+			if (_header.DataSize)
+				visit(Records(), (ULONG)_header.DataSize);
+			return true;
+		}
+
+		auto p = Records(), end = p + _header.DataSize;
+		while ((ULONG64)(end - p) >= sizeof(TraceBlockHeader)) {
+			TraceBlockHeader block;
+			::memcpy(&block, p, sizeof(block));
+			p += sizeof(block);
+			if (block.StoredSize > (ULONG64)(end - p) || block.StoredSize > block.RawSize)
+				return false;
+
+			if (block.StoredSize == block.RawSize) {
+				visit(p, block.RawSize);
+			}
+			else {
+				if (_batch.size() < block.RawSize)
+					_batch.resize(block.RawSize);
+				if (!BlockCompressor::Decompress(p, block.StoredSize, _batch.data(), block.RawSize))
+					return false;
+				visit(_batch.data(), block.RawSize);
+			}
+
+			// the next block starts 8 aligned
+			p += block.StoredSize;
+			auto padding = (ULONG64)(-(LONG64)(p - Records()) & 7);
+			p += padding < (ULONG64)(end - p) ? padding : end - p;
+		}
+		return true;
+	}
+
+	// stops at the first record that doesn't look right; returns how many were visited
+	template<typename Visit>
+	ULONG64 ForEach(Visit&& visit) {
+		ULONG64 count = 0;
+		bool good = true;
+		ForEachBatch([&](const UCHAR* records, ULONG size) {
+			auto p = records, end = p + size;
+			while (good && p + sizeof(ItemHeader) <= end) {
+				auto header = (const ItemHeader*)p;
+				if (header->Size < sizeof(ItemHeader) || header->Size > end - p) {
+					good = false;
+					break;
+				}
+				visit(header);
+				p += header->Size;
+				count++;
+			}
+		});
+		return count;
+	}
+
+private:
+	MappedFile _file;
+	TraceSegmentHeader _header;
+	std::vector<UCHAR> _batch;		// the current block, decompressed
+};
@@ -0,0 +1,153 @@
+// AggregateBench.cpp : thread churn recorded event by event (pool, ring, reader)
+// vs. counted per process and collected as summaries every interval.
+// producers create and exit threads in a few processes, as thread pools
+// and short lived workers do; the bench checks no create or exit goes uncounted.
+// the driver's producers can't be preempted holding the table's lock, these can:
+// with more producers than CPUs the collect times include waiting out their time slices.
+
+#include "BenchUtil.h"
+#include "../SysMon/EventRing.h"
+#include "../SysMon/ItemPool.h"
+#include "../SysMon/ThreadAggregator.h"
+#include <thread>
+#include <atomic>
+
+namespace {
+	const ULONG RingCapacity = 1024;
+	typedef EventRingSet<ItemHeader, RingCapacity> ItemRings;
+
+	ULONG PickProcess(ULONG& seed, ULONG processes) {
+		seed = seed * 1103515245 + 12345;
+		return ((seed >> 8) % processes + 1) * 4;
+	}
+
+	void RunRaw(ULONG producers, ULONG events, ULONG processes) {
+		ItemPool pool;
+		if (!pool.Init(DriverPoolClasses, ARRAYSIZE(DriverPoolClasses), 0)) {
+			printf("failed to allocate slabs\n");
+			return;
+		}
+		std::vector<ItemRings::Ring> buffers(producers);
+		ItemRings rings;
+		rings.Init(buffers.data(), producers);
+
+		std::vector<std::thread> threads;
+		auto start = NowNs();
+		for (ULONG p = 0; p < producers; p++) {
+			threads.emplace_back([&, p] {
+				ULONG seed = p + 1;
+				for (ULONG i = 0; i < events; i++) {
+					auto type = (i & 1) ? ItemType::ThreadExit : ItemType::ThreadCreate;
+					auto item = (ThreadCreateExitInfo*)pool.Alloc(type, sizeof(ThreadCreateExitInfo));
+					item->Type = type;
+					item->Size = sizeof(ThreadCreateExitInfo);
+					item->Time.QuadPart = i;
+					item->ProcessId = PickProcess(seed, processes);
+					item->ThreadId = i;
+					while (!rings.Push(p, item, item->Size))
+						std::this_thread::yield();
+				}
+			});
+		}
+
+		ULONGLONG total = (ULONGLONG)producers * events, count = 0, bytes = 0;
+		while (count < total) {
+			auto drained = rings.Drain([&](ItemHeader* item) {
+				bytes += item->Size;
+				pool.Free(item);
+				return true;
+			});
+			if (drained == 0)
+				std::this_thread::yield();
+			count += drained;
+		}
+		auto elapsed = NowNs() - start;
+
+		for (auto& t : threads)
+			t.join();
+		pool.Destroy();
+
+		PrintRate("raw records", count, elapsed);
+		printf("  %-24s %8.2f bytes/event\n", "", (double)bytes / total);
+	}
+
+	bool RunAggregated(ULONG producers, ULONG events, ULONG processes, ULONG intervalUs) {
+		ThreadAggregator aggregator;
+		if (!aggregator.Init(1024, 0)) {
+			printf("failed to allocate the table\n");
+			return false;
+		}
+		std::vector<ThreadCounters> counters(1024);
+
+		std::atomic<ULONG> done(0);
+		std::vector<std::thread> threads;
+		std::vector<ULONG> uncounted(producers);
+		auto start = NowNs();
+		for (ULONG p = 0; p < producers; p++) {
+			threads.emplace_back([&, p] {
+				ULONG seed = p + 1;
+				for (ULONG i = 0; i < events; i++) {
+					auto pid = PickProcess(seed, processes);
+					auto counted = (i & 1) ? aggregator.OnExit(pid, 1000 + i % 5000) : aggregator.OnCreate(pid);
+					if (!counted)
+						uncounted[p]++;
+				}
+				done++;
+			});
+		}
+
+		// the read thread's part: collect every interval, one record per busy process
+		ULONGLONG creates = 0, exits = 0, summaries = 0;
+		std::vector<LONGLONG> collect;
+		auto gather = [&] {
+			auto before = NowNs();
+			auto count = aggregator.Collect(counters.data(), (ULONG)counters.size());
+			collect.push_back(NowNs() - before);
+			for (ULONG i = 0; i < count; i++) {
+				creates += counters[i].Creates;
+				exits += counters[i].Exits;
+			}
+			summaries += count;
+		};
+		std::thread collector([&] {
+			while (done < producers) {
+				std::this_thread::sleep_for(std::chrono::microseconds(intervalUs));
+				gather();
+			}
+		});
+
+		for (auto& t : threads)
+			t.join();
+		auto elapsed = NowNs() - start;
+		collector.join();
+		gather();
+		aggregator.Destroy();
+
+		ULONGLONG total = (ULONGLONG)producers * events, missed = 0;
+		for (auto u : uncounted)
+			missed += u;
+		PrintRate("aggregated", total, elapsed);
+		printf("  %-24s %8.2f bytes/event (%llu summaries)\n", "", (double)summaries * sizeof(ThreadSummaryInfo) / total,
+			(unsigned long long)summaries);
+		PrintLatency("collect", collect);
+		if (creates + exits + missed != total) {
+			printf("  counted %llu creates and %llu exits out of %llu events\n", (unsigned long long)creates,
+				(unsigned long long)exits, (unsigned long long)total);
+			return false;
+		}
+		return true;
+	}
+}
+
+int AggregateBench(int argc, const char* argv[]) {
+	auto producers = ArgValue(argc, argv, "producers", 4);
+	auto events = ArgValue(argc, argv, "events", 1000000);
+	auto processes = ArgValue(argc, argv, "processes", 50);
+	auto interval = ArgValue(argc, argv, "interval", 100000);
+
+	printf("%u producers, %u thread events each, %u processes, collected every %u usec\n", producers, events, processes, interval);
+	RunRaw(producers, events, processes);
+	auto ok = RunAggregated(producers, events, processes, interval);
+	printf(ok ? "every event counted\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
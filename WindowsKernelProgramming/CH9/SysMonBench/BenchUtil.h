@@ -0,0 +1,118 @@
+#pragma once
+
+#include "../SysMon/Platform.h"
+#include "../SysMon/SysMonCommon.h"
+#include "../SysMon/ItemPool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+inline LONGLONG NowNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline ULONG ArgValue(int argc, const char* argv[], const char* name, ULONG defaultValue) {
+	auto len = strlen(name);
+	for (int i = 2; i < argc; i++)
+		if (strncmp(argv[i], name, len) == 0 && argv[i][len] == '=')
+			return (ULONG)strtoul(argv[i] + len + 1, nullptr, 0);
+	return defaultValue;
+}
+
+inline LONGLONG Percentile(std::vector<LONGLONG>& samples, double p) {
+	if (samples.empty())
+		return 0;
+	auto index = (size_t)(p * (samples.size() - 1));
+	std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+	return samples[index];
+}
+
+inline void PrintLatency(const char* name, std::vector<LONGLONG>& samples) {
+	auto p50 = Percentile(samples, 0.50);
+	auto p99 = Percentile(samples, 0.99);
+	auto p999 = Percentile(samples, 0.999);
+	printf("  %-24s p50 %8lld ns  p99 %8lld ns  p999 %8lld ns\n", name, (long long)p50, (long long)p99, (long long)p999);
+}
+
+inline void PrintRate(const char* name, ULONGLONG events, LONGLONG elapsedNs) {
+	printf("  %-24s %12llu events  %8.2f M events/s\n", name, (unsigned long long)events,
+		elapsedNs ? events * 1000.0 / elapsedNs : 0.0);
+}
+
+// same size classes the driver uses
+inline const ItemPoolClass DriverPoolClasses[] = {
+	{ ItemType::ProcessCreate, sizeof(ProcessCreateInfo) + 512 * sizeof(WCHAR), 256 },
+	{ ItemType::ProcessExit, sizeof(ProcessExitInfo), 256 },
+	{ ItemType::ThreadCreate, sizeof(ThreadCreateExitInfo), 4096 },
+	{ ItemType::ThreadExit, sizeof(ThreadCreateExitInfo), 4096 },
+	{ ItemType::ImageLoad, sizeof(ImageLoadInfo), 1024 },
+	{ ItemType::RegistrySetValue, sizeof(RegistrySetValueInfo), 512 },
+	{ ItemType::ImageLoadV2, sizeof(ImageLoadInfoV2) + 128 * sizeof(WCHAR), 1024 },
+	{ ItemType::RegistrySetValueV2, sizeof(RegistrySetValueInfoV2) + 128 * sizeof(WCHAR) + MaxRegistryDataSizeV2, 512 },
+	{ ItemType::ImageLoadInterned, sizeof(ImageLoadInternedInfo), 1024 },
+	{ ItemType::ThreadSummary, sizeof(ThreadSummaryInfo), 256 },
+	{ ItemType::RateSummary, sizeof(RateSummaryInfo), 16 },
+	{ ItemType::ProcessCreateInterned, sizeof(ProcessCreateInternedInfo), 256 },
+};
+
+// picks the next record type and size, roughly what a busy build machine produces
+inline void NextEventType(ULONG& seed, ItemType& type, ULONG& size) {
+	seed = seed * 1103515245 + 12345;
+	auto r = (seed >> 16) % 100;
+	if (r < 35) {
+		type = ItemType::ThreadCreate;
+		size = sizeof(ThreadCreateExitInfo);
+	}
+	else if (r < 70) {
+		type = ItemType::ThreadExit;
+		size = sizeof(ThreadCreateExitInfo);
+	}
+	else if (r < 90) {
+		type = ItemType::ImageLoad;
+		size = sizeof(ImageLoadInfo);
+	}
+	else if (r < 93) {
+		type = ItemType::ProcessCreate;
+		size = sizeof(ProcessCreateInfo) + (seed >> 8) % 2048;
+	}
+	else if (r < 96) {
+		type = ItemType::ProcessExit;
+		size = sizeof(ProcessExitInfo);
+	}
+	else {
+		type = ItemType::RegistrySetValue;
+		size = sizeof(RegistrySetValueInfo);
+	}
+}
+
+// the benchmark modes, one per file
+int RingBench(int argc, const char* argv[]);
+int PoolBench(int argc, const char* argv[]);
+int WakeBench(int argc, const char* argv[]);
+int ChannelBench(int argc, const char* argv[]);
+int FormatBench(int argc, const char* argv[]);
+int FilterBench(int argc, const char* argv[]);
+int DrainBench(int argc, const char* argv[]);
+int InternBench(int argc, const char* argv[]);
+int AggregateBench(int argc, const char* argv[]);
+int TraceBench(int argc, const char* argv[]);
+int PipelineBench(int argc, const char* argv[]);
+int TimeBench(int argc, const char* argv[]);
+int DisplayBench(int argc, const char* argv[]);
+int KeyBench(int argc, const char* argv[]);
+int StateBench(int argc, const char* argv[]);
+int ConsumerBench(int argc, const char* argv[]);
+int CompressBench(int argc, const char* argv[]);
+int ExportBench(int argc, const char* argv[]);
+int ExportCheck(int argc, const char* argv[]);
+int RateBench(int argc, const char* argv[]);
+int PriorityBench(int argc, const char* argv[]);
+int StatsBench(int argc, const char* argv[]);
+int CommandLineBench(int argc, const char* argv[]);
+int ReadBench(int argc, const char* argv[]);
+int ExprBench(int argc, const char* argv[]);
+int ExprCheck(int argc, const char* argv[]);
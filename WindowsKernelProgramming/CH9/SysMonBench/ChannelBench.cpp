@@ -0,0 +1,188 @@
+// ChannelBench.cpp : the mapped channel against the queue+copy read path.
+// two views of one shared memory object stand in for the driver's kernel
+// mapping and the client's user mapping.
+
+#include "BenchUtil.h"
+#include "../SysMon/EventRing.h"
+#include "../SysMon/ItemPool.h"
+#include "../SysMon/SharedChannel.h"
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	const ULONG RingCapacity = 1024;
+	typedef EventRingSet<ItemHeader, RingCapacity> ItemRings;
+
+	struct SharedMemory {
+		void* ProducerView = nullptr;
+		void* ConsumerView = nullptr;
+		ULONG Size;
+
+		bool Create(ULONG size) {
+			Size = size;
+#ifdef _WIN32
+			_section = ::CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, size, nullptr);
+			if (!_section)
+				return false;
+			ProducerView = ::MapViewOfFile(_section, FILE_MAP_WRITE, 0, 0, size);
+			ConsumerView = ::MapViewOfFile(_section, FILE_MAP_WRITE, 0, 0, size);
+#else
+			auto fd = ::memfd_create("sysmon-channel", 0);
+			if (fd < 0 || ::ftruncate(fd, size) != 0)
+				return false;
+			ProducerView = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			ConsumerView = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			::close(fd);
+			if (ProducerView == MAP_FAILED || ConsumerView == MAP_FAILED)
+				return false;
+#endif
+			return true;
+		}
+
+		~SharedMemory() {
+#ifdef _WIN32
+			::UnmapViewOfFile(ProducerView);
+			::UnmapViewOfFile(ConsumerView);
+			::CloseHandle(_section);
+#else
+			::munmap(ProducerView, Size);
+			::munmap(ConsumerView, Size);
+#endif
+		}
+
+#ifdef _WIN32
+		HANDLE _section;
+#endif
+	};
+
+	// what a notify routine does once it has memory for the record
+	void Fill(ItemHeader* item, ItemType type, ULONG size, ULONG i) {
+		item->Type = type;
+		item->Size = (USHORT)size;
+		item->Time.QuadPart = i;
+		if (type == ItemType::ImageLoad)
+			::memset(item + 1, 0, size - sizeof(ItemHeader));
+	}
+
+	// what the client does with each record
+	ULONGLONG Consume(const ItemHeader* item) {
+		return (ULONGLONG)item->Type + item->Size;
+	}
+
+	void RunChannel(ULONG producers, ULONG events, ULONG size) {
+		SharedMemory memory;
+		SharedChannel producer, consumer;
+		if (!memory.Create(size) || !producer.Init(memory.ProducerView, size) || !consumer.Attach(memory.ConsumerView)) {
+			printf("failed to set up shared memory\n");
+			return;
+		}
+
+		std::vector<std::thread> threads;
+		auto start = NowNs();
+		for (ULONG p = 0; p < producers; p++) {
+			threads.emplace_back([&, p] {
+				ULONG seed = p + 1;
+				for (ULONG i = 0; i < events; i++) {
+					ItemType type;
+					ULONG itemSize;
+					NextEventType(seed, type, itemSize);
+					void* item;
+					while ((item = producer.Reserve(itemSize)) == nullptr)
+						std::this_thread::yield();
+					Fill((ItemHeader*)item, type, itemSize, i);
+					producer.Commit(item);
+				}
+			});
+		}
+
+		ULONGLONG total = (ULONGLONG)producers * events, count = 0, sum = 0;
+		while (count < total) {
+			auto item = (ItemHeader*)consumer.Peek();
+			if (item == nullptr) {
+				std::this_thread::yield();
+				continue;
+			}
+			sum += Consume(item);
+			consumer.Advance();
+			count++;
+		}
+		auto elapsed = NowNs() - start;
+
+		for (auto& t : threads)
+			t.join();
+
+		PrintRate("mapped channel", count, elapsed);
+		printf("  %-24s %u (retried, not lost)\n", "ring full", consumer.Dropped());
+	}
+
+	void RunQueueAndCopy(ULONG producers, ULONG events) {
+		std::vector<ItemRings::Ring> buffers(producers);
+		ItemRings rings;
+		rings.Init(buffers.data(), producers);
+		ItemPool pool;
+		pool.Init(DriverPoolClasses, ARRAYSIZE(DriverPoolClasses), 0);
+
+		std::vector<std::thread> threads;
+		auto start = NowNs();
+		for (ULONG p = 0; p < producers; p++) {
+			threads.emplace_back([&, p] {
+				ULONG seed = p + 1;
+				for (ULONG i = 0; i < events; i++) {
+					ItemType type;
+					ULONG size;
+					NextEventType(seed, type, size);
+					auto item = pool.Alloc(type, size);
+					Fill(item, type, size, i);
+					while (!rings.Push(p, item, item->Size))
+						std::this_thread::yield();
+				}
+			});
+		}
+
+		// SysMonRead copying into the client's buffer, then the client walking it
+		static UCHAR buffer[1 << 16];
+		ULONGLONG total = (ULONGLONG)producers * events, count = 0, sum = 0;
+		while (count < total) {
+			ULONG used = 0;
+			rings.Drain([&](ItemHeader* item) {
+				if (sizeof(buffer) - used < item->Size)
+					return false;
+				::memcpy(buffer + used, item, item->Size);
+				used += item->Size;
+				pool.Free(item);
+				return true;
+			});
+			if (used == 0) {
+				std::this_thread::yield();
+				continue;
+			}
+			for (ULONG offset = 0; offset < used; count++) {
+				auto item = (ItemHeader*)(buffer + offset);
+				sum += Consume(item);
+				offset += item->Size;
+			}
+		}
+		auto elapsed = NowNs() - start;
+
+		for (auto& t : threads)
+			t.join();
+		pool.Destroy();
+
+		PrintRate("queue + copy", count, elapsed);
+	}
+}
+
+int ChannelBench(int argc, const char* argv[]) {
+	auto producers = ArgValue(argc, argv, "producers", 4);
+	auto events = ArgValue(argc, argv, "events", 1000000);
+	auto size = ArgValue(argc, argv, "size", 4 << 20);
+
+	printf("%u producers, %u events each\n", producers, events);
+	RunQueueAndCopy(producers, events);
+	RunChannel(producers, events, size + 4096);
+	return 0;
+}
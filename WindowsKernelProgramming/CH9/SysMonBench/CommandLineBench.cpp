@@ -0,0 +1,235 @@
+// CommandLineBench.cpp : process create records during a build storm, replayed from a
+// synthetic build: compilers with tens of KB of /I and /D options, some run again with
+// the same line (a second configuration, a dependency scan), the console host and a few
+// tools started with the same line over and over, and each project's link steps.
+// bytes queued and bytes a reader gets, and the time to build the records, for the whole
+// line (v1) and cut to a limit, each with and without CommandLineTable (v5). the reader
+// must get every line back as captured; with a reader far enough behind, lines pushed
+// out of the table before it got them are counted as lost.
+
+#include "BenchUtil.h"
+#include "../SysMon/CommandLineTable.h"
+#include "../SysMon/CommandLineDefinitions.h"
+#include <string>
+
+namespace {
+	typedef std::basic_string<WCHAR> Line;
+
+	Line Widen(const std::string& text) {
+		return Line(text.begin(), text.end());
+	}
+
+	ULONG Random(ULONG& seed) {
+		seed = seed * 1103515245 + 12345;
+		return seed >> 8;
+	}
+
+	// what a build starts, in order
+	std::vector<Line> BuildLines(ULONG count, ULONG projects) {
+		std::vector<std::string> prefixes, links;
+		ULONG seed = 7;
+		for (ULONG p = 0; p < projects; p++) {
+			std::string prefix = "\"C:\\Program Files\\Microsoft Visual Studio\\2022\\Enterprise\\VC\\Tools\\MSVC\\14.38.33130\\bin\\HostX64\\x64\\cl.exe\""
+				" /c /nologo /W4 /WX /O2 /Oi /GL /Gy /MD /EHsc /std:c++17 /permissive- /Zc:inline /Zi";
+			auto includes = 60 + Random(seed) % 240;
+			for (ULONG i = 0; i < includes; i++)
+				prefix += " /I\"D:\\src\\product\\components\\module" + std::to_string(Random(seed) % 500) + "\\include\"";
+			auto defines = 20 + Random(seed) % 60;
+			for (ULONG i = 0; i < defines; i++)
+				prefix += " /DFEATURE_" + std::to_string(Random(seed) % 1000) + "=1";
+			prefixes.push_back(prefix + " /Fo\"D:\\src\\product\\out\\project" + std::to_string(p) + "\\\\\"");
+			links.push_back("\"link.exe\" /nologo /LTCG /OUT:\"D:\\src\\product\\out\\project" + std::to_string(p) +
+				".dll\" /DLL @\"D:\\src\\product\\out\\project" + std::to_string(p) + "\\link.rsp\" /INCREMENTAL:NO /OPT:REF");
+		}
+		static const char* const tools[] = {
+			"\\??\\C:\\WINDOWS\\system32\\conhost.exe 0xffffffff -ForceV1",
+			"\"C:\\Program Files\\Microsoft Visual Studio\\2022\\Enterprise\\Common7\\IDE\\mspdbsrv.exe\" -start -spawn",
+			"\"C:\\Program Files\\Microsoft Visual Studio\\2022\\Enterprise\\MSBuild\\Current\\Bin\\amd64\\Tracker.exe\" /a /if \"D:\\src\\product\\out\\tlog\" /r",
+			"\"C:\\Program Files\\Git\\cmd\\git.exe\" rev-parse --short HEAD",
+		};
+
+		std::vector<Line> lines;
+		std::vector<Line> compiles;
+		ULONG files = 0;
+		while (lines.size() < count) {
+			auto r = Random(seed) % 100;
+			if (r < 30)
+				lines.push_back(Widen(tools[0]));		// every console child gets one
+			else if (r < 40)
+				lines.push_back(Widen(tools[1 + Random(seed) % 3]));
+			else if (r < 45)
+				lines.push_back(Widen(links[Random(seed) % projects]));
+			else if (r < 55 && !compiles.empty())
+				lines.push_back(compiles[compiles.size() - 1 - Random(seed) % (compiles.size() < 64 ? compiles.size() : 64)]);
+			else {
+				auto p = Random(seed) % projects;
+				compiles.push_back(Widen(prefixes[p] + " \"D:\\src\\product\\project" + std::to_string(p) + "\\source" +
+					std::to_string(files++) + ".cpp\""));
+				lines.push_back(compiles.back());
+			}
+		}
+		return lines;
+	}
+
+	ULONG DefinitionSize(ULONG length) {
+		return (sizeof(StringDefinitionInfo) + length * sizeof(WCHAR) + RecordAlignmentV2 - 1) & ~(RecordAlignmentV2 - 1);
+	}
+
+	struct Result {
+		ULONG64 Queued;			// record bytes
+		ULONG64 Read;			// what the reader got, definitions included
+		ULONG64 Lost;			// lines the reader couldn't be sent
+		ULONG64 Whole;			// lines sent in full, the table's oldest still pinned
+		ULONG64 Table;			// the lines CommandLineTable holds in the end
+		ULONG64 Repeats;
+		LONGLONG Elapsed;		// building the records
+	};
+
+	// v1 records, cut to the limit
+	Result RunFull(ItemPool& pool, const std::vector<Line>& lines, ULONG limit) {
+		Result result{};
+		auto start = NowNs();
+		for (auto& line : lines) {
+			auto length = (ULONG)(line.size() < limit ? line.size() : limit);
+			auto size = (ULONG)sizeof(ProcessCreateInfo) + length * sizeof(WCHAR);
+			auto info = (ProcessCreateInfo*)pool.Alloc(ItemType::ProcessCreate, size);
+			if (info == nullptr)
+				continue;
+			info->Type = ItemType::ProcessCreate;
+			info->Size = (USHORT)size;
+			info->CommandLineLength = (USHORT)length;
+			info->CommandLineOffset = sizeof(ProcessCreateInfo);
+			::memcpy(info + 1, line.data(), length * sizeof(WCHAR));
+			result.Queued += size;
+			pool.Free(info);
+		}
+		result.Elapsed = NowNs() - start;
+		result.Read = result.Queued;
+		return result;
+	}
+
+	// v5 records, read every batch records; the reader's lines must match what was captured
+	Result RunInterned(ItemPool& pool, const std::vector<Line>& lines, ULONG limit, ULONG batch, bool& ok) {
+		CommandLineTable table;
+		table.Init(SysMonCommandLineCapacity, 0);
+		ULONG sent[SysMonCommandLineCapacity] = {};
+		CommandLineDefinitions<Line> definitions;
+
+		Result result{};
+		std::vector<ProcessCreateInternedInfo> queued;
+		std::vector<size_t> sources;
+		auto read = [&] {
+			for (size_t i = 0; i < queued.size(); i++) {
+				auto& info = queued[i];
+				auto entry = table.Lookup(info.CommandLineId);
+				if (entry && sent[table.Slot(info.CommandLineId)] != info.CommandLineId) {
+					result.Read += DefinitionSize(entry->Length);
+					definitions.Define(info.CommandLineId).assign(entry->Text, entry->Length);
+					sent[table.Slot(info.CommandLineId)] = info.CommandLineId;
+				}
+				result.Read += info.Size;
+
+				auto& source = lines[sources[i]];
+				auto line = definitions.Find(info.CommandLineId);
+				if (line == nullptr)
+					result.Lost++;
+				else
+					ok &= *line == source.substr(0, limit) && info.CommandLineLength == source.size();
+				table.Unpin(info.CommandLineId);
+			}
+			queued.clear();
+			sources.clear();
+		};
+
+		LONGLONG elapsed = 0;
+		for (size_t i = 0; i < lines.size(); i++) {
+			auto& line = lines[i];
+			auto length = (USHORT)(line.size() < limit ? line.size() : limit);
+			auto start = NowNs();
+			bool repeat;
+			auto id = table.Intern(line.data(), length, repeat);
+			if (id == 0) {
+				// what the driver does then: a v1 record with the line
+				elapsed += NowNs() - start;
+				auto size = sizeof(ProcessCreateInfo) + length * sizeof(WCHAR);
+				result.Queued += size;
+				result.Read += size;
+				result.Whole++;
+				continue;
+			}
+			auto info = (ProcessCreateInternedInfo*)pool.Alloc(ItemType::ProcessCreateInterned, sizeof(ProcessCreateInternedInfo));
+			if (info == nullptr) {
+				ok = false;
+				break;
+			}
+			info->Type = ItemType::ProcessCreateInterned;
+			info->Size = sizeof(ProcessCreateInternedInfo);
+			info->CommandLineId = id;
+			info->CommandLineLength = (USHORT)line.size();
+			elapsed += NowNs() - start;
+
+			result.Queued += info->Size;
+			queued.push_back(*info);
+			sources.push_back(i);
+			pool.Free(info);
+			if (queued.size() >= batch)
+				read();
+		}
+		read();
+
+		result.Table = table.Bytes();
+		result.Repeats = table.Repeats();
+		result.Elapsed = elapsed;
+		table.Destroy();
+		return result;
+	}
+
+	void Print(const char* name, const Result& result, const Result& baseline, size_t lines) {
+		printf("  %-28s queued %8.1f MB  read %8.1f MB (%5.1f %%)  %7.0f ns/create\n", name, result.Queued / 1048576.0,
+			result.Read / 1048576.0, result.Read * 100.0 / baseline.Read, (double)result.Elapsed / lines);
+		if (result.Table)
+			printf("  %-28s %llu repeats, %.1f MB of lines held, %llu sent whole, %llu lost\n", "", (unsigned long long)result.Repeats,
+				result.Table / 1048576.0, (unsigned long long)result.Whole, (unsigned long long)result.Lost);
+	}
+}
+
+int CommandLineBench(int argc, const char* argv[]) {
+	auto count = ArgValue(argc, argv, "creates", 20000);
+	auto projects = ArgValue(argc, argv, "projects", 24);
+	auto limit = ArgValue(argc, argv, "limit", 2048);
+	auto batch = ArgValue(argc, argv, "batch", 64);
+
+	ItemPool pool;
+	if (!pool.Init(DriverPoolClasses, ARRAYSIZE(DriverPoolClasses), 0)) {
+		printf("failed to allocate slabs\n");
+		return 1;
+	}
+
+	auto lines = BuildLines(count, projects);
+	ULONG64 chars = 0;
+	ULONG longest = 0;
+	for (auto& line : lines) {
+		chars += line.size();
+		if (line.size() > longest)
+			longest = (ULONG)line.size();
+	}
+	printf("%u process creates from %u projects, %.1f KB a line on average, %u chars the longest\n", count, projects,
+		chars * sizeof(WCHAR) / 1024.0 / lines.size(), longest);
+
+	bool ok = true;
+	auto full = RunFull(pool, lines, SysMonCommandLineMaxLength);
+	Print("whole lines", full, full, lines.size());
+	Print("cut to limit", RunFull(pool, lines, limit), full, lines.size());
+	Print("repeats sent once", RunInterned(pool, lines, SysMonCommandLineMaxLength, batch, ok), full, lines.size());
+	Print("cut, repeats sent once", RunInterned(pool, lines, limit, batch, ok), full, lines.size());
+
+	// a reader that only comes by at the end: once every slot is pinned new lines go whole
+	bool lagging = true;
+	auto behind = RunInterned(pool, lines, SysMonCommandLineMaxLength, count, lagging);
+	Print("reader far behind", behind, full, lines.size());
+	lagging &= behind.Lost == 0;
+
+	pool.Destroy();
+	printf(ok && lagging ? "every line read back as captured\n" : "FAILED\n");
+	return ok && lagging ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+// CompressBench.cpp : BlockCompressor on 64 KB batches like the client reads, built
+// from EventGenerator's records (the driver's v1 layouts, zero padding included).
+// the whole mix, then each kind of record on its own. ratio, compression and
+// decompression speed in MB of records per second; every batch must come back the same.
+
+#include "BenchUtil.h"
+#include "EventGenerator.h"
+#include "../SysMon/BlockCompressor.h"
+
+namespace {
+	const ULONG BatchSize = 1 << 16;	// what the client reads at a time
+
+	// batches of the records the generator makes that wanted says yes to
+	template<typename Wanted>
+	std::vector<std::vector<UCHAR>> MakeBatches(ItemPool& pool, ULONG megabytes, Wanted&& wanted) {
+		std::vector<std::vector<UCHAR>> batches;
+		EventGenerator generator(1);
+		LONGLONG time = 132800000000000000;
+		std::vector<UCHAR> batch;
+		for (ULONGLONG total = 0; total < ((ULONGLONG)megabytes << 20); ) {
+			auto item = generator.Next(pool, time += 1234);
+			if (item == nullptr)
+				break;
+			if (wanted(item->Type)) {
+				if (batch.size() + item->Size > BatchSize) {
+					total += batch.size();
+					batches.push_back(std::move(batch));
+					batch.clear();
+				}
+				batch.insert(batch.end(), (UCHAR*)item, (UCHAR*)item + item->Size);
+			}
+			pool.Free(item);
+		}
+		return batches;
+	}
+
+	bool Run(const char* name, const std::vector<std::vector<UCHAR>>& batches, ULONG rounds) {
+		BlockCompressor compressor;
+		std::vector<std::vector<UCHAR>> packed(batches.size(), std::vector<UCHAR>(BatchSize));
+		std::vector<ULONG> sizes(batches.size());
+		std::vector<UCHAR> restored(BatchSize);
+		ULONGLONG raw = 0, stored = 0;
+		LONGLONG compressTime = 0, decompressTime = 0;
+		bool ok = true;
+
+		for (ULONG round = 0; round < rounds; round++) {
+			auto start = NowNs();
+			for (size_t i = 0; i < batches.size(); i++)
+				sizes[i] = compressor.Compress(batches[i].data(), (ULONG)batches[i].size(), packed[i].data(), (ULONG)batches[i].size() - 1);
+			compressTime += NowNs() - start;
+
+			start = NowNs();
+			for (size_t i = 0; i < batches.size(); i++)
+				if (sizes[i])
+					ok &= BlockCompressor::Decompress(packed[i].data(), sizes[i], restored.data(), (ULONG)batches[i].size());
+			decompressTime += NowNs() - start;
+		}
+
+		// and that it's the same data
+		for (size_t i = 0; i < batches.size(); i++) {
+			raw += batches[i].size();
+			stored += sizes[i] ? sizes[i] : batches[i].size();
+			if (sizes[i])
+				ok &= BlockCompressor::Decompress(packed[i].data(), sizes[i], restored.data(), (ULONG)batches[i].size()) &&
+					memcmp(restored.data(), batches[i].data(), batches[i].size()) == 0;
+		}
+
+		auto mb = (double)raw * rounds / (1 << 20);
+		printf("  %-20s %6.1f MB  ratio %5.2f  compress %7.1f MB/s  ", name, (double)raw / (1 << 20), (double)raw / stored, mb * 1e9 / compressTime);
+		if (stored < raw)
+			printf("decompress %7.1f MB/s", mb * 1e9 / decompressTime);
+		else
+			printf("stored as is");
+		printf("%s\n", ok ? "" : "  FAILED");
+		return ok;
+	}
+}
+
+int CompressBench(int argc, const char* argv[]) {
+	auto megabytes = ArgValue(argc, argv, "mb", 32);
+	auto rounds = ArgValue(argc, argv, "rounds", 3);
+
+	ItemPool pool;
+	if (!pool.Init(DriverPoolClasses, ARRAYSIZE(DriverPoolClasses), 0)) {
+		printf("failed to allocate slabs\n");
+		return 1;
+	}
+
+	printf("%u MB of 64 KB batches per mix, %u rounds\n", megabytes, rounds);
+	bool ok = Run("all events", MakeBatches(pool, megabytes, [](ItemType) { return true; }), rounds);
+	ok &= Run("processes", MakeBatches(pool, megabytes, [](ItemType type) {
+		return type == ItemType::ProcessCreate || type == ItemType::ProcessExit;
+	}), rounds);
+	ok &= Run("threads", MakeBatches(pool, megabytes, [](ItemType type) {
+		return type == ItemType::ThreadCreate || type == ItemType::ThreadExit;
+	}), rounds);
+	ok &= Run("image loads", MakeBatches(pool, megabytes, [](ItemType type) { return type == ItemType::ImageLoad; }), rounds);
+	ok &= Run("registry writes", MakeBatches(pool, megabytes, [](ItemType type) { return type == ItemType::RegistrySetValue; }), rounds);
+
+	// random bytes don't compress, they must be stored as they are
+	std::vector<std::vector<UCHAR>> noise(1, std::vector<UCHAR>(BatchSize));
+	ULONG seed = 7;
+	for (auto& byte : noise[0]) {
+		seed = seed * 1103515245 + 12345;
+		byte = (UCHAR)(seed >> 16);
+	}
+	ok &= Run("random bytes", noise, rounds);
+
+	pool.Destroy();
+	return ok ? 0 : 1;
+}
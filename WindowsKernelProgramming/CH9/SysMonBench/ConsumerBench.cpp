@@ -0,0 +1,138 @@
+// ConsumerBench.cpp : several readers on one EventQueue, each with its own cursor.
+// a producer pushes a round of events, then every reader due that round reads what
+// it can in 64 KB reads. "no cursor" is the destructive read SysMonRead did before,
+// "1 reader" the same through a cursor, which must cost the same. with several
+// readers the records go through the shared log; a slow one reads every slow= rounds
+// and loses what the log (log= records) can't keep for it. every reader must see
+// its records in order, and all of them or the ones it missed.
+
+#include "BenchUtil.h"
+#include "EventGenerator.h"
+#include "../SysMon/EventQueue.h"
+
+namespace {
+	const ULONG RingCapacity = 4096;
+	const ULONG ReadSize = 1 << 16;
+
+	// one thread does everything here
+	struct NoLock {
+		void Lock() {}
+		bool TryLock() {
+			return true;
+		}
+		void Unlock() {}
+	};
+
+	typedef EventQueue<RingCapacity, NoLock> Queue;
+
+	struct Reader {
+		ReadCursor Cursor;
+		ULONG Every;			// reads every this many rounds
+		ULONGLONG Read;
+		LONGLONG Last;			// Time of the last record, the producer's sequence number
+		bool Ordered;
+	};
+
+	bool Run(const char* name, ItemPool& pool, ULONG readers, ULONG slow, ULONG logCapacity, ULONG events, ULONG round) {
+		std::vector<Queue::Ring> buffers(Queue::RingCount(1));
+		std::vector<ItemHeader*> log(logCapacity);
+		NoLock lock;
+		Queue queue;
+		queue.Init(buffers.data(), 1, &pool, &lock);
+		queue.InitLog(log.data(), logCapacity);
+
+		std::vector<Reader> state(readers ? readers : 1);
+		for (ULONG i = 0; i < state.size(); i++) {
+			auto& reader = state[i];
+			reader.Every = i == 1 && slow ? slow : 1;
+			reader.Read = 0;
+			reader.Last = -1;
+			reader.Ordered = true;
+			if (readers)
+				queue.Attach(&reader.Cursor);
+		}
+
+		std::vector<UCHAR> buffer(ReadSize);
+		EventGenerator generator(1);
+		ULONGLONG produced = 0, dropped = 0;
+		LONGLONG readTime = 0;
+		auto drain = [&](Reader& reader) {
+			auto start = NowNs();
+			for (;;) {
+				auto size = queue.Read(buffer.data(), ReadSize, readers ? &reader.Cursor : nullptr);
+				if (size == 0)
+					break;
+				for (ULONG offset = 0; offset < size; ) {
+					auto item = (ItemHeader*)(buffer.data() + offset);
+					reader.Ordered &= item->Time.QuadPart > reader.Last;
+					reader.Last = item->Time.QuadPart;
+					offset += item->Size;
+					reader.Read++;
+				}
+			}
+			readTime += NowNs() - start;
+		};
+
+		for (ULONG turn = 0; produced < events; turn++) {
+			for (ULONG i = 0; i < round && produced < events; i++, produced++) {
+				auto item = generator.Next(pool, (LONGLONG)produced);
+				if (item == nullptr || !queue.Admit(0, item))
+					dropped++;
+				else if (!queue.Push(0, item, item->Type, item->Size)) {
+					queue.Drop(item);
+					dropped++;
+				}
+			}
+			for (auto& reader : state)
+				if (turn % reader.Every == 0)
+					drain(reader);
+		}
+		for (auto& reader : state)
+			drain(reader);
+
+		ULONGLONG delivered = 0;
+		bool ok = dropped == 0 && queue.Count() == 0;
+		for (auto& reader : state) {
+			auto missed = readers ? reader.Cursor.Missed : 0;
+			delivered += reader.Read;
+			ok &= reader.Ordered && reader.Read + missed == produced;
+		}
+		printf("  %-24s %8.1f ns/record read", name, (double)readTime / delivered);
+		for (ULONG i = 0; i < state.size(); i++)
+			printf("  [%u] %llu missed", i, (unsigned long long)(readers ? state[i].Cursor.Missed : 0));
+		printf("%s\n", ok ? "" : "  FAILED");
+
+		for (auto& reader : state)
+			if (readers)
+				queue.Detach(&reader.Cursor);
+		queue.Clear();
+		return ok;
+	}
+}
+
+int ConsumerBench(int argc, const char* argv[]) {
+	auto events = ArgValue(argc, argv, "events", 2000000);
+	auto round = ArgValue(argc, argv, "round", 1024);
+	auto slow = ArgValue(argc, argv, "slow", 64);
+	auto logCapacity = ArgValue(argc, argv, "log", 1 << 15);
+	if (logCapacity & (logCapacity - 1)) {
+		printf("log= must be a power of 2\n");
+		return 1;
+	}
+
+	ItemPool pool;
+	if (!pool.Init(DriverPoolClasses, ARRAYSIZE(DriverPoolClasses), 0)) {
+		printf("failed to allocate slabs\n");
+		return 1;
+	}
+
+	printf("%u events, %u per round, shared log of %u records, slow reader every %u rounds\n", events, round, logCapacity, slow);
+	bool ok = Run("no cursor (before)", pool, 0, 0, logCapacity, events, round);
+	ok &= Run("1 reader", pool, 1, 0, logCapacity, events, round);
+	ok &= Run("2 readers", pool, 2, 0, logCapacity, events, round);
+	ok &= Run("3 readers", pool, 3, 0, logCapacity, events, round);
+	ok &= Run("2 readers, one slow", pool, 2, slow, logCapacity, events, round);
+
+	pool.Destroy();
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,169 @@
+// DisplayBench.cpp : turning records into the client's text lines, the way
+// DisplayInfo used to (a std::wstring per command line, printf per field,
+// a calendar conversion per timestamp) vs. EventFormatter. output goes to
+// out= (default /dev/null, so only formatting is measured; a file or a pipe
+// adds the writes), events from EventGenerator one 64 KB batch at a time.
+
+#include "BenchUtil.h"
+#include "EventGenerator.h"
+#include "../SysMon/EventFormatter.h"
+#include "../SysMon/TimeSource.h"
+#include <string>
+#include <time.h>
+
+namespace {
+	const ULONG BatchSize = 1 << 16;	// what the client reads at a time
+
+	// fills a read-sized batch, roughly 1 usec apart
+	ULONG MakeBatch(UCHAR* buffer, ItemPool& pool, EventGenerator& generator, LONGLONG& time, ULONG& count) {
+		ULONG offset = 0;
+		count = 0;
+		for (;;) {
+			auto item = generator.Next(pool, time);
+			if (item == nullptr)
+				return offset;
+			auto fits = offset + item->Size <= BatchSize;
+			if (fits) {
+				::memcpy(buffer + offset, item, item->Size);
+				offset += item->Size;
+				count++;
+				time += 10;
+			}
+			pool.Free(item);
+			if (!fits)
+				return offset;
+		}
+	}
+
+	std::wstring Widen(const WCHAR* text, size_t length) {
+		return std::wstring(text, text + length);
+	}
+
+	template<size_t N>
+	std::wstring Widen(const WCHAR (&text)[N]) {
+		size_t length = 0;
+		while (length < N && text[length])
+			length++;
+		return Widen(text, length);
+	}
+
+	// the old DisplayInfo, with gmtime standing in for FileTimeToSystemTime
+	void PrintInfo(FILE* out, const UCHAR* buffer, ULONG size) {
+		for (ULONG offset = 0; offset < size; ) {
+			auto header = (const ItemHeader*)(buffer + offset);
+			auto time = header->Time.QuadPart - 116444736000000000LL;
+			auto seconds = (time_t)(time / 10000000);
+			tm st;
+			gmtime_r(&seconds, &st);
+			fprintf(out, "%02d:%02d:%02d.%03d: ", st.tm_hour, st.tm_min, st.tm_sec, (int)(time / 10000 % 1000));
+
+			switch (header->Type) {
+				case ItemType::ProcessExit:
+					fprintf(out, "Process %d Exited\n", ((const ProcessExitInfo*)header)->ProcessId);
+					break;
+
+				case ItemType::ProcessCreate:
+				{
+					auto info = (const ProcessCreateInfo*)header;
+					auto commandline = Widen((const WCHAR*)((const UCHAR*)info + info->CommandLineOffset), info->CommandLineLength);
+					fprintf(out, "Process %d Created. Command line: %ls\n", info->ProcessId, commandline.c_str());
+					break;
+				}
+
+				case ItemType::ThreadCreate:
+				case ItemType::ThreadExit:
+				{
+					auto info = (const ThreadCreateExitInfo*)header;
+					fprintf(out, header->Type == ItemType::ThreadCreate ? "Thread %d Created in process %d\n" : "Thread %d Exited from process %d\n",
+						info->ThreadId, info->ProcessId);
+					break;
+				}
+
+				case ItemType::ImageLoad:
+				{
+					auto info = (const ImageLoadInfo*)header;
+					fprintf(out, "Image loaded into process %d at address 0x%p (%ls)\n", info->ProcessId, info->LoadAddress,
+						Widen(info->ImageFileName).c_str());
+					break;
+				}
+
+				case ItemType::RegistrySetValue:
+				{
+					auto info = (const RegistrySetValueInfo*)header;
+					fprintf(out, "Registry write PID=%d: %ls\\%ls type: %d size: %d data: ", info->ProcessId,
+						Widen(info->KeyName).c_str(), Widen(info->ValueName).c_str(), info->DataType, info->DataSize);
+					for (ULONG i = 0; i < info->DataSize && i < sizeof(info->Data); i++)
+						fprintf(out, "%02X ", info->Data[i]);
+					fprintf(out, "\n");
+					break;
+				}
+
+				default:
+					fprintf(out, "\n");
+					break;
+			}
+			offset += header->Size;
+		}
+	}
+
+	template<typename Format>
+	LONGLONG Run(const char* name, ItemPool& pool, ULONG events, Format&& format) {
+		std::vector<UCHAR> buffer(BatchSize);
+		EventGenerator generator(1);
+		LONGLONG time = ReadSystemTime(), elapsed = 0;
+		ULONGLONG done = 0;
+		while (done < events) {
+			ULONG count;
+			auto size = MakeBatch(buffer.data(), pool, generator, time, count);
+			auto start = NowNs();
+			format(buffer.data(), size);
+			elapsed += NowNs() - start;
+			done += count;
+		}
+		PrintRate(name, done, elapsed);
+		printf("  %-24s %8.1f ns/event\n", "", (double)elapsed / done);
+		return elapsed;
+	}
+}
+
+int DisplayBench(int argc, const char* argv[]) {
+	auto events = ArgValue(argc, argv, "events", 2000000);
+	const char* path = "/dev/null";
+	for (int i = 2; i < argc; i++)
+		if (strncmp(argv[i], "out=", 4) == 0)
+			path = argv[i] + 4;
+
+	ItemPool pool;
+	if (!pool.Init(DriverPoolClasses, ARRAYSIZE(DriverPoolClasses), 0)) {
+		printf("failed to allocate slabs\n");
+		return 1;
+	}
+	printf("%u events to %s\n", events, path);
+
+	auto out = fopen(path, "w");
+	if (out == nullptr) {
+		printf("can't open %s\n", path);
+		return 1;
+	}
+	auto before = Run("printf per field", pool, events, [&](const UCHAR* buffer, ULONG size) {
+		PrintInfo(out, buffer, size);
+		fflush(out);
+	});
+	fclose(out);
+
+	out = fopen(path, "w");
+	LONGLONG after;
+	{
+		EventFormatter formatter;
+		formatter.Init(out, SysMonFormatV1);
+		after = Run("EventFormatter", pool, events, [&](const UCHAR* buffer, ULONG size) {
+			formatter.Format(buffer, size);
+			formatter.Flush();
+		});
+	}
+	fclose(out);
+	printf("%.1fx faster\n", (double)before / after);
+
+	pool.Destroy();
+	return 0;
+}
@@ -0,0 +1,150 @@
+// DrainBench.cpp : how long a 64 KB read holds the reader lock.
+// "locked" copies and frees every record with the lock held, as SysMonRead used to;
+// "splice" takes a batch out under the lock and copies it after, as CompleteRead does now.
+// a contender thread takes the same lock now and then, standing in for producers
+// evicting on overflow, and records how long it had to wait.
+
+#include "BenchUtil.h"
+#include "../SysMon/EventRing.h"
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+namespace {
+	const ULONG RingCapacity = 4096;
+	typedef EventRingSet<ItemHeader, RingCapacity> ItemRings;
+	const ULONG ReadSize = 1 << 16;
+	const ULONG BatchSize = 128;
+
+	struct Queue {
+		std::vector<ItemRings::Ring> Buffers;
+		ItemRings Rings;
+		ItemPool Pool;
+		std::mutex Lock;
+		std::atomic<ULONG> Finished{ 0 };
+		std::atomic<bool> Done{ false };
+		std::vector<LONGLONG> Hold;
+		std::vector<LONGLONG> Wait;
+	};
+
+	ULONG ReadLocked(Queue& queue, UCHAR* buffer) {
+		ULONG len = ReadSize, count = 0;
+		std::lock_guard<std::mutex> locker(queue.Lock);
+		auto start = NowNs();
+		queue.Rings.Drain([&](ItemHeader* item) {
+			auto size = item->Size;
+			if (len < size)
+				return false;
+			memcpy(buffer + count, item, size);
+			len -= size;
+			count += size;
+			queue.Pool.Free(item);
+			return true;
+		});
+		queue.Hold.push_back(NowNs() - start);
+		return count;
+	}
+
+	ULONG ReadSplice(Queue& queue, UCHAR* buffer) {
+		ItemHeader* batch[BatchSize];
+		ULONG len = ReadSize, count = 0, taken;
+		do {
+			taken = 0;
+			{
+				std::lock_guard<std::mutex> locker(queue.Lock);
+				auto start = NowNs();
+				queue.Rings.Drain([&](ItemHeader* item) {
+					if (taken == BatchSize || len < item->Size)
+						return false;
+					batch[taken++] = item;
+					len -= item->Size;
+					return true;
+				});
+				queue.Hold.push_back(NowNs() - start);
+			}
+
+			for (ULONG i = 0; i < taken; i++) {
+				auto size = batch[i]->Size;
+				memcpy(buffer + count, batch[i], size);
+				count += size;
+				queue.Pool.Free(batch[i]);
+			}
+		} while (taken == BatchSize);
+		return count;
+	}
+
+	void Run(const char* name, ULONG (*read)(Queue&, UCHAR*), ULONG producers, ULONG events) {
+		Queue queue;
+		queue.Buffers.resize(producers);
+		queue.Rings.Init(queue.Buffers.data(), producers);
+		if (!queue.Pool.Init(DriverPoolClasses, ARRAYSIZE(DriverPoolClasses), 0)) {
+			printf("failed to allocate slabs\n");
+			return;
+		}
+
+		std::vector<std::thread> threads;
+		for (ULONG p = 0; p < producers; p++) {
+			threads.emplace_back([&, p] {
+				ULONG seed = p + 1;
+				for (ULONG i = 0; i < events; i++) {
+					ItemType type;
+					ULONG size;
+					NextEventType(seed, type, size);
+					auto item = queue.Pool.Alloc(type, size);
+					item->Type = type;
+					item->Size = (USHORT)size;
+					item->Time.QuadPart = NowNs();
+					while (!queue.Rings.Push(p, item, item->Size))
+						std::this_thread::yield();
+				}
+				queue.Finished++;
+			});
+		}
+
+		std::thread contender([&] {
+			while (!queue.Done) {
+				auto start = NowNs();
+				{
+					std::lock_guard<std::mutex> locker(queue.Lock);
+					queue.Wait.push_back(NowNs() - start);
+				}
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+			}
+		});
+
+		std::vector<UCHAR> buffer(ReadSize);
+		ULONGLONG bytes = 0, reads = 0;
+		auto start = NowNs();
+		while (queue.Finished < producers || queue.Rings.Count()) {
+			auto count = read(queue, buffer.data());
+			if (count == 0) {
+				std::this_thread::yield();
+				continue;
+			}
+			bytes += count;
+			reads++;
+		}
+		auto elapsed = NowNs() - start;
+
+		for (auto& t : threads)
+			t.join();
+
+		queue.Done = true;
+		contender.join();
+		queue.Pool.Destroy();
+
+		printf("%s: %llu reads, %.1f MB/s\n", name, (unsigned long long)reads, bytes * 1000.0 / elapsed);
+		PrintLatency("lock hold", queue.Hold);
+		PrintLatency("contender wait", queue.Wait);
+	}
+}
+
+int DrainBench(int argc, const char* argv[]) {
+	auto producers = ArgValue(argc, argv, "producers", 4);
+	auto events = ArgValue(argc, argv, "events", 1000000);
+
+	printf("%u producers, %u events each, %u KB reads\n", producers, events, ReadSize >> 10);
+	Run("locked", ReadLocked, producers, events);
+	Run("splice", ReadSplice, producers, events);
+	return 0;
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+// EventGenerator.h : synthetic records built the way SysMon's notify routines
+// build them (v1 layouts): same types, same sizes, same fields filled in.
+// the mix is NextEventType's, roughly a busy build machine.
+
+#include "BenchUtil.h"
+
+class EventGenerator {
+public:
+	explicit EventGenerator(ULONG seed) : _seed(seed) {}
+
+	// allocates and fills the next record, nullptr if the pool is out of memory
+	ItemHeader* Next(ItemPool& pool, LONGLONG time) {
+		ItemType type;
+		ULONG size;
+		NextEventType(_seed, type, size);
+		switch (type) {
+			case ItemType::ProcessCreate:
+				return ProcessCreate(pool, time);
+
+			case ItemType::ProcessExit:
+			{
+				auto item = (ProcessExitInfo*)Alloc(pool, type, sizeof(ProcessExitInfo), time);
+				if (item)
+					item->ProcessId = ProcessId();
+				return item;
+			}
+
+			case ItemType::ThreadCreate:
+			case ItemType::ThreadExit:
+			{
+				auto item = (ThreadCreateExitInfo*)Alloc(pool, type, sizeof(ThreadCreateExitInfo), time);
+				if (item) {
+					item->ProcessId = ProcessId();
+					item->ThreadId = Random() & 0xfffc;
+				}
+				return item;
+			}
+
+			case ItemType::ImageLoad:
+				return ImageLoad(pool, time);
+
+			default:
+				return RegistrySetValue(pool, time);
+		}
+	}
+
+private:
+	ItemHeader* Alloc(ItemPool& pool, ItemType type, ULONG size, LONGLONG time) {
+		auto item = pool.Alloc(type, size);
+		if (item) {
+			item->Type = type;
+			item->Size = (USHORT)size;
+			item->Time.QuadPart = time;
+		}
+		return item;
+	}
+
+	ItemHeader* ProcessCreate(ItemPool& pool, LONGLONG time) {
+		static const char* const CommandLines[] = {
+			"\"C:\\Windows\\system32\\conhost.exe\" 0xffffffff -ForceV1",
+			"C:\\Windows\\system32\\svchost.exe -k netsvcs -p -s Schedule",
+			"\"C:\\Program Files\\Microsoft Visual Studio\\2019\\Community\\VC\\Tools\\MSVC\\14.29.30133\\bin\\HostX64\\x64\\CL.exe\" /c /Zi /nologo /W3 /WX- /diagnostics:column /sdl /O2 /Oi /GL /D NDEBUG /D _CONSOLE /D _UNICODE /D UNICODE /Gm- /EHsc /MD /GS /Gy /fp:precise /permissive- /Zc:wchar_t /Zc:forScope /Zc:inline /Yu\"pch.h\" /Fp\"x64\\Release\\app.pch\" /Fo\"x64\\Release\\\\\" /Fd\"x64\\Release\\vc142.pdb\" /external:W3 /Gd /TP /FC /errorReport:prompt main.cpp",
+			"git.exe status --porcelain",
+		};
+		auto text = CommandLines[Random() % ARRAYSIZE(CommandLines)];
+		auto length = (USHORT)strlen(text);
+		auto item = (ProcessCreateInfo*)Alloc(pool, ItemType::ProcessCreate, sizeof(ProcessCreateInfo) + length * sizeof(WCHAR), time);
+		if (item == nullptr)
+			return nullptr;
+
+		item->ProcessId = ProcessId();
+		item->ParentProcessId = ProcessId();
+		item->CommandLineLength = length;
+		item->CommandLineOffset = sizeof(ProcessCreateInfo);
+		auto commandLine = (WCHAR*)(item + 1);
+		for (USHORT i = 0; i < length; i++)
+			commandLine[i] = text[i];
+		return item;
+	}
+
+	ItemHeader* ImageLoad(ItemPool& pool, LONGLONG time) {
+		static const char* const Images[] = {
+			"\\Device\\HarddiskVolume3\\Windows\\System32\\ntdll.dll",
+			"\\Device\\HarddiskVolume3\\Windows\\System32\\kernel32.dll",
+			"\\Device\\HarddiskVolume3\\Windows\\System32\\KernelBase.dll",
+			"\\Device\\HarddiskVolume3\\Windows\\WinSxS\\amd64_microsoft.windows.common-controls_6595b64144ccf1df_6.0.19041.1110_none_60b5254171f9507e\\comctl32.dll",
+		};
+		auto item = (ImageLoadInfo*)Alloc(pool, ItemType::ImageLoad, sizeof(ImageLoadInfo), time);
+		if (item == nullptr)
+			return nullptr;
+
+		// the driver zeroes the record and copies the path in
+		auto header = *(ItemHeader*)item;
+		memset(item, 0, sizeof(ImageLoadInfo));
+		*(ItemHeader*)item = header;
+		item->ProcessId = ProcessId();
+		item->LoadAddress = (void*)(ULONG_PTR)(0x7ff800000000ULL + (Random() << 16));
+		item->ImageSize = 0x1a0000;
+		Copy(item->ImageFileName, Images[Random() % ARRAYSIZE(Images)]);
+		return item;
+	}
+
+	ItemHeader* RegistrySetValue(ItemPool& pool, LONGLONG time) {
+		auto item = (RegistrySetValueInfo*)Alloc(pool, ItemType::RegistrySetValue, sizeof(RegistrySetValueInfo), time);
+		if (item == nullptr)
+			return nullptr;
+
+		auto header = *(ItemHeader*)item;
+		memset(item, 0, sizeof(RegistrySetValueInfo));
+		*(ItemHeader*)item = header;
+		item->ProcessId = ProcessId();
+		item->ThreadId = Random() & 0xfffc;
+		Copy(item->KeyName, "\\REGISTRY\\MACHINE\\SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\StartupApproved\\Run");
+		Copy(item->ValueName, "OneDrive");
+		item->DataType = 3;		// REG_BINARY
+		item->DataSize = 12;
+		memset(item->Data, 0x02, item->DataSize);
+		return item;
+	}
+
+	template<size_t N>
+	static void Copy(WCHAR (&target)[N], const char* text) {
+		size_t i = 0;
+		for (; i < N - 1 && text[i]; i++)
+			target[i] = text[i];
+		target[i] = 0;
+	}
+
+	ULONG Random() {
+		_seed = _seed * 1103515245 + 12345;
+		return _seed >> 8;
+	}
+
+	ULONG ProcessId() {
+		return (Random() % 200 + 1) * 4;
+	}
+
+private:
+	ULONG _seed;
+};
@@ -0,0 +1,132 @@
+// ExportCheck.cpp : a columnar export read back against what went in. for each row
+// group size (a row a group, an odd size, the default and one past the whole stream)
+// every row's time, type, process and name, the chunk stats around them, the row and
+// group counts, and image loads per process over a tenth of the time found through
+// ForEachGroup next to a count over the records themselves. then an export of nothing.
+// events= records; exits with 1 if anything doesn't match. files go to the temp
+// directory and are removed.
+
+#include "ExportEvents.h"
+#include "../SysMon/ColumnExport.h"
+#include <filesystem>
+#include <unordered_map>
+
+namespace {
+	typedef std::unordered_map<ULONG, ULONG> Counts;
+
+	bool Write(const char* path, ULONG groupRows, const std::vector<std::vector<UCHAR>>& batches) {
+		ColumnExporter exporter;
+		if (!exporter.Init(path, SysMonFormatV1, groupRows))
+			return false;
+		for (auto& batch : batches)
+			exporter.Export(batch.data(), (ULONG)batch.size());
+		return exporter.Close();
+	}
+
+	bool CheckRows(const ColumnReader& reader, const std::vector<const ItemHeader*>& expected, ULONG groupRows) {
+		ULONG64 row = 0;
+		ULONG wrong = 0;
+		for (ULONG group = 0; group < reader.RowGroups(); group++) {
+			auto& chunk = reader.Chunk(group, ExportColumn::Time);
+			auto rows = chunk.Rows;
+			auto times = reader.Values<LONGLONG>(group, ExportColumn::Time);
+			auto types = reader.Values<USHORT>(group, ExportColumn::Type);
+			auto processes = reader.Values<ULONG>(group, ExportColumn::ProcessId);
+			auto names = reader.Values<ULONG>(group, ExportColumn::Name);
+			for (ULONG i = 0; i < rows && row < expected.size(); i++, row++) {
+				auto item = expected[row];
+				ULONG length;
+				auto text = reader.String(names[i], length);
+				if (times[i] != item->Time.QuadPart || types[i] != (USHORT)item->Type || processes[i] != ProcessOf(item) ||
+					NameOf(item) != (text ? std::basic_string<WCHAR>(text, length) : std::basic_string<WCHAR>()) ||
+					times[i] < chunk.Min || times[i] > chunk.Max) {
+					if (wrong++ == 0)
+						printf("  group size %u: row %llu doesn't read back\n", groupRows, (unsigned long long)row);
+				}
+			}
+		}
+
+		auto groups = (expected.size() + groupRows - 1) / groupRows;
+		if (row != expected.size() || reader.Header().Rows != expected.size() || reader.RowGroups() != groups) {
+			printf("  group size %u: %llu rows in %u groups read, %llu in %llu written\n", groupRows, (unsigned long long)row,
+				reader.RowGroups(), (unsigned long long)expected.size(), (unsigned long long)groups);
+			return false;
+		}
+		return wrong == 0;
+	}
+
+	// image loads per process from first to last, through the groups the stats pick
+	bool CheckQuery(const ColumnReader& reader, const std::vector<const ItemHeader*>& expected, ULONG groupRows) {
+		auto span = expected.back()->Time.QuadPart - expected.front()->Time.QuadPart;
+		auto first = expected.front()->Time.QuadPart + span / 2, last = first + span / 10;
+		Counts fromColumns, fromRecords;
+		reader.ForEachGroup(first, last, [&](ULONG group) {
+			auto rows = reader.Chunk(group, ExportColumn::Time).Rows;
+			auto times = reader.Values<LONGLONG>(group, ExportColumn::Time);
+			auto types = reader.Values<USHORT>(group, ExportColumn::Type);
+			auto processes = reader.Values<ULONG>(group, ExportColumn::ProcessId);
+			for (ULONG i = 0; i < rows; i++)
+				if (types[i] == (USHORT)ItemType::ImageLoad && times[i] >= first && times[i] <= last)
+					fromColumns[processes[i]]++;
+		});
+		for (auto item : expected)
+			if (item->Type == ItemType::ImageLoad && item->Time.QuadPart >= first && item->Time.QuadPart <= last)
+				fromRecords[ProcessOf(item)]++;
+		if (fromColumns != fromRecords) {
+			printf("  group size %u: image loads per process don't add up\n", groupRows);
+			return false;
+		}
+		return true;
+	}
+}
+
+int ExportCheck(int argc, const char* argv[]) {
+	auto events = ArgValue(argc, argv, "events", 100000);
+
+	ItemPool pool;
+	if (!pool.Init(DriverPoolClasses, ARRAYSIZE(DriverPoolClasses), 0)) {
+		printf("failed to allocate slabs\n");
+		return 1;
+	}
+
+	auto path = (std::filesystem::temp_directory_path() / "SysMonExportCheck.smc").string();
+	std::vector<std::vector<UCHAR>> batches;
+	std::vector<const ItemHeader*> expected;
+	MakeBatches(pool, events, batches, expected);
+	if (expected.empty()) {
+		printf("no events\n");
+		return 1;
+	}
+
+	bool ok = true;
+	const ULONG sizes[] = { 1, 1000, 1 << 16, (ULONG)expected.size() + 1 };
+	for (auto groupRows : sizes) {
+		ColumnReader reader;
+		if (!Write(path.c_str(), groupRows, batches) || !reader.Open(path.c_str())) {
+			printf("  group size %u: can't write %s and read it back\n", groupRows, path.c_str());
+			ok = false;
+			continue;
+		}
+		ok &= CheckRows(reader, expected, groupRows);
+		ok &= CheckQuery(reader, expected, groupRows);
+		printf("  %u rows a group, %u groups\n", groupRows, reader.RowGroups());
+		reader.Close();
+	}
+
+	// nothing exported still makes a file that reads as empty
+	ColumnReader reader;
+	if (!Write(path.c_str(), 1 << 16, {}) || !reader.Open(path.c_str()) || reader.Header().Rows != 0 || reader.RowGroups() != 0) {
+		printf("  an empty export doesn't read back empty\n");
+		ok = false;
+	}
+	reader.Close();
+
+	remove(path.c_str());
+	pool.Destroy();
+	if (!ok) {
+		printf("FAILED\n");
+		return 1;
+	}
+	printf("%u events, every row read back\n", (ULONG)expected.size());
+	return 0;
+}
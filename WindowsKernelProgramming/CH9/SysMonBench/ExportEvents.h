@@ -0,0 +1,58 @@
+#pragma once
+
+// ExportEvents.h : the event stream the export modes feed ColumnExporter, and what
+// a row of it should read back as.
+
+#include "EventGenerator.h"
+#include <string>
+#include <vector>
+
+const ULONG ExportBatchSize = 1 << 16;
+
+inline std::basic_string<WCHAR> NameOf(const ItemHeader* item) {
+	auto terminated = [](const WCHAR* text, size_t size) {
+		size_t length = 0;
+		while (length < size && text[length])
+			length++;
+		return std::basic_string<WCHAR>(text, length);
+	};
+	switch (item->Type) {
+		case ItemType::ProcessCreate:
+		{
+			auto info = (const ProcessCreateInfo*)item;
+			return std::basic_string<WCHAR>((const WCHAR*)((const UCHAR*)item + info->CommandLineOffset), info->CommandLineLength);
+		}
+		case ItemType::ImageLoad:
+			return terminated(((const ImageLoadInfo*)item)->ImageFileName, MaxImageFileSize);
+		case ItemType::RegistrySetValue:
+			return terminated(((const RegistrySetValueInfo*)item)->KeyName, ARRAYSIZE(((const RegistrySetValueInfo*)item)->KeyName));
+		default:
+			return {};
+	}
+}
+
+inline ULONG ProcessOf(const ItemHeader* item) {
+	// v1 records have the process id first, but for threads
+	if (item->Type == ItemType::ThreadCreate || item->Type == ItemType::ThreadExit)
+		return ((const ThreadCreateExitInfo*)item)->ProcessId;
+	return *(const ULONG*)(item + 1);
+}
+
+// events of EventGenerator's, 1000 ticks apart, in read-sized batches; expected gets each in turn
+inline void MakeBatches(ItemPool& pool, ULONG events, std::vector<std::vector<UCHAR>>& batches, std::vector<const ItemHeader*>& expected) {
+	batches.assign(1, {});
+	EventGenerator generator(1);
+	LONGLONG time = 132800000000000000;
+	for (ULONG i = 0; i < events; i++) {
+		auto item = generator.Next(pool, time += 1000);
+		if (item == nullptr)
+			break;
+		if (batches.back().size() + item->Size > ExportBatchSize)
+			batches.emplace_back();
+		batches.back().insert(batches.back().end(), (UCHAR*)item, (UCHAR*)item + item->Size);
+		pool.Free(item);
+	}
+	for (auto& batch : batches)
+		for (ULONG offset = 0; offset < batch.size(); offset += ((const ItemHeader*)&batch[offset])->Size)
+			expected.push_back((const ItemHeader*)&batch[offset]);
+}
@@ -0,0 +1,162 @@
+// ExprBench.cpp : filter expressions (FilterCompiler.h) as the notify routines run them
+// (FilterProgram.h): what running a program costs per event, over EventGenerator's mix
+// described the way the callbacks describe them, next to EventFilter's type check, with hits= percent of the image loads and
+// registry writes made to match the image and Run key programs. each program's cost is
+// given for the events it passes and for the ones it turns down apart: a hit runs
+// every compare, a miss mostly stops at the first. rounds= passes over events= events.
+
+#include "FilterSample.h"
+#include "EventGenerator.h"
+#include "../SysMon/EventFilter.h"
+#include "../SysMon/FilterCompiler.h"
+#include <memory>
+
+namespace {
+	// EventGenerator's records, as the callbacks see them; hits percent of the image loads
+	// and registry writes get a dropped DLL or a Run key
+	std::vector<Sample> MakeSamples(ULONG count, ULONG hits) {
+		ItemPool pool;
+		std::vector<Sample> samples;
+		if (!pool.Init(DriverPoolClasses, ARRAYSIZE(DriverPoolClasses), 0))
+			return samples;
+
+		EventGenerator generator(5);
+		ULONG images = 0, writes = 0;
+		for (ULONG i = 0; i < count; i++) {
+			auto item = generator.Next(pool, 0);
+			if (item == nullptr)
+				break;
+			Sample sample(item->Type);
+			switch (item->Type) {
+				case ItemType::ProcessCreate:
+				{
+					auto info = (ProcessCreateInfo*)item;
+					auto line = (const WCHAR*)((UCHAR*)info + info->CommandLineOffset);
+					sample.ProcessId = info->ProcessId;
+					sample.ParentProcessId = info->ParentProcessId;
+					sample.CommandLine.assign(line, info->CommandLineLength);
+					// the image is the command line's first word
+					auto first = sample.CommandLine[0] == '"' ? sample.CommandLine.find('"', 1) : sample.CommandLine.find(' ');
+					sample.Path = Widen("\\??\\") + sample.CommandLine.substr(sample.CommandLine[0] == '"', first - (sample.CommandLine[0] == '"'));
+					break;
+				}
+
+				case ItemType::ProcessExit:
+					sample.ProcessId = ((ProcessExitInfo*)item)->ProcessId;
+					break;
+
+				case ItemType::ThreadCreate:
+				case ItemType::ThreadExit:
+					sample.ProcessId = ((ThreadCreateExitInfo*)item)->ProcessId;
+					sample.ThreadId = ((ThreadCreateExitInfo*)item)->ThreadId;
+					break;
+
+				case ItemType::ImageLoad:
+					sample.ProcessId = ((ImageLoadInfo*)item)->ProcessId;
+					sample.Path = ((ImageLoadInfo*)item)->ImageFileName;
+					if (images++ % 100 < hits)
+						sample.Path = Widen("\\Device\\HarddiskVolume3\\Users\\me\\AppData\\Local\\Temp\\Evil.dll");
+					break;
+
+				default:
+				{
+					auto info = (RegistrySetValueInfo*)item;
+					sample.ProcessId = info->ProcessId;
+					sample.ThreadId = info->ThreadId;
+					sample.Key = info->KeyName;
+					sample.Value = info->ValueName;
+					if (writes++ % 100 < hits) {
+						sample.Key = Widen("\\REGISTRY\\MACHINE\\SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Run");
+						sample.Value = Widen("Updater");
+					}
+					break;
+				}
+			}
+			samples.push_back(sample);
+			pool.Free(item);
+		}
+		pool.Destroy();
+		return samples;
+	}
+
+	template<typename Check>
+	double Time(const std::vector<FilterEvent>& events, ULONG rounds, Check&& check, ULONGLONG& passed) {
+		if (events.empty())
+			return 0;
+		auto start = NowNs();
+		for (ULONG round = 0; round < rounds; round++)
+			for (auto& event : events)
+				passed += check(event);
+		return (double)(NowNs() - start) / ((ULONGLONG)rounds * events.size());
+	}
+
+	template<typename Check>
+	void Run(const char* name, const std::vector<FilterEvent>& events, ULONG rounds, Check&& check) {
+		ULONGLONG passed = 0;
+		auto cost = Time(events, rounds, check, passed);
+		printf("  %-36s %6.1f ns/event  %5.1f%% passed\n", name, cost, passed * 100.0 / ((ULONGLONG)rounds * events.size()));
+	}
+
+	// the events the check passes timed apart from the ones it doesn't
+	template<typename Check>
+	void RunSplit(const char* name, const std::vector<FilterEvent>& events, ULONG rounds, Check&& check) {
+		std::vector<FilterEvent> hits, misses;
+		for (auto& event : events)
+			(check(event) ? hits : misses).push_back(event);
+		ULONGLONG passed = 0;
+		auto hit = Time(hits, rounds, check, passed), miss = Time(misses, rounds, check, passed);
+		printf("  %-36s %6.1f ns/event  %5.1f%% passed", name, (hit * hits.size() + miss * misses.size()) / events.size(),
+			hits.size() * 100.0 / events.size());
+		if (!hits.empty() && !misses.empty())
+			printf(", %6.1f ns a hit, %6.1f ns a miss", hit, miss);
+		printf("\n");
+	}
+}
+
+int ExprBench(int argc, const char* argv[]) {
+	auto count = ArgValue(argc, argv, "events", 100000);
+	auto rounds = ArgValue(argc, argv, "rounds", 50);
+	auto hits = ArgValue(argc, argv, "hits", 5);
+
+	auto samples = MakeSamples(count, hits);
+	std::vector<FilterEvent> events;
+	for (auto& sample : samples)
+		events.push_back(sample.Event());
+	printf("%u events, %u rounds, %u%% of image loads and registry writes hit\n", (ULONG)events.size(), rounds, hits);
+
+	// the way the driver checks first, for comparison
+	auto filter = std::make_unique<EventFilter>();
+	filter->Init();
+	SysMonFilter images = { 1 << (ULONG)ItemType::ImageLoad, 0, 0, {} };
+	filter->Set(&images, SYSMON_FILTER_SIZE(0));
+	Run("EventFilter, image loads", events, rounds, [&](const FilterEvent& event) {
+		return filter->Allows((ItemType)event.Number[(ULONG)SysMonFilterField::Type], event.Number[(ULONG)SysMonFilterField::ProcessId]);
+	});
+
+	static const struct {
+		const char* Name;
+		const char* Text;
+	} programs[] = {
+		{ "empty", "" },
+		{ "image endswith", "type==ImageLoad && path endswith \"\\\\evil.dll\"" },
+		{ "Run key", "type == RegistrySetValue && key startswith \"\\\\REGISTRY\\\\MACHINE\\\\SOFTWARE\\\\Microsoft\\\\Windows\\\\CurrentVersion\\\\Run\"" },
+		{ "path contains", "path contains \"common-controls\"" },
+		{ "several fields", "!(pid == 4 || ppid == 4) && (cmdline contains \"-enc\" || path endswith \"\\\\powershell.exe\" || "
+			"(type == RegistrySetValue && value == \"OneDrive\") || (type == ThreadCreate && tid < 0x100))" },
+	};
+	auto program = std::make_unique<FilterProgram>();
+	for (auto& test : programs) {
+		program->Init();
+		FilterCompiler compiler;
+		if (!compiler.Compile(test.Text) || !program->Set(compiler.Program(), compiler.Size())) {
+			printf("  %s doesn't compile: %s\n", test.Name, compiler.Error());
+			return 1;
+		}
+		char name[64];
+		::snprintf(name, sizeof(name), "%s, %u instructions", test.Name, compiler.Program()->Count);
+		RunSplit(name, events, rounds, [&](const FilterEvent& event) {
+			return program->Allows(event);
+		});
+	}
+	return 0;
+}
@@ -0,0 +1,228 @@
+// ExprCheck.cpp : filter expressions (FilterCompiler.h) checked against what FilterProgram.h
+// must do: expressions that mustn't compile and where they're reported, expressions
+// against hand made events with the verdict they must give, and programs
+// FilterProgram::Set must turn down. exits with 1 if any of them doesn't hold.
+
+#include "FilterSample.h"
+#include "../SysMon/FilterCompiler.h"
+#include <vector>
+
+namespace {
+	Sample Image() {
+		Sample sample(ItemType::ImageLoad, 1234);
+		sample.Path = Widen("\\Device\\HarddiskVolume3\\Users\\me\\AppData\\Local\\Temp\\EVIL.DLL");
+		return sample;
+	}
+
+	Sample Registry() {
+		Sample sample(ItemType::RegistrySetValue, 800, 0, 804);
+		sample.Key = Widen("\\REGISTRY\\MACHINE\\SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Run");
+		sample.Value = Widen("Updater");
+		return sample;
+	}
+
+	Sample Process() {
+		Sample sample(ItemType::ProcessCreate, 5000, 4);
+		sample.Path = Widen("\\??\\C:\\Windows\\System32\\WindowsPowerShell\\v1.0\\powershell.exe");
+		sample.CommandLine = Widen("powershell.exe -enc SQBFAFgA");
+		return sample;
+	}
+
+	Sample Thread() {
+		return Sample(ItemType::ThreadCreate, 1234, 0, 5678);
+	}
+
+	Sample Exit() {
+		return Sample(ItemType::ProcessExit, 5000);
+	}
+
+	Sample Emoji() {
+		auto sample = Registry();
+		sample.Value = { 0xd83d, 0xde00 };		// U+1F600
+		return sample;
+	}
+
+	bool Install(FilterProgram& program, const char* text) {
+		FilterCompiler compiler;
+		return compiler.Compile(text) && program.Set(compiler.Program(), compiler.Size());
+	}
+
+	// expressions that mustn't compile, and where the mistake is
+	bool CheckErrors() {
+		// where a long one gives up depends on the limits, only that it does
+		const ULONG Anywhere = ~0u;
+		struct Case {
+			std::string Text;
+			ULONG Offset;
+		};
+		std::string nested(65, '('), chain, large = "path == \"" + std::string(SysMonFilterMaxChars + 1, 'a') + "\"";
+		nested += "pid == 1" + std::string(65, ')');
+		for (int i = 0; i < 200; i++)
+			chain += "pid == 1 || ";
+		chain += "pid == 2";
+
+		const Case cases[] = {
+			{ "type ==", 7 },
+			{ "pid == 12 &&", 12 },
+			{ "path == 5", 8 },
+			{ "pid startswith \"a\"", 4 },
+			{ "path < \"a\"", 5 },
+			{ "foo == 1", 0 },
+			{ "type == Bogus", 8 },
+			{ "path == \"abc", 8 },
+			{ "pid == 99999999999", 7 },
+			{ "pid == 12x", 7 },
+			{ "(pid == 1", 9 },
+			{ "pid == 1)", 8 },
+			{ "pid == 1 & pid == 2", 9 },
+			{ "!", 1 },
+			{ "pid", 3 },
+			{ nested, 64 },
+			{ chain, Anywhere },
+			{ large, 8 },
+		};
+
+		bool ok = true;
+		for (auto& test : cases) {
+			FilterCompiler compiler;
+			auto compiled = compiler.Compile(test.Text.c_str());
+			if (compiled || (test.Offset != Anywhere && compiler.ErrorOffset() != test.Offset)) {
+				printf("  should not compile at %u: %.60s (%s at %u)\n", test.Offset, test.Text.c_str(),
+					compiled ? "compiled" : compiler.Error(), compiler.ErrorOffset());
+				ok = false;
+			}
+		}
+		printf("  %-28s %u cases\n", "rejected expressions", (ULONG)ARRAYSIZE(cases));
+		return ok;
+	}
+
+	// expressions against events, and the verdict
+	bool CheckVerdicts() {
+		struct Case {
+			const char* Text;
+			Sample (*Make)();
+			bool Allowed;
+		};
+		const Case cases[] = {
+			{ "", Thread, true },
+			{ "type==ImageLoad && path endswith \"\\\\evil.dll\"", Image, true },
+			{ "type==ImageLoad && path endswith \"\\\\evil.dll\"", Registry, false },
+			{ "type==ImageLoad && path endswith \"\\\\evil.dll\"", Process, false },
+			{ "path endswith \"\\evil.dll\"", Image, true },
+			{ "type == 5", Image, true },
+			{ "type == imageload", Image, true },
+			{ "TYPE == ImageLoad", Thread, false },
+			{ "path startswith \"\\\\device\\\\\"", Image, true },
+			{ "path contains \"appdata\\\\local\"", Image, true },
+			{ "path contains \"appdata\\\\roaming\"", Image, false },
+			{ "path == \"x\"", Thread, false },
+			{ "path != \"x\"", Thread, false },
+			{ "!(path == \"x\")", Thread, true },
+			{ "key startswith \"\\\\REGISTRY\\\\MACHINE\\\\SOFTWARE\\\\Microsoft\\\\Windows\\\\CurrentVersion\\\\Run\"", Registry, true },
+			{ "key startswith \"\\\\REGISTRY\\\\MACHINE\\\\SOFTWARE\\\\Microsoft\\\\Windows\\\\CurrentVersion\\\\RunOnce\"", Registry, false },
+			{ "key == \"\\\\registry\\\\machine\\\\software\\\\microsoft\\\\windows\\\\currentversion\\\\run\"", Registry, true },
+			{ "value == \"updater\"", Registry, true },
+			{ "value == \"update\"", Registry, false },
+			{ "value != \"update\"", Registry, true },
+			{ "value == \"\xf0\x9f\x98\x80\"", Emoji, true },
+			{ "value == \"\xf0\x9f\x98\x81\"", Emoji, false },
+			{ "value == \"a\\\"b\"", Registry, false },
+			{ "cmdline contains \"-ENC\"", Process, true },
+			{ "cmdline contains \"\"", Process, true },
+			{ "cmdline contains \"\"", Exit, false },
+			{ "cmdline endswith \"SQBFAFgA\"", Process, true },
+			{ "cmdline endswith \"powershell.exe -enc SQBFAFgA and more\"", Process, false },
+			{ "ppid == 4 && pid > 4999 && pid < 5001", Process, true },
+			{ "pid >= 5000 && pid <= 5000", Process, true },
+			{ "pid >= 5001 || pid <= 4999", Process, false },
+			{ "pid != 5000", Process, false },
+			{ "ppid == 4", Exit, false },
+			{ "tid == 0x162e", Thread, true },
+			{ "tid == 0X162E", Thread, true },
+			{ "tid == 804", Registry, true },
+			{ "pid == 1 || pid == 1234", Thread, true },
+			{ "pid == 1 || pid == 2 && tid == 5678", Thread, false },
+			{ "pid == 1234 || pid == 2 && tid == 1", Thread, true },
+			{ "(pid == 1 || pid == 1234) && tid == 5678", Thread, true },
+			{ "(pid == 1 || pid == 1234) && tid == 1", Thread, false },
+			{ "!!(type == ThreadCreate)", Thread, true },
+			{ "!(pid == 1234) || tid == 5678", Thread, true },
+			{ "!(pid == 4 || ppid == 4) && (cmdline contains \"-enc\" || path endswith \"\\\\powershell.exe\")", Process, false },
+			{ "!(pid == 4 || ppid == 8) && (cmdline contains \"-enc\" || path endswith \"\\\\powershell.exe\")", Process, true },
+			{ "!(pid == 4 || ppid == 8) && (cmdline contains \"-enc\" || path endswith \"\\\\powershell.exe\")", Image, false },
+			{ "type == ProcessCreate && path endswith \"POWERSHELL.EXE\"", Process, true },
+			{ "type == ProcessExit && pid == 5000", Exit, true },
+		};
+
+		bool ok = true;
+		for (auto& test : cases) {
+			FilterProgram program;
+			program.Init();
+			auto sample = test.Make();
+			if (!Install(program, test.Text) || program.Allows(sample.Event()) != test.Allowed) {
+				printf("  should %s: %s\n", test.Allowed ? "pass" : "not pass", test.Text);
+				ok = false;
+			}
+		}
+		printf("  %-28s %u cases\n", "verdicts", (ULONG)ARRAYSIZE(cases));
+		return ok;
+	}
+
+	// programs Set turns down, leaving the one before in place
+	bool CheckPrograms() {
+		typedef SysMonFilterInstruction I;
+		const I compare = { SysMonFilterOp::Equal, SysMonFilterField::ProcessId, 0, 1234 };
+		struct Case {
+			const char* Name;
+			std::vector<I> Code;
+			ULONG Chars;
+			ULONG Short;		// bytes missing from the buffer
+		};
+		const Case cases[] = {
+			{ "jump backward", { compare, { SysMonFilterOp::JumpIfFalse, SysMonFilterField::Type, 0, 0 } }, 0, 0 },
+			{ "jump to itself", { compare, { SysMonFilterOp::JumpIfTrue, SysMonFilterField::Type, 0, 1 } }, 0, 0 },
+			{ "jump past the end", { compare, { SysMonFilterOp::JumpIfFalse, SysMonFilterField::Type, 0, 3 } }, 0, 0 },
+			{ "string past the text", { { SysMonFilterOp::StringEqual, SysMonFilterField::Path, 5, 0 } }, 4, 0 },
+			{ "string starting past it", { { SysMonFilterOp::Contains, SysMonFilterField::Path, 0, 5 } }, 4, 0 },
+			{ "string op, number field", { { SysMonFilterOp::StartsWith, SysMonFilterField::ProcessId, 1, 0 } }, 4, 0 },
+			{ "number op, string field", { { SysMonFilterOp::Less, SysMonFilterField::Key, 0, 1 } }, 0, 0 },
+			{ "unknown op", { { SysMonFilterOp::Count, SysMonFilterField::Type, 0, 0 } }, 0, 0 },
+			{ "unknown field", { { SysMonFilterOp::Equal, SysMonFilterField::Count, 0, 0 } }, 0, 0 },
+			{ "buffer too short", { compare }, 4, 2 },
+			{ "too much text", { compare }, SysMonFilterMaxChars + 1, 0 },
+			{ "too many instructions", std::vector<I>(SysMonFilterMaxInstructions + 1, compare), 0, 0 },
+		};
+
+		FilterProgram program;
+		program.Init();
+		auto image = Image();
+		bool ok = Install(program, "pid == 1234");
+		for (auto& test : cases) {
+			auto size = (ULONG)SYSMON_FILTER_PROGRAM_SIZE(test.Code.size(), test.Chars);
+			std::vector<UCHAR> buffer(size);
+			auto code = (SysMonFilterProgram*)buffer.data();
+			code->Count = (ULONG)test.Code.size();
+			code->CharCount = test.Chars;
+			::memcpy(code->Code, test.Code.data(), test.Code.size() * sizeof(I));
+			if (program.Set(code, size - test.Short) || !program.Allows(image.Event()) || program.Allows(Process().Event())) {
+				printf("  should be turned down: %s\n", test.Name);
+				ok = false;
+			}
+		}
+
+		// too short to say how long it is
+		SysMonFilterProgram empty = {};
+		ok &= !program.Set(&empty, SYSMON_FILTER_PROGRAM_SIZE(0, 0) - 1) && program.Set(&empty, SYSMON_FILTER_PROGRAM_SIZE(0, 0)) &&
+			program.Allows(Thread().Event());
+		printf("  %-28s %u cases\n", "malformed programs", (ULONG)ARRAYSIZE(cases) + 1);
+		return ok;
+	}
+}
+
+int ExprCheck(int, const char*[]) {
+	bool ok = CheckErrors();
+	ok &= CheckVerdicts();
+	ok &= CheckPrograms();
+	printf(ok ? "every case as expected\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
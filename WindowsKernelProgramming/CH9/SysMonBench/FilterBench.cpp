@@ -0,0 +1,144 @@
+// FilterBench.cpp : what the filter check costs a notify routine.
+// producers ask the filter about a stream of (type, pid) pairs while another
+// thread keeps replacing it, every update= microseconds (0 = never).
+
+#include "BenchUtil.h"
+#include "../SysMon/EventFilter.h"
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+namespace {
+	struct FilterSetup {
+		const char* Name;
+		ULONG TypeMask;
+		ULONG IncludeCount;
+		ULONG ExcludeCount;
+	};
+
+	const FilterSetup Setups[] = {
+		{ "everything", SysMonFilterAllTypes, 0, 0 },
+		{ "types only", (1 << (ULONG)ItemType::ProcessCreate) | (1 << (ULONG)ItemType::ProcessExit), 0, 0 },
+		{ "include 8 pids", SysMonFilterAllTypes, 8, 0 },
+		{ "exclude 64 pids", SysMonFilterAllTypes, 0, 64 },
+	};
+
+	std::vector<UCHAR> BuildFilter(const FilterSetup& setup, ULONG round) {
+		std::vector<UCHAR> buffer(SYSMON_FILTER_SIZE(setup.IncludeCount + setup.ExcludeCount));
+		auto filter = (SysMonFilter*)buffer.data();
+		filter->TypeMask = setup.TypeMask;
+		filter->IncludeCount = setup.IncludeCount;
+		filter->ExcludeCount = setup.ExcludeCount;
+		for (ULONG i = 0; i < setup.IncludeCount + setup.ExcludeCount; i++)
+			filter->ProcessIds[i] = ((i * 7919 + round) % 4096) * 4;
+		return buffer;
+	}
+
+	// the straightforward alternative: one lock around the same table
+	struct LockedFilter {
+		std::mutex Lock;
+		EventFilter Filter;
+
+		bool Allows(ItemType type, ULONG pid) {
+			std::lock_guard<std::mutex> locker(Lock);
+			return Filter.Allows(type, pid);
+		}
+
+		void Set(const SysMonFilter* filter, ULONG size) {
+			std::lock_guard<std::mutex> locker(Lock);
+			Filter.Set(filter, size);
+		}
+	};
+
+	// generating the events alone, to subtract
+	struct NoFilter {
+		EventFilter Filter;
+
+		volatile ULONG Sink;	// or the compiler drops the generator too
+
+		bool Allows(ItemType type, ULONG pid) {
+			Sink = pid + (ULONG)type;
+			return true;
+		}
+
+		void Set(const SysMonFilter*, ULONG) {
+		}
+	};
+
+	struct LatchFilter {
+		std::mutex Lock;	// serializes writers only, like FilterMutex in the driver
+		EventFilter Filter;
+
+		bool Allows(ItemType type, ULONG pid) {
+			return Filter.Allows(type, pid);
+		}
+
+		void Set(const SysMonFilter* filter, ULONG size) {
+			std::lock_guard<std::mutex> locker(Lock);
+			Filter.Set(filter, size);
+		}
+	};
+
+	template<typename Filter>
+	void Run(const char* name, const FilterSetup& setup, ULONG producers, ULONG events, ULONG update) {
+		Filter filter;
+		filter.Filter.Init();
+		auto initial = BuildFilter(setup, 0);
+		filter.Set((SysMonFilter*)initial.data(), (ULONG)initial.size());
+
+		std::atomic<bool> stop(false);
+		std::atomic<ULONGLONG> passed(0);
+		std::thread updater;
+		if (update) {
+			updater = std::thread([&] {
+				for (ULONG round = 1; !stop; round++) {
+					auto buffer = BuildFilter(setup, round);
+					filter.Set((SysMonFilter*)buffer.data(), (ULONG)buffer.size());
+					std::this_thread::sleep_for(std::chrono::microseconds(update));
+				}
+			});
+		}
+
+		std::vector<std::thread> threads;
+		auto start = NowNs();
+		for (ULONG p = 0; p < producers; p++) {
+			threads.emplace_back([&, p] {
+				ULONG seed = p + 1;
+				ULONGLONG count = 0;
+				for (ULONG i = 0; i < events; i++) {
+					ItemType type;
+					ULONG size;
+					NextEventType(seed, type, size);
+					count += filter.Allows(type, (seed >> 4) % 16384);
+				}
+				passed += count;
+			});
+		}
+		for (auto& t : threads)
+			t.join();
+		auto elapsed = NowNs() - start;
+
+		stop = true;
+		if (updater.joinable())
+			updater.join();
+
+		ULONGLONG total = (ULONGLONG)producers * events;
+		// wall clock over all producers' events: the cost per event for the machine as a whole
+		printf("  %-16s %-8s %6.1f ns/event  %5.1f%% passed\n", setup.Name, name,
+			(double)elapsed / total, passed * 100.0 / total);
+	}
+}
+
+int FilterBench(int argc, const char* argv[]) {
+	auto producers = ArgValue(argc, argv, "producers", 4);
+	auto events = ArgValue(argc, argv, "events", 10000000);
+	auto update = ArgValue(argc, argv, "update", 1000);
+
+	printf("%u producers, %u events each, filter replaced every %u us\n", producers, events, update);
+	Run<NoFilter>("none", Setups[0], producers, events, 0);
+	for (auto& setup : Setups) {
+		Run<LatchFilter>("latch", setup, producers, events, update);
+		Run<LockedFilter>("mutex", setup, producers, events, update);
+	}
+	return 0;
+}
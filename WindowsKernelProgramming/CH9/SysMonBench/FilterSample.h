@@ -0,0 +1,59 @@
+#pragma once
+
+// FilterSample.h : events the way the notify routines describe them to FilterProgram,
+// built from what each callback has at hand. shared by the expr modes.
+
+#include "BenchUtil.h"
+#include "../SysMon/FilterProgram.h"
+#include <string>
+
+typedef std::basic_string<WCHAR> Text;
+
+inline Text Widen(const char* text) {
+	Text result;
+	while (*text)
+		result.push_back((WCHAR)(UCHAR)*text++);
+	return result;
+}
+
+// what a notify routine has at hand; the event points into it
+struct Sample {
+	Sample(ItemType type, ULONG processId = 0, ULONG parentProcessId = 0, ULONG threadId = 0) :
+		Type(type), ProcessId(processId), ParentProcessId(parentProcessId), ThreadId(threadId) {}
+
+	ItemType Type;
+	ULONG ProcessId;
+	ULONG ParentProcessId;
+	ULONG ThreadId;
+	Text Path, CommandLine, Key, Value;
+
+	FilterEvent Event() const {
+		FilterEvent event(Type, ProcessId);
+		switch (Type) {
+			case ItemType::ProcessCreate:
+				event.SetNumber(SysMonFilterField::ParentProcessId, ParentProcessId);
+				event.SetString(SysMonFilterField::Path, Path.data(), (ULONG)Path.size());
+				event.SetString(SysMonFilterField::CommandLine, CommandLine.data(), (ULONG)CommandLine.size());
+				break;
+
+			case ItemType::ThreadCreate:
+			case ItemType::ThreadExit:
+				event.SetNumber(SysMonFilterField::ThreadId, ThreadId);
+				break;
+
+			case ItemType::ImageLoad:
+				event.SetString(SysMonFilterField::Path, Path.data(), (ULONG)Path.size());
+				break;
+
+			case ItemType::RegistrySetValue:
+				event.SetNumber(SysMonFilterField::ThreadId, ThreadId);
+				event.SetString(SysMonFilterField::Key, Key.data(), (ULONG)Key.size());
+				event.SetString(SysMonFilterField::Value, Value.data(), (ULONG)Value.size());
+				break;
+
+			default:
+				break;
+		}
+		return event;
+	}
+};
@@ -0,0 +1,150 @@
+// FormatBench.cpp : size of image load and registry records, fixed layout
+// (SysMonFormatV1) vs. offset/length strings (SysMonFormatV2), built from
+// paths typical for a desktop machine. also times building the records.
+
+#include "BenchUtil.h"
+#include <string>
+
+namespace {
+	const char* const ImagePaths[] = {
+		"\\Windows\\System32\\ntdll.dll",
+		"\\Windows\\System32\\kernel32.dll",
+		"\\Windows\\System32\\KernelBase.dll",
+		"\\Windows\\System32\\ucrtbase.dll",
+		"\\Windows\\System32\\combase.dll",
+		"\\Windows\\System32\\rpcrt4.dll",
+		"\\Windows\\WinSxS\\amd64_microsoft.windows.common-controls_6595b64144ccf1df_6.0.19041.1110_none_60b5254171f9507e\\comctl32.dll",
+		"\\Program Files\\Microsoft Visual Studio\\2019\\Community\\VC\\Tools\\MSVC\\14.29.30133\\bin\\HostX64\\x64\\c1xx.dll",
+		"\\Device\\HarddiskVolume3\\Users\\dev\\AppData\\Local\\Temp\\build\\obj\\x64\\Release\\app.exe",
+	};
+
+	struct RegistryWrite {
+		const char* Key;
+		const char* Value;
+		ULONG DataSize;
+	};
+
+	const RegistryWrite RegistryWrites[] = {
+		{ "\\REGISTRY\\MACHINE\\SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Run", "Updater", 96 },
+		{ "\\REGISTRY\\MACHINE\\SYSTEM\\ControlSet001\\Services\\bam\\State\\UserSettings\\S-1-5-21-1004336348-1177238915-682003330-1001", "\\Device\\HarddiskVolume3\\Windows\\System32\\cmd.exe", 24 },
+		{ "\\REGISTRY\\MACHINE\\SOFTWARE\\Microsoft\\Windows Defender\\Scan", "LastScanRun", 8 },
+		{ "\\REGISTRY\\MACHINE\\SYSTEM\\ControlSet001\\Control\\Session Manager", "PendingFileRenameOperations", 256 },
+		{ "\\REGISTRY\\MACHINE\\SOFTWARE\\Classes\\CLSID", "", 4 },
+	};
+
+	std::u16string Widen(const char* text) {
+		return std::u16string(text, text + strlen(text));
+	}
+
+	ULONG BuildImageV1(UCHAR* buffer, const std::u16string& path) {
+		auto& item = *(ImageLoadInfo*)buffer;
+		memset(&item, 0, sizeof(item));
+		item.Type = ItemType::ImageLoad;
+		item.Size = sizeof(item);
+		auto count = std::min<size_t>(path.size(), MaxImageFileSize - 1);
+		memcpy(item.ImageFileName, path.data(), count * sizeof(WCHAR));
+		return item.Size;
+	}
+
+	ULONG BuildImageV2(UCHAR* buffer, const std::u16string& path) {
+		auto& item = *(ImageLoadInfoV2*)buffer;
+		auto length = (USHORT)std::min<size_t>(path.size(), MaxImageFileSizeV2);
+		item.Type = ItemType::ImageLoadV2;
+		item.Size = (USHORT)((sizeof(item) + length * sizeof(WCHAR) + RecordAlignmentV2 - 1) & ~(RecordAlignmentV2 - 1));
+		item.ImageFileNameLength = length;
+		item.ImageFileNameOffset = sizeof(item);
+		memcpy(buffer + sizeof(item), path.data(), length * sizeof(WCHAR));
+		return item.Size;
+	}
+
+	ULONG BuildRegistryV1(UCHAR* buffer, const std::u16string& key, const std::u16string& value, const UCHAR* data, ULONG dataSize) {
+		auto& item = *(RegistrySetValueInfo*)buffer;
+		memset(&item, 0, sizeof(item));
+		item.Type = ItemType::RegistrySetValue;
+		item.Size = sizeof(item);
+		memcpy(item.KeyName, key.data(), std::min<size_t>(key.size(), ARRAYSIZE(item.KeyName) - 1) * sizeof(WCHAR));
+		memcpy(item.ValueName, value.data(), std::min<size_t>(value.size(), ARRAYSIZE(item.ValueName) - 1) * sizeof(WCHAR));
+		item.DataSize = dataSize;
+		memcpy(item.Data, data, std::min<size_t>(dataSize, sizeof(item.Data)));
+		return item.Size;
+	}
+
+	ULONG BuildRegistryV2(UCHAR* buffer, const std::u16string& key, const std::u16string& value, const UCHAR* data, ULONG dataSize) {
+		auto& item = *(RegistrySetValueInfoV2*)buffer;
+		auto keyLength = (USHORT)std::min<size_t>(key.size(), MaxKeyNameSizeV2);
+		auto valueLength = (USHORT)std::min<size_t>(value.size(), MaxValueNameSizeV2);
+		auto dataLength = (USHORT)std::min<ULONG>(dataSize, MaxRegistryDataSizeV2);
+		item.Type = ItemType::RegistrySetValueV2;
+		item.DataSize = dataSize;
+
+		auto offset = (USHORT)sizeof(item);
+		item.KeyNameLength = keyLength;
+		item.KeyNameOffset = offset;
+		memcpy(buffer + offset, key.data(), keyLength * sizeof(WCHAR));
+		offset += keyLength * sizeof(WCHAR);
+		item.ValueNameLength = valueLength;
+		item.ValueNameOffset = offset;
+		memcpy(buffer + offset, value.data(), valueLength * sizeof(WCHAR));
+		offset += valueLength * sizeof(WCHAR);
+		item.DataLength = dataLength;
+		item.DataOffset = offset;
+		memcpy(buffer + offset, data, dataLength);
+		item.Size = (USHORT)((offset + dataLength + RecordAlignmentV2 - 1) & ~(RecordAlignmentV2 - 1));
+		return item.Size;
+	}
+
+	template<typename Build>
+	void Run(const char* name, ULONG events, Build&& build) {
+		std::vector<UCHAR> buffer(1 << 16);
+		ULONGLONG bytes = 0;
+		ULONG perBuffer = 0, offset = 0;
+		auto start = NowNs();
+		for (ULONG i = 0; i < events; i++) {
+			auto size = build(buffer.data() + offset, i);
+			bytes += size;
+			offset += size;
+			if (offset + 4096 > buffer.size()) {
+				if (perBuffer == 0)
+					perBuffer = i + 1;
+				offset = 0;
+			}
+		}
+		auto elapsed = NowNs() - start;
+		PrintRate(name, events, elapsed);
+		printf("  %-24s %8.1f bytes/event  %u events per 64 KB read\n", "", (double)bytes / events, perBuffer);
+	}
+}
+
+int FormatBench(int argc, const char* argv[]) {
+	auto events = ArgValue(argc, argv, "events", 1000000);
+
+	std::vector<std::u16string> images;
+	for (auto path : ImagePaths)
+		images.push_back(Widen(path));
+
+	std::vector<std::u16string> keys, values;
+	for (auto& write : RegistryWrites) {
+		keys.push_back(Widen(write.Key));
+		values.push_back(Widen(write.Value));
+	}
+	UCHAR data[256] = {};
+
+	printf("image loads\n");
+	Run("v1 fixed", events, [&](UCHAR* buffer, ULONG i) {
+		return BuildImageV1(buffer, images[i % images.size()]);
+	});
+	Run("v2 compact", events, [&](UCHAR* buffer, ULONG i) {
+		return BuildImageV2(buffer, images[i % images.size()]);
+	});
+
+	printf("registry writes\n");
+	Run("v1 fixed", events, [&](UCHAR* buffer, ULONG i) {
+		auto n = i % ARRAYSIZE(RegistryWrites);
+		return BuildRegistryV1(buffer, keys[n], values[n], data, RegistryWrites[n].DataSize);
+	});
+	Run("v2 compact", events, [&](UCHAR* buffer, ULONG i) {
+		auto n = i % ARRAYSIZE(RegistryWrites);
+		return BuildRegistryV2(buffer, keys[n], values[n], data, RegistryWrites[n].DataSize);
+	});
+	return 0;
+}
@@ -0,0 +1,141 @@
+// InternBench.cpp : image loads with the path in every record (v2)
+// vs. an interned path id (v3). paths are drawn from a few hundred made-up
+// system and application images, the popular ones far more often,
+// like the same DLLs being loaded into every new process.
+
+#include "BenchUtil.h"
+#include "../SysMon/InternTable.h"
+#include <thread>
+#include <string>
+
+namespace {
+	const ULONG ReadSize = 1 << 16;
+
+	std::vector<std::u16string> MakePaths(ULONG count) {
+		static const char* const Directories[] = {
+			"\\Device\\HarddiskVolume3\\Windows\\System32\\",
+			"\\Device\\HarddiskVolume3\\Windows\\SysWOW64\\",
+			"\\Device\\HarddiskVolume3\\Program Files\\Common Files\\microsoft shared\\ClickToRun\\",
+			"\\Device\\HarddiskVolume3\\Windows\\WinSxS\\amd64_microsoft.windows.common-controls_6595b64144ccf1df_6.0.19041.1110_none_60b5254171f9507e\\",
+		};
+		std::vector<std::u16string> paths;
+		for (ULONG i = 0; i < count; i++) {
+			std::string path = Directories[i % ARRAYSIZE(Directories)];
+			path += "module" + std::to_string(i) + ".dll";
+			paths.emplace_back(path.begin(), path.end());
+		}
+		return paths;
+	}
+
+	// roughly Zipf: low indices (ntdll, kernel32...) come up most
+	ULONG PickPath(ULONG& seed, ULONG count) {
+		seed = seed * 1103515245 + 12345;
+		auto r = ((seed >> 8) & 0xffff) / 65536.0;
+		return (ULONG)(count * r * r * r) % count;
+	}
+
+	ULONG BuildV2(UCHAR* buffer, const std::u16string& path) {
+		auto& item = *(ImageLoadInfoV2*)buffer;
+		auto length = (USHORT)path.size();
+		item.Type = ItemType::ImageLoadV2;
+		item.Size = (USHORT)((sizeof(item) + length * sizeof(WCHAR) + RecordAlignmentV2 - 1) & ~(RecordAlignmentV2 - 1));
+		item.ImageFileNameLength = length;
+		item.ImageFileNameOffset = sizeof(item);
+		memcpy(buffer + sizeof(item), path.data(), length * sizeof(WCHAR));
+		return item.Size;
+	}
+
+	ULONG BuildInterned(UCHAR* buffer, InternTable& table, const std::u16string& path) {
+		auto& item = *(ImageLoadInternedInfo*)buffer;
+		item.Type = ItemType::ImageLoadInterned;
+		item.Size = sizeof(item);
+		item.ImageNameId = table.Intern(path.data(), (USHORT)path.size());
+		return item.Size;
+	}
+
+	// what the reader adds in front of the first use of each path
+	ULONG DefinitionBytes(const std::u16string& path) {
+		return (sizeof(StringDefinitionInfo) + path.size() * sizeof(WCHAR) + RecordAlignmentV2 - 1) & ~(RecordAlignmentV2 - 1);
+	}
+
+	// producers build records; reports build rate and what the reader would copy
+	template<typename Build>
+	void Run(const char* name, ULONG producers, ULONG events, const std::vector<std::u16string>& paths, Build&& build) {
+		std::vector<ULONGLONG> bytes(producers);
+		std::vector<std::thread> threads;
+		auto start = NowNs();
+		for (ULONG p = 0; p < producers; p++) {
+			threads.emplace_back([&, p] {
+				std::vector<UCHAR> record(4096);
+				ULONG seed = p + 1;
+				for (ULONG i = 0; i < events; i++)
+					bytes[p] += build(record.data(), paths[PickPath(seed, (ULONG)paths.size())]);
+			});
+		}
+		for (auto& t : threads)
+			t.join();
+		auto elapsed = NowNs() - start;
+
+		ULONGLONG total = 0;
+		for (auto b : bytes)
+			total += b;
+		PrintRate(name, (ULONGLONG)producers * events, elapsed);
+		printf("  %-24s %8.1f bytes/event\n", "", (double)total / producers / events);
+	}
+
+	// the reader's side: copying records of this size into 64 KB buffers
+	void RunCopy(const char* name, ULONG recordSize, ULONG events) {
+		std::vector<UCHAR> record(recordSize, 1), buffer(ReadSize);
+		ULONG offset = 0;
+		auto start = NowNs();
+		for (ULONG i = 0; i < events; i++) {
+			if (offset + recordSize > ReadSize)
+				offset = 0;
+			memcpy(buffer.data() + offset, record.data(), recordSize);
+			offset += recordSize;
+		}
+		auto elapsed = NowNs() - start;
+		printf("  %-24s %8.2f ns/event (%u byte records, %u per read)\n", name, (double)elapsed / events,
+			recordSize, ReadSize / recordSize);
+	}
+}
+
+int InternBench(int argc, const char* argv[]) {
+	auto producers = ArgValue(argc, argv, "producers", 4);
+	auto events = ArgValue(argc, argv, "events", 1000000);
+	auto pathCount = ArgValue(argc, argv, "paths", 300);
+
+	auto paths = MakePaths(pathCount);
+	printf("%u producers, %u image loads each, %u distinct paths\n", producers, events, pathCount);
+
+	printf("building records\n");
+	Run("v2 path in record", producers, events, paths, [](UCHAR* buffer, const std::u16string& path) {
+		return BuildV2(buffer, path);
+	});
+
+	InternTable table;
+	if (!table.Init(4096, 0)) {
+		printf("failed to allocate the intern table\n");
+		return 1;
+	}
+	Run("v3 interned", producers, events, paths, [&](UCHAR* buffer, const std::u16string& path) {
+		return BuildInterned(buffer, table, path);
+	});
+
+	// each path goes out once per session, ahead of its first use
+	ULONGLONG definitions = 0;
+	for (auto& path : paths)
+		definitions += DefinitionBytes(path);
+	auto total = (ULONGLONG)producers * events;
+	printf("  %u paths interned, definitions add %.2f bytes/event\n", table.Count(), (double)definitions / total);
+	table.Destroy();
+
+	printf("copying into reads\n");
+	ULONGLONG v2Bytes = 0;
+	for (auto& path : paths)
+		v2Bytes += (sizeof(ImageLoadInfoV2) + path.size() * sizeof(WCHAR) + RecordAlignmentV2 - 1) & ~(RecordAlignmentV2 - 1);
+	RunCopy("v1 fixed", sizeof(ImageLoadInfo), events);
+	RunCopy("v2 typical", (ULONG)(v2Bytes / paths.size()), events);
+	RunCopy("v3 interned", sizeof(ImageLoadInternedInfo), events);
+	return 0;
+}
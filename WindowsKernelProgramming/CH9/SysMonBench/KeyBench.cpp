@@ -0,0 +1,151 @@
+// KeyBench.cpp : deciding whether a registry write is recorded from its key name.
+// the old fixed \REGISTRY\MACHINE\ compare, the same include/exclude prefixes
+// checked one after the other (case-insensitive, whole components, longest wins)
+// and KeyFilter's trie. prefixes= configured (up to 32), names= distinct key names
+// drawn from a mix of HKLM, HKU and class registrations.
+
+#include "BenchUtil.h"
+#include "../SysMon/KeyFilter.h"
+#include <string>
+
+namespace {
+	typedef std::basic_string<WCHAR> KeyName;
+
+	KeyName Widen(const char* text) {
+		KeyName name;
+		while (*text)
+			name.push_back((WCHAR)*text++);
+		return name;
+	}
+
+	const char* const Roots[] = {
+		"\\REGISTRY\\MACHINE\\SOFTWARE\\Microsoft\\Windows\\CurrentVersion",
+		"\\REGISTRY\\MACHINE\\SOFTWARE\\Classes\\CLSID",
+		"\\REGISTRY\\MACHINE\\SOFTWARE\\Policies\\Microsoft",
+		"\\REGISTRY\\MACHINE\\SYSTEM\\ControlSet001\\Services",
+		"\\REGISTRY\\MACHINE\\SYSTEM\\ControlSet001\\Control\\Session Manager",
+		"\\REGISTRY\\USER\\S-1-5-21-3623811015-3361044348-30300820-1013\\Software\\Microsoft\\Windows\\CurrentVersion\\Explorer",
+		"\\REGISTRY\\USER\\S-1-5-21-3623811015-3361044348-30300820-1013_Classes\\Local Settings\\Software",
+		"\\REGISTRY\\A\\{6f6a1a8c-2b32-11e9-8d2b-806e6f6e6963}\\Root\\InventoryApplicationFile",
+	};
+
+	// what a monitoring setup typically asks for, longer lists add made up subkeys
+	const struct {
+		const char* Text;
+		bool Exclude;
+	} Common[] = {
+		{ "\\REGISTRY\\MACHINE\\SOFTWARE", false },
+		{ "\\REGISTRY\\MACHINE\\SYSTEM\\ControlSet001\\Services", false },
+		{ "\\REGISTRY\\USER", false },
+		{ "\\registry\\machine\\software\\classes", true },
+		{ "\\REGISTRY\\USER\\S-1-5-21-3623811015-3361044348-30300820-1013_Classes", true },
+		{ "\\REGISTRY\\MACHINE\\SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Run", false },
+	};
+
+	std::vector<KeyName> MakeNames(ULONG count) {
+		std::vector<KeyName> names;
+		ULONG seed = 12345;
+		char text[64];
+		for (ULONG i = 0; i < count; i++) {
+			seed = seed * 1103515245 + 12345;
+			auto name = Widen(Roots[(seed >> 16) % ARRAYSIZE(Roots)]);
+			snprintf(text, sizeof(text), "\\Key%u\\Sub%u", (seed >> 8) % 97, i);
+			name += Widen(text);
+			names.push_back(name);
+		}
+		return names;
+	}
+
+	std::vector<UCHAR> MakeFilter(ULONG count) {
+		std::vector<UCHAR> buffer(SYSMON_KEY_FILTER_SIZE(count));
+		auto filter = (SysMonKeyFilter*)buffer.data();
+		filter->Count = count;
+		char text[SysMonKeyFilterMaxLength];
+		for (ULONG i = 0; i < count; i++) {
+			auto& common = Common[i % ARRAYSIZE(Common)];
+			if (i < ARRAYSIZE(Common))
+				snprintf(text, sizeof(text), "%s", common.Text);
+			else
+				snprintf(text, sizeof(text), "%s\\Key%u", common.Text, i * 7 % 97);
+			auto& prefix = filter->Prefixes[i];
+			prefix.Exclude = common.Exclude;
+			prefix.Length = (ULONG)strlen(text);
+			for (ULONG j = 0; j < prefix.Length; j++)
+				prefix.Text[j] = text[j];
+		}
+		return buffer;
+	}
+
+	// what OnRegistryNotify did before
+	bool MachineOnly(const WCHAR* name, ULONG length) {
+		static const char machine[] = "\\REGISTRY\\MACHINE\\";
+		if (length < sizeof(machine) - 1)
+			return false;
+		for (ULONG i = 0; i < sizeof(machine) - 1; i++)
+			if (name[i] != machine[i])
+				return false;
+		return true;
+	}
+
+	// every prefix compared in turn, same rules as KeyFilter
+	bool Linear(const SysMonKeyFilter* filter, const WCHAR* name, ULONG length) {
+		ULONG best = 0;
+		bool include = false, allowed = true;
+		for (ULONG i = 0; i < filter->Count; i++) {
+			auto& prefix = filter->Prefixes[i];
+			auto size = prefix.Length;
+			include |= prefix.Exclude == 0;
+			if (size > length || (size < length && name[size] != '\\'))
+				continue;
+			ULONG j = 0;
+			while (j < size && UpcaseKeyChar(name[j]) == UpcaseKeyChar(prefix.Text[j]))
+				j++;
+			if (j < size || size < best)
+				continue;
+			if (size > best || prefix.Exclude)
+				allowed = prefix.Exclude == 0;
+			best = size;
+		}
+		return best ? allowed : !include;
+	}
+
+	template<typename Check>
+	void Run(const char* name, const std::vector<KeyName>& names, ULONG rounds, Check&& check) {
+		ULONGLONG allowed = 0, done = 0;
+		auto start = NowNs();
+		for (ULONG round = 0; round < rounds; round++)
+			for (auto& key : names) {
+				allowed += check(key.data(), (ULONG)key.size());
+				done++;
+			}
+		auto elapsed = NowNs() - start;
+		printf("  %-24s %8.1f ns/key  %5.1f%% recorded\n", name, (double)elapsed / done, allowed * 100.0 / done);
+	}
+}
+
+int KeyBench(int argc, const char* argv[]) {
+	auto count = std::min(ArgValue(argc, argv, "prefixes", 16), SysMonKeyFilterMaxPrefixes);
+	auto nameCount = ArgValue(argc, argv, "names", 4096);
+	auto rounds = ArgValue(argc, argv, "rounds", 500);
+
+	auto names = MakeNames(nameCount);
+	auto buffer = MakeFilter(count);
+	auto filter = (const SysMonKeyFilter*)buffer.data();
+	auto keys = new KeyFilter;
+	if (!keys->Init(0) || !keys->Set(filter, (ULONG)buffer.size())) {
+		printf("filter rejected\n");
+		return 1;
+	}
+
+	ULONG mismatches = 0;
+	for (auto& key : names)
+		mismatches += keys->Allows(key.data(), (ULONG)key.size()) != Linear(filter, key.data(), (ULONG)key.size());
+	printf("%u prefixes, %u names, trie and linear scan disagree on %u\n", count, nameCount, mismatches);
+
+	Run("HKLM compare (old)", names, rounds, [](const WCHAR* name, ULONG length) { return MachineOnly(name, length); });
+	Run("linear prefix scan", names, rounds, [&](const WCHAR* name, ULONG length) { return Linear(filter, name, length); });
+	Run("KeyFilter trie", names, rounds, [&](const WCHAR* name, ULONG length) { return keys->Allows(name, length); });
+
+	delete keys;
+	return mismatches ? 1 : 0;
+}
@@ -0,0 +1,151 @@
+// PipelineBench.cpp : the driver's event path end to end, without the driver.
+// producer threads stand in for notify routines on different CPUs: they build
+// records from EventGenerator at a given rate and push them through the same
+// EventQueue the driver's PushItem uses (limits, overflow policy, drops).
+// a reader thread does what SysMonRead does, Read into a user sized buffer,
+// and measures how long each record waited. every record must end up either
+// read or counted as dropped.
+
+#include "BenchUtil.h"
+#include "EventGenerator.h"
+#include "../SysMon/EventQueue.h"
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <string>
+
+namespace {
+	const ULONG RingCapacity = 2048;	// the driver's
+
+	// the driver's reader lock is a fast mutex
+	struct ReaderLock {
+		void Lock() {
+			_mutex.lock();
+		}
+
+		bool TryLock() {
+			return _mutex.try_lock();
+		}
+
+		void Unlock() {
+			_mutex.unlock();
+		}
+
+	private:
+		std::mutex _mutex;
+	};
+
+	typedef EventQueue<RingCapacity, ReaderLock> Queue;
+
+	// paces a producer at rate events per second, 0: as fast as it can
+	void WaitTurn(LONGLONG start, ULONG i, ULONG rate) {
+		if (rate == 0)
+			return;
+
+		auto due = start + (LONGLONG)i * 1000000000 / rate;
+		for (;;) {
+			auto ahead = due - NowNs();
+			if (ahead <= 0)
+				break;
+			if (ahead > 100000)
+				std::this_thread::sleep_for(std::chrono::nanoseconds(ahead));
+			else
+				std::this_thread::yield();
+		}
+	}
+}
+
+int PipelineBench(int argc, const char* argv[]) {
+	auto producers = ArgValue(argc, argv, "producers", 4);
+	auto events = ArgValue(argc, argv, "events", 500000);
+	auto rate = ArgValue(argc, argv, "rate", 0);
+	auto readSize = ArgValue(argc, argv, "read", 1 << 16);
+	auto pause = ArgValue(argc, argv, "pause", 0);
+
+	ItemPool pool;
+	if (!pool.Init(DriverPoolClasses, ARRAYSIZE(DriverPoolClasses), 0)) {
+		printf("failed to allocate slabs\n");
+		return 1;
+	}
+	std::vector<Queue::Ring> buffers(Queue::RingCount(producers));
+	ReaderLock readers;
+	Queue queue;
+	queue.Init(buffers.data(), producers, &pool, &readers);
+	queue.Limits.MaxRecords = ArgValue(argc, argv, "max-records", 0);
+	queue.Limits.MaxBytes = ArgValue(argc, argv, "max-bytes", 0);
+	queue.Limits.Policy = (SysMonOverflowPolicy)ArgValue(argc, argv, "policy", 0);
+
+	static const char* const policies[] = { "drop oldest", "drop newest", "drop lowest priority" };
+	printf("%u producers, %u events each at %s, %u byte reads every %u usec\n", producers, events,
+		rate ? (std::to_string(rate) + " events/s").c_str() : "full speed", readSize, pause);
+	printf("limits: %u records, %u bytes, %s\n", queue.Limits.MaxRecords, queue.Limits.MaxBytes,
+		policies[(ULONG)queue.Limits.Policy % ARRAYSIZE(policies)]);
+
+	std::atomic<ULONG> done(0);
+	std::vector<std::thread> threads;
+	auto start = NowNs();
+	for (ULONG p = 0; p < producers; p++) {
+		threads.emplace_back([&, p] {
+			EventGenerator generator(p + 1);
+			for (ULONG i = 0; i < events; i++) {
+				WaitTurn(start, i, rate);
+				auto item = generator.Next(pool, NowNs());
+				if (item == nullptr) {
+					queue.CountDrop(ItemType::None);
+					continue;
+				}
+				// each thread is its own CPU, so it's the only producer of its ring
+				if (queue.Admit(p, item) && !queue.Push(p, item, item->Type, item->Size))
+					queue.Drop(item);
+			}
+			done++;
+		});
+	}
+
+	// the reader: what SysMonRead and the client's loop do between them
+	std::vector<UCHAR> buffer(readSize);
+	std::vector<LONGLONG> latency;
+	latency.reserve((size_t)producers * events);
+	ULONGLONG total = (ULONGLONG)producers * events, read = 0, reads = 0, bytes = 0;
+	auto dropped = [&] {
+		ULONGLONG count = 0;
+		for (auto d : queue.Dropped)
+			count += d;
+		return count;
+	};
+	while (done < producers || read + dropped() < total) {
+		auto size = queue.Read(buffer.data(), readSize);
+		auto now = NowNs();
+		for (ULONG offset = 0; offset < size; ) {
+			auto item = (ItemHeader*)(buffer.data() + offset);
+			latency.push_back(now - item->Time.QuadPart);
+			offset += item->Size;
+			read++;
+		}
+		bytes += size;
+		reads++;
+		if (pause)
+			std::this_thread::sleep_for(std::chrono::microseconds(pause));
+		else if (size == 0)
+			std::this_thread::yield();
+	}
+	auto elapsed = NowNs() - start;
+
+	for (auto& t : threads)
+		t.join();
+
+	PrintRate("produced", total, elapsed);
+	PrintRate("read", read, elapsed);
+	printf("  %-24s %12llu events  %8.3f %%\n", "dropped", (unsigned long long)dropped(), dropped() * 100.0 / total);
+	for (ULONG i = 0; i < SysMonMaxTypes; i++)
+		if (queue.Dropped[i])
+			printf("    type %-2u %12u\n", i, (ULONG)queue.Dropped[i]);
+	printf("  %-24s %12llu reads     %8.0f bytes/read\n", "", (unsigned long long)reads, reads ? (double)bytes / reads : 0.0);
+	PrintLatency("enqueue->dequeue", latency);
+
+	queue.Clear();
+	pool.Destroy();
+	auto ok = read + dropped() == total;
+	printf(ok ? "every event read or counted as dropped\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,85 @@
+// PoolBench.cpp : record allocation with the slab pool vs. plain malloc.
+// producers allocate records from a synthetic event mix and queue them,
+// the consumer frees them - the same cross-thread pattern SysMon has.
+
+#include "BenchUtil.h"
+#include "../SysMon/EventRing.h"
+#include "../SysMon/ItemPool.h"
+#include <thread>
+
+namespace {
+	const ULONG RingCapacity = 1024;
+	typedef EventRingSet<ItemHeader, RingCapacity> ItemRings;
+
+	struct MallocAllocator {
+		ItemHeader* Alloc(ItemType, ULONG size) {
+			return (ItemHeader*)malloc(size);
+		}
+
+		void Free(ItemHeader* item) {
+			free(item);
+		}
+	};
+
+	template<typename Allocator>
+	void Run(const char* name, Allocator& allocator, ULONG producers, ULONG events) {
+		std::vector<ItemRings::Ring> buffers(producers);
+		ItemRings rings;
+		rings.Init(buffers.data(), producers);
+
+		std::vector<std::thread> threads;
+		auto start = NowNs();
+		for (ULONG p = 0; p < producers; p++) {
+			threads.emplace_back([&, p] {
+				ULONG seed = p + 1;
+				for (ULONG i = 0; i < events; i++) {
+					ItemType type;
+					ULONG size;
+					NextEventType(seed, type, size);
+					auto item = allocator.Alloc(type, size);
+					item->Type = type;
+					item->Size = (USHORT)size;
+					item->Time.QuadPart = i;
+					while (!rings.Push(p, item, item->Size))
+						std::this_thread::yield();
+				}
+			});
+		}
+
+		ULONGLONG total = (ULONGLONG)producers * events, count = 0;
+		while (count < total) {
+			auto drained = rings.Drain([&](ItemHeader* item) {
+				allocator.Free(item);
+				return true;
+			});
+			if (drained == 0)
+				std::this_thread::yield();
+			count += drained;
+		}
+		auto elapsed = NowNs() - start;
+
+		for (auto& t : threads)
+			t.join();
+
+		PrintRate(name, count, elapsed);
+	}
+}
+
+int PoolBench(int argc, const char* argv[]) {
+	auto producers = ArgValue(argc, argv, "producers", 4);
+	auto events = ArgValue(argc, argv, "events", 1000000);
+
+	printf("%u producers, %u events each\n", producers, events);
+
+	MallocAllocator heap;
+	Run("malloc", heap, producers, events);
+
+	ItemPool pool;
+	if (!pool.Init(DriverPoolClasses, ARRAYSIZE(DriverPoolClasses), 0)) {
+		printf("failed to allocate slabs\n");
+		return 1;
+	}
+	Run("slab pool", pool, producers, events);
+	pool.Destroy();
+	return 0;
+}
@@ -0,0 +1,224 @@
+// PriorityBench.cpp : the queue's rings per CPU and priority class.
+// first what merging them by timestamp costs: a ring per CPU as before, then four
+// times as many, drained the old way (every ring looked at for every record) and
+// the way Drain does now (a heap of the ring heads, past a handful of rings).
+// then a thread storm on a capped queue with a slow reader, drop oldest against
+// drop lowest priority: how much of each type is lost. every record must be read
+// or counted as dropped, reads must come out in time order, and with drop lowest
+// priority not one process create may be lost.
+
+#include "BenchUtil.h"
+#include "../SysMon/EventQueue.h"
+
+namespace {
+	const ULONG MergeCapacity = 8192;
+	typedef EventRingSet<ItemHeader, MergeCapacity> MergeRings;
+
+	const ULONG RingCapacity = 2048;	// the driver's
+
+	// one thread does everything here
+	struct NoLock {
+		void Lock() {}
+		bool TryLock() {
+			return true;
+		}
+		void Unlock() {}
+	};
+
+	typedef EventQueue<RingCapacity, NoLock> Queue;
+
+	ULONG Random(ULONG& seed) {
+		seed = seed * 1103515245 + 12345;
+		return seed >> 8;
+	}
+
+	// what Drain did before: the oldest head of all the rings, for every record
+	ULONG ScanDrain(MergeRings::Ring* rings, ULONG count, LONGLONG& last, bool& ordered) {
+		ULONG drained = 0;
+		for (;;) {
+			MergeRings::Ring* oldest = nullptr;
+			ItemHeader* item = nullptr;
+			for (ULONG i = 0; i < count; i++) {
+				auto head = rings[i].Peek();
+				if (head && (item == nullptr || head->Time.QuadPart < item->Time.QuadPart)) {
+					item = head;
+					oldest = &rings[i];
+				}
+			}
+			if (item == nullptr)
+				break;
+			ordered &= item->Time.QuadPart >= last;
+			last = item->Time.QuadPart;
+			oldest->Pop(item->Size);
+			drained++;
+		}
+		return drained;
+	}
+
+	bool RunMerge(const char* name, ULONG cpus, ULONG classes, ULONG records, ULONG rounds) {
+		auto count = cpus * classes;
+		std::vector<MergeRings::Ring> buffers(count);
+		MergeRings rings;
+		rings.Init(buffers.data(), count);
+		std::vector<ItemHeader> items(records);
+
+		LONGLONG scanTime = 0, drainTime = 0;
+		bool ok = true;
+		ULONG seed = 1;
+		for (ULONG round = 0; round < rounds * 2; round++) {
+			// every CPU's records in time order, the CPUs interleaved at random
+			for (ULONG i = 0; i < records; i++) {
+				auto& item = items[i];
+				ItemType type;
+				ULONG size;
+				NextEventType(seed, type, size);
+				item.Type = type;
+				item.Size = (USHORT)sizeof(ItemHeader);
+				item.Time.QuadPart = (LONGLONG)round * records + i;
+				auto level = classes > 1 ? SysMonTypePriority(type) : 0;
+				ok &= rings.Push(level * cpus + Random(seed) % cpus, &item, item.Size);
+			}
+
+			LONGLONG last = -1;
+			ULONG drained;
+			auto start = NowNs();
+			if (round & 1) {
+				drained = rings.Drain([&](ItemHeader* item) {
+					ok &= item->Time.QuadPart >= last;
+					last = item->Time.QuadPart;
+					return true;
+				});
+				drainTime += NowNs() - start;
+			}
+			else {
+				drained = ScanDrain(buffers.data(), count, last, ok);
+				scanTime += NowNs() - start;
+			}
+			ok &= drained == records;
+		}
+
+		auto total = (double)records * rounds;
+		printf("  %-24s %3u rings  scan %6.1f ns/record  drain %6.1f ns/record%s\n", name, count,
+			scanTime / total, drainTime / total, ok ? "" : "  FAILED");
+		return ok;
+	}
+
+	struct Loss {
+		ULONGLONG Produced[SysMonMaxTypes];
+		ULONGLONG Read[SysMonMaxTypes];
+	};
+
+	// a thread storm from every CPU, the rest now and then; the reader takes a
+	// small buffer every so often and can't keep up
+	bool RunStorm(ItemPool& pool, SysMonOverflowPolicy policy, ULONG cpus, ULONG steps, ULONG maxRecords) {
+		std::vector<Queue::Ring> buffers(Queue::RingCount(cpus));
+		NoLock lock;
+		Queue queue;
+		queue.Init(buffers.data(), cpus, &pool, &lock);
+		queue.Limits.MaxRecords = maxRecords;
+		queue.Limits.Policy = policy;
+
+		Loss loss;
+		::memset(&loss, 0, sizeof(loss));
+		std::vector<UCHAR> buffer(1 << 14);
+		LONGLONG last = -1;
+		bool ordered = true;
+		auto read = [&] {
+			auto size = queue.Read(buffer.data(), (ULONG)buffer.size());
+			for (ULONG offset = 0; offset < size; ) {
+				auto item = (ItemHeader*)(buffer.data() + offset);
+				ordered &= item->Time.QuadPart >= last;
+				last = item->Time.QuadPart;
+				loss.Read[(ULONG)item->Type]++;
+				offset += item->Size;
+			}
+			return size;
+		};
+
+		auto start = NowNs();
+		for (ULONG step = 0; step < steps; step++) {
+			auto type = (step & 1) ? ItemType::ThreadExit : ItemType::ThreadCreate;
+			ULONG size = sizeof(ThreadCreateExitInfo);
+			if (step % 997 == 0) {
+				type = ItemType::ProcessCreate;
+				size = sizeof(ProcessCreateInfo) + 256;
+			}
+			else if (step % 101 == 0) {
+				type = ItemType::RegistrySetValue;
+				size = sizeof(RegistrySetValueInfo);
+			}
+			else if (step % 53 == 0) {
+				type = ItemType::ImageLoad;
+				size = sizeof(ImageLoadInfo);
+			}
+
+			auto item = pool.Alloc(type, size);
+			if (item == nullptr) {
+				queue.CountDrop(type);
+			}
+			else {
+				item->Type = type;
+				item->Size = (USHORT)size;
+				item->Time.QuadPart = step;
+				if (queue.Admit(step % cpus, item) && !queue.Push(step % cpus, item, item->Type, item->Size))
+					queue.Drop(item);
+			}
+			loss.Produced[(ULONG)type]++;
+
+			if (step % 4096 == 4095)
+				read();
+		}
+		while (read())
+			;
+		auto elapsed = NowNs() - start;
+
+		static const char* const policies[] = { "drop oldest", "drop newest", "drop lowest priority" };
+		static const ItemType types[] = {
+			ItemType::ProcessCreate, ItemType::RegistrySetValue, ItemType::ImageLoad, ItemType::ThreadCreate, ItemType::ThreadExit
+		};
+		static const char* const names[] = { "process creates", "registry writes", "image loads", "thread creates", "thread exits" };
+		bool ok = ordered;
+		printf("%s:\n", policies[(ULONG)policy]);
+		PrintRate("pushed and read", steps, elapsed);
+		for (ULONG i = 0; i < ARRAYSIZE(types); i++) {
+			auto type = (ULONG)types[i];
+			auto dropped = (ULONGLONG)queue.Dropped[type];
+			ok &= loss.Read[type] + dropped == loss.Produced[type];
+			printf("  %-24s %10llu  %7.2f %% lost\n", names[i], (unsigned long long)loss.Produced[type],
+				loss.Produced[type] ? dropped * 100.0 / loss.Produced[type] : 0.0);
+		}
+		if (policy == SysMonOverflowPolicy::DropLowestPriority)
+			ok &= queue.Dropped[(ULONG)ItemType::ProcessCreate] == 0;
+		if (!ordered)
+			printf("  records out of order\n");
+
+		queue.Clear();
+		return ok;
+	}
+}
+
+int PriorityBench(int argc, const char* argv[]) {
+	auto cpus = ArgValue(argc, argv, "cpus", 4);
+	auto records = ArgValue(argc, argv, "records", 16384);
+	auto rounds = ArgValue(argc, argv, "rounds", 200);
+	auto steps = ArgValue(argc, argv, "steps", 2000000);
+	auto maxRecords = ArgValue(argc, argv, "max-records", 4096);
+
+	ItemPool pool;
+	if (!pool.Init(DriverPoolClasses, ARRAYSIZE(DriverPoolClasses), 0)) {
+		printf("failed to allocate slabs\n");
+		return 1;
+	}
+
+	printf("merging %u records, %u CPUs, %u rounds:\n", records, cpus, rounds);
+	bool ok = RunMerge("per CPU", cpus, 1, records, rounds);
+	ok &= RunMerge("per CPU and class", cpus, SysMonPriorityClasses, records, rounds);
+
+	printf("thread storm, %u steps on %u CPUs, at most %u records queued\n", steps, cpus, maxRecords);
+	ok &= RunStorm(pool, SysMonOverflowPolicy::DropOldest, cpus, steps, maxRecords);
+	ok &= RunStorm(pool, SysMonOverflowPolicy::DropLowestPriority, cpus, steps, maxRecords);
+
+	pool.Destroy();
+	printf(ok ? "every record read or counted as dropped\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
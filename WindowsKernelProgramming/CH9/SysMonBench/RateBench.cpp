@@ -0,0 +1,157 @@
+// RateBench.cpp : RateLimiter's token buckets, as checked in the notify routines.
+// what a check costs with nothing limited, with a type limit and with process limits
+// on top; then a simulated run where one process floods thread creates among
+// well behaved ones: the flooder must be held to its allowance, the others and
+// every process create must get through, and the collected summaries must account
+// for every record kept out. last, producers racing for one bucket at the same
+// instant must get exactly its burst between them.
+
+#include "BenchUtil.h"
+#include "../SysMon/RateLimiter.h"
+#include <thread>
+#include <atomic>
+
+namespace {
+	const LONG64 Second = 10000000;		// 100 nsec units
+
+	SysMonRateLimits NoLimits() {
+		SysMonRateLimits limits;
+		::memset(&limits, 0, sizeof(limits));
+		return limits;
+	}
+
+	void RunCost(const char* name, const SysMonRateLimits& limits, ULONG producers, ULONG checks) {
+		RateLimiter limiter;
+		limiter.Init(256, 0);
+		limiter.Set(limits);
+
+		std::atomic<ULONGLONG> allowed(0);
+		std::vector<std::thread> threads;
+		auto start = NowNs();
+		for (ULONG p = 0; p < producers; p++) {
+			threads.emplace_back([&, p] {
+				ULONGLONG passed = 0;
+				// a microsecond apart, well within every limit
+				LONG64 now = Second;
+				for (ULONG i = 0; i < checks; i++) {
+					now += 10;
+					if (!limiter.Active() || limiter.Allows(ItemType::ThreadCreate, (p * 64 + (i & 63) + 1) * 4, now))
+						passed++;
+				}
+				allowed += passed;
+			});
+		}
+		for (auto& t : threads)
+			t.join();
+		auto elapsed = NowNs() - start;
+		PrintRate(name, (ULONGLONG)producers * checks, elapsed);
+		limiter.Destroy();
+	}
+
+	// one flooder among quiet processes, collected every simulated second
+	bool RunFlood(ULONG seconds) {
+		const ULONG FloodRate = 200000, QuietProcesses = 50, QuietThreads = 20, QuietCreates = 5;
+		const ULONG TypeRate = 20000, ProcessRate = 1000;
+		const ULONG Flooder = 4000;
+
+		auto limits = NoLimits();
+		limits.Types[(int)ItemType::ThreadCreate] = { TypeRate, 0, ProcessRate, 0 };
+		limits.Types[(int)ItemType::ProcessCreate] = { 1000, 0, 0, 0 };
+		limits.IntervalMs = 1000;
+
+		RateLimiter limiter;
+		limiter.Init(256, 0);
+		limiter.Set(limits);
+
+		unsigned long long floodAllowed = 0, floodDenied = 0, quietAllowed = 0, quietDenied = 0;
+		unsigned long long createsAllowed = 0, createsDenied = 0, reported = 0;
+		ULONG topRight = 0;
+		auto start = NowNs();
+		for (ULONG s = 0; s < seconds; s++) {
+			auto base = (s + 1) * Second;
+			// the flooder's threads spread evenly over the second, the others' in between
+			for (ULONG i = 0; i < FloodRate; i++) {
+				auto now = base + (LONG64)i * Second / FloodRate;
+				(limiter.Allows(ItemType::ThreadCreate, Flooder, now) ? floodAllowed : floodDenied)++;
+
+				if (i % (FloodRate / (QuietProcesses * QuietThreads)) == 0) {
+					auto pid = (i / (FloodRate / (QuietProcesses * QuietThreads)) % QuietProcesses + 1) * 8;
+					(limiter.Allows(ItemType::ThreadCreate, pid, now) ? quietAllowed : quietDenied)++;
+				}
+				if (i % (FloodRate / (QuietProcesses * QuietCreates)) == 0) {
+					auto pid = (i / (FloodRate / (QuietProcesses * QuietCreates)) % QuietProcesses + 1) * 8;
+					(limiter.Allows(ItemType::ProcessCreate, pid, now) ? createsAllowed : createsDenied)++;
+				}
+			}
+
+			RateCounters counters;
+			reported += limiter.Collect(counters, base + Second);
+			topRight += counters.TopProcessId == Flooder;
+		}
+		auto elapsed = NowNs() - start;
+		auto checks = floodAllowed + floodDenied + quietAllowed + quietDenied + createsAllowed + createsDenied;
+
+		printf("simulated %u sec, %u thread creates/sec from one process, %u others:\n", seconds, FloodRate, QuietProcesses);
+		PrintRate("checks", checks, elapsed);
+		printf("  %-24s %8llu let in, %llu kept out (%u/sec allowed)\n", "flooder", floodAllowed, floodDenied, ProcessRate);
+		printf("  %-24s %8llu let in, %llu kept out\n", "other threads", quietAllowed, quietDenied);
+		printf("  %-24s %8llu let in, %llu kept out\n", "process creates", createsAllowed, createsDenied);
+		printf("  %-24s %8llu reported, flooder on top %u of %u times, %u processes left\n", "summaries", reported, topRight, seconds,
+			limiter.Count());
+
+		// a second's burst to start with, then the rate
+		auto most = (ULONGLONG)ProcessRate * (seconds + 1);
+		bool ok = floodAllowed <= most && floodAllowed >= most - ProcessRate && quietDenied == 0 && createsDenied == 0 &&
+			reported == floodDenied && topRight == seconds;
+		limiter.Destroy();
+		return ok;
+	}
+
+	// producers at the same instant, one bucket: the burst and not one more
+	bool RunRace(ULONG producers, ULONG burst) {
+		auto limits = NoLimits();
+		limits.Types[(int)ItemType::ImageLoad] = { 1, burst, 0, 0 };
+
+		RateLimiter limiter;
+		limiter.Init(256, 0);
+		limiter.Set(limits);
+
+		std::atomic<ULONG> allowed(0);
+		std::vector<std::thread> threads;
+		for (ULONG p = 0; p < producers; p++) {
+			threads.emplace_back([&, p] {
+				ULONG passed = 0;
+				for (ULONG i = 0; i < burst; i++)
+					passed += limiter.Allows(ItemType::ImageLoad, (p + 1) * 4, Second);
+				allowed += passed;
+			});
+		}
+		for (auto& t : threads)
+			t.join();
+
+		RateCounters counters;
+		auto suppressed = limiter.Collect(counters, Second);
+		printf("%u producers racing for a burst of %u: %u let in, %u kept out\n", producers, burst, allowed.load(), suppressed);
+		limiter.Destroy();
+		return allowed == burst && suppressed == producers * burst - burst;
+	}
+}
+
+int RateBench(int argc, const char* argv[]) {
+	auto producers = ArgValue(argc, argv, "producers", 4);
+	auto checks = ArgValue(argc, argv, "checks", 2000000);
+	auto seconds = ArgValue(argc, argv, "seconds", 10);
+
+	printf("%u producers, %u checks each:\n", producers, checks);
+	RunCost("nothing limited", NoLimits(), producers, checks);
+	auto limits = NoLimits();
+	limits.Types[(int)ItemType::ThreadCreate] = { 1000000, 0, 0, 0 };
+	RunCost("type limit", limits, producers, checks);
+	limits.Types[(int)ItemType::ThreadCreate] = { 1000000, 0, 100000, 0 };
+	RunCost("type and process limits", limits, producers, checks);
+
+	bool ok = RunFlood(seconds);
+	ok &= RunRace(producers, 10000);
+	printf(ok ? "every record accounted for\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
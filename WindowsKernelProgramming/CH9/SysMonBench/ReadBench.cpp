@@ -0,0 +1,269 @@
+// ReadBench.cpp : the client's read loop, with a pipe standing in for the driver.
+// a writer thread puts 64 KB batches of EventGenerator records into the pipe, as fast
+// as it can or in bursts (burst= batches, then pause= msec), each batch in two writes
+// cut at a random point so reads see records cut short. the reader formats all of it with
+// EventFormatter to out= (default /dev/null), either reading, formatting and reading
+// again like the client did, or through ReadPipeline with buffers= buffers, depth= of
+// them in flight, formatting and writing on the one thread, then with the text written
+// by an OutputWriter thread as the client does. how long the writer was held up is what
+// the driver would spend with its queue filling up. the reader must get every byte, in order.
+
+#include "BenchUtil.h"
+#include "EventGenerator.h"
+#include "../SysMon/EventFormatter.h"
+#include "../SysMon/ReadPipeline.h"
+#include "../SysMon/TimeSource.h"
+#include <thread>
+#include <unistd.h>
+
+namespace {
+	const ULONG BatchSize = 1 << 16;	// what the client reads at a time
+	const ULONG OutputBuffers = 4;		// the client's text buffers
+	const ULONG OutputSize = 1 << 18;
+
+	// fills a read-sized batch, roughly 1 usec apart
+	ULONG MakeBatch(UCHAR* buffer, ItemPool& pool, EventGenerator& generator, LONGLONG& time, ULONG& count) {
+		ULONG offset = 0;
+		count = 0;
+		for (;;) {
+			auto item = generator.Next(pool, time);
+			if (item == nullptr)
+				return offset;
+			auto fits = offset + item->Size <= BatchSize;
+			if (fits) {
+				::memcpy(buffer + offset, item, item->Size);
+				offset += item->Size;
+				count++;
+				time += 10;
+			}
+			pool.Free(item);
+			if (!fits)
+				return offset;
+		}
+	}
+
+	ULONG Checksum(ULONG hash, const UCHAR* data, ULONG size) {
+		for (ULONG i = 0; i < size; i++)
+			hash = (hash ^ data[i]) * 16777619;
+		return hash;
+	}
+
+	ULONG CountRecords(const UCHAR* data, ULONG size) {
+		ULONG count = 0;
+		for (ULONG offset = 0; offset + sizeof(ItemHeader) <= size; offset += ((const ItemHeader*)(data + offset))->Size)
+			count++;
+		return count;
+	}
+
+	bool WriteAll(int fd, const UCHAR* data, ULONG size) {
+		while (size) {
+			auto written = ::write(fd, data, size);
+			if (written <= 0)
+				return false;
+			data += written;
+			size -= (ULONG)written;
+		}
+		return true;
+	}
+
+	struct Totals {
+		ULONG64 Records;
+		ULONG64 Bytes;
+		ULONG Checksum;
+		ULONG64 Reads;
+		ULONG64 Stalls;			// the reader out of buffers
+		ULONG64 Waits;			// the decoder out of text buffers
+	};
+
+	struct WriterTotals : Totals {
+		LONGLONG Blocked;		// in write(2)
+	};
+
+	// the driver's side
+	void Write(int fd, const std::vector<std::vector<UCHAR>>& batches, ULONG count, ULONG burst, ULONG pauseMs, WriterTotals& totals) {
+		ULONG seed = 3;
+		for (ULONG i = 0; i < count; i++) {
+			if (i && i % burst == 0 && pauseMs)
+				std::this_thread::sleep_for(std::chrono::milliseconds(pauseMs));
+
+			auto& batch = batches[i % batches.size()];
+			auto size = (ULONG)batch.size();
+			seed = seed * 1103515245 + 12345;
+			auto cut = (seed >> 8) % size;
+			auto start = NowNs();
+			if (!WriteAll(fd, batch.data(), cut) || !WriteAll(fd, batch.data() + cut, size - cut))
+				break;
+			totals.Blocked += NowNs() - start;
+			totals.Records += CountRecords(batch.data(), size);
+			totals.Bytes += size;
+			totals.Checksum = Checksum(totals.Checksum, batch.data(), size);
+		}
+		::close(fd);
+	}
+
+	void Consume(EventFormatter& formatter, const UCHAR* data, ULONG size, Totals& totals) {
+		formatter.Format(data, size);
+		totals.Records += CountRecords(data, size);
+		totals.Bytes += size;
+		totals.Checksum = Checksum(totals.Checksum, data, size);
+	}
+
+	// read, format, read again
+	bool ReadInline(int fd, EventFormatter& formatter, Totals& totals) {
+		ReadSource source;
+		source.Attach(fd, 1);
+		std::vector<UCHAR> buffer(BatchSize);
+		for (;;) {
+			ULONG bytes;
+			source.Start(0, buffer.data(), BatchSize);
+			auto result = source.Wait(0, bytes);
+			if (result != ReadResult::Filled)
+				return result == ReadResult::Ended;
+			totals.Reads++;
+			Consume(formatter, buffer.data(), bytes, totals);
+			formatter.Flush();
+		}
+	}
+
+	bool ReadPipelined(int fd, EventFormatter& formatter, ULONG buffers, ULONG depth, FILE* out, Totals& totals) {
+		ReadSource source;
+		source.Attach(fd, buffers);
+		ReadPipeline pipeline;
+		OutputWriter writer;
+		if (out) {
+			writer.Start(out, OutputBuffers, OutputSize);
+			formatter.SetWriter(&writer);
+		}
+		pipeline.Start(source, buffers, depth, BatchSize);
+		while (!pipeline.Done()) {
+			auto batch = pipeline.Next(100);
+			if (batch) {
+				Consume(formatter, batch->Data, batch->Size, totals);
+				pipeline.Release(batch);
+			}
+			if (batch == nullptr || pipeline.Waiting() == 0)
+				formatter.Flush();
+		}
+		pipeline.Close();
+		formatter.Flush();
+		formatter.SetWriter(nullptr);
+		writer.Close();
+		totals.Reads = pipeline.Reads();
+		totals.Stalls = pipeline.Stalls();
+		totals.Waits = writer.Waits();
+		return !pipeline.Failed() && !writer.Failed();
+	}
+
+	template<typename Read>
+	bool Run(const char* name, const std::vector<std::vector<UCHAR>>& batches, ULONG count, ULONG burst, ULONG pauseMs,
+		FILE* out, Read&& read) {
+		int fds[2];
+		if (::pipe(fds) != 0)
+			return false;
+
+		EventFormatter formatter;
+		formatter.Init(out, SysMonFormatV1);
+		WriterTotals written{};
+		Totals got{};
+		auto start = NowNs();
+		std::thread writer([&] { Write(fds[1], batches, count, burst, pauseMs, written); });
+		auto ok = read(fds[0], formatter, got);
+		writer.join();
+		auto elapsed = NowNs() - start;
+		::close(fds[0]);
+
+		PrintRate(name, got.Records, elapsed);
+		printf("  %-24s writer held up %.1f ms in all, %.1f us a batch; %llu reads, out of buffers %llu times", "",
+			written.Blocked / 1e6, written.Blocked / 1e3 / count, (unsigned long long)got.Reads, (unsigned long long)got.Stalls);
+		if (got.Waits)
+			printf(", decoder waited on output %llu times", (unsigned long long)got.Waits);
+		printf("\n");
+		return ok && got.Records == written.Records && got.Bytes == written.Bytes && got.Checksum == written.Checksum;
+	}
+
+	// a record cut short by the end of the stream fails the read, what came before it still arrives
+	bool CheckTruncated(const std::vector<UCHAR>& batch) {
+		int fds[2];
+		if (::pipe(fds) != 0)
+			return false;
+		std::thread writer([&] {
+			WriteAll(fds[1], batch.data(), (ULONG)batch.size() - 3);
+			::close(fds[1]);
+		});
+
+		ReadSource source;
+		source.Attach(fds[0], 2);
+		ReadPipeline pipeline;
+		pipeline.Start(source, 2, 2, BatchSize);
+		ULONG64 bytes = 0;
+		while (!pipeline.Done()) {
+			auto next = pipeline.Next(100);
+			if (next) {
+				bytes += next->Size;
+				pipeline.Release(next);
+			}
+		}
+		pipeline.Close();
+		writer.join();
+		::close(fds[0]);
+
+		ULONG whole = 0;
+		while (whole + ((const ItemHeader*)(batch.data() + whole))->Size <= batch.size() - 3)
+			whole += ((const ItemHeader*)(batch.data() + whole))->Size;
+		return pipeline.Failed() && pipeline.Error() == EILSEQ && bytes == whole;
+	}
+}
+
+int ReadBench(int argc, const char* argv[]) {
+	auto count = ArgValue(argc, argv, "batches", 2000);
+	auto burst = ArgValue(argc, argv, "burst", 6);
+	auto pauseMs = ArgValue(argc, argv, "pause", 0);
+	auto buffers = ArgValue(argc, argv, "buffers", 16);
+	auto depth = ArgValue(argc, argv, "depth", 4);
+	const char* path = "/dev/null";
+	for (int i = 2; i < argc; i++)
+		if (strncmp(argv[i], "out=", 4) == 0)
+			path = argv[i] + 4;
+
+	ItemPool pool;
+	if (!pool.Init(DriverPoolClasses, ARRAYSIZE(DriverPoolClasses), 0)) {
+		printf("failed to allocate slabs\n");
+		return 1;
+	}
+	std::vector<std::vector<UCHAR>> batches(32);
+	EventGenerator generator(1);
+	LONGLONG time = ReadSystemTime();
+	for (auto& batch : batches) {
+		batch.resize(BatchSize);
+		ULONG records;
+		batch.resize(MakeBatch(batch.data(), pool, generator, time, records));
+	}
+	pool.Destroy();
+
+	auto out = fopen(path, "w");
+	if (out == nullptr) {
+		printf("can't open %s\n", path);
+		return 1;
+	}
+	printf("%u batches of 64 KB to %s", count, path);
+	if (pauseMs)
+		printf(", %u at a time every %u ms", burst, pauseMs);
+	printf("\n");
+	bool ok = Run("one read at a time", batches, count, burst, pauseMs, out, [&](int fd, EventFormatter& formatter, Totals& totals) {
+		return ReadInline(fd, formatter, totals);
+	});
+	char name[64];
+	::snprintf(name, sizeof(name), "pipeline, %u in flight", depth);
+	ok &= Run(name, batches, count, burst, pauseMs, out, [&](int fd, EventFormatter& formatter, Totals& totals) {
+		return ReadPipelined(fd, formatter, buffers, depth, nullptr, totals);
+	});
+	::snprintf(name, sizeof(name), "pipeline, output thread");
+	ok &= Run(name, batches, count, burst, pauseMs, out, [&](int fd, EventFormatter& formatter, Totals& totals) {
+		return ReadPipelined(fd, formatter, buffers, depth, out, totals);
+	});
+	fclose(out);
+
+	ok &= CheckTruncated(batches[0]);
+	printf(ok ? "every record read, in order\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
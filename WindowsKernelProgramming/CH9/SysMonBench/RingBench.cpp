@@ -0,0 +1,147 @@
+// RingBench.cpp : many producers, one draining consumer.
+// compares the per-CPU rings against the original mutex-guarded list
+// and checks that no event is lost or reordered within a producer.
+
+#include "BenchUtil.h"
+#include "../SysMon/EventRing.h"
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+namespace {
+	const ULONG RingCapacity = 1024;
+	typedef EventRingSet<ItemHeader, RingCapacity> ItemRings;
+
+	ThreadCreateExitInfo* NewItem(ULONG producer, ULONG sequence) {
+		auto item = (ThreadCreateExitInfo*)malloc(sizeof(ThreadCreateExitInfo));
+		item->Type = ItemType::ThreadCreate;
+		item->Size = sizeof(ThreadCreateExitInfo);
+		item->ProcessId = producer;
+		item->ThreadId = sequence;
+		item->Time.QuadPart = NowNs();
+		return item;
+	}
+
+	struct Checker {
+		std::vector<ULONG> Next;
+		std::vector<LONGLONG> Latency;
+		ULONGLONG Count = 0;
+		bool Failed = false;
+
+		explicit Checker(ULONG producers) : Next(producers) {}
+
+		void Consume(ItemHeader* header) {
+			auto item = (ThreadCreateExitInfo*)header;
+			if (item->ThreadId != Next[item->ProcessId]) {
+				if (!Failed)
+					printf("  producer %u: expected event %u, got %u\n", item->ProcessId, Next[item->ProcessId], item->ThreadId);
+				Failed = true;
+			}
+			Next[item->ProcessId] = item->ThreadId + 1;
+			if ((Count & 15) == 0)
+				Latency.push_back(NowNs() - item->Time.QuadPart);
+			Count++;
+			free(item);
+		}
+	};
+
+	bool RunRings(ULONG producers, ULONG events) {
+		std::vector<ItemRings::Ring> buffers(producers);
+		ItemRings rings;
+		rings.Init(buffers.data(), producers);
+
+		Checker checker(producers);
+		std::atomic<ULONG> done(0);
+		std::vector<std::thread> threads;
+		auto start = NowNs();
+
+		for (ULONG p = 0; p < producers; p++) {
+			threads.emplace_back([&, p] {
+				for (ULONG i = 0; i < events; i++) {
+					auto item = NewItem(p, i);
+					while (!rings.Push(p, item, item->Size))
+						std::this_thread::yield();
+				}
+				done++;
+			});
+		}
+
+		// the consumer mirrors SysMonRead: drain whatever is there, then come back
+		ULONGLONG total = (ULONGLONG)producers * events;
+		while (checker.Count < total) {
+			if (rings.Drain([&](ItemHeader* item) { checker.Consume(item); return true; }) == 0)
+				std::this_thread::yield();
+		}
+		auto elapsed = NowNs() - start;
+
+		for (auto& t : threads)
+			t.join();
+
+		PrintRate("per-CPU rings", checker.Count, elapsed);
+		PrintLatency("enqueue->dequeue", checker.Latency);
+		return !checker.Failed;
+	}
+
+	bool RunLockedList(ULONG producers, ULONG events) {
+		// the original scheme: every producer and the reader share one lock
+		struct Node {
+			Node* Next;
+			ItemHeader* Item;
+		};
+		std::mutex lock;
+		Node* head = nullptr;
+		Node* tail = nullptr;
+
+		Checker checker(producers);
+		std::vector<std::thread> threads;
+		auto start = NowNs();
+
+		for (ULONG p = 0; p < producers; p++) {
+			threads.emplace_back([&, p] {
+				for (ULONG i = 0; i < events; i++) {
+					auto node = new Node{ nullptr, NewItem(p, i) };
+					std::lock_guard<std::mutex> locker(lock);
+					if (tail)
+						tail->Next = node;
+					else
+						head = node;
+					tail = node;
+				}
+			});
+		}
+
+		ULONGLONG total = (ULONGLONG)producers * events;
+		while (checker.Count < total) {
+			{
+				std::lock_guard<std::mutex> locker(lock);
+				while (head) {
+					auto node = head;
+					head = node->Next;
+					checker.Consume(node->Item);
+					delete node;
+				}
+				tail = nullptr;
+			}
+			std::this_thread::yield();
+		}
+		auto elapsed = NowNs() - start;
+
+		for (auto& t : threads)
+			t.join();
+
+		PrintRate("locked list", checker.Count, elapsed);
+		PrintLatency("enqueue->dequeue", checker.Latency);
+		return !checker.Failed;
+	}
+}
+
+int RingBench(int argc, const char* argv[]) {
+	auto producers = ArgValue(argc, argv, "producers", 4);
+	auto events = ArgValue(argc, argv, "events", 1000000);
+
+	printf("%u producers, %u events each\n", producers, events);
+	auto ok = RunRings(producers, events);
+	ok = RunLockedList(producers, events) && ok;
+	printf(ok ? "no events lost or reordered\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
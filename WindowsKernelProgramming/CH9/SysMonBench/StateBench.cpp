@@ -0,0 +1,388 @@
+// StateBench.cpp : keeping the client's table of running processes up to date.
+// a synthetic but consistent event stream (processes= alive at a time, each with
+// its threads coming and going and images loading) is recorded into trace segments
+// with TraceRecorder, then replayed into StateTable and into the same state kept in
+// std::unordered_map/set with a std::wstring per path. then queries= lookups of one
+// process' threads and modules, from the table vs. by rescanning the history.
+// segments go to the temp directory and are removed.
+
+#include "BenchUtil.h"
+#include "../SysMon/TraceRecorder.h"
+#include "../SysMon/StateTable.h"
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+	const ULONG BatchSize = 1 << 16;	// what the client reads at a time
+	const ULONG MaxThreads = 64;		// per process, so an exit always fits in a batch
+
+	volatile ULONG Sink;
+
+	const char* const Images[] = {
+		"\\Device\\HarddiskVolume3\\Windows\\System32\\ntdll.dll",
+		"\\Device\\HarddiskVolume3\\Windows\\System32\\kernel32.dll",
+		"\\Device\\HarddiskVolume3\\Windows\\System32\\KernelBase.dll",
+		"\\Device\\HarddiskVolume3\\Windows\\System32\\ucrtbase.dll",
+		"\\Device\\HarddiskVolume3\\Windows\\System32\\advapi32.dll",
+		"\\Device\\HarddiskVolume3\\Windows\\System32\\msvcrt.dll",
+		"\\Device\\HarddiskVolume3\\Windows\\System32\\sechost.dll",
+		"\\Device\\HarddiskVolume3\\Windows\\System32\\rpcrt4.dll",
+		"\\Device\\HarddiskVolume3\\Program Files\\Git\\mingw64\\bin\\libiconv-2.dll",
+		"\\Device\\HarddiskVolume3\\Windows\\WinSxS\\amd64_microsoft.windows.common-controls_6595b64144ccf1df_6.0.19041.1110_none_60b5254171f9507e\\comctl32.dll",
+	};
+
+	// processes start, run threads, load images and exit, in an order that makes sense
+	class Workload {
+	public:
+		Workload(ULONG processes) : _target(processes) {}
+
+		// fills a read-sized batch, v2 records
+		ULONG MakeBatch(UCHAR* buffer, ULONG& count) {
+			_buffer = buffer;
+			_offset = 0;
+			count = 0;
+			while (_offset + 4096 <= BatchSize) {
+				Step();
+				count++;
+			}
+			return _offset;
+		}
+
+	private:
+		struct Process {
+			ULONG ProcessId;
+			std::vector<ULONG> Threads;
+		};
+
+		void Step() {
+			auto r = Random() % 100;
+			if (_processes.size() < 2 || (r < 2 && _processes.size() < _target)) {
+				Create();
+				return;
+			}
+			auto& process = _processes[Random() % _processes.size()];
+			if (r < 4 && _processes.size() > _target / 2)
+				Exit(process);
+			else if (r < 12)
+				ImageLoad(process);
+			else if ((r < 56 && process.Threads.size() < MaxThreads) || process.Threads.empty())
+				ThreadEvent(ItemType::ThreadCreate, process, NextId());
+			else {
+				auto which = Random() % process.Threads.size();
+				ThreadEvent(ItemType::ThreadExit, process, process.Threads[which]);
+			}
+		}
+
+		void Create() {
+			static const char commandLine[] = "\"C:\\Program Files\\Git\\cmd\\git.exe\" status --porcelain --untracked-files=no";
+			const ULONG length = sizeof(commandLine) - 1;
+			auto info = (ProcessCreateInfo*)Add(ItemType::ProcessCreate, sizeof(ProcessCreateInfo) + length * sizeof(WCHAR));
+			info->ProcessId = NextId();
+			info->ParentProcessId = _processes.empty() ? 4 : _processes[Random() % _processes.size()].ProcessId;
+			info->CommandLineLength = length;
+			info->CommandLineOffset = sizeof(ProcessCreateInfo);
+			for (ULONG i = 0; i < length; i++)
+				((WCHAR*)(info + 1))[i] = commandLine[i];
+			_processes.push_back({ info->ProcessId, {} });
+			ThreadEvent(ItemType::ThreadCreate, _processes.back(), NextId());
+		}
+
+		void Exit(Process& process) {
+			while (!process.Threads.empty())
+				ThreadEvent(ItemType::ThreadExit, process, process.Threads.back());
+			auto info = (ProcessExitInfo*)Add(ItemType::ProcessExit, sizeof(ProcessExitInfo));
+			info->ProcessId = process.ProcessId;
+			if (&process != &_processes.back())
+				process = std::move(_processes.back());
+			_processes.pop_back();
+		}
+
+		void ThreadEvent(ItemType type, Process& process, ULONG threadId) {
+			auto info = (ThreadCreateExitInfo*)Add(type, sizeof(ThreadCreateExitInfo));
+			info->ProcessId = process.ProcessId;
+			info->ThreadId = threadId;
+			if (type == ItemType::ThreadCreate)
+				process.Threads.push_back(threadId);
+			else {
+				auto& threads = process.Threads;
+				*std::find(threads.begin(), threads.end(), threadId) = threads.back();
+				threads.pop_back();
+			}
+		}
+
+		void ImageLoad(Process& process) {
+			auto path = Images[Random() % ARRAYSIZE(Images)];
+			auto length = (ULONG)strlen(path);
+			auto info = (ImageLoadInfoV2*)Add(ItemType::ImageLoadV2, sizeof(ImageLoadInfoV2) + length * sizeof(WCHAR));
+			info->ProcessId = process.ProcessId;
+			info->ImageFileNameLength = (USHORT)length;
+			info->ImageFileNameOffset = sizeof(ImageLoadInfoV2);
+			info->LoadAddress = (void*)(ULONG_PTR)(0x7ff800000000ULL + ((ULONG64)Random() << 16));
+			info->ImageSize = 0x1a0000;
+			for (ULONG i = 0; i < length; i++)
+				((WCHAR*)(info + 1))[i] = path[i];
+		}
+
+		ItemHeader* Add(ItemType type, ULONG size) {
+			size = (size + RecordAlignmentV2 - 1) & ~(RecordAlignmentV2 - 1);
+			auto item = (ItemHeader*)(_buffer + _offset);
+			memset(item, 0, size);
+			item->Type = type;
+			item->Size = (USHORT)size;
+			item->Time.QuadPart = _time += 10;
+			_offset += size;
+			return item;
+		}
+
+		// process and thread IDs share one space, like on Windows
+		ULONG NextId() {
+			_nextId = _nextId + 4 < (1 << 20) ? _nextId + 4 : 8;
+			return _nextId;
+		}
+
+		ULONG Random() {
+			_seed = _seed * 1103515245 + 12345;
+			return _seed >> 8;
+		}
+
+	private:
+		std::vector<Process> _processes;
+		size_t _target;
+		UCHAR* _buffer = nullptr;
+		ULONG _offset = 0;
+		ULONG _seed = 1;
+		ULONG _nextId = 4;
+		LONGLONG _time = 0;
+	};
+
+	// the same state the obvious way
+	class NodeState {
+	public:
+		void Update(const UCHAR* records, ULONG size) {
+			for (ULONG offset = 0; offset < size; ) {
+				auto header = (const ItemHeader*)(records + offset);
+				Update(header);
+				offset += header->Size;
+			}
+		}
+
+		size_t Threads() const {
+			return _threadOwners.size();
+		}
+
+		size_t Processes() const {
+			return _processes.size();
+		}
+
+		// a process' threads and modules
+		size_t Count(ULONG processId) const {
+			auto process = _processes.find(processId);
+			return process == _processes.end() ? 0 : process->second.Threads.size() + process->second.Modules.size();
+		}
+
+	private:
+		struct Process {
+			ULONG ParentProcessId = 0;
+			std::wstring CommandLine;
+			std::unordered_set<ULONG> Threads;
+			std::vector<std::wstring> Modules;
+		};
+
+		void Update(const ItemHeader* header) {
+			switch (header->Type) {
+				case ItemType::ProcessCreate:
+				{
+					auto info = (const ProcessCreateInfo*)header;
+					auto text = (const WCHAR*)((const UCHAR*)info + info->CommandLineOffset);
+					auto& process = _processes[info->ProcessId];
+					process.ParentProcessId = info->ParentProcessId;
+					process.CommandLine.assign(text, text + info->CommandLineLength);
+					break;
+				}
+
+				case ItemType::ProcessExit:
+				{
+					auto process = _processes.find(((const ProcessExitInfo*)header)->ProcessId);
+					if (process != _processes.end()) {
+						for (auto thread : process->second.Threads)
+							_threadOwners.erase(thread);
+						_processes.erase(process);
+					}
+					break;
+				}
+
+				case ItemType::ThreadCreate:
+				{
+					auto info = (const ThreadCreateExitInfo*)header;
+					_processes[info->ProcessId].Threads.insert(info->ThreadId);
+					_threadOwners[info->ThreadId] = info->ProcessId;
+					break;
+				}
+
+				case ItemType::ThreadExit:
+				{
+					auto info = (const ThreadCreateExitInfo*)header;
+					auto owner = _threadOwners.find(info->ThreadId);
+					if (owner != _threadOwners.end()) {
+						_processes[owner->second].Threads.erase(info->ThreadId);
+						_threadOwners.erase(owner);
+					}
+					break;
+				}
+
+				case ItemType::ImageLoadV2:
+				{
+					auto info = (const ImageLoadInfoV2*)header;
+					auto text = (const WCHAR*)((const UCHAR*)info + info->ImageFileNameOffset);
+					_processes[info->ProcessId].Modules.emplace_back(text, text + info->ImageFileNameLength);
+					break;
+				}
+
+				default:
+					break;
+			}
+		}
+
+	private:
+		std::unordered_map<ULONG, Process> _processes;
+		std::unordered_map<ULONG, ULONG> _threadOwners;
+	};
+
+	// a process' live threads and modules without a table: through the whole history
+	size_t Rescan(const std::vector<std::string>& paths, ULONG processId) {
+		std::unordered_set<ULONG> threads;
+		size_t modules = 0;
+		for (auto& path : paths) {
+			TraceReader reader;
+			if (!reader.Open(path.c_str()))
+				continue;
+			reader.ForEach([&](const ItemHeader* item) {
+				switch (item->Type) {
+					case ItemType::ProcessCreate:
+						if (((const ProcessCreateInfo*)item)->ProcessId == processId) {
+							threads.clear();
+							modules = 0;
+						}
+						break;
+					case ItemType::ThreadCreate:
+						if (((const ThreadCreateExitInfo*)item)->ProcessId == processId)
+							threads.insert(((const ThreadCreateExitInfo*)item)->ThreadId);
+						break;
+					case ItemType::ThreadExit:
+						if (((const ThreadCreateExitInfo*)item)->ProcessId == processId)
+							threads.erase(((const ThreadCreateExitInfo*)item)->ThreadId);
+						break;
+					case ItemType::ImageLoadV2:
+						modules += ((const ImageLoadInfoV2*)item)->ProcessId == processId;
+						break;
+					default:
+						break;
+				}
+			});
+		}
+		return threads.size() + modules;
+	}
+
+	template<typename Update>
+	LONGLONG Replay(const char* name, const std::vector<std::string>& paths, ULONGLONG events, Update&& update) {
+		LONGLONG elapsed = 0;
+		for (auto& path : paths) {
+			TraceReader reader;
+			if (!reader.Open(path.c_str()))
+				continue;
+			// the segment paged in first, only the updates are timed
+			for (ULONG64 i = 0; i < reader.Header().DataSize; i += 4096)
+				Sink = Sink + reader.Records()[i];
+			auto start = NowNs();
+			update(reader.Records(), (ULONG)reader.Header().DataSize);
+			elapsed += NowNs() - start;
+		}
+		PrintRate(name, events, elapsed);
+		printf("  %-24s %8.1f ns/event\n", "", (double)elapsed / events);
+		return elapsed;
+	}
+}
+
+int StateBench(int argc, const char* argv[]) {
+	auto events = ArgValue(argc, argv, "events", 2000000);
+	auto processes = ArgValue(argc, argv, "processes", 300);
+	auto queries = ArgValue(argc, argv, "queries", 20);
+
+	auto base = (std::filesystem::temp_directory_path() / "SysMonState").string();
+	TraceRecorder recorder;
+	if (!recorder.Init(base.c_str(), 64 << 20, SysMonFormatV2)) {
+		printf("failed to create a segment\n");
+		return 1;
+	}
+	std::vector<UCHAR> buffer(BatchSize);
+	Workload workload(processes);
+	ULONGLONG written = 0;
+	while (written < events) {
+		ULONG count;
+		auto size = workload.MakeBatch(buffer.data(), count);
+		if (!recorder.Append(buffer.data(), size)) {
+			printf("failed to record\n");
+			return 1;
+		}
+		written += count;
+	}
+	recorder.Close();
+
+	std::vector<std::string> paths;
+	for (ULONG i = 1; i <= recorder.Segments(); i++) {
+		char path[512];
+		snprintf(path, sizeof(path), "%s.%06u.trace", base.c_str(), i);
+		paths.push_back(path);
+	}
+	printf("%llu events, %llu bytes in %u segments, %u processes at a time\n", (unsigned long long)written,
+		(unsigned long long)recorder.Bytes(), recorder.Segments(), processes);
+
+	NodeState nodes;
+	auto before = Replay("unordered_map/set", paths, written, [&](const UCHAR* records, ULONG size) {
+		nodes.Update(records, size);
+	});
+
+	StateTable state;
+	state.Init();
+	auto after = Replay("StateTable", paths, written, [&](const UCHAR* records, ULONG size) {
+		state.Update(records, size);
+	});
+	printf("%.1fx faster\n", (double)before / after);
+
+	bool ok = state.Processes() == nodes.Processes() && state.Threads() == nodes.Threads();
+	printf("%u processes, %u threads, %u modules at the end\n", state.Processes(), state.Threads(), state.Modules());
+
+	// lookups of running processes, answers checked against the rescans
+	std::vector<ULONG> processIds;
+	state.ForEachProcess([&](const ProcessRecord& process) {
+		processIds.push_back(process.ProcessId);
+	});
+	LONGLONG table = 0, rescan = 0;
+	for (ULONG i = 0; i < queries && !processIds.empty(); i++) {
+		auto processId = processIds[(i * 7919) % processIds.size()];
+		auto start = NowNs();
+		size_t found = 0;
+		if (auto process = state.FindProcess(processId)) {
+			state.ForEachThread(*process, [&](const ThreadRecord&) { found++; });
+			state.ForEachModule(*process, [&](const ModuleRecord&) { found++; });
+		}
+		table += NowNs() - start;
+
+		start = NowNs();
+		auto expected = Rescan(paths, processId);
+		rescan += NowNs() - start;
+		ok = ok && found == expected && nodes.Count(processId) == expected;
+	}
+	if (queries) {
+		printf("one process' threads and modules, %u queries:\n", queries);
+		printf("  %-24s %12.1f usec/query\n", "StateTable", table / 1000.0 / queries);
+		printf("  %-24s %12.1f usec/query\n", "rescanning the trace", rescan / 1000.0 / queries);
+	}
+
+	for (auto& path : paths)
+		remove(path.c_str());
+	printf(ok ? "state agrees\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,153 @@
+// StatsBench.cpp : EventStats' per-CPU histograms and counters, as the notify routines
+// update them. what a timed callback costs with nothing counted, with every producer on
+// its own block and with all of them on one (the counters as they'd be without the
+// per-CPU blocks); the collected counts and sums must match what went in. then the same
+// with the system clock for a stamp, every callback timed and 1 in SlowClockSampling,
+// as the driver does without an invariant TSC. then the
+// read side: a batch tallied locally and added once must come out the same as every
+// record added on its own. last, the bucket boundaries.
+
+#include "BenchUtil.h"
+#include "../SysMon/EventStats.h"
+#include "../SysMon/TimeSource.h"
+#include <thread>
+
+namespace {
+	enum class Counting { Nothing, PerCpu, Shared, SlowClock, Sampled };
+
+	bool RunCost(const char* name, Counting counting, ULONG producers, ULONG callbacks) {
+		EventStats stats;
+		stats.Init(producers, 0);
+
+		std::vector<std::thread> threads;
+		std::vector<ULONGLONG> sums(producers);
+		auto slow = counting == Counting::SlowClock || counting == Counting::Sampled;
+		auto every = counting == Counting::Sampled ? EventStats::SlowClockSampling : 1;
+		auto start = NowNs();
+		for (ULONG p = 0; p < producers; p++) {
+			threads.emplace_back([&, p] {
+				auto cpu = counting == Counting::Shared ? 0 : p;
+				ULONGLONG sum = 0;
+				for (ULONG i = 0; i < callbacks; i++) {
+					auto type = (i & 1) ? ItemType::ThreadExit : ItemType::ThreadCreate;
+					if (slow) {
+						if (!stats.Sample(cpu, every)) {
+							stats.Enqueued(cpu, type);
+							continue;
+						}
+						auto begin = NowNs();
+						auto elapsed = (ULONG64)(NowNs() - begin);
+						stats.Enqueued(cpu, type);
+						stats.Record(cpu, EventHistogram::Callback, elapsed);
+						sum += elapsed;
+						continue;
+					}
+					auto begin = ReadTimeCounter();
+					auto elapsed = ReadTimeCounter() - begin;
+					if (counting != Counting::Nothing) {
+						stats.Enqueued(cpu, type);
+						stats.Record(cpu, EventHistogram::Callback, elapsed);
+					}
+					sum += elapsed;
+				}
+				sums[p] = sum;
+			});
+		}
+		for (auto& t : threads)
+			t.join();
+		auto elapsed = NowNs() - start;
+		PrintRate(name, (ULONGLONG)producers * callbacks, elapsed);
+
+		SysMonLatencyStats collected;
+		stats.Collect(collected);
+		stats.Destroy();
+		if (counting == Counting::Nothing)
+			return true;
+
+		ULONGLONG sum = 0;
+		for (auto s : sums)
+			sum += s;
+		auto total = (ULONGLONG)producers * callbacks;
+		return collected.Callback.Count == (ULONGLONG)producers * (callbacks / every) && collected.Callback.Sum == sum &&
+			collected.Enqueued[(ULONG)ItemType::ThreadCreate] + collected.Enqueued[(ULONG)ItemType::ThreadExit] == total &&
+			collected.Residence.Count == 0;
+	}
+
+	// residence times of a read's records, tallied first or added one by one
+	bool RunBatches(ULONG reads, ULONG batch) {
+		EventStats tallied, single;
+		tallied.Init(1, 0);
+		single.Init(1, 0);
+
+		ULONG seed = 1;
+		std::vector<ULONG64> values(batch);
+		LONGLONG talliedTime = 0, singleTime = 0;
+		for (ULONG r = 0; r < reads; r++) {
+			for (auto& value : values) {
+				seed = seed * 1103515245 + 12345;
+				value = (ULONG64)(seed >> 8) << (seed % 24);
+			}
+
+			auto start = NowNs();
+			SysMonHistogram histogram;
+			::memset(&histogram, 0, sizeof(histogram));
+			for (auto value : values)
+				EventStats::Tally(histogram, value);
+			tallied.Record(0, EventHistogram::Residence, histogram);
+			talliedTime += NowNs() - start;
+
+			start = NowNs();
+			for (auto value : values)
+				single.Record(0, EventHistogram::Residence, value);
+			singleTime += NowNs() - start;
+		}
+
+		SysMonLatencyStats a, b;
+		tallied.Collect(a);
+		single.Collect(b);
+		tallied.Destroy();
+		single.Destroy();
+
+		auto total = (double)reads * batch;
+		printf("%u reads of %u records: one by one %.1f ns/record, tallied %.1f ns/record\n", reads, batch,
+			singleTime / total, talliedTime / total);
+		return ::memcmp(&a.Residence, &b.Residence, sizeof(a.Residence)) == 0 && a.Residence.Count == (ULONG64)reads * batch;
+	}
+
+	bool CheckBuckets() {
+		static const struct {
+			ULONG64 Value;
+			ULONG Bucket;
+		} cases[] = {
+			{ 0, 0 }, { 1, 1 }, { 2, 2 }, { 3, 2 }, { 4, 3 }, { 1023, 10 }, { 1024, 11 },
+			{ 0xffffffff, 32 }, { 0x100000000, 33 }, { 1ull << 38, 39 }, { ~0ull, SysMonHistogramBuckets - 1 }
+		};
+		bool ok = true;
+		for (auto& c : cases) {
+			auto bucket = EventStats::Bucket(c.Value);
+			if (bucket != c.Bucket) {
+				printf("  %llu went to bucket %u, not %u\n", (unsigned long long)c.Value, bucket, c.Bucket);
+				ok = false;
+			}
+		}
+		return ok;
+	}
+}
+
+int StatsBench(int argc, const char* argv[]) {
+	auto producers = ArgValue(argc, argv, "producers", 4);
+	auto callbacks = ArgValue(argc, argv, "callbacks", 2000000);
+	auto reads = ArgValue(argc, argv, "reads", 2000);
+	auto batch = ArgValue(argc, argv, "batch", 512);
+
+	printf("%u producers, %u timed callbacks each:\n", producers, callbacks);
+	bool ok = RunCost("nothing counted", Counting::Nothing, producers, callbacks);
+	ok &= RunCost("per CPU blocks", Counting::PerCpu, producers, callbacks);
+	ok &= RunCost("one shared block", Counting::Shared, producers, callbacks);
+	ok &= RunCost("system clock, every one", Counting::SlowClock, producers, callbacks);
+	ok &= RunCost("system clock, sampled", Counting::Sampled, producers, callbacks);
+	ok &= RunBatches(reads, batch);
+	ok &= CheckBuckets();
+	printf(ok ? "every value counted\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,61 @@
+// SysMonBench.cpp : exercises the portable parts of SysMon outside the kernel.
+//
+// builds on Windows or Linux, e.g.
+//   g++ -O2 -std=c++17 -pthread *.cpp -o SysMonBench
+//
+// usage: SysMonBench <mode> [name=value ...]
+
+#include "BenchUtil.h"
+
+struct BenchMode {
+	const char* Name;
+	const char* Description;
+	int (*Run)(int argc, const char* argv[]);
+};
+
+static const BenchMode Modes[] = {
+	{ "ring", "per-CPU event rings vs. a locked list (producers=, events=)", RingBench },
+	{ "pool", "slab pool vs. malloc for a synthetic event mix (producers=, events=)", PoolBench },
+	{ "wake", "reader wake-up latency, event vs. polling (samples=, poll=)", WakeBench },
+	{ "channel", "shared memory channel vs. queue and copy (producers=, events=, size=)", ChannelBench },
+	{ "format", "bytes per event, fixed vs. compact records (events=)", FormatBench },
+	{ "filter", "cost of the event filter per event (producers=, events=, update=)", FilterBench },
+	{ "drain", "reader lock hold time, copy under the lock vs. splice (producers=, events=)", DrainBench },
+	{ "intern", "image path interning: lookups, bytes and copy cost per event (producers=, events=, paths=)", InternBench },
+	{ "aggregate", "thread events as records vs. per-process summaries (producers=, events=, processes=, interval=)", AggregateBench },
+	{ "trace", "recording events: formatted text vs. fwrite vs. mapped segments (events=, segment=)", TraceBench },
+	{ "pipeline", "driver queue end to end: events/s, drops, latency (producers=, events=, rate=, max-records=, max-bytes=, policy=, read=, pause=)", PipelineBench },
+	{ "time", "event timestamps: system time vs. cycle counter, conversion error (calls=, seconds=, interval=)", TimeBench },
+	{ "display", "client output: printf per field vs. EventFormatter (events=, out=)", DisplayBench },
+	{ "keys", "registry key filter: HKLM compare vs. linear prefix scan vs. trie (prefixes=, names=, rounds=)", KeyBench },
+	{ "state", "client process table from replayed traces: StateTable vs. unordered_map, queries vs. rescans (events=, processes=, queries=)", StateBench },
+	{ "consumers", "several readers with their own cursors: destructive read vs. 1, 2, 3 readers, a slow one (events=, round=, slow=, log=)", ConsumerBench },
+	{ "compress", "recorded batches: BlockCompressor ratio and MB/s per event mix (mb=, rounds=)", CompressBench },
+	{ "export", "columnar export: write speed and size vs. a trace, a time-ranged query vs. a trace scan (events=, group=)", ExportBench },
+	{ "exportcheck", "columnar export read back for several group sizes, and empty; exits 1 on a mismatch (events=)", ExportCheck },
+	{ "ratelimit", "token buckets in the notify routines: check cost, a flooding process held to its rate, racing producers (producers=, checks=, seconds=)", RateBench },
+	{ "priority", "rings per priority class: merge cost, losses under a thread storm by policy (cpus=, records=, rounds=, steps=, max-records=)", PriorityBench },
+	{ "stats", "per-CPU latency histograms: cost per callback vs. one shared block, tallied read batches, buckets (producers=, callbacks=, reads=, batch=)", StatsBench },
+	{ "cmdline", "process creates in a build storm: bytes queued and read, whole, cut to a limit, repeats sent once (creates=, projects=, limit=, batch=)", CommandLineBench },
+	{ "read", "client reads through a pipe: read then format vs. ReadPipeline, writer held up, in order (batches=, burst=, pause=, buffers=, depth=, out=)", ReadBench },
+	{ "expr", "filter expressions: ns/event for several programs vs. EventFilter, hits and misses (events=, rounds=, hits=)", ExprBench },
+	{ "exprcheck", "filter expressions: rejected expressions, verdicts, malformed programs; exits 1 on a mismatch", ExprCheck },
+};
+
+int PrintUsage() {
+	printf("Usage: SysMonBench <mode> [name=value ...]\n");
+	for (auto& mode : Modes)
+		printf("\t%-10s %s\n", mode.Name, mode.Description);
+	return 1;
+}
+
+int main(int argc, const char* argv[]) {
+	if (argc < 2)
+		return PrintUsage();
+
+	for (auto& mode : Modes)
+		if (strcmp(argv[1], mode.Name) == 0)
+			return mode.Run(argc, argv);
+
+	return PrintUsage();
+}
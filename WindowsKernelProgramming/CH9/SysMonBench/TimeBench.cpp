@@ -0,0 +1,72 @@
+// TimeBench.cpp : what stamping an event costs, system time (clock_gettime here,
+// KeQuerySystemTimePrecise in the driver) vs. the raw cycle counter, and how far
+// counter values converted back with TimeSource's calibration are from the real
+// system time. the calibration is refreshed every interval= msec, like the driver
+// does between reads; samples in between show how the error grows with its age.
+
+#include "BenchUtil.h"
+#include "../SysMon/TimeSource.h"
+#include <thread>
+
+namespace {
+	template<typename Read>
+	void Cost(const char* name, ULONG count, Read&& read) {
+		ULONG64 sink = 0;
+		auto start = NowNs();
+		for (ULONG i = 0; i < count; i++)
+			sink += (ULONG64)read();
+		auto elapsed = NowNs() - start;
+		printf("  %-24s %8.1f ns/call  (%llu)\n", name, (double)elapsed / count, (unsigned long long)(sink & 1));
+	}
+}
+
+int TimeBench(int argc, const char* argv[]) {
+	auto calls = ArgValue(argc, argv, "calls", 10000000);
+	auto seconds = ArgValue(argc, argv, "seconds", 5);
+	auto interval = ArgValue(argc, argv, "interval", 1000);
+
+	printf("counter %s reliable (invariant TSC)\n", TimeCounterIsReliable() ? "is" : "is NOT");
+
+	TimeCalibrator clock;
+	clock.Init();
+	printf("initial rate %llu ticks/s\n", (unsigned long long)clock.Current().Frequency());
+
+	printf("cost, %u calls each:\n", calls);
+	Cost("system time", calls, [] { return ReadSystemTime(); });
+	Cost("counter", calls, [] { return ReadTimeCounter(); });
+	Cost("counter + conversion", calls, [&] { return clock.ToSystemTime(ReadTimeCounter()); });
+	Cost("calibration anchor", calls / 100, [] { return TakeTimeAnchor().Counter; });
+
+	// conversion error: a counter read right before and after the system time
+	// brackets the moment it was taken, the midpoint is converted
+	std::vector<LONGLONG> errors, late;
+	ULONG calibrations = 0;
+	auto start = NowNs(), end = start + (LONGLONG)seconds * 1000000000, next = start;
+	while (NowNs() < end) {
+		auto now = NowNs();
+		if (now >= next) {
+			clock.Calibrate();
+			calibrations++;
+			next = now + (LONGLONG)interval * 1000000;
+		}
+
+		auto before = ReadTimeCounter();
+		auto time = ReadSystemTime();
+		auto after = ReadTimeCounter();
+		auto error = clock.ToSystemTime(before + (after - before) / 2) - time;
+		auto ns = (error < 0 ? -error : error) * 100;
+		errors.push_back(ns);
+		// the last tenth of an interval, the calibration is oldest there
+		if (next - NowNs() < (LONGLONG)interval * 100000)
+			late.push_back(ns);
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+
+	printf("conversion error, %u calibrations %u msec apart, rate %llu ticks/s:\n", calibrations, interval,
+		(unsigned long long)clock.Current().Frequency());
+	PrintLatency("all samples", errors);
+	PrintLatency("calibration oldest", late);
+	auto worst = *std::max_element(errors.begin(), errors.end());
+	printf("  %-24s %8lld ns\n", "worst", (long long)worst);
+	return 0;
+}
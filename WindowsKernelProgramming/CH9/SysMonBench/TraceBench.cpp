@@ -0,0 +1,157 @@
+// TraceBench.cpp : recording a synthetic event stream, formatted as text
+// (what the client prints) vs. raw batches written with fwrite vs. the
+// mapped segments of TraceRecorder, plain and compressed (the time is Append's,
+// the compression happens on the recorder's thread). then reads the segments
+// back and checks every record made it. files go to the temp directory and are removed.
+
+#include "BenchUtil.h"
+#include "../SysMon/TraceRecorder.h"
+#include <filesystem>
+#include <string>
+
+namespace {
+	const ULONG BatchSize = 1 << 16;	// what the client reads at a time
+
+	// fills a read-sized batch with records from the synthetic mix
+	ULONG MakeBatch(UCHAR* buffer, ULONG& seed, LONGLONG& time, ULONG& count) {
+		ULONG offset = 0;
+		count = 0;
+		for (;;) {
+			ItemType type;
+			ULONG size;
+			auto saved = seed;
+			NextEventType(seed, type, size);
+			size = (size + 7) & ~7;
+			if (offset + size > BatchSize) {
+				seed = saved;
+				return offset;
+			}
+
+			auto item = (ItemHeader*)(buffer + offset);
+			memset(item, 0, size);
+			item->Type = type;
+			item->Size = (USHORT)size;
+			item->Time.QuadPart = time++;
+			offset += size;
+			count++;
+		}
+	}
+
+	struct Result {
+		ULONGLONG Events = 0, Bytes = 0;
+		std::vector<LONGLONG> Batches;
+	};
+
+	template<typename Write>
+	Result Run(const char* name, ULONG events, Write&& write) {
+		std::vector<UCHAR> buffer(BatchSize);
+		Result result;
+		ULONG seed = 1;
+		LONGLONG time = 1;
+		LONGLONG elapsed = 0;
+		while (result.Events < events) {
+			ULONG count;
+			auto size = MakeBatch(buffer.data(), seed, time, count);
+			auto before = NowNs();
+			if (!write(buffer.data(), size)) {
+				printf("  %s: write failed\n", name);
+				break;
+			}
+			result.Batches.push_back(NowNs() - before);
+			elapsed += result.Batches.back();
+			result.Events += count;
+			result.Bytes += size;
+		}
+
+		// only the time spent writing, not making up the events
+		PrintRate(name, result.Events, elapsed);
+		printf("  %-24s %8.1f ns/event  %8.1f MB/s\n", "", (double)elapsed / result.Events, result.Bytes * 1000.0 / elapsed);
+		PrintLatency("per 64 KB batch", result.Batches);
+		return result;
+	}
+
+	// roughly what DisplayInfo does per record
+	bool WriteText(FILE* file, const UCHAR* buffer, ULONG size) {
+		for (ULONG offset = 0; offset < size; ) {
+			auto item = (const ItemHeader*)(buffer + offset);
+			auto ms = (long long)item->Time.QuadPart;
+			fprintf(file, "%02lld:%02lld:%02lld.%03lld: type %d, %u bytes, process %u\n",
+				ms / 3600000 % 24, ms / 60000 % 60, ms / 1000 % 60, ms % 1000,
+				(int)item->Type, (ULONG)item->Size, *(const ULONG*)(item + 1));
+			offset += item->Size;
+		}
+		return !ferror(file);
+	}
+
+	// every record back, in order, with the headers agreeing
+	bool ReadBack(const std::string& base, const TraceRecorder& recorder, const Result& written) {
+		ULONGLONG records = 0;
+		LONGLONG expected = 1;
+		bool ok = recorder.Records() == written.Events;
+		for (ULONG i = 1; i <= recorder.Segments(); i++) {
+			char path[512];
+			snprintf(path, sizeof(path), "%s.%06u.trace", base.c_str(), i);
+			TraceReader reader;
+			if (!reader.Open(path)) {
+				printf("  %s: can't read it back\n", path);
+				ok = false;
+				continue;
+			}
+
+			auto& header = reader.Header();
+			LONGLONG first = expected;
+			auto count = reader.ForEach([&](const ItemHeader* item) {
+				if (item->Time.QuadPart != expected)
+					ok = false;
+				expected = item->Time.QuadPart + 1;
+			});
+			ok = ok && header.Complete && count == header.RecordCount &&
+				header.FirstTime.QuadPart == first && header.LastTime.QuadPart == expected - 1;
+			records += count;
+			reader.Close();
+			remove(path);
+		}
+		return ok && records == written.Events;
+	}
+}
+
+int TraceBench(int argc, const char* argv[]) {
+	auto events = ArgValue(argc, argv, "events", 2000000);
+	auto segmentMB = ArgValue(argc, argv, "segment", 16);
+
+	auto dir = std::filesystem::temp_directory_path();
+	auto base = (dir / "SysMonBench").string();
+	printf("%u events, %u MB segments in %s\n", events, segmentMB, dir.string().c_str());
+
+	auto textPath = base + ".txt", rawPath = base + ".raw";
+	auto text = fopen(textPath.c_str(), "w");
+	Run("formatted text", events, [&](const UCHAR* buffer, ULONG size) {
+		return WriteText(text, buffer, size);
+	});
+	fclose(text);
+	remove(textPath.c_str());
+
+	auto raw = fopen(rawPath.c_str(), "wb");
+	Run("fwrite batches", events, [&](const UCHAR* buffer, ULONG size) {
+		return fwrite(buffer, 1, size, raw) == size;
+	});
+	fclose(raw);
+	remove(rawPath.c_str());
+
+	bool ok = true;
+	for (auto compress : { false, true }) {
+		TraceRecorder recorder;
+		if (!recorder.Init(base.c_str(), (ULONG64)segmentMB << 20, SysMonFormatLatest, compress)) {
+			printf("failed to create a segment\n");
+			return 1;
+		}
+		auto written = Run(compress ? "compressed segments" : "mapped segments", events, [&](const UCHAR* buffer, ULONG size) {
+			return recorder.Append(buffer, size);
+		});
+		recorder.Close();
+		printf("  %-24s %u segments, %.1f bytes/event stored\n", "", recorder.Segments(), (double)recorder.StoredBytes() / recorder.Records());
+		ok &= ReadBack(base, recorder, written);
+	}
+	printf(ok ? "all records read back\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,79 @@
+// WakeBench.cpp : how long an event waits before a blocked reader sees it,
+// waking the reader through WaitEvent vs. the client's old 200 msec polling.
+
+#include "BenchUtil.h"
+#include "../SysMon/EventRing.h"
+#include "../SysMon/EventWait.h"
+#include <thread>
+#include <atomic>
+
+namespace {
+	const ULONG RingCapacity = 1024;
+	typedef EventRingSet<ItemHeader, RingCapacity> ItemRings;
+
+	struct Channel {
+		ItemRings::Ring Buffer;
+		ItemRings Rings;
+		WaitEvent Wake;
+		volatile LONG WakePosted = 0;
+		std::atomic<bool> Done{ false };
+	};
+
+	void Produce(Channel& channel, ULONG samples, bool signal) {
+		ULONG seed = 1;
+		for (ULONG i = 0; i < samples; i++) {
+			// events trickle in, as on an idle machine
+			seed = seed * 1103515245 + 12345;
+			std::this_thread::sleep_for(std::chrono::microseconds(200 + (seed >> 16) % 800));
+
+			auto item = (ThreadCreateExitInfo*)malloc(sizeof(ThreadCreateExitInfo));
+			item->Type = ItemType::ThreadCreate;
+			item->Size = sizeof(ThreadCreateExitInfo);
+			item->Time.QuadPart = NowNs();
+			channel.Rings.Push(0, item, item->Size);
+
+			// what PushItem does when a read is parked
+			if (signal && InterlockedCompareExchange(&channel.WakePosted, 1, 0) == 0)
+				channel.Wake.Signal();
+		}
+		channel.Done = true;
+		channel.Wake.Signal();
+	}
+
+	void Run(const char* name, ULONG samples, ULONG pollMs) {
+		Channel channel;
+		channel.Rings.Init(&channel.Buffer, 1);
+		channel.Wake.Init();
+
+		std::vector<LONGLONG> latency;
+		std::thread producer(Produce, std::ref(channel), samples, pollMs == 0);
+		while (!channel.Done || channel.Rings.Count()) {
+			if (pollMs) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(pollMs));
+			}
+			else {
+				channel.Wake.Wait(WaitInfinite);
+				InterlockedExchange(&channel.WakePosted, 0);
+			}
+			channel.Rings.Drain([&](ItemHeader* item) {
+				latency.push_back(NowNs() - item->Time.QuadPart);
+				free(item);
+				return true;
+			});
+		}
+		producer.join();
+		channel.Wake.Destroy();
+
+		PrintLatency(name, latency);
+	}
+}
+
+int WakeBench(int argc, const char* argv[]) {
+	auto samples = ArgValue(argc, argv, "samples", 2000);
+	auto pollMs = ArgValue(argc, argv, "poll", 200);
+
+	printf("%u events, one every 0.2-1 msec\n", samples);
+	Run("event wake-up", samples, 0);
+	Run("polling", samples, pollMs);
+	return 0;
+}
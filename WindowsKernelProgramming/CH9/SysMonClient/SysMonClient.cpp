@@ -3,125 +3,667 @@
 
 #include "pch.h"
 #include "..\SysMon\SysMonCommon.h"
+#include "..\SysMon\SharedChannel.h"
+#include "..\SysMon\TraceRecorder.h"
+#include "..\SysMon\ColumnExport.h"
+#include "..\SysMon\EventFormatter.h"
+#include "..\SysMon\StateTable.h"
+#include "..\SysMon\ReadPipeline.h"
+#include "..\SysMon\FilterCompiler.h"
 #include <string>
+#include <vector>
+
+// what the records turn into on stdout
+EventFormatter Formatter;
+
+// --record: events go to trace segments instead of the console
+TraceRecorder* Recorder;
+// --export: events go to a columnar file instead of the console, live or replayed
+ColumnExporter* Exporter;
+// --state: events keep a table of what's running instead, shown on Ctrl+Break and at the end
+StateTable* State;
+volatile bool Stop;
+volatile bool ShowState;
 
 int Error(const char* text) {
 	printf("%s (%d)\n", text, ::GetLastError());
 	return 1;
 }
 
-void DisplayTime(const LARGE_INTEGER& time) {
+// the handle is opened for overlapped reads, so a request waits for its result here
+BOOL DeviceControl(HANDLE hFile, DWORD code, LPVOID input, DWORD inputSize, LPVOID output, DWORD outputSize, LPDWORD returned) {
+	OVERLAPPED ov = {};
+	ov.hEvent = ::CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	if (ov.hEvent == nullptr)
+		return FALSE;
+
+	auto ok = ::DeviceIoControl(hFile, code, input, inputSize, output, outputSize, returned, &ov);
+	if (!ok && ::GetLastError() == ERROR_IO_PENDING)
+		ok = ::GetOverlappedResult(hFile, &ov, returned, TRUE);
+	auto error = ::GetLastError();
+	::CloseHandle(ov.hEvent);
+	::SetLastError(error);
+	return ok;
+}
+
+void HandleEvents(BYTE* buffer, DWORD size) {
+	if (State)
+		State->Update(buffer, size);
+
+	if (Exporter && !Exporter->Export(buffer, size)) {
+		printf("Failed to export events (%d)\n", ::GetLastError());
+		Stop = true;
+	}
+
+	if (Recorder == nullptr) {
+		if (State == nullptr && Exporter == nullptr)
+			Formatter.Format(buffer, size);
+		return;
+	}
+
+	if (!Recorder->Append(buffer, size)) {
+		printf("Failed to record events (%d)\n", ::GetLastError());
+		Stop = true;
+	}
+}
+
+BOOL WINAPI OnConsoleCtrl(DWORD type) {
+	if (type == CTRL_BREAK_EVENT && State) {
+		ShowState = true;
+		return TRUE;
+	}
+
+	// finish the current segment (and the export) properly
+	Stop = true;
+	return TRUE;
+}
+
+void DisplayTime(LONGLONG time) {
+	if (time == 0) {
+		printf("??:??:??.???");
+		return;
+	}
+
 	SYSTEMTIME st;
 	::FileTimeToSystemTime((FILETIME*)&time, &st);
-	printf("%02d:%02d:%02d.%03d: ", st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
-}
-
-void DisplayBinary(const UCHAR* buffer, DWORD size) {
-	for (DWORD i = 0; i < size; i++)
-		printf("%02X ", buffer[i]);
-	printf("\n");
-}
-
-void DisplayInfo(BYTE* buffer, DWORD size) {
-	auto count = size;
-	while (count > 0) {
-		auto header = (ItemHeader*)buffer;
-		switch (header->Type) {
-			case ItemType::ProcessExit:
-			{
-				DisplayTime(header->Time);
-				auto info = (ProcessExitInfo*)buffer;
-				printf("Process %d Exited\n", info->ProcessId);
-				break;
-			}
-
-			case ItemType::ProcessCreate:
-			{
-				DisplayTime(header->Time);
-				auto info = (ProcessCreateInfo*)buffer;
-				std::wstring commandline((WCHAR*)(buffer + info->CommandLineOffset), info->CommandLineLength);
-				printf("Process %d Created. Command line: %ws\n", info->ProcessId, commandline.c_str());
-				break;
-			}
-
-			case ItemType::ThreadCreate:
-			{
-				DisplayTime(header->Time);
-				auto info = (ThreadCreateExitInfo*)buffer;
-				printf("Thread %d Created in process %d\n", info->ThreadId, info->ProcessId);
-				break;
-			}
-
-			case ItemType::ThreadExit:
-			{
-				DisplayTime(header->Time);
-				auto info = (ThreadCreateExitInfo*)buffer;
-				printf("Thread %d Exited from process %d\n", info->ThreadId, info->ProcessId);
-				break;
-			}
-
-			case ItemType::ImageLoad:
-			{
-				DisplayTime(header->Time);
-				auto info = (ImageLoadInfo*)buffer;
-				printf("Image loaded into process %d at address 0x%p (%ws)\n", info->ProcessId, info->LoadAddress, info->ImageFileName);
-				break;
-			}
-
-			case ItemType::RegistrySetValue:
-			{
-				DisplayTime(header->Time);
-				auto info = (RegistrySetValueInfo*)buffer;
-				printf("Registry write PID=%d: %ws\\%ws type: %d size: %d data: ", info->ProcessId, 
-					info->KeyName, info->ValueName, info->DataType, info->DataSize);
-				switch (info->DataType) {
-					case REG_DWORD:
-						printf("0x%08X\n", *(DWORD*)info->Data);
-						break;
-
-					case REG_SZ:
-					case REG_EXPAND_SZ:
-						printf("%ws\n", (WCHAR*)info->Data);
-						break;
-
-					case REG_BINARY:
-						DisplayBinary(info->Data, min(info->DataSize, sizeof(info->Data)));
-						break;
-
-					default:
-						DisplayBinary(info->Data, min(info->DataSize, sizeof(info->Data)));
-						break;
-
-				}
-
-				break;
-			}
-
-			default:
-				break;
-		}
-		buffer += header->Size;
-		count -= header->Size;
-	}
-
-}
-
-int main() {
-	auto hFile = ::CreateFile(L"\\\\.\\SysMon", GENERIC_READ, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+	printf("%02d:%02d:%02d.%03d", st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
+}
+
+// a snapshot: every process, its threads and its modules
+void DisplayState(const StateTable& state) {
+	ShowState = false;
+	Formatter.Flush();
+	printf("%u processes, %u threads, %u modules\n", state.Processes(), state.Threads(), state.Modules());
+	state.ForEachProcess([&](const ProcessRecord& process) {
+		printf("Process %u", process.ProcessId);
+		if (process.ParentProcessId != StateNone) {
+			printf(" (parent %u) started ", process.ParentProcessId);
+			DisplayTime(process.CreateTime);
+		}
+		printf(": %u threads", process.ThreadCount);
+		if (process.SummaryThreads != StateNone)
+			printf(" (%u by the last summary)", process.SummaryThreads);
+		printf(", %u modules\n", process.ModuleCount);
+		if (!process.CommandLine.empty())
+			printf("  %.*ls\n", (int)process.CommandLine.size(), process.CommandLine.data());
+
+		if (process.ThreadCount) {
+			printf("  threads:");
+			state.ForEachThread(process, [](const ThreadRecord& thread) {
+				printf(" %u", thread.ThreadId);
+			});
+			printf("\n");
+		}
+		state.ForEachModule(process, [&](const ModuleRecord& module) {
+			auto& name = state.Name(module.Name);
+			printf("  0x%p %.*ls\n", (void*)(ULONG_PTR)module.Base, (int)name.size(), name.data());
+		});
+	});
+	fflush(stdout);
+}
+
+// writes the export's index and dictionary, the file is no good without them
+int FinishExport(int result) {
+	if (Exporter == nullptr)
+		return result;
+
+	auto rows = Exporter->Rows();
+	auto strings = Exporter->Strings();
+	if (!Exporter->Close())
+		return Error("Failed to write export file");
+	printf("%llu events, %u distinct strings exported\n", rows, strings);
+	return result;
+}
+
+int Replay(const std::vector<std::string>& files) {
+	for (auto& file : files) {
+		TraceReader reader;
+		if (!reader.Open(file.c_str())) {
+			printf("%s: not a trace segment\n", file.c_str());
+			return 1;
+		}
+
+		auto& header = reader.Header();
+		Formatter.SetFormat(header.Format);
+		printf("%s: segment %u, %llu records, %llu bytes%s%s\n", file.c_str(), header.Sequence,
+			header.RecordCount, header.RawSize, reader.Compressed() ? " (compressed)" : "", header.Complete ? "" : " (not closed)");
+		if (State)
+			State->SetFormat(header.Format);
+		if (Exporter)
+			Exporter->SetFormat(header.Format);
+		// compressed segments come a block at a time
+		auto good = reader.ForEachBatch([](const UCHAR* records, ULONG size) {
+			if (State)
+				State->Update(records, size);
+			if (Exporter)
+				Exporter->Export(records, size);
+			else if (State == nullptr)
+				Formatter.Format(records, size);
+		});
+		Formatter.Flush();
+		if (!good)
+			printf("%s: damaged block, the rest of the segment is skipped\n", file.c_str());
+	}
+
+	// what was running when the trace ended
+	if (State)
+		DisplayState(*State);
+	return 0;
+}
+
+int ReadMapped(HANDLE hFile) {
+	// the driver writes events straight into this ring, nothing to read or copy
+	auto hEvent = ::CreateEvent(nullptr, FALSE, FALSE, nullptr);
+	SysMonChannelRequest request = { 4 << 20, (ULONG64)hEvent };
+	SysMonChannelMapping mapping;
+	DWORD returned;
+	if (!DeviceControl(hFile, IOCTL_SYSMON_MAP_CHANNEL, &request, sizeof(request), &mapping, sizeof(mapping), &returned))
+		return Error("Failed to map event channel");
+
+	SharedChannel channel;
+	if (!channel.Attach((void*)mapping.Address)) {
+		printf("Unexpected channel layout\n");
+		return 1;
+	}
+
+	while (!Stop) {
+		if (ShowState)
+			DisplayState(*State);
+
+		auto header = (ItemHeader*)channel.Peek();
+		if (header == nullptr) {
+			Formatter.Flush();
+			// ask for a wake-up, then make sure nothing slipped in meanwhile
+			channel.SetWaiting();
+			if (channel.Peek() == nullptr)
+				::WaitForSingleObject(hEvent, 500);
+			continue;
+		}
+
+		HandleEvents((BYTE*)header, header->Size);
+		channel.Advance();
+	}
+	return 0;
+}
+
+const char* TypeName(ULONG type) {
+	static const char* names[] = {
+		"None", "ProcessCreate", "ProcessExit", "ThreadCreate", "ThreadExit",
+		"ImageLoad", "RegistrySetValue", "ImageLoadV2", "RegistrySetValueV2",
+		"ImageLoadInterned", "StringDefinition", "ThreadSummary", "TimeCalibration",
+		"RateSummary", "ProcessCreateInterned"
+	};
+	return type < _countof(names) ? names[type] : "Unknown";
+}
+
+bool GetQueueStats(HANDLE hFile, SysMonQueueStats& stats) {
+	// older drivers don't fill in the reader counts
+	::memset(&stats, 0, sizeof(stats));
+	DWORD returned;
+	return DeviceControl(hFile, IOCTL_SYSMON_GET_QUEUE_STATS, nullptr, 0, &stats, sizeof(stats), &returned);
+}
+
+// the upper bound of the bucket the given fraction of the values falls in
+ULONG64 Percentile(const SysMonHistogram& histogram, double fraction) {
+	auto rank = (ULONG64)(histogram.Count * fraction);
+	ULONG64 seen = 0;
+	for (ULONG i = 0; i < SysMonHistogramBuckets; i++) {
+		seen += histogram.Buckets[i];
+		if (seen > rank)
+			return i ? 1ull << i : 0;
+	}
+	return 1ull << (SysMonHistogramBuckets - 1);
+}
+
+// ticks to usec, or records as they are when scale is 0
+void DisplayHistogram(const char* name, const SysMonHistogram& histogram, double scale) {
+	auto unit = scale ? "usec" : "records";
+	auto value = [&](ULONG64 v) { return scale ? v * scale : (double)v; };
+	if (histogram.Count == 0) {
+		printf("%s: none\n", name);
+		return;
+	}
+	printf("%s: %llu, mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f %s\n", name, histogram.Count,
+		value(histogram.Sum) / histogram.Count, value(Percentile(histogram, 0.5)), value(Percentile(histogram, 0.9)),
+		value(Percentile(histogram, 0.99)), value(Percentile(histogram, 0.999)), unit);
+
+	ULONG64 most = 0;
+	for (auto count : histogram.Buckets)
+		if (count > most)
+			most = count;
+	for (ULONG i = 0; i < SysMonHistogramBuckets; i++) {
+		if (histogram.Buckets[i] == 0)
+			continue;
+		auto bar = (int)(histogram.Buckets[i] * 40 / most);
+		printf("  < %12.1f %-7s %12llu %.*s\n", value(i ? 1ull << i : 1), unit, histogram.Buckets[i],
+			bar ? bar : 1, "########################################");
+	}
+}
+
+void DisplayLatencyStats(HANDLE hFile) {
+	SysMonLatencyStats stats;
+	DWORD returned;
+	if (!DeviceControl(hFile, IOCTL_SYSMON_GET_LATENCY_STATS, nullptr, 0, &stats, sizeof(stats), &returned)) {
+		printf("Latency statistics not available (%d)\n", ::GetLastError());
+		return;
+	}
+
+	auto scale = stats.Frequency ? 1000000.0 / stats.Frequency : 0.1;
+	DisplayHistogram("Callback time", stats.Callback, scale);
+	if (stats.CallbackSampling > 1)
+		printf("  (1 in %u callbacks timed)\n", stats.CallbackSampling);
+	DisplayHistogram("Time queued", stats.Residence, scale);
+	DisplayHistogram("Read batch", stats.ReadBatch, 0);
+	printf("%-22s %14s %14s\n", "Type", "Queued", "Dropped");
+	for (ULONG i = 0; i < SysMonMaxTypes; i++)
+		if (stats.Enqueued[i] || stats.Dropped[i])
+			printf("  %-20s %14llu %14llu\n", TypeName(i), stats.Enqueued[i], stats.Dropped[i]);
+}
+
+int DisplayQueueStats(HANDLE hFile) {
+	static const char* policies[] = { "drop oldest", "drop newest", "drop lowest priority" };
+
+	SysMonQueueStats stats;
+	if (!GetQueueStats(hFile, stats))
+		return Error("Failed to get queue statistics");
+
+	printf("Queued: %u records, %u bytes\n", stats.Records, stats.Bytes);
+	printf("Limits: %u records, %u bytes (0 = none), %s\n", stats.Limits.MaxRecords, stats.Limits.MaxBytes,
+		(ULONG)stats.Limits.Policy < _countof(policies) ? policies[(ULONG)stats.Limits.Policy] : "?");
+	printf("Dropped:\n");
+	for (ULONG i = 0; i < SysMonMaxTypes; i++)
+		if (stats.Dropped[i])
+			printf("  %-20s %u\n", TypeName(i), stats.Dropped[i]);
+	printf("Readers: %u, %u records evicted before all of them read it\n", stats.Readers, stats.Evicted);
+	DisplayLatencyStats(hFile);
+	return 0;
+}
+
+// says so when the driver had to throw events away since the last call
+void CheckDrops(HANDLE hFile, ULONG& dropped) {
+	SysMonQueueStats stats;
+	if (!GetQueueStats(hFile, stats))
+		return;
+
+	// evicted from the shared log before this handle got to them, as good as dropped
+	ULONG total = stats.Missed;
+	for (auto count : stats.Dropped)
+		total += count;
+	if (total != dropped)
+		printf("*** %u events dropped (%u queued, %u bytes)\n", total - dropped, stats.Records, stats.Bytes);
+	dropped = total;
+}
+
+int Usage() {
+	printf("Usage: SysMonClient [--mapped] [--types=process,thread,image,registry] [--pid=id ...] [--exclude=id ...]\n");
+	printf("                    [--max-records=n] [--max-bytes=n] [--policy=oldest|newest|priority]\n");
+	printf("                    [--aggregate=msec] [--record=name [--segment-mb=n] [--compress]]\n");
+	printf("                    [--key=prefix ...] [--exclude-key=prefix ...]\n");
+	printf("                    [--rate=types:per-sec[/burst] ...] [--pid-rate=types:per-sec[/burst] ...]\n");
+	printf("                    [--cmdline-max=chars] [--where=expression] [--state] [--export=file]\n");
+	printf("                    [--reset]\n");
+	printf("       SysMonClient --replay=name.000001.trace ... [--state] [--export=file]\n");
+	printf("       SysMonClient --stats\n");
+	return 1;
+}
+
+ULONG ParseTypes(const char* text) {
+	static const struct {
+		const char* Name;
+		ULONG Mask;
+	} types[] = {
+		{ "process", (1 << (ULONG)ItemType::ProcessCreate) | (1 << (ULONG)ItemType::ProcessExit) },
+		{ "thread", (1 << (ULONG)ItemType::ThreadCreate) | (1 << (ULONG)ItemType::ThreadExit) },
+		{ "image", 1 << (ULONG)ItemType::ImageLoad },
+		{ "registry", 1 << (ULONG)ItemType::RegistrySetValue },
+	};
+
+	ULONG mask = 0;
+	std::string list(text);
+	size_t start = 0;
+	while (start <= list.size()) {
+		auto end = list.find(',', start);
+		if (end == std::string::npos)
+			end = list.size();
+		auto name = list.substr(start, end - start);
+		for (auto& type : types)
+			if (::_stricmp(name.c_str(), type.Name) == 0)
+				mask |= type.Mask;
+		start = end + 1;
+	}
+	return mask;
+}
+
+// types:rate[/burst], e.g. --rate=thread:500/2000 or --pid-rate=process,image:50
+bool ParseRate(const char* text, SysMonRateLimits& limits, bool process) {
+	auto colon = ::strchr(text, ':');
+	if (colon == nullptr)
+		return false;
+	auto mask = ParseTypes(std::string(text, colon).c_str());
+	char* end;
+	auto rate = ::strtoul(colon + 1, &end, 0);
+	auto burst = *end == '/' ? ::strtoul(end + 1, nullptr, 0) : 0;
+	if (mask == 0 || rate == 0)
+		return false;
+
+	for (ULONG type = 0; type < SysMonMaxTypes; type++) {
+		if ((mask & (1 << type)) == 0)
+			continue;
+		auto& limit = limits.Types[type];
+		(process ? limit.ProcessRate : limit.Rate) = rate;
+		(process ? limit.ProcessBurst : limit.Burst) = burst;
+	}
+	return true;
+}
+
+// have the driver drop what we're not interested in before it's even recorded
+bool SetFilter(HANDLE hFile, ULONG types, const std::vector<ULONG>& include, const std::vector<ULONG>& exclude) {
+	std::vector<BYTE> buffer(SYSMON_FILTER_SIZE(include.size() + exclude.size()));
+	auto filter = (SysMonFilter*)buffer.data();
+	filter->TypeMask = types;
+	filter->IncludeCount = (ULONG)include.size();
+	filter->ExcludeCount = (ULONG)exclude.size();
+	std::copy(include.begin(), include.end(), filter->ProcessIds);
+	std::copy(exclude.begin(), exclude.end(), filter->ProcessIds + include.size());
+
+	DWORD returned;
+	return DeviceControl(hFile, IOCTL_SYSMON_SET_FILTER, filter, (DWORD)buffer.size(), nullptr, 0, &returned);
+}
+
+// registry writes under which keys to record, e.g. --key=\REGISTRY\USER --exclude-key=\REGISTRY\MACHINE\SOFTWARE\Classes
+bool SetKeyFilter(HANDLE hFile, const std::vector<std::pair<std::string, bool>>& keys) {
+	std::vector<BYTE> buffer(SYSMON_KEY_FILTER_SIZE(keys.size()));
+	auto filter = (SysMonKeyFilter*)buffer.data();
+	filter->Count = (ULONG)keys.size();
+	for (size_t i = 0; i < keys.size(); i++) {
+		auto& prefix = filter->Prefixes[i];
+		auto& text = keys[i].first;
+		prefix.Exclude = keys[i].second;
+		prefix.Length = (ULONG)min(text.size(), SysMonKeyFilterMaxLength);
+		std::copy(text.begin(), text.begin() + prefix.Length, prefix.Text);
+	}
+
+	DWORD returned;
+	return DeviceControl(hFile, IOCTL_SYSMON_SET_KEY_FILTER, filter, (DWORD)buffer.size(), nullptr, 0, &returned);
+}
+
+// 64 KB reads, up to 4 of them waiting in the driver, the rest filled and waiting to be
+// formatted: room for a 768 KB burst while the text is being written out
+const ULONG ReadBuffers = 16;
+const ULONG ReadDepth = 4;
+const ULONG ReadSize = 1 << 16;
+
+// formatted text waiting for the console or the file stdout goes to
+const ULONG OutputBuffers = 4;
+const ULONG OutputSize = 1 << 18;
+
+int ReadEvents(HANDLE hFile) {
+	DWORD returned;
+
+	// have reads wait in the driver for a batch of events (or 100 msec)
+	// instead of polling; older drivers don't know the IOCTL, so keep polling then,
+	// one read at a time
+	SysMonReadMode mode = { TRUE, 64, 100 };
+	bool blocking = DeviceControl(hFile, IOCTL_SYSMON_SET_READ_MODE, &mode, sizeof(mode), nullptr, 0, &returned);
+
+	// a thread of its own keeps the reads going, another writes the text out;
+	// this one only decodes what the reads bring
+	ReadSource source;
+	if (!source.Attach(hFile, ReadBuffers))
+		return Error("Failed to create read events");
+	OutputWriter writer;
+	writer.Start(stdout, OutputBuffers, OutputSize);
+	Formatter.SetWriter(&writer);
+	ReadPipeline pipeline;
+	pipeline.Start(source, ReadBuffers, blocking ? ReadDepth : 1, ReadSize, blocking ? 0 : 200);
+
+	ULONG dropped = 0;
+	CheckDrops(hFile, dropped);
+	auto lastCheck = ::GetTickCount64();
+
+	// once stopped, what was already read still goes through
+	bool cancelled = false;
+	while (!pipeline.Done()) {
+		if (Stop && !cancelled) {
+			pipeline.Cancel();
+			cancelled = true;
+		}
+		if (ShowState)
+			DisplayState(*State);
+
+		auto batch = pipeline.Next(200);
+		if (batch) {
+			HandleEvents(batch->Data, batch->Size);
+			pipeline.Release(batch);
+		}
+		// handed to the writer when caught up, not after every buffer
+		if (batch == nullptr || pipeline.Waiting() == 0)
+			Formatter.Flush();
+
+		if (::GetTickCount64() - lastCheck >= 1000) {
+			CheckDrops(hFile, dropped);
+			lastCheck = ::GetTickCount64();
+		}
+	}
+
+	pipeline.Close();
+	Formatter.Flush();
+	Formatter.SetWriter(nullptr);
+	writer.Close();
+	if (pipeline.Failed()) {
+		printf("Failed to read (%u)\n", pipeline.Error());
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, const char* argv[]) {
+	bool mapped = false, stats = false, limit = false, state = false;
+	ULONG types = SysMonFilterAllTypes;
+	std::vector<ULONG> include, exclude;
+	std::vector<std::pair<std::string, bool>> keys;		// prefix, exclude
+	SysMonQueueLimits limits = { 0, 0, SysMonOverflowPolicy::DropLowestPriority };
+	SysMonAggregation aggregation = { FALSE, 0 };
+	SysMonRateLimits rates = {};
+	bool rateLimit = false;
+	SysMonCommandLineCapture capture = { 0 };
+	bool commandLine = false, reset = false;
+	const char* record = nullptr;
+	const char* exportPath = nullptr;
+	const char* where = nullptr;
+	ULONG segmentMB = 64;
+	bool compress = false;
+	std::vector<std::string> replay;
+	for (int i = 1; i < argc; i++) {
+		if (::_stricmp(argv[i], "--mapped") == 0)
+			mapped = true;
+		else if (::_stricmp(argv[i], "--stats") == 0)
+			stats = true;
+		else if (::_stricmp(argv[i], "--state") == 0)
+			state = true;
+		else if (::_strnicmp(argv[i], "--max-records=", 14) == 0) {
+			limits.MaxRecords = ::strtoul(argv[i] + 14, nullptr, 0);
+			limit = true;
+		}
+		else if (::_strnicmp(argv[i], "--max-bytes=", 12) == 0) {
+			limits.MaxBytes = ::strtoul(argv[i] + 12, nullptr, 0);
+			limit = true;
+		}
+		else if (::_stricmp(argv[i], "--policy=oldest") == 0) {
+			limits.Policy = SysMonOverflowPolicy::DropOldest;
+			limit = true;
+		}
+		else if (::_stricmp(argv[i], "--policy=newest") == 0) {
+			limits.Policy = SysMonOverflowPolicy::DropNewest;
+			limit = true;
+		}
+		else if (::_stricmp(argv[i], "--policy=priority") == 0) {
+			limits.Policy = SysMonOverflowPolicy::DropLowestPriority;
+			limit = true;
+		}
+		else if (::_strnicmp(argv[i], "--aggregate=", 12) == 0) {
+			aggregation.Threads = TRUE;
+			aggregation.IntervalMs = ::strtoul(argv[i] + 12, nullptr, 0);
+		}
+		else if (::_strnicmp(argv[i], "--rate=", 7) == 0) {
+			if (!ParseRate(argv[i] + 7, rates, false))
+				return Usage();
+			rateLimit = true;
+		}
+		else if (::_strnicmp(argv[i], "--pid-rate=", 11) == 0) {
+			if (!ParseRate(argv[i] + 11, rates, true))
+				return Usage();
+			rateLimit = true;
+		}
+		else if (::_strnicmp(argv[i], "--cmdline-max=", 14) == 0) {
+			capture.MaxLength = ::strtoul(argv[i] + 14, nullptr, 0);
+			commandLine = true;
+		}
+		else if (::_stricmp(argv[i], "--reset") == 0)
+			reset = true;
+		else if (::_strnicmp(argv[i], "--record=", 9) == 0)
+			record = argv[i] + 9;
+		else if (::_strnicmp(argv[i], "--export=", 9) == 0)
+			exportPath = argv[i] + 9;
+		else if (::_strnicmp(argv[i], "--where=", 8) == 0)
+			where = argv[i] + 8;
+		else if (::_stricmp(argv[i], "--compress") == 0)
+			compress = true;
+		else if (::_strnicmp(argv[i], "--segment-mb=", 13) == 0)
+			segmentMB = min(::strtoul(argv[i] + 13, nullptr, 0), 2048);
+		else if (::_strnicmp(argv[i], "--replay=", 9) == 0)
+			replay.push_back(argv[i] + 9);
+		else if (::_strnicmp(argv[i], "--types=", 8) == 0)
+			types = ParseTypes(argv[i] + 8);
+		else if (::_strnicmp(argv[i], "--pid=", 6) == 0)
+			include.push_back(::strtoul(argv[i] + 6, nullptr, 0));
+		else if (::_strnicmp(argv[i], "--exclude=", 10) == 0)
+			exclude.push_back(::strtoul(argv[i] + 10, nullptr, 0));
+		else if (::_strnicmp(argv[i], "--key=", 6) == 0)
+			keys.emplace_back(argv[i] + 6, false);
+		else if (::_strnicmp(argv[i], "--exclude-key=", 14) == 0)
+			keys.emplace_back(argv[i] + 14, true);
+		else
+			return Usage();
+	}
+	bool filter = types != SysMonFilterAllTypes || !include.empty() || !exclude.empty();
+
+	// e.g. --where="type==ImageLoad && path endswith \"\\evil.dll\"" (see FilterCompiler.h)
+	FilterCompiler expression;
+	if (!expression.Compile(where ? where : "")) {
+		printf("--where: %s\n  %s\n  %*s^\n", expression.Error(), where, (int)expression.ErrorOffset(), "");
+		return 1;
+	}
+
+	// paths and command lines go out as UTF-8
+	::SetConsoleOutputCP(CP_UTF8);
+	Formatter.Init(stdout, SysMonFormatV1);
+
+	StateTable table;
+	if (state) {
+		table.Init();
+		State = &table;
+	}
+
+	ColumnExporter exporter;
+	if (exportPath) {
+		if (!exporter.Init(exportPath, SysMonFormatV1))
+			return Error("Failed to create export file");
+		Exporter = &exporter;
+	}
+
+	if (!replay.empty())
+		return FinishExport(Replay(replay));
+
+	auto hFile = ::CreateFile(L"\\\\.\\SysMon", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
 	if (hFile == INVALID_HANDLE_VALUE)
 		return Error("Failed to open file");
 
-	BYTE buffer[1 << 16];
+	if (stats)
+		return DisplayQueueStats(hFile);
+
+	if (filter && !SetFilter(hFile, types, include, exclude))
+		return Error("Failed to set filter");
+
+	if (!keys.empty() && !SetKeyFilter(hFile, keys))
+		return Error("Failed to set key filter");
 
-	while (true) {
-		DWORD bytes;
-		if (!::ReadFile(hFile, buffer, sizeof(buffer), &bytes, nullptr))
-			return Error("Failed to read");
+	// the filter expression, aggregation, rate limits and command line length are the
+	// driver's, not this handle's: whatever the last client set holds for every reader
+	// until someone sets it again. so they're only sent when asked for, and --reset
+	// puts back the defaults (an empty expression, nothing aggregated or limited)
+	DWORD returned;
+	if ((where || reset) && !DeviceControl(hFile, IOCTL_SYSMON_SET_FILTER_PROGRAM, (LPVOID)expression.Program(), expression.Size(), nullptr, 0, &returned))
+		return Error("Failed to set the filter expression");
 
-		if (bytes != 0)
-			DisplayInfo(buffer, bytes);
+	if (limit && !DeviceControl(hFile, IOCTL_SYSMON_SET_QUEUE_LIMITS, &limits, sizeof(limits), nullptr, 0, &returned))
+		return Error("Failed to set queue limits");
 
-		::Sleep(200);
+	if ((aggregation.Threads || reset) && !DeviceControl(hFile, IOCTL_SYSMON_SET_AGGREGATION, &aggregation, sizeof(aggregation), nullptr, 0, &returned))
+		return Error("Failed to set thread aggregation");
+
+	// summaries of what rate limits kept out come once a second
+	rates.IntervalMs = 1000;
+	if ((rateLimit || reset) && !DeviceControl(hFile, IOCTL_SYSMON_SET_RATE_LIMITS, &rates, sizeof(rates), nullptr, 0, &returned))
+		return Error("Failed to set rate limits");
+
+	if ((commandLine || reset) && !DeviceControl(hFile, IOCTL_SYSMON_SET_COMMAND_LINE, &capture, sizeof(capture), nullptr, 0, &returned))
+		return Error("Failed to set the command line limit");
+
+	// ask for the compact records; the formatter copes with whatever the driver picks
+	ULONG format = SysMonFormatLatest;
+	if (!DeviceControl(hFile, IOCTL_SYSMON_SET_FORMAT, &format, sizeof(format), &format, sizeof(format), &returned))
+		format = SysMonFormatV1;
+	// the mapped channel is written to directly, with system time
+	if (mapped && format >= SysMonFormatV4)
+		format = SysMonFormatV3;
+	Formatter.SetFormat(format);
+	if (Exporter)
+		Exporter->SetFormat(format);
+	if (State) {
+		State->SetFormat(format);
+		printf("Keeping track of processes, Ctrl+Break shows them, Ctrl+C to stop\n");
 	}
-}
 
+	TraceRecorder recorder;
+	if (record) {
+		if (!recorder.Init(record, (ULONG64)segmentMB << 20, format, compress))
+			return Error("Failed to create trace segment");
+		Recorder = &recorder;
+		printf("Recording to %s.*.trace, Ctrl+C to stop\n", record);
+	}
+	if (State || Recorder || Exporter)
+		::SetConsoleCtrlHandler(OnConsoleCtrl, TRUE);
+
+	auto result = mapped ? ReadMapped(hFile) : ReadEvents(hFile);
+	if (Recorder) {
+		recorder.Close();
+		printf("%llu events, %llu bytes in %u segments", recorder.Records(), recorder.Bytes(), recorder.Segments());
+		if (compress)
+			printf(", %llu compressed", recorder.StoredBytes());
+		printf("\n");
+	}
+	if (State)
+		DisplayState(*State);
+	return FinishExport(result);
+}